@@ -0,0 +1,411 @@
+/*
+ * bcast.c
+ *
+ * Broadcast groups: encode framebuffer updates once for many view-only clients
+ */
+
+/*
+ *  This is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This software is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this software; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301,
+ *  USA.
+ */
+
+/* When many view-only clients watch the same session (for instance, during a
+   lecture or a demo), most of them use the same pixel format and encoding
+   settings, so encoding each update separately for each of them wastes CPU
+   time.  If broadcasting is enabled, then such clients are placed into a
+   broadcast group.  One member of the group (the leader) encodes updates as
+   usual, using its own encoder and zlib streams, and each update that it sends
+   is also queued, without being copied, for the other members of the group.
+
+   The Tight encoder's zlib streams carry state from one update to the next, so
+   a member has to receive every update that the leader sends after the member
+   joins the group.  Thus, the leader waits until all members are ready for an
+   update before sending one, and a member that keeps the group waiting for
+   more than BCAST_MAX_WAIT ms (because its output queue has not drained or
+   because it has not requested an update) is removed from the group and
+   receives its own updates from then on.  When a client joins a group, the
+   leader's next update is a keyframe: a full-framebuffer update in which each
+   zlib stream is reset before it is used.  A client that leaves a group
+   receives a full-framebuffer update of its own, with its zlib streams reset
+   in the same way. */
+
+#include <string.h>
+#include "rfb.h"
+
+
+Bool rfbBroadcast = FALSE;
+
+/* Maximum time (in ms) that the leader of a group waits for a member */
+#define BCAST_MAX_WAIT  500
+
+
+static Bool Eligible(rfbClientPtr cl)
+{
+  return cl->state == RFB_NORMAL && (rfbViewOnly || cl->viewOnly) &&
+    !cl->bcastEjected && cl->readyForSetColourMapEntries &&
+    (cl->preferredEncoding == rfbEncodingTight ||
+     cl->preferredEncoding == rfbEncodingHextile ||
+     cl->preferredEncoding == rfbEncodingRaw);
+}
+
+
+/*
+ * Two clients can share updates if the updates would be encoded identically
+ * for both of them.
+ */
+
+static Bool Compatible(rfbClientPtr cl, rfbClientPtr cl2)
+{
+  return !memcmp(&cl->format, &cl2->format, sizeof(rfbPixelFormat)) &&
+    cl->preferredEncoding == cl2->preferredEncoding &&
+    cl->tightCompressLevel == cl2->tightCompressLevel &&
+    cl->tightQualityLevel == cl2->tightQualityLevel &&
+    cl->tightSubsampLevel == cl2->tightSubsampLevel &&
+    cl->imageQualityLevel == cl2->imageQualityLevel &&
+    cl->useCopyRect == cl2->useCopyRect &&
+    cl->enableLastRectEncoding == cl2->enableLastRectEncoding &&
+    cl->enableCursorShapeUpdates == cl2->enableCursorShapeUpdates &&
+    cl->enableCursorPosUpdates == cl2->enableCursorPosUpdates &&
+    cl->useRichCursorEncoding == cl2->useRichCursorEncoding;
+}
+
+
+static Bool MemberReady(rfbClientPtr cl)
+{
+  return !cl->outHead && !cl->syncFence &&
+    (cl->continuousUpdates || REGION_NOTEMPTY(pScreen, &cl->requestedRegion));
+}
+
+
+/*
+ * Make the client's next update a full-framebuffer update (including the
+ * cursor.)
+ */
+
+static void Resync(rfbClientPtr cl)
+{
+  ScreenPtr pScreen = screenInfo.screens[0];
+  RegionRec tmpRegion;
+  BoxRec box;
+
+  box.x1 = box.y1 = 0;
+  box.x2 = pScreen->width;  box.y2 = pScreen->height;
+  SAFE_REGION_INIT(pScreen, &tmpRegion, &box, 0);
+  REGION_UNION(pScreen, &cl->modifiedRegion, &cl->modifiedRegion,
+               &tmpRegion);
+  REGION_EMPTY(pScreen, &cl->copyRegion);
+  cl->copyDX = cl->copyDY = 0;
+  if (ICE_ENABLED(cl))
+    REGION_UNION(pScreen, &cl->ifRegion, &cl->ifRegion, &tmpRegion);
+  REGION_UNINIT(pScreen, &tmpRegion);
+
+  /* The group's viewers may not have the same framebuffer contents, so
+     content that the leader's viewer already has can't be used as the source
+     of a detected scroll. */
+  if (cl->scrollFB)
+    REGION_EMPTY(pScreen, &cl->scrollValid);
+
+  if (cl->enableCursorShapeUpdates)
+    cl->cursorWasChanged = TRUE;
+  if (cl->enableCursorPosUpdates)
+    cl->cursorWasMoved = TRUE;
+}
+
+
+static void FreeUpdate(rfbClientPtr cl)
+{
+  while (cl->bcastHead) {
+    rfbOutputBlock *block = cl->bcastHead;
+    cl->bcastHead = block->next;
+    rfbFreeOutputBlock(block);
+  }
+  cl->bcastTail = NULL;
+  cl->bcastSending = FALSE;
+}
+
+
+static void Leave(rfbClientPtr cl)
+{
+  int i;
+
+  if (--cl->bcastLeader->bcastMembers == 0)
+    cl->bcastLeader->bcastWaitStart = 0.0;
+  cl->bcastLeader = NULL;
+  cl->bcastReceiving = FALSE;
+
+  /* The client's zlib streams haven't been used since it joined the group,
+     but the client's decoder has been using the leader's streams. */
+  Resync(cl);
+  for (i = 0; i < 4; i++)
+    cl->zsReset[i] = TRUE;
+}
+
+
+static void Disband(rfbClientPtr cl)
+{
+  rfbClientPtr cl2;
+
+  for (cl2 = rfbClientHead; cl2; cl2 = cl2->next) {
+    if (cl2->bcastLeader == cl)
+      Leave(cl2);
+  }
+  FreeUpdate(cl);
+  cl->bcastWaitStart = 0.0;
+}
+
+
+/*
+ * Add the client to a group whose leader is compatible with it, or form a new
+ * group with a compatible client that is not yet in a group.  Returns TRUE if
+ * the client joined a group.
+ */
+
+static Bool Join(rfbClientPtr cl)
+{
+  rfbClientPtr cl2, leader = NULL;
+
+  if (!Eligible(cl))
+    return FALSE;
+
+  for (cl2 = rfbClientHead; cl2; cl2 = cl2->next) {
+    if (cl2 == cl || cl2->bcastLeader || !Eligible(cl2) ||
+        !Compatible(cl, cl2))
+      continue;
+    if (!leader || cl2->bcastMembers > leader->bcastMembers)
+      leader = cl2;
+  }
+  if (!leader)
+    return FALSE;
+
+  cl->bcastLeader = leader;
+  cl->bcastReceiving = FALSE;
+  leader->bcastMembers++;
+  leader->bcastKeyframe = TRUE;
+  Resync(leader);
+
+  rfbLog("Client %s joined the broadcast group of client %s (%d members)\n",
+         cl->host, leader->host, leader->bcastMembers + 1);
+
+  if (!leader->updateInProgress && FB_UPDATE_PENDING(leader))
+    rfbSendFramebufferUpdate(leader);
+
+  return TRUE;
+}
+
+
+/*
+ * rfbBcastCheck is called before an update is sent to a client.  It returns
+ * TRUE if the client should encode the update itself or FALSE if the client
+ * belongs to a broadcast group and will receive its leader's updates instead.
+ */
+
+Bool rfbBcastCheck(rfbClientPtr cl)
+{
+  rfbClientPtr leader = cl->bcastLeader;
+
+  if (!leader) {
+    if (cl->bcastMembers || !Join(cl))
+      return TRUE;
+    if (!(leader = cl->bcastLeader))
+      return TRUE;
+  }
+
+  /* The leader's updates cover everything that the client's own update
+     would have covered, so the client's pending changes can be discarded. */
+  rfbCollectDamage(cl);
+  REGION_EMPTY(pScreen, &cl->modifiedRegion);
+  REGION_EMPTY(pScreen, &cl->copyRegion);
+  if (ICE_ENABLED(cl))
+    REGION_EMPTY(pScreen, &cl->ifRegion);
+  if (rfbAutoLosslessRefresh > 0.0)
+    REGION_EMPTY(pScreen, &cl->alrEligibleRegion);
+  cl->cursorWasChanged = cl->cursorWasMoved = FALSE;
+
+  /* If the leader has been waiting for this client, then the leader may now
+     be able to send its update. */
+  if (leader->bcastWaitStart > 0.0 && !leader->updateInProgress)
+    rfbSendFramebufferUpdate(leader);
+
+  return FALSE;
+}
+
+
+/*
+ * rfbBcastReady returns TRUE if all members of the client's group are ready
+ * for an update.  Members that have kept the client waiting for too long are
+ * removed from the group.
+ */
+
+Bool rfbBcastReady(rfbClientPtr cl)
+{
+  rfbClientPtr cl2;
+  Bool ready = TRUE;
+  double now = gettime();
+
+  for (cl2 = rfbClientHead; cl2; cl2 = cl2->next) {
+    if (cl2->bcastLeader != cl || MemberReady(cl2))
+      continue;
+    if (cl->bcastWaitStart > 0.0 &&
+        (now - cl->bcastWaitStart) * 1000.0 >= (double)BCAST_MAX_WAIT) {
+      rfbLog("Client %s removed from the broadcast group of client %s\n",
+             cl2->host, cl->host);
+      cl2->bcastEjected = TRUE;
+      Leave(cl2);
+    } else
+      ready = FALSE;
+  }
+
+  if (!ready) {
+    if (cl->bcastWaitStart == 0.0)
+      cl->bcastWaitStart = now;
+    return FALSE;
+  }
+  cl->bcastWaitStart = 0.0;
+  return TRUE;
+}
+
+
+/*
+ * rfbBcastBegin is called when the client (the leader of a group) starts
+ * sending an update.  Until rfbBcastFinish() is called, the update is
+ * recorded as it is sent (see rfbSendUpdateBuf()), so that it can be queued
+ * for the members that are currently in the group.
+ */
+
+void rfbBcastBegin(rfbClientPtr cl)
+{
+  rfbClientPtr cl2;
+  int i;
+
+  for (cl2 = rfbClientHead; cl2; cl2 = cl2->next) {
+    if (cl2->bcastLeader == cl)
+      cl2->bcastReceiving = TRUE;
+  }
+
+  /* This has to be done before the Tight encoding job starts. */
+  if (cl->bcastKeyframe) {
+    for (i = 0; i < 4; i++)
+      cl->zsReset[i] = TRUE;
+    cl->bcastKeyframe = FALSE;
+  }
+
+  cl->bcastSending = TRUE;
+}
+
+
+static void AppendUpdateBlock(rfbClientPtr cl, rfbOutputBlock *block)
+{
+  block->next = NULL;
+  if (cl->bcastTail)
+    cl->bcastTail->next = block;
+  else
+    cl->bcastHead = block;
+  cl->bcastTail = block;
+}
+
+
+/*
+ * rfbBcastQueue records a copy of the given data, and rfbBcastQueueBlock
+ * records a reference to the given output block, as part of the client's
+ * current update.  If there is not enough memory, then the group is
+ * disbanded.
+ */
+
+void rfbBcastQueue(rfbClientPtr cl, char *buf, int len)
+{
+  rfbOutputBlock *block = rfbNewOutputBlock(len);
+
+  if (!block) {
+    rfbLogPerror("rfbBcastQueue: couldn't allocate output block");
+    Disband(cl);
+    return;
+  }
+  memcpy(block->data, buf, len);
+  block->len = len;
+  AppendUpdateBlock(cl, block);
+}
+
+
+void rfbBcastQueueBlock(rfbClientPtr cl, rfbOutputBlock *block)
+{
+  rfbOutputBlock *ref = rfbRefOutputBlock(block);
+
+  if (!ref) {
+    rfbLogPerror("rfbBcastQueueBlock: couldn't allocate output block");
+    Disband(cl);
+    return;
+  }
+  AppendUpdateBlock(cl, ref);
+}
+
+
+/*
+ * rfbBcastFinish is called once the client (the leader of a group) has sent
+ * the whole update.  The update is queued for each member that was in the
+ * group when the update began.
+ */
+
+void rfbBcastFinish(rfbClientPtr cl)
+{
+  rfbClientPtr cl2, nextCl;
+  rfbOutputBlock *block, *ref;
+
+  for (cl2 = rfbClientHead; cl2; cl2 = nextCl) {
+    nextCl = cl2->next;
+    if (cl2->bcastLeader != cl || !cl2->bcastReceiving)
+      continue;
+    cl2->bcastReceiving = FALSE;
+
+    if (cl2->pendingExtDesktopResize) {
+      if (!rfbSendExtDesktopSize(cl2)) continue;
+      cl2->pendingExtDesktopResize = FALSE;
+    }
+    if (cl2->pendingDesktopResize) {
+      if (!rfbSendDesktopSize(cl2)) continue;
+      cl2->pendingDesktopResize = FALSE;
+    }
+
+    for (block = cl->bcastHead; block; block = block->next) {
+      if (!(ref = rfbRefOutputBlock(block)) || QueueBlock(cl2, ref) < 0)
+        break;
+    }
+    if (block || FlushOutput(cl2) < 0) {
+      rfbLogPerror("rfbBcastFinish: write");
+      rfbCloseClient(cl2);
+      continue;
+    }
+
+    if (!cl2->continuousUpdates)
+      REGION_EMPTY(pScreen, &cl2->requestedRegion);
+    cl2->rfbFramebufferUpdateMessagesSent++;
+  }
+
+  FreeUpdate(cl);
+}
+
+
+/*
+ * rfbBcastLeave removes the client from its broadcast group, or disbands the
+ * group if the client is its leader.  This is called when the client's
+ * encoding settings change or it disconnects.
+ */
+
+void rfbBcastLeave(rfbClientPtr cl)
+{
+  if (cl->bcastLeader)
+    Leave(cl);
+  else if (cl->bcastMembers || cl->bcastHead)
+    Disband(cl);
+}
@@ -0,0 +1,372 @@
+/*
+ * capture.c
+ *
+ * Session capture
+ */
+
+/*
+ *  This is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This software is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this software; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301,
+ *  USA.
+ */
+
+/* The capture file holds the RFB messages that were sent to the first
+   connected viewer, starting with its first framebuffer update, so it can be
+   played back by the TurboVNC Viewer's benchmark mode.  The data is passed to
+   a writer thread through a ring buffer, so the X server never waits for the
+   disk unless the ring buffer fills up.
+
+   Since the updates depend on the viewer's earlier updates (through CopyRect
+   and the zlib streams), a capture could otherwise only be played back from
+   the start.  Every -capturekeyframe seconds, the viewer is therefore sent a
+   keyframe: a lossless update of the whole screen, with no CopyRect
+   rectangles, in which every Tight zlib stream is reset before it is used.
+   The offset of each keyframe in the capture file, along with the framebuffer
+   size and the viewer's pixel format at that point, is written to an index
+   file (the capture file name with .idx appended), so playback can start at
+   any keyframe.  The Zlib and ZRLE encodings have no way of resetting their
+   zlib streams, so no keyframes are sent to viewers that use them. */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include "rfb.h"
+
+
+char *captureFile = NULL;
+int rfbCaptureKeyframeInterval = DEFAULT_CAPTURE_KEYFRAME_INTERVAL;
+
+/* Size of the ring buffer between the X server and the writer thread */
+#define CAPTURE_BUF_SIZE  (16 * 1024 * 1024)
+
+/* Interval (ms) at which a keyframe that couldn't be sent is retried */
+#define KEYFRAME_RETRY_INTERVAL  10
+
+static pthread_t captureThread;
+static pthread_mutex_t captureMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t captureDataCond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t captureSpaceCond = PTHREAD_COND_INITIALIZER;
+static Bool captureThreadActive = FALSE;
+
+/* These are protected by captureMutex. */
+static char *captureBuf = NULL;
+static size_t captureHead, captureTail, captureCount;
+static Bool captureShutdown, captureError;
+
+/* These are accessed only by the main thread. */
+static unsigned long long captureBytes;
+static unsigned long captureStalls, captureKeyframes;
+static CARD32 captureStart;
+static FILE *captureIndex = NULL;
+static Bool keyframeWarned;
+
+
+/*
+ * The writer thread writes the contents of the ring buffer to the capture
+ * file until it is told to shut down and the ring buffer is empty.
+ */
+
+static void *CaptureThreadFunc(void *param)
+{
+  int fd = *(int *)param;
+
+  pthread_mutex_lock(&captureMutex);
+
+  for (;;) {
+    char *ptr;
+    size_t len, done = 0;
+    Bool error = FALSE;
+
+    while (captureCount == 0 && !captureShutdown)
+      pthread_cond_wait(&captureDataCond, &captureMutex);
+    if (captureCount == 0)
+      break;
+
+    ptr = &captureBuf[captureTail];
+    len = min(captureCount, CAPTURE_BUF_SIZE - captureTail);
+    pthread_mutex_unlock(&captureMutex);
+
+    if (!captureError) {
+      while (done < len) {
+        ssize_t ret = write(fd, ptr + done, len - done);
+
+        if (ret < 0) {
+          if (errno == EINTR) continue;
+          rfbLogPerror("Could not write to capture file");
+          error = TRUE;
+          break;
+        }
+        done += ret;
+      }
+    }
+
+    pthread_mutex_lock(&captureMutex);
+    if (error) captureError = TRUE;
+    captureTail = (captureTail + len) % CAPTURE_BUF_SIZE;
+    captureCount -= len;
+    pthread_cond_signal(&captureSpaceCond);
+  }
+
+  pthread_mutex_unlock(&captureMutex);
+  return NULL;
+}
+
+
+/*
+ * rfbWriteCapture() queues data that has been sent to the capture client.  It
+ * blocks only if the writer thread has fallen more than CAPTURE_BUF_SIZE bytes
+ * behind.
+ */
+
+void rfbWriteCapture(rfbClientPtr cl, char *buf, int len)
+{
+  Bool stalled = FALSE;
+
+  captureBytes += len;
+
+  pthread_mutex_lock(&captureMutex);
+
+  while (len > 0 && !captureError) {
+    size_t n;
+
+    if (captureCount == CAPTURE_BUF_SIZE) {
+      if (!stalled) captureStalls++;
+      stalled = TRUE;
+      pthread_cond_wait(&captureSpaceCond, &captureMutex);
+      continue;
+    }
+
+    n = min((size_t)len, CAPTURE_BUF_SIZE - captureCount);
+    n = min(n, CAPTURE_BUF_SIZE - captureHead);
+    memcpy(&captureBuf[captureHead], buf, n);
+    captureHead = (captureHead + n) % CAPTURE_BUF_SIZE;
+    captureCount += n;
+    buf += n;
+    len -= n;
+    pthread_cond_signal(&captureDataCond);
+  }
+
+  pthread_mutex_unlock(&captureMutex);
+}
+
+
+/*
+ * Keyframes
+ */
+
+static void WriteIndexEntry(rfbClientPtr cl, unsigned long long offset)
+{
+  rfbPixelFormat *pf = &cl->format;
+
+  fprintf(captureIndex, "%llu %u %d %d %d %d %d %d %d %d %d %d %d %d\n",
+          offset, (unsigned)(GetTimeInMillis() - captureStart), rfbFB.width,
+          rfbFB.height, pf->bitsPerPixel, pf->depth, pf->bigEndian,
+          pf->trueColour, pf->redMax, pf->greenMax, pf->blueMax,
+          pf->redShift, pf->greenShift, pf->blueShift);
+  if (fflush(captureIndex) != 0) {
+    rfbLogPerror("Could not write to capture index");
+    fclose(captureIndex);
+    captureIndex = NULL;
+  }
+}
+
+
+static CARD32 keyframeCallback(OsTimerPtr timer, CARD32 time, pointer arg)
+{
+  ScreenPtr pScreen = screenInfo.screens[0];
+  rfbClientPtr cl = (rfbClientPtr)arg;
+  RegionRec requestedRegionSave, ifRegionSave;
+  int tightCompressLevelSave, tightQualityLevelSave, i;
+  Bool useCopyRectSave;
+  unsigned long long offset = captureBytes;
+  BoxRec box;
+
+  if (!captureIndex)
+    return 0;
+
+  if (cl->preferredEncoding == rfbEncodingZlib ||
+      cl->preferredEncoding == rfbEncodingZRLE ||
+      cl->preferredEncoding == rfbEncodingZYWRLE) {
+    if (!keyframeWarned)
+      rfbLog("Capture keyframes cannot be sent with Zlib or ZRLE encoding\n");
+    keyframeWarned = TRUE;
+    return rfbCaptureKeyframeInterval * 1000;
+  }
+
+  /* The updates for a broadcast group are shared by all of its members. */
+
+  if (cl->bcastLeader || cl->bcastMembers)
+    return rfbCaptureKeyframeInterval * 1000;
+
+  /* Wait until the client is ready for an update, as with ALR. */
+
+  if (cl->state != RFB_NORMAL || cl->outHead || cl->syncFence ||
+      rfbIsCongested(cl) || rfbPacingDelay(cl) > 0)
+    return KEYFRAME_RETRY_INTERVAL;
+
+  /* Unlike an ALR slice, the keyframe brings the client's whole framebuffer
+     up to date, so the pending modified and copy regions are discarded rather
+     than restored afterward.  (A pending copy could no longer be sent as a
+     CopyRect, since the keyframe may have overwritten its source.)  The
+     client's own update request is kept. */
+  rfbCollectDamage(cl);
+
+  tightCompressLevelSave = cl->tightCompressLevel;
+  tightQualityLevelSave = cl->tightQualityLevel;
+  useCopyRectSave = cl->useCopyRect;
+  REGION_INIT(pScreen, &requestedRegionSave, NullBox, 0);
+  REGION_COPY(pScreen, &requestedRegionSave, &cl->requestedRegion);
+  REGION_INIT(pScreen, &ifRegionSave, NullBox, 0);
+  REGION_COPY(pScreen, &ifRegionSave, &cl->ifRegion);
+
+  box.x1 = box.y1 = 0;
+  box.x2 = pScreen->width;
+  box.y2 = pScreen->height;
+  cl->tightCompressLevel = 1;
+  cl->tightQualityLevel = -1;
+  /* Prevent scroll detection from turning part of the keyframe into a
+     CopyRect, which would depend on the preceding updates. */
+  cl->useCopyRect = FALSE;
+  cl->copyDX = cl->copyDY = 0;
+  REGION_EMPTY(pScreen, &cl->copyRegion);
+  REGION_RESET(pScreen, &cl->modifiedRegion, &box);
+  REGION_RESET(pScreen, &cl->requestedRegion, &box);
+  if (ICE_ENABLED(cl))
+    REGION_RESET(pScreen, &cl->ifRegion, &box);
+  for (i = 0; i < 4; i++)
+    cl->zsReset[i] = TRUE;
+
+  if (!rfbSendFramebufferUpdate(cl)) {
+    REGION_UNINIT(pScreen, &requestedRegionSave);
+    REGION_UNINIT(pScreen, &ifRegionSave);
+    return 0;
+  }
+
+  cl->tightCompressLevel = tightCompressLevelSave;
+  cl->tightQualityLevel = tightQualityLevelSave;
+  cl->useCopyRect = useCopyRectSave;
+  rfbAQApply(cl);
+  REGION_COPY(pScreen, &cl->requestedRegion, &requestedRegionSave);
+  REGION_UNINIT(pScreen, &requestedRegionSave);
+  if (ICE_ENABLED(cl))
+    REGION_COPY(pScreen, &cl->ifRegion, &ifRegionSave);
+  REGION_UNINIT(pScreen, &ifRegionSave);
+
+  /* If the update was held back, then try again shortly. */
+  if (captureBytes == offset)
+    return KEYFRAME_RETRY_INTERVAL;
+
+  WriteIndexEntry(cl, offset);
+  captureKeyframes++;
+  return rfbCaptureKeyframeInterval * 1000;
+}
+
+
+/*
+ * rfbCaptureOpen() is called when the first client connects.
+ */
+
+void rfbCaptureOpen(rfbClientPtr cl)
+{
+  char *indexFile;
+  int fd;
+
+  cl->captureFD = open(captureFile, O_CREAT | O_EXCL | O_WRONLY,
+                       S_IRUSR | S_IWUSR);
+  if (cl->captureFD < 0) {
+    rfbLogPerror("Could not open capture file");
+    return;
+  }
+
+  captureBuf = (char *)rfbAlloc(CAPTURE_BUF_SIZE);
+  captureHead = captureTail = captureCount = 0;
+  captureShutdown = captureError = FALSE;
+  captureBytes = 0;
+  captureStalls = captureKeyframes = 0;
+  captureStart = GetTimeInMillis();
+  keyframeWarned = FALSE;
+
+  if (pthread_create(&captureThread, NULL, CaptureThreadFunc,
+                     &cl->captureFD) != 0) {
+    rfbLog("Could not create capture thread\n");
+    close(cl->captureFD);
+    cl->captureFD = -1;
+    free(captureBuf);
+    captureBuf = NULL;
+    return;
+  }
+  captureThreadActive = TRUE;
+  rfbLog("Opened capture file %s\n", captureFile);
+
+  if (rfbCaptureKeyframeInterval <= 0)
+    return;
+
+  indexFile = (char *)rfbAlloc(strlen(captureFile) + 5);
+  sprintf(indexFile, "%s.idx", captureFile);
+  if ((fd = open(indexFile, O_CREAT | O_EXCL | O_WRONLY,
+                 S_IRUSR | S_IWUSR)) < 0 ||
+      (captureIndex = fdopen(fd, "w")) == NULL) {
+    rfbLogPerror("Could not open capture index");
+    if (fd >= 0) close(fd);
+    free(indexFile);
+    return;
+  }
+  fprintf(captureIndex,
+          "# offset time(ms) width height bpp depth bigendian truecolour redmax greenmax bluemax redshift greenshift blueshift\n");
+  rfbLog("Opened capture index %s\n", indexFile);
+  free(indexFile);
+
+  cl->keyframeTimer = TimerSet(cl->keyframeTimer, 0,
+                               rfbCaptureKeyframeInterval * 1000,
+                               keyframeCallback, cl);
+}
+
+
+/*
+ * rfbCaptureClose() is called when the capture client goes away.  It waits
+ * for the writer thread to write the rest of the data.
+ */
+
+void rfbCaptureClose(rfbClientPtr cl)
+{
+  TimerFree(cl->keyframeTimer);
+  cl->keyframeTimer = NULL;
+
+  if (cl->captureFD < 0)
+    return;
+
+  if (captureThreadActive) {
+    pthread_mutex_lock(&captureMutex);
+    captureShutdown = TRUE;
+    pthread_cond_signal(&captureDataCond);
+    pthread_mutex_unlock(&captureMutex);
+    pthread_join(captureThread, NULL);
+    captureThreadActive = FALSE;
+  }
+  close(cl->captureFD);
+  cl->captureFD = -1;
+  free(captureBuf);
+  captureBuf = NULL;
+
+  if (captureIndex) {
+    fclose(captureIndex);
+    captureIndex = NULL;
+  }
+
+  rfbLog("Closed capture file (%llu bytes, %lu keyframes, writer fell behind %lu times)\n",
+         captureBytes, captureKeyframes, captureStalls);
+}
@@ -129,15 +129,15 @@ Bool rfbSendCursorShape(rfbClientPtr cl, ScreenPtr pScreen)
     pCursor = NULL;
 
   if (pCursor == NULL) {
-    if (ublen + sz_rfbFramebufferUpdateRectHeader > UPDATE_BUF_SIZE) {
+    if (cl->ublen + sz_rfbFramebufferUpdateRectHeader > UPDATE_BUF_SIZE) {
       if (!rfbSendUpdateBuf(cl))
         return FALSE;
     }
     rect.r.x = rect.r.y = 0;
     rect.r.w = rect.r.h = 0;
-    memcpy(&updateBuf[ublen], (char *)&rect,
+    memcpy(&cl->updateBuf[cl->ublen], (char *)&rect,
            sz_rfbFramebufferUpdateRectHeader);
-    ublen += sz_rfbFramebufferUpdateRectHeader;
+    cl->ublen += sz_rfbFramebufferUpdateRectHeader;
 
     cl->rfbCursorShapeBytesSent += sz_rfbFramebufferUpdateRectHeader;
     cl->rfbCursorShapeUpdatesSent++;
@@ -156,17 +156,17 @@ Bool rfbSendCursorShape(rfbClientPtr cl, ScreenPtr pScreen)
 
   /* Send buffer contents if needed. */
 
-  if (ublen + sz_rfbFramebufferUpdateRectHeader + sz_rfbXCursorColors +
+  if (cl->ublen + sz_rfbFramebufferUpdateRectHeader + sz_rfbXCursorColors +
       maskBytes + dataBytes > UPDATE_BUF_SIZE) {
     if (!rfbSendUpdateBuf(cl))
       return FALSE;
   }
 
-  if (ublen + sz_rfbFramebufferUpdateRectHeader + sz_rfbXCursorColors +
+  if (cl->ublen + sz_rfbFramebufferUpdateRectHeader + sz_rfbXCursorColors +
       maskBytes + dataBytes > UPDATE_BUF_SIZE)
     return FALSE;               /* FIXME. */
 
-  saved_ublen = ublen;
+  saved_ublen = cl->ublen;
 
   /* Prepare rectangle header. */
 
@@ -175,8 +175,10 @@ Bool rfbSendCursorShape(rfbClientPtr cl, ScreenPtr pScreen)
   rect.r.w = Swap16IfLE(pCursor->bits->width);
   rect.r.h = Swap16IfLE(pCursor->bits->height);
 
-  memcpy(&updateBuf[ublen], (char *)&rect, sz_rfbFramebufferUpdateRectHeader);
-  ublen += sz_rfbFramebufferUpdateRectHeader;
+  memcpy(&cl->updateBuf[cl->ublen], (char *)&rect,
+
+         sz_rfbFramebufferUpdateRectHeader);
+  cl->ublen += sz_rfbFramebufferUpdateRectHeader;
 
   /* Prepare actual cursor data (depends on encoding used). */
 
@@ -189,8 +191,8 @@ Bool rfbSendCursorShape(rfbClientPtr cl, ScreenPtr pScreen)
     colors.backGreen = (char)(pCursor->backGreen >> 8);
     colors.backBlue  = (char)(pCursor->backBlue  >> 8);
 
-    memcpy(&updateBuf[ublen], (char *)&colors, sz_rfbXCursorColors);
-    ublen += sz_rfbXCursorColors;
+    memcpy(&cl->updateBuf[cl->ublen], (char *)&colors, sz_rfbXCursorColors);
+    cl->ublen += sz_rfbXCursorColors;
 
     bitmapData = (CARD8 *)pCursor->bits->source;
 
@@ -199,7 +201,7 @@ Bool rfbSendCursorShape(rfbClientPtr cl, ScreenPtr pScreen)
         bitmapByte = bitmapData[i * paddedRowBytes + j];
         if (screenInfo.bitmapBitOrder == LSBFirst)
           bitmapByte = _reverse_byte[bitmapByte];
-        updateBuf[ublen++] = (char)bitmapByte;
+        cl->updateBuf[cl->ublen++] = (char)bitmapByte;
       }
     }
   } else {
@@ -208,16 +210,16 @@ Bool rfbSendCursorShape(rfbClientPtr cl, ScreenPtr pScreen)
     if (pCursor->bits->argb) {
       switch (cl->format.bitsPerPixel) {
         case 8:
-          ublen += EncodeRichCursorDataARGB8(&updateBuf[ublen], &cl->format,
-                                             pCursor);
+          cl->ublen += EncodeRichCursorDataARGB8(&cl->updateBuf[cl->ublen],
+                                                 &cl->format, pCursor);
           break;
         case 16:
-          ublen += EncodeRichCursorDataARGB16(&updateBuf[ublen], &cl->format,
-                                              pCursor);
+          cl->ublen += EncodeRichCursorDataARGB16(&cl->updateBuf[cl->ublen],
+                                                  &cl->format, pCursor);
           break;
         case 32:
-          ublen += EncodeRichCursorDataARGB32(&updateBuf[ublen], &cl->format,
-                                              pCursor);
+          cl->ublen += EncodeRichCursorDataARGB32(&cl->updateBuf[cl->ublen],
+                                                  &cl->format, pCursor);
           break;
         default:
           return FALSE;
@@ -226,16 +228,16 @@ Bool rfbSendCursorShape(rfbClientPtr cl, ScreenPtr pScreen)
 #endif
       switch (cl->format.bitsPerPixel) {
         case 8:
-          ublen += EncodeRichCursorData8(&updateBuf[ublen], &cl->format,
-                                         pCursor);
+          cl->ublen += EncodeRichCursorData8(&cl->updateBuf[cl->ublen],
+                                             &cl->format, pCursor);
           break;
         case 16:
-          ublen += EncodeRichCursorData16(&updateBuf[ublen], &cl->format,
-                                          pCursor);
+          cl->ublen += EncodeRichCursorData16(&cl->updateBuf[cl->ublen],
+                                              &cl->format, pCursor);
           break;
         case 32:
-          ublen += EncodeRichCursorData32(&updateBuf[ublen], &cl->format,
-                                          pCursor);
+          cl->ublen += EncodeRichCursorData32(&cl->updateBuf[cl->ublen],
+                                              &cl->format, pCursor);
           break;
         default:
           return FALSE;
@@ -250,7 +252,7 @@ Bool rfbSendCursorShape(rfbClientPtr cl, ScreenPtr pScreen)
   if (pCursor->bits->argb) {
     int b;
     CARD32 *src = pCursor->bits->argb;
-    CARD8 *dst = (CARD8 *)&updateBuf[ublen];
+    CARD8 *dst = (CARD8 *)&cl->updateBuf[cl->ublen];
 
     memset(dst, 0, maskBytes);
     for (i = 0; i < pCursor->bits->height; i++) {
@@ -261,7 +263,7 @@ Bool rfbSendCursorShape(rfbClientPtr cl, ScreenPtr pScreen)
           src++;
         }
         *dst = _reverse_byte[*dst];
-        dst++;  ublen++;
+        dst++;  cl->ublen++;
       }
     }
   } else {
@@ -273,7 +275,7 @@ Bool rfbSendCursorShape(rfbClientPtr cl, ScreenPtr pScreen)
         bitmapByte = bitmapData[i * paddedRowBytes + j];
         if (screenInfo.bitmapBitOrder == LSBFirst)
           bitmapByte = _reverse_byte[bitmapByte];
-        updateBuf[ublen++] = (char)bitmapByte;
+        cl->updateBuf[cl->ublen++] = (char)bitmapByte;
       }
     }
 #ifdef ARGB_CURSOR
@@ -282,7 +284,7 @@ Bool rfbSendCursorShape(rfbClientPtr cl, ScreenPtr pScreen)
 
   /* Update statistics. */
 
-  cl->rfbCursorShapeBytesSent += (ublen - saved_ublen);
+  cl->rfbCursorShapeBytesSent += (cl->ublen - saved_ublen);
   cl->rfbCursorShapeUpdatesSent++;
 
   return TRUE;
@@ -298,7 +300,7 @@ Bool rfbSendCursorPos(rfbClientPtr cl, ScreenPtr pScreen)
   rfbFramebufferUpdateRectHeader rect;
   int x, y;
 
-  if (ublen + sz_rfbFramebufferUpdateRectHeader > UPDATE_BUF_SIZE) {
+  if (cl->ublen + sz_rfbFramebufferUpdateRectHeader > UPDATE_BUF_SIZE) {
     if (!rfbSendUpdateBuf(cl))
       return FALSE;
   }
@@ -311,8 +313,10 @@ Bool rfbSendCursorPos(rfbClientPtr cl, ScreenPtr pScreen)
   rect.r.w = 0;
   rect.r.h = 0;
 
-  memcpy(&updateBuf[ublen], (char *)&rect, sz_rfbFramebufferUpdateRectHeader);
-  ublen += sz_rfbFramebufferUpdateRectHeader;
+  memcpy(&cl->updateBuf[cl->ublen], (char *)&rect,
+
+         sz_rfbFramebufferUpdateRectHeader);
+  cl->ublen += sz_rfbFramebufferUpdateRectHeader;
 
   cl->rfbCursorPosBytesSent += sz_rfbFramebufferUpdateRectHeader;
   cl->rfbCursorPosUpdatesSent++;
@@ -0,0 +1,675 @@
+/*
+ * damagetrace.c
+ *
+ * Recording and replay of framebuffer damage traces
+ */
+
+/*
+ *  This is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This software is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this software; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301,
+ *  USA.
+ */
+
+/* A capture file (-capture) holds the RFB stream that was sent to one viewer,
+   so it can't be re-encoded with different settings.  A damage trace instead
+   holds the drawing that was done to the framebuffer: one record for each
+   batch of damage that rfbFlushDamage() adds to the clients' modified regions
+   (along with the new contents of the damaged area), one for each copy that
+   rfbCopyArea() or rfbCopyWindow() handles, and one for each region that
+   rfbPutImage() marks as eligible for ALR.  Another instance of Xvnc with the
+   same geometry and pixel format can replay the trace, at the original speed
+   or as fast as its viewers can receive the updates, and the replayed drawing
+   then passes through the whole update pipeline (interframe comparison, ALR,
+   flow control, and the encoders), so different versions or configurations of
+   the server can be compared on an identical workload.
+
+   The replayer draws to the root window with a GC of its own, so the damage
+   layer, the sprite routines, and rfbCopyArea() see the replayed drawing
+   exactly as they would see drawing from an X client.
+
+   File format (all integers are big endian):
+
+     header:  "TVNCDMG1", CARD16 width, CARD16 height, CARD8 bitsPerPixel,
+              CARD8 depth, CARD8 bigEndian, CARD8 pad, CARD8 redShift,
+              CARD8 greenShift, CARD8 blueShift, CARD8 pad
+     record:  CARD8 type, CARD8 pad[3], CARD32 time (ms since the start of
+              the recording), CARD32 nRects, INT16 dx, INT16 dy,
+              nRects * { CARD16 x, y, w, h },
+              [damage records only] CARD32 length, length bytes of pixel data
+
+   The pixel data for each rectangle is in ZPixmap format, with each row padded
+   as for PutImage.  The pixel data from all of the damage records is
+   compressed with a single zlib stream, which is flushed at the end of each
+   record. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "windowstr.h"
+#include "servermd.h"
+#include "rfb.h"
+
+
+char *rfbRecordDamageFile = NULL;
+char *rfbReplayDamageFile = NULL;
+double rfbReplaySpeed = 1.0;
+Bool rfbRecordingDamage = FALSE;
+Bool rfbReplayingDamage = FALSE;
+
+#define TRACE_MAGIC  "TVNCDMG1"
+#define TRACE_MAGIC_LEN  8
+
+#define sz_traceHeader  20
+#define sz_traceRecord  16
+#define sz_traceRect  8
+
+enum { TRACE_DAMAGE = 1, TRACE_COPY, TRACE_ALR };
+
+/* The pixel data is compressed quickly rather than well, since it is
+   compressed while the X server is drawing */
+#define TRACE_ZLIB_LEVEL  1
+
+/* Interval (ms) at which the replayer checks whether a viewer has connected */
+#define REPLAY_POLL_INTERVAL  100
+
+/* When replaying as fast as possible, each record is replayed once the
+   updates for the previous one have been sent to all viewers, or after this
+   many ms, whichever comes first. */
+#define REPLAY_MAX_WAIT  1000
+
+static FILE *traceFile = NULL;
+static z_stream traceStream;
+static Bool traceStreamInit = FALSE;
+static unsigned long traceRecords = 0;
+static double tracePixels = 0.;
+
+static char *traceBuf = NULL, *traceZBuf = NULL;
+static size_t traceBufSize = 0, traceZBufSize = 0;
+static xRectangle *traceRects = NULL;
+static int traceRectsSize = 0;
+
+/* Recording state */
+static CARD32 recordStart;
+
+/* Replay state */
+static OsTimerPtr replayTimer = NULL;
+static GCPtr replayGC = NULL;
+static Bool replayStarted = FALSE, replayPending = FALSE;
+static CARD32 replayStart, replayWaitStart;
+static double replayStartTime;
+static struct {
+  int type, nRects, dx, dy;
+  CARD32 time;
+} replayRec;
+
+
+static void Put16(unsigned char *p, CARD16 v)
+{
+  p[0] = v >> 8;  p[1] = v & 0xFF;
+}
+
+
+static void Put32(unsigned char *p, CARD32 v)
+{
+  p[0] = v >> 24;  p[1] = (v >> 16) & 0xFF;  p[2] = (v >> 8) & 0xFF;
+  p[3] = v & 0xFF;
+}
+
+
+static CARD16 Get16(const unsigned char *p)
+{
+  return (CARD16)((p[0] << 8) | p[1]);
+}
+
+
+static CARD32 Get32(const unsigned char *p)
+{
+  return ((CARD32)p[0] << 24) | ((CARD32)p[1] << 16) | ((CARD32)p[2] << 8) |
+         (CARD32)p[3];
+}
+
+
+static void CheckBuf(char **buf, size_t *size, size_t len)
+{
+  if (len > *size) {
+    *buf = (char *)rfbRealloc(*buf, len);
+    *size = len;
+  }
+}
+
+
+static void CheckRects(int nRects)
+{
+  if (nRects > traceRectsSize) {
+    traceRects = (xRectangle *)rfbRealloc(traceRects,
+                                          nRects * sizeof(xRectangle));
+    traceRectsSize = nRects;
+  }
+}
+
+
+static void CloseTrace(void)
+{
+  if (traceStreamInit) {
+    if (rfbRecordingDamage)
+      deflateEnd(&traceStream);
+    else
+      inflateEnd(&traceStream);
+    traceStreamInit = FALSE;
+  }
+  if (traceFile) {
+    fclose(traceFile);
+    traceFile = NULL;
+  }
+  free(traceBuf);  traceBuf = NULL;  traceBufSize = 0;
+  free(traceZBuf);  traceZBuf = NULL;  traceZBufSize = 0;
+  free(traceRects);  traceRects = NULL;  traceRectsSize = 0;
+}
+
+
+/****************************************************************************/
+/*
+ * Recording
+ */
+/****************************************************************************/
+
+static void StopRecording(void)
+{
+  rfbLogPerror("Could not write damage trace");
+  rfbLog("Damage trace recording stopped\n");
+  CloseTrace();
+  rfbRecordingDamage = FALSE;
+}
+
+
+static void WriteRecord(int type, RegionPtr reg, int dx, int dy, char *data,
+                        CARD32 dataLen)
+{
+  unsigned char hdr[sz_traceRecord], rect[sz_traceRect];
+  BoxPtr rects = REGION_RECTS(reg);
+  int i, nRects = REGION_NUM_RECTS(reg);
+
+  memset(hdr, 0, sz_traceRecord);
+  hdr[0] = type;
+  Put32(&hdr[4], GetTimeInMillis() - recordStart);
+  Put32(&hdr[8], nRects);
+  Put16(&hdr[12], (CARD16)dx);
+  Put16(&hdr[14], (CARD16)dy);
+  if (fwrite(hdr, sz_traceRecord, 1, traceFile) != 1) goto bailout;
+
+  for (i = 0; i < nRects; i++) {
+    Put16(&rect[0], rects[i].x1);
+    Put16(&rect[2], rects[i].y1);
+    Put16(&rect[4], rects[i].x2 - rects[i].x1);
+    Put16(&rect[6], rects[i].y2 - rects[i].y1);
+    if (fwrite(rect, sz_traceRect, 1, traceFile) != 1) goto bailout;
+  }
+
+  if (type == TRACE_DAMAGE) {
+    Put32(hdr, dataLen);
+    if (fwrite(hdr, 4, 1, traceFile) != 1 ||
+        fwrite(data, dataLen, 1, traceFile) != 1)
+      goto bailout;
+  }
+
+  /* Flush each record, so that the trace is usable even if the X server is
+     killed. */
+  if (fflush(traceFile) != 0) goto bailout;
+  traceRecords++;
+  return;
+
+  bailout:
+  StopRecording();
+}
+
+
+/*
+ * rfbRecordDamage() is called with each batch of damage before it is added to
+ * the clients' modified regions, and with each region that is eligible for
+ * ALR.  The pixels are read with GetImage() so that the sprite routines
+ * remove the cursor from them first.
+ */
+
+void rfbRecordDamage(ScreenPtr pScreen, RegionPtr reg, Bool alr)
+{
+  BoxPtr rects;
+  int i, nRects, depth = pScreen->rootDepth;
+  size_t len = 0;
+  char *ptr;
+
+  if (!rfbRecordingDamage || !pScreen->root ||
+      !REGION_NOTEMPTY(pScreen, reg))
+    return;
+
+  if (alr) {
+    WriteRecord(TRACE_ALR, reg, 0, 0, NULL, 0);
+    return;
+  }
+
+  rects = REGION_RECTS(reg);
+  nRects = REGION_NUM_RECTS(reg);
+  for (i = 0; i < nRects; i++)
+    len += (size_t)PixmapBytePad(rects[i].x2 - rects[i].x1, depth) *
+           (rects[i].y2 - rects[i].y1);
+  CheckBuf(&traceBuf, &traceBufSize, len);
+
+  ptr = traceBuf;
+  for (i = 0; i < nRects; i++) {
+    int w = rects[i].x2 - rects[i].x1, h = rects[i].y2 - rects[i].y1;
+
+    (*pScreen->GetImage) (&pScreen->root->drawable, rects[i].x1, rects[i].y1,
+                          w, h, ZPixmap, ~0, ptr);
+    ptr += PixmapBytePad(w, depth) * h;
+    tracePixels += (double)w * (double)h;
+  }
+
+  traceStream.next_in = (Bytef *)traceBuf;
+  traceStream.avail_in = len;
+  CheckBuf(&traceZBuf, &traceZBufSize, deflateBound(&traceStream, len) + 16);
+  traceStream.next_out = (Bytef *)traceZBuf;
+  traceStream.avail_out = traceZBufSize;
+  for (;;) {
+    int err = deflate(&traceStream, Z_SYNC_FLUSH);
+    size_t zLen = (char *)traceStream.next_out - traceZBuf;
+
+    if (err != Z_OK && err != Z_BUF_ERROR) {
+      rfbLog("Could not compress damage trace: %s\n", traceStream.msg);
+      rfbLog("Damage trace recording stopped\n");
+      CloseTrace();
+      rfbRecordingDamage = FALSE;
+      return;
+    }
+    if (traceStream.avail_out != 0) break;
+    CheckBuf(&traceZBuf, &traceZBufSize, traceZBufSize * 2);
+    traceStream.next_out = (Bytef *)traceZBuf + zLen;
+    traceStream.avail_out = traceZBufSize - zLen;
+  }
+
+  WriteRecord(TRACE_DAMAGE, reg, 0, 0, traceZBuf,
+              (char *)traceStream.next_out - traceZBuf);
+}
+
+
+/*
+ * rfbRecordCopy() is called after a copy has been done to the framebuffer.
+ * src is the source region (which is modified by this routine), and dst is
+ * the destination region.  Any part of the destination that was not copied
+ * from the source is recorded as ordinary damage.
+ */
+
+void rfbRecordCopy(ScreenPtr pScreen, RegionPtr src, RegionPtr dst, int dx,
+                   int dy)
+{
+  RegionRec moved, rest;
+
+  if (!rfbRecordingDamage) return;
+
+  REGION_TRANSLATE(pScreen, src, dx, dy);
+  REGION_INIT(pScreen, &moved, NullBox, 0);
+  REGION_INTERSECT(pScreen, &moved, src, dst);
+  if (REGION_NOTEMPTY(pScreen, &moved))
+    WriteRecord(TRACE_COPY, &moved, dx, dy, NULL, 0);
+
+  REGION_INIT(pScreen, &rest, NullBox, 0);
+  REGION_SUBTRACT(pScreen, &rest, dst, &moved);
+  if (rfbRecordingDamage)
+    rfbRecordDamage(pScreen, &rest, FALSE);
+
+  REGION_UNINIT(pScreen, &rest);
+  REGION_UNINIT(pScreen, &moved);
+}
+
+
+/****************************************************************************/
+/*
+ * Replay
+ */
+/****************************************************************************/
+
+static Bool ReadRecord(void)
+{
+  unsigned char hdr[sz_traceRecord], rect[sz_traceRect];
+  int i, depth = screenInfo.screens[0]->rootDepth;
+  size_t len = 0;
+  CARD32 zLen;
+
+  /* The end of the file is only expected between records */
+  if (fread(hdr, sz_traceRecord, 1, traceFile) != 1) {
+    if (ferror(traceFile)) goto bailout;
+    return FALSE;
+  }
+
+  replayRec.type = hdr[0];
+  replayRec.time = Get32(&hdr[4]);
+  replayRec.nRects = (int)Get32(&hdr[8]);
+  replayRec.dx = (INT16)Get16(&hdr[12]);
+  replayRec.dy = (INT16)Get16(&hdr[14]);
+  if (replayRec.type < TRACE_DAMAGE || replayRec.type > TRACE_ALR ||
+      replayRec.nRects < 1 || replayRec.nRects > rfbFB.width * rfbFB.height)
+    goto bailout;
+
+  CheckRects(replayRec.nRects);
+  for (i = 0; i < replayRec.nRects; i++) {
+    xRectangle *r = &traceRects[i];
+
+    if (fread(rect, sz_traceRect, 1, traceFile) != 1) goto bailout;
+    r->x = Get16(&rect[0]);  r->y = Get16(&rect[2]);
+    r->width = Get16(&rect[4]);  r->height = Get16(&rect[6]);
+    if (r->width < 1 || r->height < 1 || r->x + r->width > rfbFB.width ||
+        r->y + r->height > rfbFB.height)
+      goto bailout;
+    if (replayRec.type == TRACE_COPY &&
+        (r->x - replayRec.dx < 0 || r->y - replayRec.dy < 0 ||
+         r->x + r->width - replayRec.dx > rfbFB.width ||
+         r->y + r->height - replayRec.dy > rfbFB.height))
+      goto bailout;
+    len += (size_t)PixmapBytePad(r->width, depth) * r->height;
+  }
+
+  if (replayRec.type != TRACE_DAMAGE)
+    return TRUE;
+
+  if (fread(hdr, 4, 1, traceFile) != 1) goto bailout;
+  zLen = Get32(hdr);
+  CheckBuf(&traceZBuf, &traceZBufSize, zLen);
+  if (zLen && fread(traceZBuf, zLen, 1, traceFile) != 1) goto bailout;
+
+  /* The output buffer has one byte to spare, so that inflate() consumes the
+     whole record, including the end of the flush. */
+  CheckBuf(&traceBuf, &traceBufSize, len + 1);
+  traceStream.next_in = (Bytef *)traceZBuf;
+  traceStream.avail_in = zLen;
+  traceStream.next_out = (Bytef *)traceBuf;
+  traceStream.avail_out = len + 1;
+  if (inflate(&traceStream, Z_SYNC_FLUSH) != Z_OK ||
+      traceStream.avail_in != 0 || traceStream.avail_out != 1)
+    goto bailout;
+
+  return TRUE;
+
+  bailout:
+  rfbLog("Damage trace %s is corrupt or truncated\n", rfbReplayDamageFile);
+  return FALSE;
+}
+
+
+static void ReplayRecord(ScreenPtr pScreen)
+{
+  DrawablePtr pRoot = &pScreen->root->drawable;
+  int i, depth = pScreen->rootDepth;
+
+  switch (replayRec.type) {
+
+    case TRACE_DAMAGE:
+    {
+      char *ptr = traceBuf;
+
+      ValidateGC(pRoot, replayGC);
+      rfbReplayingDamage = TRUE;
+      for (i = 0; i < replayRec.nRects; i++) {
+        xRectangle *r = &traceRects[i];
+
+        (*replayGC->ops->PutImage) (pRoot, replayGC, depth, r->x, r->y,
+                                    r->width, r->height, 0, ZPixmap, ptr);
+        ptr += PixmapBytePad(r->width, depth) * r->height;
+        tracePixels += (double)r->width * (double)r->height;
+      }
+      rfbReplayingDamage = FALSE;
+      break;
+    }
+
+    case TRACE_COPY:
+    {
+      int x1 = rfbFB.width, y1 = rfbFB.height, x2 = 0, y2 = 0;
+
+      /* Copy the bounding box of the destination, clipped to the
+         destination. */
+      for (i = 0; i < replayRec.nRects; i++) {
+        xRectangle *r = &traceRects[i];
+
+        x1 = min(x1, r->x);  y1 = min(y1, r->y);
+        x2 = max(x2, r->x + r->width);  y2 = max(y2, r->y + r->height);
+      }
+      SetClipRects(replayGC, 0, 0, replayRec.nRects, traceRects,
+                   CT_UNSORTED);
+      ValidateGC(pRoot, replayGC);
+      (*replayGC->ops->CopyArea) (pRoot, pRoot, replayGC, x1 - replayRec.dx,
+                                  y1 - replayRec.dy, x2 - x1, y2 - y1, x1,
+                                  y1);
+      (*replayGC->funcs->ChangeClip) (replayGC, CT_NONE, NULL, 0);
+      break;
+    }
+
+    case TRACE_ALR:
+    {
+      RegionPtr reg = RECTS_TO_REGION(pScreen, replayRec.nRects, traceRects,
+                                      CT_UNSORTED);
+
+      rfbAddALRDamage(pScreen, reg);
+      REGION_DESTROY(pScreen, reg);
+      break;
+    }
+  }
+
+  traceRecords++;
+}
+
+
+/* Returns TRUE if all of the damage that has been replayed so far has been
+   sent to all viewers */
+
+static Bool ReplayIdle(ScreenPtr pScreen)
+{
+  rfbClientPtr cl;
+
+  if (rfbFB.pDamage &&
+      REGION_NOTEMPTY(pScreen, DamageRegion(rfbFB.pDamage)))
+    return FALSE;
+
+  for (cl = rfbClientHead; cl; cl = cl->next) {
+    if (cl->state != RFB_NORMAL) continue;
+    if (cl->deferredUpdateScheduled ||
+        REGION_NOTEMPTY(pScreen, &cl->copyRegion) ||
+        REGION_NOTEMPTY(pScreen, &cl->modifiedRegion) ||
+        rfbDamageGen > cl->damageGen)
+      return FALSE;
+  }
+  return TRUE;
+}
+
+
+static void EndReplay(void)
+{
+  double elapsed = gettime() - replayStartTime;
+
+  rfbLog("Replayed %lu damage trace records (%.1f Mpixels) in %.3f s\n",
+         traceRecords, tracePixels / 1000000., elapsed);
+  CloseTrace();
+  if (replayGC) {
+    FreeGC(replayGC, (GContext)0);
+    replayGC = NULL;
+  }
+}
+
+
+/*
+ * The replay timer waits for a viewer to connect and then replays each record
+ * when it is due.
+ */
+
+static CARD32 ReplayCallback(OsTimerPtr timer, CARD32 now, pointer arg)
+{
+  ScreenPtr pScreen = screenInfo.screens[0];
+
+  if (!replayStarted) {
+    rfbClientPtr cl;
+    XID val = IncludeInferiors;
+    int status;
+
+    for (cl = rfbClientHead; cl; cl = cl->next)
+      if (cl->state == RFB_NORMAL) break;
+    if (!cl || !pScreen->root) return REPLAY_POLL_INTERVAL;
+
+    replayGC = CreateGC(&pScreen->root->drawable, GCSubwindowMode, &val,
+                        &status, (XID)0, serverClient);
+    if (!replayGC) {
+      rfbLog("Could not create GC for damage trace replay\n");
+      CloseTrace();
+      return 0;
+    }
+
+    rfbLog("Replaying damage trace %s\n", rfbReplayDamageFile);
+    replayStarted = TRUE;
+    replayStart = now;
+    replayStartTime = gettime();
+  }
+
+  for (;;) {
+    if (!replayPending) {
+      if (!ReadRecord()) {
+        EndReplay();
+        return 0;
+      }
+      replayPending = TRUE;
+      replayWaitStart = now;
+    }
+
+    if (rfbReplaySpeed > 0.0) {
+      CARD32 due = replayStart +
+                   (CARD32)((double)replayRec.time / rfbReplaySpeed);
+
+      if ((INT32)(due - now) > 0)
+        return due - now;
+    } else if (!ReplayIdle(pScreen) &&
+               now - replayWaitStart < REPLAY_MAX_WAIT)
+      return 1;
+
+    ReplayRecord(pScreen);
+    replayPending = FALSE;
+
+    /* When replaying as fast as possible, give the X server a chance to
+       flush the damage and send the updates. */
+    if (rfbReplaySpeed <= 0.0)
+      return 1;
+  }
+}
+
+
+/****************************************************************************/
+/*
+ * Initialization and shutdown
+ */
+/****************************************************************************/
+
+/*
+ * rfbInitDamageTrace() is called once the screen pixmap exists.
+ */
+
+void rfbInitDamageTrace(ScreenPtr pScreen)
+{
+  unsigned char hdr[sz_traceHeader];
+
+  if (rfbRecordDamageFile && rfbReplayDamageFile) {
+    rfbLog("-recorddamage cannot be used with -replaydamage.  Ignoring -recorddamage.\n");
+    rfbRecordDamageFile = NULL;
+  }
+
+  if (rfbRecordDamageFile) {
+    if ((traceFile = fopen(rfbRecordDamageFile, "wb")) == NULL) {
+      rfbLogPerror("Could not open damage trace file");
+      return;
+    }
+
+    memset(hdr, 0, sz_traceHeader);
+    memcpy(hdr, TRACE_MAGIC, TRACE_MAGIC_LEN);
+    Put16(&hdr[8], rfbFB.width);
+    Put16(&hdr[10], rfbFB.height);
+    hdr[12] = rfbServerFormat.bitsPerPixel;
+    hdr[13] = rfbServerFormat.depth;
+    hdr[14] = rfbServerFormat.bigEndian;
+    hdr[16] = rfbServerFormat.redShift;
+    hdr[17] = rfbServerFormat.greenShift;
+    hdr[18] = rfbServerFormat.blueShift;
+    if (fwrite(hdr, sz_traceHeader, 1, traceFile) != 1 ||
+        fflush(traceFile) != 0) {
+      rfbLogPerror("Could not write damage trace");
+      CloseTrace();
+      return;
+    }
+
+    memset(&traceStream, 0, sizeof(z_stream));
+    if (deflateInit(&traceStream, TRACE_ZLIB_LEVEL) != Z_OK) {
+      rfbLog("Could not initialize zlib stream for damage trace\n");
+      CloseTrace();
+      return;
+    }
+    traceStreamInit = TRUE;
+    rfbRecordingDamage = TRUE;
+    recordStart = GetTimeInMillis();
+    rfbLog("Recording damage trace to %s\n", rfbRecordDamageFile);
+  }
+
+  if (rfbReplayDamageFile) {
+    if ((traceFile = fopen(rfbReplayDamageFile, "rb")) == NULL) {
+      rfbLogPerror("Could not open damage trace file");
+      return;
+    }
+
+    if (fread(hdr, sz_traceHeader, 1, traceFile) != 1 ||
+        memcmp(hdr, TRACE_MAGIC, TRACE_MAGIC_LEN)) {
+      rfbLog("%s is not a damage trace\n", rfbReplayDamageFile);
+      CloseTrace();
+      return;
+    }
+    if (Get16(&hdr[8]) != rfbFB.width || Get16(&hdr[10]) != rfbFB.height ||
+        hdr[12] != rfbServerFormat.bitsPerPixel ||
+        hdr[13] != rfbServerFormat.depth ||
+        hdr[14] != rfbServerFormat.bigEndian ||
+        hdr[16] != rfbServerFormat.redShift ||
+        hdr[17] != rfbServerFormat.greenShift ||
+        hdr[18] != rfbServerFormat.blueShift) {
+      rfbLog("Damage trace %s was recorded with a %dx%d, depth %d framebuffer\n",
+             rfbReplayDamageFile, Get16(&hdr[8]), Get16(&hdr[10]), hdr[13]);
+      rfbLog("   and can't be replayed with this one\n");
+      CloseTrace();
+      return;
+    }
+
+    memset(&traceStream, 0, sizeof(z_stream));
+    if (inflateInit(&traceStream) != Z_OK) {
+      rfbLog("Could not initialize zlib stream for damage trace\n");
+      CloseTrace();
+      return;
+    }
+    traceStreamInit = TRUE;
+    replayTimer = TimerSet(replayTimer, 0, REPLAY_POLL_INTERVAL,
+                           ReplayCallback, NULL);
+  }
+}
+
+
+void rfbShutdownDamageTrace(void)
+{
+  if (rfbRecordingDamage) {
+    rfbLog("Recorded %lu damage trace records (%.1f Mpixels)\n",
+           traceRecords, tracePixels / 1000000.);
+    CloseTrace();
+    rfbRecordingDamage = FALSE;
+  }
+  if (replayTimer) {
+    TimerFree(replayTimer);
+    replayTimer = NULL;
+  }
+  CloseTrace();
+}
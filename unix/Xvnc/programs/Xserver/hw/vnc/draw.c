@@ -1,10 +1,12 @@
 /*
- * draw.c - drawing routines for the RFB X server.  This is a set of
- * wrappers around the standard MI/MFB/CFB drawing routines which work out
- * to a fair approximation the region of the screen being modified by the
- * drawing.  If the RFB client is ready then the modified region of the screen
- * is sent to the client, otherwise the modified region will simply grow with
- * each drawing request until the client is ready.
+ * draw.c - drawing routines for the RFB X server.  The region of the screen
+ * being modified by drawing is obtained from the X server's damage layer and
+ * is added to the modified region of each RFB client in batches, once per
+ * pass through the dispatch loop.  If the RFB client is ready then the
+ * modified region of the screen is sent to the client, otherwise the modified
+ * region will simply grow with each drawing request until the client is
+ * ready.  CopyArea and CopyWindow are still wrapped, so that they can be sent
+ * as CopyRect.
  *
  * Modified for XFree86 4.x by Alan Hourihane <alanh@fairlite.demon.co.uk>
  */
@@ -71,10 +73,26 @@ in this Software without prior written authorization from the X Consortium.
 #include "rfb.h"
 #include "fb.h"
 #include "misc.h"
+#include "damage.h"
 
 extern WindowPtr *WindowTable;  /* Why isn't this in a header file? */
 
 int rfbDeferUpdateTime = DEFAULT_DEFER_UPDATE_TIME;  /* ms */
+Bool rfbAdaptiveDefer = FALSE;
+int rfbMaxFPS = 0;
+
+/* Limits for the adaptive defer time (ms) */
+#define ADAPTIVE_DEFER_MIN 1
+#define ADAPTIVE_DEFER_MAX 100
+
+/* Damage rate (in screens per second) at or above which updates are deferred
+   for the full rfbDeferUpdateTime or longer */
+#define ADAPTIVE_DEFER_FULL_RATE 2.0
+
+/* rfbFBGeneration changes whenever the framebuffer may have been modified.
+   The hash-based interframe comparison engine uses it to determine whether
+   its cached block hashes are still valid. */
+unsigned long rfbFBGeneration = 1;
 
 
 static inline Bool is_visible(DrawablePtr drawable)
@@ -114,43 +132,14 @@ static inline Bool is_visible(DrawablePtr drawable)
 
 #define TRC(x)  /* (rfbLog x) */
 
-/* ADD_TO_MODIFIED_REGION adds the given region to the modified region for each
-   client */
-
-#define ADD_TO_MODIFIED_REGION(pScreen, reg) {  \
-  rfbClientPtr clTemp;  \
-  BoxRec *boxTemp = REGION_EXTENTS(pScreen, reg);  \
-  if ((boxTemp->x2 - boxTemp->x1) * (boxTemp->y2 - boxTemp->y1) != 0)  \
-    for (clTemp = rfbClientHead; clTemp; clTemp = clTemp->next) {  \
-      if (!prfb->dontSendFramebufferUpdate ||  \
-          !clTemp->enableCursorShapeUpdates)  \
-        REGION_UNION((pScreen), &clTemp->modifiedRegion,  \
-                     &clTemp->modifiedRegion, reg);  \
-    }  \
-}
-
-/* ADD_TO_ALR_REGION adds the given region to the ALR-eligible region for each
-   client */
-
-#define ADD_TO_ALR_REGION(pScreen, reg) {  \
-  rfbClientPtr clTemp;  \
-  BoxRec *boxTemp = REGION_EXTENTS(pScreen, reg);  \
-  if ((boxTemp->x2 - boxTemp->x1) * (boxTemp->y2 - boxTemp->y1) != 0)  \
-    for (clTemp = rfbClientHead; clTemp; clTemp = clTemp->next) {  \
-      if (!prfb->dontSendFramebufferUpdate ||  \
-          !clTemp->enableCursorShapeUpdates)  \
-        REGION_UNION((pScreen), &clTemp->alrEligibleRegion,  \
-                     &clTemp->alrEligibleRegion, reg);  \
-    }  \
-}
-
-/* SCHEDULE_FB_UPDATE is used at the end of each drawing routine to schedule an
-   update to be sent to each client if there is one pending and the client is
-   ready for it.  */
+/* SCHEDULE_FB_UPDATE is used after damage has been added to the clients'
+   modified regions to schedule an update to be sent to each client if there
+   is one pending and the client is ready for it.  */
 
 #define SCHEDULE_FB_UPDATE(pScreen, prfb)  \
   if (!prfb->dontSendFramebufferUpdate && !prfb->blockUpdates) {  \
     rfbClientPtr clTemp, nextCl;  \
+    if (rfbMetricsSocket) rfbMetricsNoteDamage();  \
     for (clTemp = rfbClientHead; clTemp; clTemp = nextCl) {  \
       nextCl = clTemp->next;  \
       if (!clTemp->deferredUpdateScheduled && FB_UPDATE_PENDING(clTemp))  \
@@ -160,6 +149,9 @@ static inline Bool is_visible(DrawablePtr drawable)
 
 /* function prototypes */
 
+static void rfbAddDamage(ScreenPtr pScreen, RegionPtr reg, Bool alr,
+                         Bool cursor);
+static void rfbFlushDamage(ScreenPtr pScreen);
 static void rfbScheduleDeferredUpdate(rfbClientPtr cl);
 static void rfbCopyRegion(ScreenPtr pScreen, rfbClientPtr cl,
                           RegionPtr src, RegionPtr dst, int dx, int dy);
@@ -177,54 +169,12 @@ static void rfbCopyClip(GCPtr pgcDst, GCPtr pgcSrc);
 
 /* GC ops */
 
-static void rfbFillSpans(DrawablePtr pDrawable, GCPtr pGC, int nInit,
-                         DDXPointPtr pptInit, int *pwidthInit, int fSorted);
-static void rfbSetSpans(DrawablePtr pDrawable, GCPtr pGC, char *psrc,
-                        register DDXPointPtr ppt, int *pwidth, int nspans,
-                        int fSorted);
 static void rfbPutImage(DrawablePtr pDrawable, GCPtr pGC, int depth, int x,
                         int y, int w, int h, int leftPad, int format,
                         char *pBits);
 static RegionPtr rfbCopyArea(DrawablePtr pSrc, DrawablePtr pDst, GCPtr pGC,
                              int srcx, int srcy, int w, int h, int dstx,
                              int dsty);
-static RegionPtr rfbCopyPlane(DrawablePtr pSrc, DrawablePtr pDst,
-                              register GCPtr pGC, int srcx, int srcy, int w,
-                              int h, int dstx, int dsty, unsigned long plane);
-static void rfbPolyPoint(DrawablePtr pDrawable, GCPtr pGC, int mode, int npt,
-                         xPoint *pts);
-static void rfbPolylines(DrawablePtr pDrawable, GCPtr pGC, int mode, int npt,
-                         DDXPointPtr ppts);
-static void rfbPolySegment(DrawablePtr pDrawable, GCPtr pGC, int nseg,
-                           xSegment *segs);
-static void rfbPolyRectangle(DrawablePtr pDrawable, GCPtr pGC, int nrects,
-                             xRectangle *rects);
-static void rfbPolyArc(DrawablePtr pDrawable, register GCPtr pGC, int narcs,
-                       xArc *arcs);
-static void rfbFillPolygon(register DrawablePtr pDrawable, register GCPtr pGC,
-                           int shape, int mode, int count, DDXPointPtr pts);
-static void rfbPolyFillRect(DrawablePtr pDrawable, GCPtr pGC, int nrects,
-                            xRectangle *rects);
-static void rfbPolyFillArc(DrawablePtr pDrawable, GCPtr pGC, int narcs,
-                           xArc *arcs);
-static void GetTextBoundingBox(DrawablePtr pDrawable, FontPtr font, int x,
-                               int y, int n, BoxPtr pbox);
-static int rfbPolyText8(DrawablePtr pDrawable, GCPtr pGC, int x, int y,
-                        int count, char *chars);
-static int rfbPolyText16(DrawablePtr pDrawable, GCPtr pGC, int x, int y,
-                         int count, unsigned short *chars);
-static void rfbImageText8(DrawablePtr pDrawable, GCPtr pGC, int x, int y,
-                          int count, char *chars);
-static void rfbImageText16(DrawablePtr pDrawable, GCPtr pGC, int x, int y,
-                           int count, unsigned short *chars);
-static void rfbImageGlyphBlt(DrawablePtr pDrawable, GCPtr pGC, int x, int y,
-                             unsigned int nglyph, CharInfoPtr *ppci,
-                             pointer pglyphBase);
-static void rfbPolyGlyphBlt(DrawablePtr pDrawable, GCPtr pGC, int x, int y,
-                            unsigned int nglyph, CharInfoPtr *ppci,
-                            pointer pglyphBase);
-static void rfbPushPixels(GCPtr pGC, PixmapPtr pBitMap, DrawablePtr pDrawable,
-                          int w, int h, int x, int y);
 
 
 static const GCFuncs rfbGCFuncs = {
@@ -238,17 +188,6 @@ static const GCFuncs rfbGCFuncs = {
 };
 
 
-static const GCOps rfbGCOps = {
-  rfbFillSpans,     rfbSetSpans,     rfbPutImage,
-  rfbCopyArea,      rfbCopyPlane,    rfbPolyPoint,
-  rfbPolylines,     rfbPolySegment,  rfbPolyRectangle,
-  rfbPolyArc,       rfbFillPolygon,  rfbPolyFillRect,
-  rfbPolyFillArc,   rfbPolyText8,    rfbPolyText16,
-  rfbImageText8,    rfbImageText16,  rfbImageGlyphBlt,
-  rfbPolyGlyphBlt,  rfbPushPixels
-};
-
-
 void ClipToScreen(ScreenPtr pScreen, RegionPtr pRegion)
 {
   RegionRec screenRegion;
@@ -260,6 +199,279 @@ void ClipToScreen(ScreenPtr pScreen, RegionPtr pRegion)
 }
 
 
+/****************************************************************************/
+/*
+ * Tile-grid damage tracking
+ */
+/****************************************************************************/
+
+/* With more than one client connected, adding each batch of damage to every
+   client's modified region would make the cost of drawing proportional to the
+   number of clients.  Instead, rfbAddDamage() marks the damaged tiles in a
+   grid that is shared by all clients.  Each tile records the framebuffer
+   generation in which it was last damaged, and each client records the
+   generation as of which it last collected the grid (cl->damageGen), so
+   rfbCollectDamage() can add to the client's modified region all of the tiles
+   that have been damaged since then.  rowGen[] holds the newest generation in
+   each row of tiles, so unchanged rows can be skipped. */
+
+#define DAMAGE_TILE_SHIFT  4
+#define DAMAGE_TILE_SIZE  (1 << DAMAGE_TILE_SHIFT)
+
+/* The generation of the most recent damage that was added to the grid */
+unsigned long rfbDamageGen = 0;
+
+static unsigned long *tileGen = NULL, *alrTileGen = NULL, *rowGen = NULL;
+static xRectangle *damageRects = NULL;
+static int tilesX = 0, tilesY = 0;
+
+
+static void CheckDamageGrid(void)
+{
+  int tx = (rfbFB.width + DAMAGE_TILE_SIZE - 1) >> DAMAGE_TILE_SHIFT;
+  int ty = (rfbFB.height + DAMAGE_TILE_SIZE - 1) >> DAMAGE_TILE_SHIFT;
+
+  if (tx == tilesX && ty == tilesY) return;
+
+  /* If the framebuffer was resized, then all clients have already been sent
+     (or will be sent) a full update, so the old grid can be discarded. */
+  free(tileGen);
+  free(alrTileGen);
+  free(rowGen);
+  free(damageRects);
+  tileGen = (unsigned long *)rfbAlloc0(tx * ty * sizeof(unsigned long));
+  alrTileGen = (unsigned long *)rfbAlloc0(tx * ty * sizeof(unsigned long));
+  rowGen = (unsigned long *)rfbAlloc0(ty * sizeof(unsigned long));
+  /* Each row of tiles can produce at most (tx + 1) / 2 runs. */
+  damageRects = (xRectangle *)rfbAlloc(tx * ty * sizeof(xRectangle));
+  tilesX = tx;  tilesY = ty;
+}
+
+
+static void MarkTiles(BoxPtr box, unsigned long *gen)
+{
+  int x1 = max(box->x1, 0), y1 = max(box->y1, 0);
+  int x2 = min(box->x2, rfbFB.width), y2 = min(box->y2, rfbFB.height);
+  int tx, ty;
+
+  if (x2 <= x1 || y2 <= y1) return;
+
+  x1 >>= DAMAGE_TILE_SHIFT;  x2 = (x2 - 1) >> DAMAGE_TILE_SHIFT;
+  y1 >>= DAMAGE_TILE_SHIFT;  y2 = (y2 - 1) >> DAMAGE_TILE_SHIFT;
+
+  for (ty = y1; ty <= y2; ty++) {
+    unsigned long *row = &gen[ty * tilesX];
+
+    rowGen[ty] = rfbFBGeneration;
+    for (tx = x1; tx <= x2; tx++)
+      row[tx] = rfbFBGeneration;
+  }
+}
+
+
+/*
+ * Add the given region to the modified region (or, if alr is TRUE, the
+ * ALR-eligible region) of each client.  If the damage was caused by drawing or
+ * removing the cursor (cursor is TRUE), then clients that receive cursor shape
+ * updates don't need to know about it, so the damage is added directly to the
+ * regions of the other clients.  That is also done if only one client is
+ * connected, in which case the grid would not save anything.
+ */
+
+static void rfbAddDamage(ScreenPtr pScreen, RegionPtr reg, Bool alr,
+                         Bool cursor)
+{
+  BoxPtr box = REGION_EXTENTS(pScreen, reg), rects;
+  int i, nrects;
+
+  if ((box->x2 - box->x1) * (box->y2 - box->y1) == 0 || !rfbClientHead)
+    return;
+
+  if (cursor || !rfbClientHead->next) {
+    rfbClientPtr cl;
+
+    for (cl = rfbClientHead; cl; cl = cl->next) {
+      if (!cursor || !cl->enableCursorShapeUpdates) {
+        if (!alr)
+          REGION_UNION(pScreen, &cl->modifiedRegion, &cl->modifiedRegion,
+                       reg);
+        else if (rfbAutoLosslessRefresh > 0.0)
+          REGION_UNION(pScreen, &cl->alrEligibleRegion,
+                       &cl->alrEligibleRegion, reg);
+      }
+    }
+    return;
+  }
+
+  CheckDamageGrid();
+  rects = REGION_RECTS(reg);
+  nrects = REGION_NUM_RECTS(reg);
+  for (i = 0; i < nrects; i++)
+    MarkTiles(&rects[i], alr ? alrTileGen : tileGen);
+  rfbDamageGen = rfbFBGeneration;
+}
+
+
+/*
+ * Add the tiles in the given grid that have been damaged since generation
+ * since to the given region.  Each row of tiles is reduced to a list of
+ * horizontal runs, and a row whose runs match those of the row above it is
+ * merged with that row, so the result is already a valid y-x banded region.
+ */
+
+static void CollectTiles(ScreenPtr pScreen, unsigned long *gen,
+                         unsigned long since, RegionPtr dst)
+{
+  int tx, ty, i, n = 0, prevFirst = 0, prevCount = 0, prevRow = -2;
+
+  for (ty = 0; ty < tilesY; ty++) {
+    unsigned long *row = &gen[ty * tilesX];
+    int first = n, y = ty << DAMAGE_TILE_SHIFT;
+    int h = min(DAMAGE_TILE_SIZE, rfbFB.height - y);
+
+    if (rowGen[ty] <= since || h <= 0) continue;
+
+    for (tx = 0; tx < tilesX; ) {
+      int x = tx << DAMAGE_TILE_SHIFT;
+
+      if (row[tx] <= since) {
+        tx++;  continue;
+      }
+      while (tx < tilesX && row[tx] > since) tx++;
+      damageRects[n].x = x;
+      damageRects[n].y = y;
+      damageRects[n].width = min(tx << DAMAGE_TILE_SHIFT, rfbFB.width) - x;
+      damageRects[n].height = h;
+      n++;
+    }
+    if (n == first) continue;
+
+    if (prevRow == ty - 1 && n - first == prevCount) {
+      for (i = 0; i < prevCount; i++) {
+        if (damageRects[prevFirst + i].x != damageRects[first + i].x ||
+            damageRects[prevFirst + i].width != damageRects[first + i].width)
+          break;
+      }
+      if (i == prevCount) {
+        for (i = 0; i < prevCount; i++)
+          damageRects[prevFirst + i].height += h;
+        n = first;
+        prevRow = ty;
+        continue;
+      }
+    }
+    prevFirst = first;
+    prevCount = n - first;
+    prevRow = ty;
+  }
+
+  if (n > 0) {
+    RegionPtr tmpRegion = RECTS_TO_REGION(pScreen, n, damageRects,
+                                          CT_YXBANDED);
+
+    REGION_UNION(pScreen, dst, dst, tmpRegion);
+    REGION_DESTROY(pScreen, tmpRegion);
+  }
+}
+
+
+/*
+ * rfbCollectDamage() adds the damage that has accumulated in the damage layer
+ * and in the tile grid since the last time it was called for the given client
+ * to the client's modified and ALR-eligible regions.  It must be called
+ * before those regions are used.
+ */
+
+void rfbCollectDamage(rfbClientPtr cl)
+{
+  ScreenPtr pScreen = screenInfo.screens[0];
+  unsigned long since = cl->damageGen;
+
+  rfbFlushDamage(pScreen);
+
+  cl->damageGen = rfbFBGeneration;
+  if (rfbDamageGen <= since || !tileGen) return;
+
+  CollectTiles(pScreen, tileGen, since, &cl->modifiedRegion);
+  if (rfbAutoLosslessRefresh > 0.0)
+    CollectTiles(pScreen, alrTileGen, since, &cl->alrEligibleRegion);
+}
+
+
+/****************************************************************************/
+/*
+ * Damage reporting
+ */
+/****************************************************************************/
+
+/* The damage layer accumulates the damage from each drawing operation in
+   rfbFB.pDamage, and rfbFlushDamage() periodically adds the accumulated damage
+   to the clients' modified regions.  Because reportAfter is set, the damage
+   from the drawing operation that is currently in progress is held in the
+   pending region until the operation completes, which allows rfbCopyArea()
+   and rfbCopyWindow() to discard the damage from a copy that they have
+   already accounted for.
+
+   rfbFlushDamage() is also called from timer callbacks (through
+   rfbCollectDamage()), which run before the block handler, and from the copy
+   functions.  Scheduling updates from there could send an update to another
+   client in the middle of an update, so damageFlushed instead tells the block
+   handler to schedule updates for the clients whose modified regions have
+   grown. */
+
+static Bool damageFlushed = FALSE;
+
+static void rfbFlushDamage(ScreenPtr pScreen)
+{
+  RegionPtr reg;
+  double tStart;
+
+  if (!rfbFB.pDamage) return;
+
+  reg = DamageRegion(rfbFB.pDamage);
+  if (!REGION_NOTEMPTY(pScreen, reg)) return;
+
+  TRACE_START(tStart);
+  rfbFBGeneration++;
+  rfbRecordDamage(pScreen, reg, FALSE);
+  rfbAddDamage(pScreen, reg, FALSE, FALSE);
+  TRACE_END(tStart, "damage", "rects", REGION_NUM_RECTS(reg));
+  DamageEmpty(rfbFB.pDamage);
+  damageFlushed = TRUE;
+}
+
+
+/*
+ * rfbAddALRDamage() is called by the damage trace replayer to mark a region as
+ * eligible for ALR, as rfbPutImage() did when the trace was recorded.
+ */
+
+void rfbAddALRDamage(ScreenPtr pScreen, RegionPtr reg)
+{
+  rfbFBGeneration++;
+  rfbAddDamage(pScreen, reg, TRUE, FALSE);
+}
+
+
+/*
+ * rfbAddCursorDamage() is called by the sprite routines after they draw or
+ * remove the cursor.  That drawing is done with internal damage reporting
+ * enabled, so the damage layer does not report it to us, and only the clients
+ * that don't receive cursor shape updates need to know about it.
+ */
+
+void rfbAddCursorDamage(ScreenPtr pScreen, BoxPtr box)
+{
+  RegionRec tmpRegion;
+
+  SAFE_REGION_INIT(pScreen, &tmpRegion, box, 0);
+  ClipToScreen(pScreen, &tmpRegion);
+  rfbFBGeneration++;
+  rfbAddDamage(pScreen, &tmpRegion, FALSE, TRUE);
+  REGION_UNINIT(pScreen, &tmpRegion);
+}
+
+
 /****************************************************************************/
 /*
  * Screen functions wrapper stuff
@@ -283,33 +495,81 @@ void ClipToScreen(ScreenPtr pScreen, RegionPtr pRegion)
 Bool rfbCloseScreen(ScreenPtr pScreen)
 {
   rfbFBInfoPtr prfb = &rfbFB;
-#ifdef RENDER
-  PictureScreenPtr ps;
-#endif
 
   pScreen->CloseScreen = prfb->CloseScreen;
+  pScreen->CreateScreenResources = prfb->CreateScreenResources;
+  pScreen->BlockHandler = prfb->BlockHandler;
   pScreen->CreateGC = prfb->CreateGC;
   pScreen->CopyWindow = prfb->CopyWindow;
-  pScreen->ClearToBackground = prfb->ClearToBackground;
-#ifdef RENDER
-  ps = GetPictureScreenIfSet(pScreen);
-  if (ps) {
-    ps->Composite = prfb->Composite;
-    ps->Glyphs = prfb->Glyphs;
-  }
-#endif
   pScreen->InstallColormap = prfb->InstallColormap;
   pScreen->UninstallColormap = prfb->UninstallColormap;
   pScreen->ListInstalledColormaps = prfb->ListInstalledColormaps;
   pScreen->StoreColors = prfb->StoreColors;
   pScreen->SaveScreen = prfb->SaveScreen;
 
+  /* The damage layer has already been closed, so prfb->pDamage can't be
+     destroyed here. */
+  prfb->pDamage = NULL;
+
   TRC((stderr, "Unwrapped screen functions\n"));
 
   return (*pScreen->CloseScreen) (pScreen);
 }
 
 
+/*
+ * CreateScreenResources - the screen pixmap doesn't exist until this has been
+ * called, so this is where we start tracking damage to it.  The damage layer
+ * is set up by the sprite routines, which wrap CreateGC after we do, so the
+ * damage layer's GC ops are always called before ours.
+ */
+
+Bool rfbCreateScreenResources(ScreenPtr pScreen)
+{
+  Bool ret;
+  rfbFBInfoPtr prfb = &rfbFB;
+
+  pScreen->CreateScreenResources = prfb->CreateScreenResources;
+  ret = (*pScreen->CreateScreenResources) (pScreen);
+  pScreen->CreateScreenResources = rfbCreateScreenResources;
+  if (!ret) return FALSE;
+
+  prfb->pDamage = DamageCreate(NULL, NULL, DamageReportNone, FALSE, pScreen,
+                               NULL);
+  if (!prfb->pDamage) return FALSE;
+  DamageSetReportAfterOp(prfb->pDamage, TRUE);
+  DamageRegister(&pScreen->GetScreenPixmap(pScreen)->drawable,
+                 prfb->pDamage);
+
+  rfbInitDamageTrace(pScreen);
+
+  return TRUE;
+}
+
+
+/*
+ * BlockHandler - this is called each time the X server has processed all
+ * pending requests and is about to wait for more, so it is where the damage
+ * from those requests is added to the clients' modified regions.
+ */
+
+void rfbBlockHandler(ScreenPtr pScreen, void *timeout)
+{
+  rfbFBInfoPtr prfb = &rfbFB;
+
+  pScreen->BlockHandler = prfb->BlockHandler;
+  (*pScreen->BlockHandler) (pScreen, timeout);
+  prfb->BlockHandler = pScreen->BlockHandler;
+  pScreen->BlockHandler = rfbBlockHandler;
+
+  rfbFlushDamage(pScreen);
+  if (damageFlushed) {
+    damageFlushed = FALSE;
+    SCHEDULE_FB_UPDATE(pScreen, prfb);
+  }
+}
+
+
 /*
  * CreateGC - wrap the GC funcs (the GC ops will be wrapped when the GC
  * func "ValidateGC" is called).
@@ -352,7 +612,7 @@ void rfbCopyWindow(WindowPtr pWin, DDXPointRec ptOldOrg, RegionPtr pOldRegion)
 {
   int dx, dy;
   rfbClientPtr cl;
-  RegionRec srcRegion, dstRegion;
+  RegionRec srcRegion, dstRegion, traceRegion;
 
   SCREEN_PROLOGUE(pWin->drawable.pScreen, CopyWindow);
 
@@ -368,6 +628,11 @@ void rfbCopyWindow(WindowPtr pWin, DDXPointRec ptOldOrg, RegionPtr pOldRegion)
   ClipToScreen(pScreen, &dstRegion);
   REGION_INTERSECT(pScreen, &dstRegion, &dstRegion, &pWin->borderClip);
 
+  /* Any damage from earlier drawing operations has to be in the clients'
+     modified regions before rfbCopyRegion() is called. */
+  rfbFlushDamage(pScreen);
+
+  rfbFBGeneration++;
   for (cl = rfbClientHead; cl; cl = cl->next) {
     if (cl->useCopyRect) {
       REGION_INIT(pScreen, &srcRegion, NullBox, 0);
@@ -385,52 +650,29 @@ void rfbCopyWindow(WindowPtr pWin, DDXPointRec ptOldOrg, RegionPtr pOldRegion)
     }
   }
 
-  REGION_UNINIT(pSrc->pScreen, &dstRegion);
-
-  (*pScreen->CopyWindow) (pWin, ptOldOrg, pOldRegion);
-
-  SCHEDULE_FB_UPDATE(pScreen, prfb);
-
-  SCREEN_EPILOGUE(CopyWindow, rfbCopyWindow);
-}
-
-
-/*
- * ClearToBackground - when generateExposures is false, the region being
- * modified is the given rectangle (clipped to the "window clip region").
- */
-
-void rfbClearToBackground(WindowPtr pWin, int x, int y, int w, int h,
-                          Bool generateExposures)
-{
-  RegionRec tmpRegion;
-  BoxRec box;
-
-  SCREEN_PROLOGUE(pWin->drawable.pScreen, ClearToBackground);
-
-  TRC((stderr, "rfbClearToBackground called\n"));
-
-  if (!generateExposures) {
-    box.x1 = x + pWin->drawable.x;
-    box.y1 = y + pWin->drawable.y;
-    box.x2 = w ? (box.x1 + w) : (pWin->drawable.x + pWin->drawable.width);
-    box.y2 = h ? (box.y1 + h) : (pWin->drawable.y + pWin->drawable.height);
+  /* The destination has been accounted for, so discard the damage that the
+     damage layer is holding for it. */
+  if (prfb->pDamage)
+    REGION_EMPTY(pScreen, DamagePendingRegion(prfb->pDamage));
 
-    SAFE_REGION_INIT(pScreen, &tmpRegion, &box, 0);
-
-    REGION_INTERSECT(pScreen, &tmpRegion, &tmpRegion, &pWin->clipList);
+  /* The wrapped CopyWindow function translates pOldRegion. */
+  if (rfbRecordingDamage) {
+    REGION_INIT(pScreen, &traceRegion, NullBox, 0);
+    REGION_COPY(pScreen, &traceRegion, pOldRegion);
+  }
 
-    ADD_TO_MODIFIED_REGION(pScreen, &tmpRegion);
+  (*pScreen->CopyWindow) (pWin, ptOldOrg, pOldRegion);
 
-    REGION_UNINIT(pScreen, &tmpRegion);
+  if (rfbRecordingDamage) {
+    rfbRecordCopy(pScreen, &traceRegion, &dstRegion, dx, dy);
+    REGION_UNINIT(pScreen, &traceRegion);
   }
 
-  (*pScreen->ClearToBackground) (pWin, x, y, w, h, generateExposures);
+  REGION_UNINIT(pSrc->pScreen, &dstRegion);
 
-  if (!generateExposures)
-    SCHEDULE_FB_UPDATE(pScreen, prfb);
+  SCHEDULE_FB_UPDATE(pScreen, prfb);
 
-  SCREEN_EPILOGUE(ClearToBackground, rfbClearToBackground);
+  SCREEN_EPILOGUE(CopyWindow, rfbCopyWindow);
 }
 
 
@@ -438,11 +680,26 @@ void rfbClearToBackground(WindowPtr pWin, int x, int y, int w, int h,
 /*
  * GC funcs wrapper stuff
  *
- * We only really want to wrap the GC ops, but to do this we need to wrap
- * ValidateGC and so all the other GC funcs must be wrapped as well.
+ * We only really want to wrap CopyArea (and, if ALR is enabled, PutImage), but
+ * to do this we need to wrap ValidateGC and so all the other GC funcs must be
+ * wrapped as well.  Rather than wrapping every GC op, each GC gets its own
+ * copy of the wrapped GC ops, in which only the ops that we are interested in
+ * are replaced, so the other ops are called without going through this layer.
+ * This works only because the GC ops below this layer (the fb ops) don't wrap
+ * anything.
  */
 /****************************************************************************/
 
+static void WrapGCOps(GCPtr pGC, rfbGCPtr pGCPriv)
+{
+  pGCPriv->wrapOps = pGC->ops;
+  pGCPriv->ops = *pGC->ops;
+  pGCPriv->ops.CopyArea = rfbCopyArea;
+  if (rfbAutoLosslessRefresh > 0.0 || rfbRecordingDamage)
+    pGCPriv->ops.PutImage = rfbPutImage;
+  pGC->ops = &pGCPriv->ops;
+}
+
 #define GC_FUNC_PROLOGUE(pGC)  \
   rfbGCPtr pGCPriv =  \
     (rfbGCPtr)dixLookupPrivate(&(pGC)->devPrivates, &rfbGCKey);  \
@@ -453,10 +710,8 @@ void rfbClearToBackground(WindowPtr pWin, int x, int y, int w, int h,
 #define GC_FUNC_EPILOGUE(pGC)  \
   pGCPriv->wrapFuncs = (pGC)->funcs;  \
   (pGC)->funcs = &rfbGCFuncs;  \
-  if (pGCPriv->wrapOps) {  \
-    pGCPriv->wrapOps = (pGC)->ops;  \
-    (pGC)->ops = &rfbGCOps;  \
-  }
+  if (pGCPriv->wrapOps)  \
+    WrapGCOps(pGC, pGCPriv);
 
 
 /*
@@ -561,80 +816,14 @@ static void rfbCopyClip(GCPtr pgcDst, GCPtr pgcSrc)
   (pGC)->ops = pGCPrivate->wrapOps;
 
 #define GC_OP_EPILOGUE(pGC)  \
-  pGCPrivate->wrapOps = (pGC)->ops;  \
   (pGC)->funcs = oldFuncs;  \
-  (pGC)->ops = &rfbGCOps;
-
-
-/*
- * FillSpans - being very safe - assume the entire clip region is damaged.
- */
-
-static void rfbFillSpans(DrawablePtr pDrawable, GCPtr pGC,
-                         int nInit,            /* number of spans to fill */
-                         DDXPointPtr pptInit,  /* pointer to list of start points */
-                         int *pwidthInit,      /* pointer to list of n widths */
-                         int fSorted)
-{
-  GC_OP_PROLOGUE(pDrawable, pGC);
-
-  TRC((stderr, "rfbFillSpans called\n"));
-
-  if (pDrawable->type == DRAWABLE_WINDOW) {
-    RegionRec changed;
-    REGION_INIT(pDrawable->pScreen, &changed, NullBox, 0);
-    REGION_COPY(pDrawable->pScreen, &changed, pGC->pCompositeClip);
-    REGION_INTERSECT(pDrawable->pScreen, &changed, &changed,
-                     &((WindowPtr)pDrawable)->borderClip);
-    ADD_TO_MODIFIED_REGION(pDrawable->pScreen, &changed);
-    REGION_UNINIT(pDrawable->pScreen, &changed);
-  } else {
-    ADD_TO_MODIFIED_REGION(pDrawable->pScreen, pGC->pCompositeClip);
-  }
-
-  (*pGC->ops->FillSpans) (pDrawable, pGC, nInit, pptInit, pwidthInit, fSorted);
-
-  SCHEDULE_FB_UPDATE(pDrawable->pScreen, prfb);
-
-  GC_OP_EPILOGUE(pGC);
-}
+  WrapGCOps(pGC, pGCPrivate);
 
 
 /*
- * SetSpans - being very safe - assume the entire clip region is damaged.
- */
-
-static void rfbSetSpans(DrawablePtr pDrawable, GCPtr pGC, char *psrc,
-                        register DDXPointPtr ppt, int *pwidth, int nspans,
-                        int fSorted)
-{
-  GC_OP_PROLOGUE(pDrawable, pGC);
-
-  TRC((stderr, "rfbSetSpans called\n"));
-
-  if (pDrawable->type == DRAWABLE_WINDOW) {
-    RegionRec changed;
-    REGION_INIT(pDrawable->pScreen, &changed, NullBox, 0);
-    REGION_COPY(pDrawable->pScreen, &changed, pGC->pCompositeClip);
-    REGION_INTERSECT(pDrawable->pScreen, &changed, &changed,
-                     &((WindowPtr)pDrawable)->borderClip);
-    ADD_TO_MODIFIED_REGION(pDrawable->pScreen, &changed);
-    REGION_UNINIT(pDrawable->pScreen, &changed);
-  } else {
-    ADD_TO_MODIFIED_REGION(pDrawable->pScreen, pGC->pCompositeClip);
-  }
-
-  (*pGC->ops->SetSpans) (pDrawable, pGC, psrc, ppt, pwidth, nspans, fSorted);
-
-  SCHEDULE_FB_UPDATE(pDrawable->pScreen, prfb);
-
-  GC_OP_EPILOGUE(pGC);
-}
-
-
-/*
- * PutImage - the region being modified is the rectangle of the
- * PutImage (clipped to the window clip region).
+ * PutImage - the damage layer reports the region being modified, but if ALR
+ * is enabled, then that region (the rectangle of the PutImage, clipped to the
+ * window clip region) is also eligible for ALR.
  */
 
 static void rfbPutImage(DrawablePtr pDrawable, GCPtr pGC, int depth,
@@ -658,16 +847,20 @@ static void rfbPutImage(DrawablePtr pDrawable, GCPtr pGC, int depth,
   REGION_INTERSECT(pDrawable->pScreen, &tmpRegion, &tmpRegion,
                    pGC->pCompositeClip);
 
-  ADD_TO_MODIFIED_REGION(pDrawable->pScreen, &tmpRegion);
-  ADD_TO_ALR_REGION(pDrawable->pScreen, &tmpRegion);
+  /* The damage trace replayer marks only the regions that were eligible for
+     ALR when the trace was recorded. */
+  if (!rfbReplayingDamage) {
+    rfbFBGeneration++;
+    rfbAddDamage(pDrawable->pScreen, &tmpRegion, TRUE,
+                 prfb->dontSendFramebufferUpdate);
+    rfbRecordDamage(pDrawable->pScreen, &tmpRegion, TRUE);
+  }
 
   REGION_UNINIT(pDrawable->pScreen, &tmpRegion);
 
   (*pGC->ops->PutImage) (pDrawable, pGC, depth, x, y, w, h, leftPad, format,
                          pBits);
 
-  SCHEDULE_FB_UPDATE(pDrawable->pScreen, prfb);
-
   GC_OP_EPILOGUE(pGC);
 }
 
@@ -677,7 +870,8 @@ static void rfbPutImage(DrawablePtr pDrawable, GCPtr pGC, int depth,
  * to the window clip region).
  * If the client will accept CopyRect messages then use rfbCopyRegion
  * to optimise the pending screen changes into a single "copy region" plus
- * the ordinary modified region.
+ * the ordinary modified region.  If the source is not visible, then the
+ * damage layer reports the destination as ordinary damage.
  */
 
 static RegionPtr rfbCopyArea(DrawablePtr pSrc, DrawablePtr pDst, GCPtr pGC,
@@ -688,25 +882,32 @@ static RegionPtr rfbCopyArea(DrawablePtr pSrc, DrawablePtr pDst, GCPtr pGC,
   RegionPtr rgn;
   RegionRec srcRegion, dstRegion;
   BoxRec box;
+  Bool visible = is_visible(pSrc);
 
   GC_OP_PROLOGUE(pDst, pGC);
 
   TRC((stderr, "rfbCopyArea called\n"));
 
-  box.x1 = dstx + pDst->x;
-  box.y1 = dsty + pDst->y;
-  box.x2 = box.x1 + w;
-  box.y2 = box.y1 + h;
+  if (visible) {
+    box.x1 = dstx + pDst->x;
+    box.y1 = dsty + pDst->y;
+    box.x2 = box.x1 + w;
+    box.y2 = box.y1 + h;
 
-  SAFE_REGION_INIT(pDst->pScreen, &dstRegion, &box, 0);
-  REGION_INTERSECT(pDst->pScreen, &dstRegion, &dstRegion, pGC->pCompositeClip);
+    SAFE_REGION_INIT(pDst->pScreen, &dstRegion, &box, 0);
+    REGION_INTERSECT(pDst->pScreen, &dstRegion, &dstRegion,
+                     pGC->pCompositeClip);
 
-  if (is_visible(pSrc)) {
     box.x1 = srcx + pSrc->x;
     box.y1 = srcy + pSrc->y;
     box.x2 = box.x1 + w;
     box.y2 = box.y1 + h;
 
+    /* Any damage from earlier drawing operations has to be in the clients'
+       modified regions before rfbCopyRegion() is called. */
+    rfbFlushDamage(pDst->pScreen);
+
+    rfbFBGeneration++;
     for (cl = rfbClientHead; cl; cl = cl->next) {
       if (cl->useCopyRect) {
         SAFE_REGION_INIT(pSrc->pScreen, &srcRegion, &box, 0);
@@ -730,58 +931,31 @@ static RegionPtr rfbCopyArea(DrawablePtr pSrc, DrawablePtr pDst, GCPtr pGC,
       }
     }
 
-  } else {
-
-    ADD_TO_MODIFIED_REGION(pDst->pScreen, &dstRegion);
+    /* The destination has been accounted for, so discard the damage that the
+       damage layer is holding for it. */
+    if (prfb->pDamage)
+      REGION_EMPTY(pDst->pScreen, DamagePendingRegion(prfb->pDamage));
   }
 
-  REGION_UNINIT(pDst->pScreen, &dstRegion);
-
   rgn = (*pGC->ops->CopyArea) (pSrc, pDst, pGC, srcx, srcy, w, h, dstx, dsty);
 
-  SCHEDULE_FB_UPDATE(pDst->pScreen, prfb);
-
-  GC_OP_EPILOGUE(pGC);
-
-  return rgn;
-}
-
-
-/*
- * CopyPlane - the region being modified is the destination rectangle (clipped
- * to the window clip region).
- */
-
-static RegionPtr rfbCopyPlane(DrawablePtr pSrc, DrawablePtr pDst,
-                              register GCPtr pGC, int srcx, int srcy,
-                              int w, int h, int dstx, int dsty,
-                              unsigned long plane)
-{
-  RegionPtr rgn;
-  RegionRec tmpRegion;
-  BoxRec box;
-
-  GC_OP_PROLOGUE(pDst, pGC);
-
-  TRC((stderr, "rfbCopyPlane called\n"));
-
-  box.x1 = dstx + pDst->x;
-  box.y1 = dsty + pDst->y;
-  box.x2 = box.x1 + w;
-  box.y2 = box.y1 + h;
-
-  SAFE_REGION_INIT(pDst->pScreen, &tmpRegion, &box, 0);
-
-  REGION_INTERSECT(pDst->pScreen, &tmpRegion, &tmpRegion, pGC->pCompositeClip);
-
-  ADD_TO_MODIFIED_REGION(pDst->pScreen, &tmpRegion);
-
-  REGION_UNINIT(pDst->pScreen, &tmpRegion);
-
-  rgn = (*pGC->ops->CopyPlane) (pSrc, pDst, pGC, srcx, srcy, w, h,
-                                dstx, dsty, plane);
+  if (visible) {
+    if (rfbRecordingDamage) {
+      SAFE_REGION_INIT(pSrc->pScreen, &srcRegion, &box, 0);
+      if (pSrc->type == DRAWABLE_WINDOW &&
+          REGION_NOTEMPTY(pScreen, &((WindowPtr)pSrc)->clipList)) {
+        REGION_INTERSECT(pSrc->pScreen, &srcRegion, &srcRegion,
+                         &((WindowPtr)pSrc)->clipList);
+      }
+      rfbRecordCopy(pDst->pScreen, &srcRegion, &dstRegion,
+                    dstx + pDst->x - srcx - pSrc->x,
+                    dsty + pDst->y - srcy - pSrc->y);
+      REGION_UNINIT(pSrc->pScreen, &srcRegion);
+    }
+    REGION_UNINIT(pDst->pScreen, &dstRegion);
 
-  SCHEDULE_FB_UPDATE(pDst->pScreen, prfb);
+    SCHEDULE_FB_UPDATE(pDst->pScreen, prfb);
+  }
 
   GC_OP_EPILOGUE(pGC);
 
@@ -789,948 +963,11 @@ static RegionPtr rfbCopyPlane(DrawablePtr pSrc, DrawablePtr pDst,
 }
 
 
+/****************************************************************************/
 /*
- * PolyPoint - find the smallest rectangle which encloses the points drawn
- * (and clip).
+ * Other functions
  */
-
-static void rfbPolyPoint(DrawablePtr pDrawable, GCPtr pGC,
-                         int mode,  /* Origin or Previous */
-                         int npt, xPoint *pts)
-{
-  int i;
-  RegionRec tmpRegion;
-  BoxRec box;
-
-  GC_OP_PROLOGUE(pDrawable, pGC);
-
-  TRC((stderr, "rfbPolyPoint called\n"));
-
-  if (npt) {
-    int minX = pts[0].x, maxX = pts[0].x;
-    int minY = pts[0].y, maxY = pts[0].y;
-
-    if (mode == CoordModePrevious) {
-      int x = pts[0].x, y = pts[0].y;
-
-      for (i = 1; i < npt; i++) {
-        x += pts[i].x;
-        y += pts[i].y;
-        if (x < minX) minX = x;
-        if (x > maxX) maxX = x;
-        if (y < minY) minY = y;
-        if (y > maxY) maxY = y;
-      }
-    } else {
-      for (i = 1; i < npt; i++) {
-        if (pts[i].x < minX) minX = pts[i].x;
-        if (pts[i].x > maxX) maxX = pts[i].x;
-        if (pts[i].y < minY) minY = pts[i].y;
-        if (pts[i].y > maxY) maxY = pts[i].y;
-      }
-    }
-
-    box.x1 = minX + pDrawable->x;
-    box.y1 = minY + pDrawable->y;
-    box.x2 = maxX + 1 + pDrawable->x;
-    box.y2 = maxY + 1 + pDrawable->y;
-
-    SAFE_REGION_INIT(pDrawable->pScreen, &tmpRegion, &box, 0);
-
-    REGION_INTERSECT(pDrawable->pScreen, &tmpRegion, &tmpRegion,
-                     pGC->pCompositeClip);
-
-    ADD_TO_MODIFIED_REGION(pDrawable->pScreen, &tmpRegion);
-
-    REGION_UNINIT(pDrawable->pScreen, &tmpRegion);
-  }
-
-  (*pGC->ops->PolyPoint) (pDrawable, pGC, mode, npt, pts);
-
-  if (npt)
-    SCHEDULE_FB_UPDATE(pDrawable->pScreen, prfb);
-
-  GC_OP_EPILOGUE(pGC);
-}
-
-
-/*
- * PolyLines - take the union of bounding boxes around each line (and clip).
- */
-
-static void rfbPolylines(DrawablePtr pDrawable, GCPtr pGC, int mode, int npt,
-                         DDXPointPtr ppts)
-{
-  RegionPtr tmpRegion;
-  xRectangle *rects;
-  int i, extra, nlines, lw;
-  int x1, x2, y1, y2;
-
-  GC_OP_PROLOGUE(pDrawable, pGC);
-
-  TRC((stderr, "rfbPolylines called\n"));
-
-  if (npt) {
-    lw = pGC->lineWidth;
-    if (lw == 0)
-      lw = 1;
-
-    if (npt == 1) {
-      nlines = 1;
-      rects = (xRectangle *)rfbAlloc(sizeof(xRectangle));
-
-      rects[0].x = ppts[0].x - lw + pDrawable->x;  /* being safe here */
-      rects[0].y = ppts[0].y - lw + pDrawable->y;
-      rects[0].width = 2 * lw;
-      rects[0].height = 2 * lw;
-    } else {
-      nlines = npt - 1;
-      rects = (xRectangle *)rfbAlloc(nlines * sizeof(xRectangle));
-
-      /*
-       * mitered joins can project quite a way from
-       * the line end; the 11 degree miter limit limits
-       * this extension to lw / (2 * tan(11/2)), rounded up
-       * and converted to int yields 6 * lw
-       */
-
-      if (pGC->joinStyle == JoinMiter)
-        extra = 6 * lw;
-      else
-        extra = lw / 2;
-
-      x1 = ppts[0].x + pDrawable->x;
-      y1 = ppts[0].y + pDrawable->y;
-
-      for (i = 0; i < nlines; i++) {
-        if (mode == CoordModeOrigin) {
-          x2 = pDrawable->x + ppts[i + 1].x;
-          y2 = pDrawable->y + ppts[i + 1].y;
-        } else {
-          x2 = x1 + ppts[i + 1].x;
-          y2 = y1 + ppts[i + 1].y;
-        }
-
-        if (x1 > x2) {
-          rects[i].x = x2 - extra;
-          rects[i].width = x1 - x2 + 1 + 2 * extra;
-        } else {
-          rects[i].x = x1 - extra;
-          rects[i].width = x2 - x1 + 1 + 2 * extra;
-        }
-
-        if (y1 > y2) {
-          rects[i].y = y2 - extra;
-          rects[i].height = y1 - y2 + 1 + 2 * extra;
-        } else {
-          rects[i].y = y1 - extra;
-          rects[i].height = y2 - y1 + 1 + 2 * extra;
-        }
-
-        x1 = x2;
-        y1 = y2;
-      }
-    }
-    tmpRegion = RECTS_TO_REGION(pDrawable->pScreen, nlines, rects, CT_NONE);
-    REGION_INTERSECT(pDrawable->pScreen, tmpRegion, tmpRegion,
-                     pGC->pCompositeClip);
-
-    ADD_TO_MODIFIED_REGION(pDrawable->pScreen, tmpRegion);
-
-    REGION_DESTROY(pDrawable->pScreen, tmpRegion);
-    free((char *)rects);
-  }
-
-  (*pGC->ops->Polylines) (pDrawable, pGC, mode, npt, ppts);
-
-  if (npt)
-    SCHEDULE_FB_UPDATE(pDrawable->pScreen, prfb);
-
-  GC_OP_EPILOGUE(pGC);
-}
-
-
-/*
- * PolySegment - take the union of bounding boxes around each segment (and
- * clip).
- */
-
-static void rfbPolySegment(DrawablePtr pDrawable, GCPtr pGC, int nseg,
-                           xSegment *segs)
-{
-  RegionPtr tmpRegion;
-  xRectangle *rects;
-  int i, extra, lw;
-
-  GC_OP_PROLOGUE(pDrawable, pGC);
-
-  TRC((stderr, "rfbPolySegment called\n"));
-
-  if (nseg) {
-    rects = (xRectangle *)rfbAlloc(nseg * sizeof(xRectangle));
-
-    lw = pGC->lineWidth;
-    if (lw == 0)
-      lw = 1;
-
-    extra = lw / 2;
-
-    for (i = 0; i < nseg; i++) {
-      if (segs[i].x1 > segs[i].x2) {
-        rects[i].x = segs[i].x2 - extra + pDrawable->x;
-        rects[i].width = segs[i].x1 - segs[i].x2 + 1 + 2 * extra;
-      } else {
-        rects[i].x = segs[i].x1 - extra + pDrawable->x;
-        rects[i].width = segs[i].x2 - segs[i].x1 + 1 + 2 * extra;
-      }
-
-      if (segs[i].y1 > segs[i].y2) {
-        rects[i].y = segs[i].y2 - extra + pDrawable->y;
-        rects[i].height = segs[i].y1 - segs[i].y2 + 1 + 2 * extra;
-      } else {
-        rects[i].y = segs[i].y1 - extra + pDrawable->y;
-        rects[i].height = segs[i].y2 - segs[i].y1 + 1 + 2 * extra;
-      }
-    }
-
-    tmpRegion = RECTS_TO_REGION(pDrawable->pScreen, nseg, rects, CT_NONE);
-    REGION_INTERSECT(pDrawable->pScreen, tmpRegion, tmpRegion,
-                     pGC->pCompositeClip);
-
-    ADD_TO_MODIFIED_REGION(pDrawable->pScreen, tmpRegion);
-
-    REGION_DESTROY(pDrawable->pScreen, tmpRegion);
-    free((char *)rects);
-  }
-
-  (*pGC->ops->PolySegment) (pDrawable, pGC, nseg, segs);
-
-  if (nseg)
-    SCHEDULE_FB_UPDATE(pDrawable->pScreen, prfb);
-
-  GC_OP_EPILOGUE(pGC);
-}
-
-
-/*
- * PolyRectangle (rectangle outlines) - take the union of bounding boxes
- * around each line (and clip).
- */
-
-static void rfbPolyRectangle(DrawablePtr pDrawable, GCPtr pGC, int nrects,
-                             xRectangle *rects)
-{
-  int i, extra, lw;
-  RegionPtr tmpRegion;
-  xRectangle *regRects;
-
-  GC_OP_PROLOGUE(pDrawable, pGC);
-
-  TRC((stderr, "rfbPolyRectangle called\n"));
-
-  if (nrects) {
-    regRects = (xRectangle *)rfbAlloc(nrects * 4 * sizeof(xRectangle));
-
-    lw = pGC->lineWidth;
-    if (lw == 0)
-      lw = 1;
-
-    extra = lw / 2;
-
-    for (i = 0; i < nrects; i++) {
-      regRects[i * 4].x = rects[i].x - extra + pDrawable->x;
-      regRects[i * 4].y = rects[i].y - extra + pDrawable->y;
-      regRects[i * 4].width = rects[i].width + 1 + 2 * extra;
-      regRects[i * 4].height = 1 + 2 * extra;
-
-      regRects[i * 4 + 1].x = rects[i].x - extra + pDrawable->x;
-      regRects[i * 4 + 1].y = rects[i].y - extra + pDrawable->y;
-      regRects[i * 4 + 1].width = 1 + 2 * extra;
-      regRects[i * 4 + 1].height = rects[i].height + 1 + 2 * extra;
-
-      regRects[i * 4 + 2].x =
-        rects[i].x + rects[i].width - extra + pDrawable->x;
-      regRects[i * 4 + 2].y = rects[i].y - extra + pDrawable->y;
-      regRects[i * 4 + 2].width = 1 + 2 * extra;
-      regRects[i * 4 + 2].height = rects[i].height + 1 + 2 * extra;
-
-      regRects[i * 4 + 3].x = rects[i].x - extra + pDrawable->x;
-      regRects[i * 4 + 3].y =
-        rects[i].y + rects[i].height - extra + pDrawable->y;
-      regRects[i * 4 + 3].width = rects[i].width + 1 + 2 * extra;
-      regRects[i * 4 + 3].height = 1 + 2 * extra;
-    }
-
-    tmpRegion = RECTS_TO_REGION(pDrawable->pScreen, nrects * 4, regRects,
-                                CT_NONE);
-    REGION_INTERSECT(pDrawable->pScreen, tmpRegion, tmpRegion,
-                     pGC->pCompositeClip);
-
-    ADD_TO_MODIFIED_REGION(pDrawable->pScreen, tmpRegion);
-
-    REGION_DESTROY(pDrawable->pScreen, tmpRegion);
-    free((char *)regRects);
-  }
-
-  (*pGC->ops->PolyRectangle) (pDrawable, pGC, nrects, rects);
-
-  if (nrects)
-    SCHEDULE_FB_UPDATE(pDrawable->pScreen, prfb);
-
-  GC_OP_EPILOGUE(pGC);
-}
-
-
-/*
- * PolyArc - take the union of bounding boxes around each arc (and clip).
- * Bounding boxes assume each is a full circle / ellipse.
- */
-
-static void rfbPolyArc(DrawablePtr pDrawable, register GCPtr pGC, int narcs,
-                       xArc *arcs)
-{
-  int i, extra, lw;
-  RegionPtr tmpRegion;
-  xRectangle *rects;
-
-  GC_OP_PROLOGUE(pDrawable, pGC);
-
-  TRC((stderr, "rfbPolyArc called\n"));
-
-  if (narcs) {
-    rects = (xRectangle *)rfbAlloc(narcs * sizeof(xRectangle));
-
-    lw = pGC->lineWidth;
-    if (lw == 0)
-      lw = 1;
-
-    extra = lw / 2;
-
-    for (i = 0; i < narcs; i++) {
-      rects[i].x = arcs[i].x - extra + pDrawable->x;
-      rects[i].y = arcs[i].y - extra + pDrawable->y;
-      rects[i].width = arcs[i].width + lw;
-      rects[i].height = arcs[i].height + lw;
-    }
-
-    tmpRegion = RECTS_TO_REGION(pDrawable->pScreen, narcs, rects, CT_NONE);
-    REGION_INTERSECT(pDrawable->pScreen, tmpRegion, tmpRegion,
-                     pGC->pCompositeClip);
-
-    ADD_TO_MODIFIED_REGION(pDrawable->pScreen, tmpRegion);
-
-    REGION_DESTROY(pDrawable->pScreen, tmpRegion);
-    free((char *)rects);
-  }
-
-  (*pGC->ops->PolyArc) (pDrawable, pGC, narcs, arcs);
-
-  if (narcs)
-    SCHEDULE_FB_UPDATE(pDrawable->pScreen, prfb);
-
-  GC_OP_EPILOGUE(pGC);
-}
-
-
-/*
- * FillPolygon - take bounding box around polygon (and clip).
- */
-
-static void rfbFillPolygon(register DrawablePtr pDrawable, register GCPtr pGC,
-                           int shape, int mode, int count, DDXPointPtr pts)
-{
-  int i;
-  RegionRec tmpRegion;
-  BoxRec box;
-
-  GC_OP_PROLOGUE(pDrawable, pGC);
-
-  TRC((stderr, "rfbFillPolygon called\n"));
-
-  if (count) {
-    int minX = pts[0].x, maxX = pts[0].x;
-    int minY = pts[0].y, maxY = pts[0].y;
-
-    if (mode == CoordModePrevious) {
-      int x = pts[0].x, y = pts[0].y;
-
-      for (i = 1; i < count; i++) {
-        x += pts[i].x;
-        y += pts[i].y;
-        if (x < minX) minX = x;
-        if (x > maxX) maxX = x;
-        if (y < minY) minY = y;
-        if (y > maxY) maxY = y;
-      }
-    } else {
-      for (i = 1; i < count; i++) {
-        if (pts[i].x < minX) minX = pts[i].x;
-        if (pts[i].x > maxX) maxX = pts[i].x;
-        if (pts[i].y < minY) minY = pts[i].y;
-        if (pts[i].y > maxY) maxY = pts[i].y;
-      }
-    }
-
-    box.x1 = minX + pDrawable->x;
-    box.y1 = minY + pDrawable->y;
-    box.x2 = maxX + 1 + pDrawable->x;
-    box.y2 = maxY + 1 + pDrawable->y;
-
-    SAFE_REGION_INIT(pDrawable->pScreen, &tmpRegion, &box, 0);
-
-    REGION_INTERSECT(pDrawable->pScreen, &tmpRegion, &tmpRegion,
-                     pGC->pCompositeClip);
-
-    ADD_TO_MODIFIED_REGION(pDrawable->pScreen, &tmpRegion);
-
-    REGION_UNINIT(pDrawable->pScreen, &tmpRegion);
-  }
-
-  (*pGC->ops->FillPolygon) (pDrawable, pGC, shape, mode, count, pts);
-
-  if (count)
-    SCHEDULE_FB_UPDATE(pDrawable->pScreen, prfb);
-
-  GC_OP_EPILOGUE(pGC);
-}
-
-
-/*
- * PolyFillRect - take the union of the given rectangles (and clip).
- */
-
-static void rfbPolyFillRect(DrawablePtr pDrawable, GCPtr pGC, int nrects,
-                            xRectangle *rects)
-{
-  RegionPtr tmpRegion;
-  xRectangle *regRects;
-  int i;
-
-  GC_OP_PROLOGUE(pDrawable, pGC);
-
-  TRC((stderr, "rfbPolyFillRect called\n"));
-
-  if (nrects) {
-    regRects = (xRectangle *)rfbAlloc(nrects * sizeof(xRectangle));
-
-    for (i = 0; i < nrects; i++) {
-      regRects[i].x = rects[i].x + pDrawable->x;
-      regRects[i].y = rects[i].y + pDrawable->y;
-      regRects[i].width = rects[i].width;
-      regRects[i].height = rects[i].height;
-    }
-
-    tmpRegion = RECTS_TO_REGION(pDrawable->pScreen, nrects, regRects, CT_NONE);
-    REGION_INTERSECT(pDrawable->pScreen, tmpRegion, tmpRegion,
-                     pGC->pCompositeClip);
-
-    ADD_TO_MODIFIED_REGION(pDrawable->pScreen, tmpRegion);
-
-    REGION_DESTROY(pDrawable->pScreen, tmpRegion);
-    free((char *)regRects);
-  }
-
-  (*pGC->ops->PolyFillRect) (pDrawable, pGC, nrects, rects);
-
-  if (nrects)
-    SCHEDULE_FB_UPDATE(pDrawable->pScreen, prfb);
-
-  GC_OP_EPILOGUE(pGC);
-}
-
-
-/*
- * PolyFillArc - take the union of bounding boxes around each arc (and clip).
- * Bounding boxes assume each is a full circle / ellipse.
- */
-
-static void rfbPolyFillArc(DrawablePtr pDrawable, GCPtr pGC, int narcs,
-                           xArc *arcs)
-{
-  int i, extra, lw;
-  RegionPtr tmpRegion;
-  xRectangle *rects;
-
-  GC_OP_PROLOGUE(pDrawable, pGC);
-
-  TRC((stderr, "rfbPolyFillArc called\n"));
-
-  if (narcs) {
-    rects = (xRectangle *)rfbAlloc(narcs * sizeof(xRectangle));
-
-    lw = pGC->lineWidth;
-    if (lw == 0)
-      lw = 1;
-
-    extra = lw / 2;
-
-    for (i = 0; i < narcs; i++) {
-      rects[i].x = arcs[i].x - extra + pDrawable->x;
-      rects[i].y = arcs[i].y - extra + pDrawable->y;
-      rects[i].width = arcs[i].width + lw;
-      rects[i].height = arcs[i].height + lw;
-    }
-
-    tmpRegion = RECTS_TO_REGION(pDrawable->pScreen, narcs, rects, CT_NONE);
-    REGION_INTERSECT(pDrawable->pScreen, tmpRegion, tmpRegion,
-                     pGC->pCompositeClip);
-
-    ADD_TO_MODIFIED_REGION(pDrawable->pScreen, tmpRegion);
-
-    REGION_DESTROY(pDrawable->pScreen, tmpRegion);
-    free((char *)rects);
-  }
-
-  (*pGC->ops->PolyFillArc) (pDrawable, pGC, narcs, arcs);
-
-  if (narcs)
-    SCHEDULE_FB_UPDATE(pDrawable->pScreen, prfb);
-
-  GC_OP_EPILOGUE(pGC);
-}
-
-
-/*
- * Get a rough bounding box around n characters of the given font.
- */
-
-static void GetTextBoundingBox(DrawablePtr pDrawable, FontPtr font, int x,
-                               int y, int n, BoxPtr pbox)
-{
-  int maxAscent, maxDescent, maxCharWidth;
-
-  if (FONTASCENT(font) > FONTMAXBOUNDS(font, ascent))
-    maxAscent = FONTASCENT(font);
-  else
-    maxAscent = FONTMAXBOUNDS(font, ascent);
-
-  if (FONTDESCENT(font) > FONTMAXBOUNDS(font, descent))
-    maxDescent = FONTDESCENT(font);
-  else
-    maxDescent = FONTMAXBOUNDS(font, descent);
-
-  if (FONTMAXBOUNDS(font, rightSideBearing) >
-      FONTMAXBOUNDS(font, characterWidth))
-    maxCharWidth = FONTMAXBOUNDS(font, rightSideBearing);
-  else
-    maxCharWidth = FONTMAXBOUNDS(font, characterWidth);
-
-  pbox->x1 = pDrawable->x + x;
-  pbox->y1 = pDrawable->y + y - maxAscent;
-  pbox->x2 = pbox->x1 + maxCharWidth * n;
-  pbox->y2 = pbox->y1 + maxAscent + maxDescent;
-
-  if (FONTMINBOUNDS(font, leftSideBearing) < 0)
-    pbox->x1 += FONTMINBOUNDS(font, leftSideBearing);
-}
-
-
-/*
- * PolyText8 - use rough bounding box.
- */
-
-static int rfbPolyText8(DrawablePtr pDrawable, GCPtr pGC, int x, int y,
-                        int count, char *chars)
-{
-  int ret;
-  RegionRec tmpRegion;
-  BoxRec box;
-
-  GC_OP_PROLOGUE(pDrawable, pGC);
-
-  TRC((stderr, "rfbPolyText8 called '%.*s'\n", count, chars));
-
-  if (count) {
-    GetTextBoundingBox(pDrawable, pGC->font, x, y, count, &box);
-
-    SAFE_REGION_INIT(pDrawable->pScreen, &tmpRegion, &box, 0);
-
-    REGION_INTERSECT(pDrawable->pScreen, &tmpRegion, &tmpRegion,
-                     pGC->pCompositeClip);
-
-    ADD_TO_MODIFIED_REGION(pDrawable->pScreen, &tmpRegion);
-
-    REGION_UNINIT(pDrawable->pScreen, &tmpRegion);
-  }
-
-  ret = (*pGC->ops->PolyText8) (pDrawable, pGC, x, y, count, chars);
-
-  if (count)
-    SCHEDULE_FB_UPDATE(pDrawable->pScreen, prfb);
-
-  GC_OP_EPILOGUE(pGC);
-  return ret;
-}
-
-
-/*
- * PolyText16 - use rough bounding box.
- */
-
-static int rfbPolyText16(DrawablePtr pDrawable, GCPtr pGC, int x, int y,
-                         int count, unsigned short *chars)
-{
-  int ret;
-  RegionRec tmpRegion;
-  BoxRec box;
-
-  GC_OP_PROLOGUE(pDrawable, pGC);
-
-  TRC((stderr, "rfbPolyText16 called\n"));
-
-  if (count) {
-    GetTextBoundingBox(pDrawable, pGC->font, x, y, count, &box);
-
-    SAFE_REGION_INIT(pDrawable->pScreen, &tmpRegion, &box, 0);
-
-    REGION_INTERSECT(pDrawable->pScreen, &tmpRegion, &tmpRegion,
-                     pGC->pCompositeClip);
-
-    ADD_TO_MODIFIED_REGION(pDrawable->pScreen, &tmpRegion);
-
-    REGION_UNINIT(pDrawable->pScreen, &tmpRegion);
-  }
-
-  ret = (*pGC->ops->PolyText16) (pDrawable, pGC, x, y, count, chars);
-
-  if (count)
-    SCHEDULE_FB_UPDATE(pDrawable->pScreen, prfb);
-
-  GC_OP_EPILOGUE(pGC);
-  return ret;
-}
-
-
-/*
- * ImageText8 - use rough bounding box.
- */
-
-static void rfbImageText8(DrawablePtr pDrawable, GCPtr pGC, int x, int y,
-                          int count, char *chars)
-{
-  RegionRec tmpRegion;
-  BoxRec box;
-
-  GC_OP_PROLOGUE(pDrawable, pGC);
-
-  TRC((stderr, "rfbImageText8 called '%.*s'\n", count, chars));
-
-  if (count) {
-    GetTextBoundingBox(pDrawable, pGC->font, x, y, count, &box);
-
-    SAFE_REGION_INIT(pDrawable->pScreen, &tmpRegion, &box, 0);
-
-    REGION_INTERSECT(pDrawable->pScreen, &tmpRegion, &tmpRegion,
-                     pGC->pCompositeClip);
-
-    ADD_TO_MODIFIED_REGION(pDrawable->pScreen, &tmpRegion);
-
-    REGION_UNINIT(pDrawable->pScreen, &tmpRegion);
-  }
-
-  (*pGC->ops->ImageText8) (pDrawable, pGC, x, y, count, chars);
-
-  if (count)
-    SCHEDULE_FB_UPDATE(pDrawable->pScreen, prfb);
-
-  GC_OP_EPILOGUE(pGC);
-}
-
-
-/*
- * ImageText16 - use rough bounding box.
- */
-
-static void rfbImageText16(DrawablePtr pDrawable, GCPtr pGC, int x, int y,
-                           int count, unsigned short *chars)
-{
-  RegionRec tmpRegion;
-  BoxRec box;
-
-  GC_OP_PROLOGUE(pDrawable, pGC);
-
-  TRC((stderr, "rfbImageText16 called\n"));
-
-  if (count) {
-    GetTextBoundingBox(pDrawable, pGC->font, x, y, count, &box);
-
-    SAFE_REGION_INIT(pDrawable->pScreen, &tmpRegion, &box, 0);
-
-    REGION_INTERSECT(pDrawable->pScreen, &tmpRegion, &tmpRegion,
-                     pGC->pCompositeClip);
-
-    ADD_TO_MODIFIED_REGION(pDrawable->pScreen, &tmpRegion);
-
-    REGION_UNINIT(pDrawable->pScreen, &tmpRegion);
-  }
-
-  (*pGC->ops->ImageText16) (pDrawable, pGC, x, y, count, chars);
-
-  if (count)
-    SCHEDULE_FB_UPDATE(pDrawable->pScreen, prfb);
-
-  GC_OP_EPILOGUE(pGC);
-}
-
-
-/*
- * ImageGlyphBlt - use rough bounding box.
- */
-
-static void rfbImageGlyphBlt(DrawablePtr pDrawable, GCPtr pGC, int x, int y,
-                             unsigned int nglyph,
-                             CharInfoPtr *ppci,   /* array of character info */
-                             pointer pglyphBase)  /* start of array of glyphs */
-{
-  RegionRec tmpRegion;
-  BoxRec box;
-
-  GC_OP_PROLOGUE(pDrawable, pGC);
-
-  TRC((stderr, "rfbImageGlyphBlt called\n"));
-
-  if (nglyph) {
-    GetTextBoundingBox(pDrawable, pGC->font, x, y, nglyph, &box);
-
-    SAFE_REGION_INIT(pDrawable->pScreen, &tmpRegion, &box, 0);
-
-    REGION_INTERSECT(pDrawable->pScreen, &tmpRegion, &tmpRegion,
-                     pGC->pCompositeClip);
-
-    ADD_TO_MODIFIED_REGION(pDrawable->pScreen, &tmpRegion);
-
-    REGION_UNINIT(pDrawable->pScreen, &tmpRegion);
-  }
-
-  (*pGC->ops->ImageGlyphBlt) (pDrawable, pGC, x, y, nglyph, ppci, pglyphBase);
-
-  if (nglyph)
-    SCHEDULE_FB_UPDATE(pDrawable->pScreen, prfb);
-
-  GC_OP_EPILOGUE(pGC);
-}
-
-
-/*
- * PolyGlyphBlt - use rough bounding box.
- */
-
-static void rfbPolyGlyphBlt(DrawablePtr pDrawable, GCPtr pGC, int x, int y,
-                            unsigned int nglyph,
-                            CharInfoPtr *ppci,   /* array of character info */
-                            pointer pglyphBase)  /* start of array of glyphs */
-{
-  RegionRec tmpRegion;
-  BoxRec box;
-
-  GC_OP_PROLOGUE(pDrawable, pGC);
-
-  TRC((stderr, "rfbPolyGlyphBlt called\n"));
-
-  if (nglyph) {
-    GetTextBoundingBox(pDrawable, pGC->font, x, y, nglyph, &box);
-
-    SAFE_REGION_INIT(pDrawable->pScreen, &tmpRegion, &box, 0);
-
-    REGION_INTERSECT(pDrawable->pScreen, &tmpRegion, &tmpRegion,
-                     pGC->pCompositeClip);
-
-    ADD_TO_MODIFIED_REGION(pDrawable->pScreen, &tmpRegion);
-
-    REGION_UNINIT(pDrawable->pScreen, &tmpRegion);
-  }
-
-  (*pGC->ops->PolyGlyphBlt) (pDrawable, pGC, x, y, nglyph, ppci, pglyphBase);
-
-  if (nglyph)
-    SCHEDULE_FB_UPDATE(pDrawable->pScreen, prfb);
-
-  GC_OP_EPILOGUE(pGC);
-}
-
-
-/*
- * PushPixels - be fairly safe - region modified is intersection of the given
- * rectangle with the window clip region.
- */
-
-static void rfbPushPixels(GCPtr pGC, PixmapPtr pBitMap, DrawablePtr pDrawable,
-                          int w, int h, int x, int y)
-{
-  RegionRec tmpRegion;
-  BoxRec box;
-
-  GC_OP_PROLOGUE(pDrawable, pGC);
-
-  TRC((stderr, "rfbPushPixels called\n"));
-
-  box.x1 = x + pDrawable->x;
-  box.y1 = y + pDrawable->y;
-  box.x2 = box.x1 + w;
-  box.y2 = box.y1 + h;
-
-  SAFE_REGION_INIT(pDrawable->pScreen, &tmpRegion, &box, 0);
-
-  REGION_INTERSECT(pDrawable->pScreen, &tmpRegion, &tmpRegion,
-                   pGC->pCompositeClip);
-
-  ADD_TO_MODIFIED_REGION(pDrawable->pScreen, &tmpRegion);
-
-  REGION_UNINIT(pDrawable->pScreen, &tmpRegion);
-
-  (*pGC->ops->PushPixels) (pGC, pBitMap, pDrawable, w, h, x, y);
-
-  SCHEDULE_FB_UPDATE(pDrawable->pScreen, prfb);
-
-  GC_OP_EPILOGUE(pGC);
-}
-
-
-#ifdef RENDER
-
-void rfbComposite(CARD8 op, PicturePtr pSrc, PicturePtr pMask, PicturePtr pDst,
-                  INT16 xSrc, INT16 ySrc, INT16 xMask, INT16 yMask,
-                  INT16 xDst, INT16 yDst, CARD16 width, CARD16 height)
-{
-  ScreenPtr pScreen = pDst->pDrawable->pScreen;
-  rfbFBInfoPtr prfb = &rfbFB;
-  RegionRec tmpRegion, fbRegion;
-  BoxRec box;
-  PictureScreenPtr ps = GetPictureScreen(pScreen);
-
-  if (is_visible(pDst->pDrawable)) {
-    box.x1 = max(pDst->pDrawable->x + xDst, 0);
-    box.y1 = max(pDst->pDrawable->y + yDst, 0);
-    box.x2 = box.x1 + width;
-    box.y2 = box.y1 + height;
-
-    REGION_INIT(pScreen, &tmpRegion, &box, 0);
-
-    box.x1 = 0;
-    box.y1 = 0;
-    box.x2 = pScreen->width;
-    box.y2 = pScreen->height;
-
-    REGION_INIT(pScreen, &fbRegion, &box, 0);
-
-    REGION_INTERSECT(pScreen, &tmpRegion, &tmpRegion, &fbRegion);
-
-    ADD_TO_MODIFIED_REGION(pScreen, &tmpRegion);
-  }
-
-  ps->Composite = prfb->Composite;
-  (*ps->Composite) (op, pSrc, pMask, pDst, xSrc, ySrc, xMask, yMask,
-                    xDst, yDst, width, height);
-  ps->Composite = rfbComposite;
-
-  if (is_visible(pDst->pDrawable)) {
-    SCHEDULE_FB_UPDATE(pScreen, prfb);
-
-    REGION_UNINIT(pScreen, &tmpRegion);
-  }
-}
-
-
-static int GlyphCount(int nlist, GlyphListPtr list, GlyphPtr *glyphs)
-{
-  int count;
-
-  count = 0;
-  while (nlist--) {
-    count += list->len;
-    list++;
-  }
-
-  return count;
-}
-
-
-static RegionPtr GlyphsToRegion(ScreenPtr pScreen, int nlist,
-                                GlyphListPtr list, GlyphPtr *glyphs)
-{
-  int n;
-  GlyphPtr glyph;
-  int x, y;
-
-  int nrects = GlyphCount(nlist, list, glyphs);
-  xRectangle rects[nrects];
-  xRectanglePtr rect;
-
-  x = 0;
-  y = 0;
-  rect = &rects[0];
-  while (nlist--) {
-    x += list->xOff;
-    y += list->yOff;
-    n = list->len;
-    list++;
-    while (n--) {
-      glyph = *glyphs++;
-      rect->x = x - glyph->info.x;
-      rect->y = y - glyph->info.y;
-      rect->width = glyph->info.width;
-      rect->height = glyph->info.height;
-      x += glyph->info.xOff;
-      y += glyph->info.yOff;
-      rect++;
-    }
-  }
-
-  return RECTS_TO_REGION(pScreen, nrects, rects, CT_NONE);
-}
-
-
-/* Glyphs - Glyph-specific version of Composite (caches and whatnot) */
-
-void rfbGlyphs(CARD8 op, PicturePtr pSrc, PicturePtr pDst,
-               PictFormatPtr maskFormat, INT16 xSrc, INT16 ySrc, int nlists,
-               GlyphListPtr lists, GlyphPtr *glyphs)
-{
-  ScreenPtr pScreen = pDst->pDrawable->pScreen;
-  rfbFBInfoPtr prfb = &rfbFB;
-  RegionRec *tmpRegion = NULL;
-  PictureScreenPtr ps = GetPictureScreen(pScreen);
-
-  if (is_visible(pDst->pDrawable)) {
-    BoxRec fbBox;
-    RegionRec fbRegion;
-
-    tmpRegion = GlyphsToRegion(pScreen, nlists, lists, glyphs);
-    REGION_TRANSLATE(pScreen, tmpRegion, pDst->pDrawable->x,
-                     pDst->pDrawable->y);
-
-    fbBox.x1 = 0;
-    fbBox.y1 = 0;
-    fbBox.x2 = rfbFB.width;
-    fbBox.y2 = rfbFB.height;
-    REGION_INIT(pScreen, &fbRegion, &fbBox, 0);
-
-    REGION_INTERSECT(pScreen, tmpRegion, tmpRegion, &fbRegion);
-
-    REGION_UNINIT(pScreen, &fbRegion);
-
-    ADD_TO_MODIFIED_REGION(pScreen, tmpRegion);
-
-    REGION_DESTROY(pScreen, tmpRegion);
-  }
-
-  ps->Glyphs = prfb->Glyphs;
-  (*ps->Glyphs) (op, pSrc, pDst, maskFormat, xSrc, ySrc, nlists, lists,
-                 glyphs);
-  ps->Glyphs = rfbGlyphs;
-
-  if (is_visible(pDst->pDrawable))
-    SCHEDULE_FB_UPDATE(pScreen, prfb);
-}
-
-#endif  /* RENDER */
-
-
-/****************************************************************************/
-/*
- * Other functions
- */
-/****************************************************************************/
+/****************************************************************************/
 
 /*
  * rfbCopyRegion.  Args are src and dst regions plus a translation (dx, dy).
@@ -1765,6 +1002,8 @@ static void rfbCopyRegion(ScreenPtr pScreen, rfbClientPtr cl, RegionPtr src,
 {
   RegionRec tmp;
 
+  rfbCollectDamage(cl);
+
   /* src = src - modifiedRegion */
 
   REGION_SUBTRACT(pScreen, src, src, &cl->modifiedRegion);
@@ -1852,7 +1091,9 @@ static void rfbCopyRegion(ScreenPtr pScreen, rfbClientPtr cl, RegionPtr src,
 
 /*
  * rfbDeferredUpdateCallback() is called when a client's deferredUpdateTimer
- * goes off.
+ * goes off.  If multi-threaded encoding is enabled, then the deferred updates
+ * of any other clients that are due (or nearly due) are sent at the same
+ * time, so that the updates can be encoded in parallel.
  */
 
 static CARD32 rfbDeferredUpdateCallback(OsTimerPtr timer, CARD32 now,
@@ -1861,6 +1102,32 @@ static CARD32 rfbDeferredUpdateCallback(OsTimerPtr timer, CARD32 now,
   rfbClientPtr cl = (rfbClientPtr)arg;
   BOOL status = TRUE;
 
+  if (rfbTraceEnabled)
+    rfbTraceAsyncSpan("defer", cl->deferredUpdateStart, "ms",
+                      cl->deferUpdateTime);
+
+  if (rfbNumThreads > 1 && rfbClientHead && rfbClientHead->next) {
+    rfbClientPtr cl2;
+    double deadline = gettime() + 0.001;
+    int nDue = 0;
+
+    for (cl2 = rfbClientHead; cl2; cl2 = cl2->next) {
+      cl2->updateDue = FALSE;
+      if (cl2->deferredUpdateScheduled && FB_UPDATE_PENDING(cl2) &&
+          (cl2 == cl || cl2->deferredUpdateStart +
+           (double)cl2->deferUpdateTime / 1000. <= deadline)) {
+        cl2->updateDue = TRUE;
+        nDue++;
+      }
+    }
+    if (nDue > 1) {
+      rfbSendFramebufferUpdates();
+      return 0;
+    }
+    for (cl2 = rfbClientHead; cl2; cl2 = cl2->next)
+      cl2->updateDue = FALSE;
+  }
+
   if (cl->deferredUpdateScheduled && FB_UPDATE_PENDING(cl))
     status = rfbSendFramebufferUpdate(cl);
 
@@ -1876,9 +1143,10 @@ static CARD32 rfbDeferredUpdateCallback(OsTimerPtr timer, CARD32 now,
 
 static void rfbScheduleDeferredUpdate(rfbClientPtr cl)
 {
-  if (rfbDeferUpdateTime != 0) {
-    cl->deferredUpdateTimer = TimerSet(cl->deferredUpdateTimer, 0,
-                                       rfbDeferUpdateTime,
+  int delay = max(cl->deferUpdateTime, rfbPacingDelay(cl));
+
+  if (delay != 0) {
+    cl->deferredUpdateTimer = TimerSet(cl->deferredUpdateTimer, 0, delay,
                                        rfbDeferredUpdateCallback, cl);
     cl->deferredUpdateScheduled = TRUE;
     cl->deferredUpdateStart = gettime();
@@ -1888,6 +1156,66 @@ static void rfbScheduleDeferredUpdate(rfbClientPtr cl)
 }
 
 
+/*
+ * rfbPacingDelay() returns the number of milliseconds that must elapse before
+ * the next framebuffer update can be sent to the client without exceeding
+ * the maximum frame rate.
+ */
+
+int rfbPacingDelay(rfbClientPtr cl)
+{
+  double interval, elapsed;
+
+  if (rfbMaxFPS <= 0)
+    return 0;
+
+  interval = 1000. / (double)rfbMaxFPS;
+  elapsed = (gettime() - cl->lastUpdateTime) * 1000.;
+  if (elapsed >= interval)
+    return 0;
+
+  return (int)(interval - elapsed + 0.999);
+}
+
+
+/*
+ * rfbAdaptDeferTime() is called after each framebuffer update has been sent,
+ * if adaptive deferral is enabled, to choose the defer time for the client's
+ * next update.  A client that receives only a trickle of damage (such as a
+ * client whose user is typing) has its updates deferred only briefly, in
+ * order to minimize latency.  As the damage rate increases toward several
+ * screens per second, the defer time increases to rfbDeferUpdateTime, so
+ * that damage is coalesced.  Beyond that, updates are never started more
+ * often than they can be encoded, and a client with a high-latency
+ * connection has its updates deferred for up to half of the round-trip time,
+ * since sending them any more often would only fill the network buffers.
+ */
+
+void rfbAdaptDeferTime(rfbClientPtr cl, double encodeTime)
+{
+  double defer, weight;
+
+  cl->encodeTime = (cl->encodeTime * 3. + encodeTime * 1000.) / 4.;
+
+  weight = min(cl->damageRate / ADAPTIVE_DEFER_FULL_RATE, 1.0);
+  defer = ADAPTIVE_DEFER_MIN +
+          (double)(rfbDeferUpdateTime - ADAPTIVE_DEFER_MIN) * weight;
+
+  if (weight >= 1.0) {
+    if (defer < cl->encodeTime)
+      defer = cl->encodeTime;
+    if (cl->enableFence && cl->baseRTT != (unsigned)-1 &&
+        defer < (double)cl->baseRTT / 2.)
+      defer = (double)cl->baseRTT / 2.;
+  }
+
+  if (defer > ADAPTIVE_DEFER_MAX)
+    defer = ADAPTIVE_DEFER_MAX;
+
+  cl->deferUpdateTime = (int)(defer + 0.5);
+}
+
+
 /*
  * PrintRegion is useful for debugging.
  */
@@ -25,10 +25,40 @@
 /* #define CONGESTION_DEBUG */
 
 #include "rfb.h"
+#include <limits.h>
+#include <stddef.h>
 #include <netinet/tcp.h>
 #include <sys/time.h>
 
 
+/* Adaptive quality: target frame rate (0 = disabled) */
+int rfbAQTargetFPS = 0;
+
+/* Number of milliseconds between adaptive quality decisions */
+#define AQ_INTERVAL 1000
+
+/* Quality is raised only after this many consecutive intervals in which the
+   estimated frame rate exceeded AQ_HEADROOM times the target.  Each time that
+   a raise has to be undone in the next interval, the number of intervals is
+   doubled (up to AQ_MAX_RAISE_INTERVALS), so that a connection whose capacity
+   lies between two steps of the ladder does not oscillate. */
+#define AQ_RAISE_INTERVALS 3
+#define AQ_MAX_RAISE_INTERVALS 48
+#define AQ_HEADROOM 2.0
+
+/* The quality ladder.  These are the same JPEG quality and subsampling
+   combinations as the TurboVNC Viewer's quality presets. */
+static const struct {
+  int quality, subsamp;
+} aqLadder[] = {
+  { 15, TVNC_4X }, { 29, TVNC_4X }, { 41, TVNC_4X }, { 42, TVNC_2X },
+  { 62, TVNC_2X }, { 77, TVNC_2X }, { 79, TVNC_1X }, { 86, TVNC_1X },
+  { 92, TVNC_1X }, { 100, TVNC_1X }
+};
+
+#define AQ_LEVELS (int)(sizeof(aqLadder) / sizeof(aqLadder[0]))
+
+
 /* This window should get us going fairly quickly on a network with decent
    bandwidth.  If it's too high, then it will rapidly be reduced and stay
    low. */
@@ -42,6 +72,34 @@ static const unsigned MINIMUM_WINDOW = 4096;
    limit for now... */
 static const unsigned MAXIMUM_WINDOW = 4194304;
 
+/* The congestion window is sized from a model of the connection, in the
+   spirit of BBR:
+
+   - The bottleneck bandwidth is the maximum delivery rate measured over the
+     last BW_FILTER_ROUNDS rounds (see rfb.h.)  A round ends each time the
+     congestion timer fires.  Rounds in which the window did not limit the
+     amount of data sent are application-limited, and their delivery rates
+     can only raise the estimate.
+   - The round-trip propagation time (baseRTT) is the minimum RTT measured
+     over the last RTPROP_WINDOW milliseconds.  If it has not been measured
+     again in that time, then the window is reduced to MINIMUM_WINDOW for
+     PROBE_RTT_TIME milliseconds (at least one round), so that any queue that
+     has built up drains and the true latency can be measured.
+   - The window is CWND_GAIN times the bandwidth-delay product, which leaves
+     room to discover any additional bandwidth.  Until the bandwidth estimate
+     stops growing by at least 25% per round for STARTUP_ROUNDS consecutive
+     window-limited rounds, the window is instead doubled every round in
+     which it limited the amount of data sent. */
+#define RTPROP_WINDOW 10000
+#define PROBE_RTT_TIME 200
+#define CWND_GAIN 2
+#define STARTUP_ROUNDS 3
+
+/* Bounds for the amount of data that is allowed to sit unsent in the socket
+   buffer of a client that doesn't support the fence extension */
+#define MINIMUM_NOTSENT_LOWAT 16384
+#define MAXIMUM_NOTSENT_LOWAT 1048576
+
 
 typedef struct {
   struct timeval tv;
@@ -50,8 +108,87 @@ typedef struct {
 } RTTInfo;
 
 
+#if defined(__linux__) && defined(TCP_INFO)
+
+/* glibc's copy of struct tcp_info predates the fields that we need, so this
+   mirrors the layout used by Linux 4.9 and later.  Older kernels return a
+   shorter structure, in which case the newer fields are ignored. */
+
+typedef struct {
+  CARD8 tcpi_state;
+  CARD8 tcpi_ca_state;
+  CARD8 tcpi_retransmits;
+  CARD8 tcpi_probes;
+  CARD8 tcpi_backoff;
+  CARD8 tcpi_options;
+  CARD8 tcpi_snd_wscale : 4, tcpi_rcv_wscale : 4;
+  CARD8 tcpi_delivery_rate_app_limited : 1, tcpi_fastopen_client_fail : 2;
+
+  CARD32 tcpi_rto;
+  CARD32 tcpi_ato;
+  CARD32 tcpi_snd_mss;
+  CARD32 tcpi_rcv_mss;
+
+  CARD32 tcpi_unacked;
+  CARD32 tcpi_sacked;
+  CARD32 tcpi_lost;
+  CARD32 tcpi_retrans;
+  CARD32 tcpi_fackets;
+
+  CARD32 tcpi_last_data_sent;
+  CARD32 tcpi_last_ack_sent;
+  CARD32 tcpi_last_data_recv;
+  CARD32 tcpi_last_ack_recv;
+
+  CARD32 tcpi_pmtu;
+  CARD32 tcpi_rcv_ssthresh;
+  CARD32 tcpi_rtt;
+  CARD32 tcpi_rttvar;
+  CARD32 tcpi_snd_ssthresh;
+  CARD32 tcpi_snd_cwnd;
+  CARD32 tcpi_advmss;
+  CARD32 tcpi_reordering;
+
+  CARD32 tcpi_rcv_rtt;
+  CARD32 tcpi_rcv_space;
+
+  CARD32 tcpi_total_retrans;
+
+  CARD64 tcpi_pacing_rate;
+  CARD64 tcpi_max_pacing_rate;
+  CARD64 tcpi_bytes_acked;
+  CARD64 tcpi_bytes_received;
+  CARD32 tcpi_segs_out;
+  CARD32 tcpi_segs_in;
+
+  CARD32 tcpi_notsent_bytes;
+  CARD32 tcpi_min_rtt;
+  CARD32 tcpi_data_segs_in;
+  CARD32 tcpi_data_segs_out;
+
+  CARD64 tcpi_delivery_rate;
+} TCPInfo;
+
+#define TCPINFO_HAS(len, field)  \
+  ((len) >= offsetof(TCPInfo, field) + sizeof(((TCPInfo *)0)->field))
+
+#endif
+
+
+/* Kernel's view of the connection.  Fields that are unavailable are 0. */
+
+typedef struct {
+  unsigned rtt;                 /* smoothed RTT (ms) */
+  unsigned minRTT;              /* minimum RTT (ms) */
+  unsigned notsent;             /* bytes not yet sent by the kernel */
+  unsigned deliveryRate;        /* most recent delivery rate (bytes/s) */
+  Bool appLimited;              /* deliveryRate was application-limited */
+} SocketStats;
+
+
 static void HandleRTTPong(rfbClientPtr, RTTInfo *);
 static void UpdateCongestion(rfbClientPtr);
+static Bool GetSocketStats(rfbClientPtr, SocketStats *);
 
 
 static CARD32 congestionCallback(OsTimerPtr timer, CARD32 time, pointer arg)
@@ -80,10 +217,66 @@ static time_t msSince(const struct timeval *then)
 }
 
 
+static void SetNotSentLowat(rfbClientPtr cl, unsigned lowat)
+{
+#ifdef TCP_NOTSENT_LOWAT
+  int val = (int)lowat;
+
+  if (setsockopt(cl->sock, IPPROTO_TCP, TCP_NOTSENT_LOWAT, (char *)&val,
+                 sizeof(val)) < 0) {
+    static Bool alreadywarned = FALSE;
+
+    if (!alreadywarned) {
+      rfbLogPerror("Could not set TCP_NOTSENT_LOWAT");
+      alreadywarned = TRUE;
+    }
+    return;
+  }
+  cl->notsentLowat = lowat;
+#endif
+}
+
+
+/*
+ * Query the kernel for the state of the client's TCP connection.  Returns
+ * FALSE if this isn't supported on this platform.
+ */
+
+static Bool GetSocketStats(rfbClientPtr cl, SocketStats *stats)
+{
+#if defined(__linux__) && defined(TCP_INFO)
+  TCPInfo tcpInfo;
+  socklen_t len = sizeof(tcpInfo);
+
+  memset(stats, 0, sizeof(SocketStats));
+  memset(&tcpInfo, 0, sizeof(tcpInfo));
+  if (getsockopt(cl->sock, SOL_TCP, TCP_INFO, (void *)&tcpInfo, &len) < 0)
+    return FALSE;
+
+  stats->rtt = stats->minRTT = tcpInfo.tcpi_rtt / 1000;
+  if (TCPINFO_HAS(len, tcpi_min_rtt) && tcpInfo.tcpi_min_rtt > 0)
+    stats->minRTT = tcpInfo.tcpi_min_rtt / 1000;
+  if (TCPINFO_HAS(len, tcpi_notsent_bytes))
+    stats->notsent = tcpInfo.tcpi_notsent_bytes;
+  if (TCPINFO_HAS(len, tcpi_delivery_rate)) {
+    stats->deliveryRate =
+      (unsigned)min(tcpInfo.tcpi_delivery_rate, (CARD64)UINT_MAX);
+    stats->appLimited = tcpInfo.tcpi_delivery_rate_app_limited;
+  }
+  return TRUE;
+#else
+  return FALSE;
+#endif
+}
+
+
 void rfbInitFlowControl(rfbClientPtr cl)
 {
   cl->ackedOffset = cl->sockOffset;
   cl->congWindow = INITIAL_WINDOW;
+  cl->roundAckedOffset = cl->ackedOffset;
+  gettimeofday(&cl->roundStart, NULL);
+  cl->rtPropStamp = cl->roundStart;
 }
 
 
@@ -137,6 +330,11 @@ static void HandleRTTPong(rfbClientPtr cl, RTTInfo *rttInfo)
 
   cl->pingCounter--;
 
+  if (rfbTraceEnabled)
+    rfbTraceAsyncSpan("fence", (double)rttInfo->tv.tv_sec +
+                      (double)rttInfo->tv.tv_usec * 0.000001, "inflight",
+                      rttInfo->inFlight);
+
   rtt = msSince(&rttInfo->tv);
   if (rtt < 1)
     rtt = 1;
@@ -144,12 +342,12 @@ static void HandleRTTPong(rfbClientPtr cl, RTTInfo *rttInfo)
   cl->ackedOffset = rttInfo->offset;
 
   /* Try to estimate wire latency by tracking lowest latency seen */
-  if (rtt < cl->baseRTT)
+  if (rtt < cl->baseRTT) {
     cl->baseRTT = rtt;
+    gettimeofday(&cl->rtPropStamp, NULL);
+  }
 
   if (rttInfo->inFlight > cl->congWindow) {
-    cl->seenCongestion = TRUE;
-
     /* Estimate added delay because of overtaxed buffers */
     delay = (rttInfo->inFlight - cl->congWindow) *
             cl->baseRTT / cl->congWindow;
@@ -209,27 +407,97 @@ Bool rfbSendRTTPing(rfbClientPtr cl)
 }
 
 
-static void UpdateCongestion(rfbClientPtr cl)
+static unsigned BtlBw(rfbClientPtr cl)
 {
-  unsigned diff;
+  unsigned bw = 0;
+  int i;
 
-  if (!cl->seenCongestion)
+  for (i = 0; i < BW_FILTER_ROUNDS; i++)
+    if (cl->bwSamples[i] > bw)
+      bw = cl->bwSamples[i];
+
+  return bw;
+}
+
+
+static void UpdateCongestion(rfbClientPtr cl)
+{
+  time_t elapsed;
+  unsigned bw, btlBw, window;
+  double bdp;
+  SocketStats stats;
+  Bool haveStats;
+
+  elapsed = msSince(&cl->roundStart);
+  if (elapsed < 1)
     return;
 
-  diff = cl->minRTT - cl->baseRTT;
-
-  if (diff > min(100, cl->baseRTT)) {
-    /* Way too fast */
-    cl->congWindow = cl->congWindow * cl->baseRTT / cl->minRTT;
-  } else if (diff > min(50, cl->baseRTT / 2)) {
-    /* Slightly too fast */
-    cl->congWindow -= 4096;
-  } else if (diff < 5) {
-    /* Way too slow */
-    cl->congWindow += 8192;
-  } else if (diff < 25) {
-    /* Too slow */
-    cl->congWindow += 4096;
+  /* Delivery rate over this round, as reported by the client's responses
+     to our pings */
+  bw = (unsigned)((double)(cl->ackedOffset - cl->roundAckedOffset) *
+                  1000. / (double)elapsed);
+
+  /* The kernel measures the RTT of the network alone, which may be lower
+     than the RTT of our pings if the client is slow to process updates.  Its
+     delivery rate, however, is measured over individual ACKs, and on shaped
+     links it swings by orders of magnitude between samples, so it is only
+     used for clients that can't respond to pings (see IsSocketCongested().)
+     A max filter would amplify its outliers. */
+  haveStats = GetSocketStats(cl, &stats);
+  if (haveStats && stats.rtt > 0 && stats.rtt < cl->minRTT)
+    cl->minRTT = stats.rtt;
+
+  btlBw = BtlBw(cl);
+  cl->bwSamples[cl->bwRound++ % BW_FILTER_ROUNDS] =
+    (cl->windowLimited || bw > btlBw) ? bw : 0;
+  btlBw = BtlBw(cl);
+  if (btlBw == 0) {
+    /* Every sample in the window was application-limited. */
+    cl->bwSamples[(cl->bwRound - 1) % BW_FILTER_ROUNDS] = btlBw = bw;
+  }
+
+  if (cl->minRTT <= cl->baseRTT) {
+    cl->baseRTT = cl->minRTT;
+    gettimeofday(&cl->rtPropStamp, NULL);
+  }
+
+  if (cl->probeRTT) {
+    /* Leave ProbeRTT once the queue has had time to drain.  The lowest RTT
+       seen during the probe becomes the new baseRTT. */
+    if (msSince(&cl->probeRTTStart) >= PROBE_RTT_TIME) {
+      cl->probeRTT = FALSE;
+      if (cl->probeMinRTT != (unsigned)-1)
+        cl->baseRTT = cl->probeMinRTT;
+      gettimeofday(&cl->rtPropStamp, NULL);
+    } else if (cl->minRTT < cl->probeMinRTT)
+      cl->probeMinRTT = cl->minRTT;
+  } else if (cl->baseRTT != (unsigned)-1 &&
+             msSince(&cl->rtPropStamp) > RTPROP_WINDOW) {
+    cl->probeRTT = TRUE;
+    cl->probeMinRTT = -1;
+    gettimeofday(&cl->probeRTTStart, NULL);
+  }
+
+  if (!cl->bwFull && cl->windowLimited) {
+    if (btlBw >= cl->bwFullBw + cl->bwFullBw / 4) {
+      cl->bwFullBw = btlBw;
+      cl->bwFullCount = 0;
+    } else if (++cl->bwFullCount >= STARTUP_ROUNDS)
+      cl->bwFull = TRUE;
+  }
+
+  if (cl->probeRTT)
+    cl->congWindow = MINIMUM_WINDOW;
+  else if (cl->baseRTT != (unsigned)-1) {
+    bdp = (double)btlBw * (double)cl->baseRTT / 1000.;
+    window = (unsigned)min(bdp * CWND_GAIN, (double)MAXIMUM_WINDOW);
+    if (!cl->bwFull) {
+      if (cl->windowLimited && cl->congWindow < MAXIMUM_WINDOW / 2)
+        window = max(window, cl->congWindow * 2);
+      else
+        window = max(window, cl->congWindow);
+    }
+    cl->congWindow = window;
   }
 
   if (cl->congWindow < MINIMUM_WINDOW)
@@ -238,27 +506,73 @@ static void UpdateCongestion(rfbClientPtr cl)
     cl->congWindow = MAXIMUM_WINDOW;
 
 #ifdef CONGESTION_DEBUG
-  rfbLog("RTT: %d ms (%d ms), Window: %d KB, Offset: %d KB, Bandwidth: %g Mbps\n",
+  rfbLog("RTT: %d ms (%d ms), Window: %d KB, Offset: %d KB, Bandwidth: %g Mbps%s\n",
          cl->minRTT, cl->baseRTT, cl->congWindow / 1024, cl->sockOffset / 1024,
-         cl->congWindow * 8.0 / cl->baseRTT / 1000.0);
-
-#ifdef TCP_INFO
-  struct tcp_info tcp_info;
-  socklen_t tcp_info_length;
-
-  tcp_info_length = sizeof(tcp_info);
-  if (getsockopt(cl->sock, SOL_TCP, TCP_INFO, (void *)&tcp_info,
-                 &tcp_info_length) == 0) {
-    rfbLog("Socket: RTT: %d ms (+/- %d ms) Window %d KB\n",
-           tcp_info.tcpi_rtt / 1000, tcp_info.tcpi_rttvar / 1000,
-           tcp_info.tcpi_snd_mss * tcp_info.tcpi_snd_cwnd / 1024);
-  }
-#endif
-
+         btlBw * 8.0 / 1000000.0,
+         cl->probeRTT ? " (ProbeRTT)" : cl->bwFull ? "" : " (startup)");
+  if (haveStats)
+    rfbLog("Socket: RTT: %d ms (min %d ms), Not sent: %d KB, Delivery rate: %g Mbps%s\n",
+           stats.rtt, stats.minRTT, stats.notsent / 1024,
+           stats.deliveryRate * 8.0 / 1000000.0,
+           stats.appLimited ? " (app-limited)" : "");
 #endif
 
   cl->minRTT = -1;
-  cl->seenCongestion = FALSE;
+  cl->windowLimited = FALSE;
+  cl->roundAckedOffset = cl->ackedOffset;
+  gettimeofday(&cl->roundStart, NULL);
+}
+
+
+/*
+ * Flow control for clients that don't support the fence extension.  The
+ * kernel's estimate of the bandwidth-delay product determines how much data
+ * may sit unsent in the socket buffer, and new updates are held back while
+ * more than that is waiting.
+ */
+
+static Bool IsSocketCongested(rfbClientPtr cl)
+{
+  SocketStats stats;
+  unsigned lowat;
+
+  if (!GetSocketStats(cl, &stats))
+    return FALSE;
+
+  /* Viewers that don't support the fence extension can't tell us how much of
+     an update they've received, so we rely on the kernel to keep the amount
+     of data queued in the socket buffer (and thus the latency) in check.  The
+     viewer hasn't yet told us whether it supports fences when the connection
+     is initialized, so the limit is set before the first update. */
+  if (cl->notsentLowat == 0) {
+    SetNotSentLowat(cl, MINIMUM_NOTSENT_LOWAT * 4);
+    if (cl->notsentLowat == 0)
+      return FALSE;
+  }
+
+  /* Ignore application-limited samples unless they raise the estimate, and
+     smooth the rest. */
+  if (stats.deliveryRate > 0 &&
+      (!stats.appLimited || stats.deliveryRate > cl->sockBw)) {
+    if (cl->sockBw == 0)
+      cl->sockBw = stats.deliveryRate;
+    else
+      cl->sockBw = (unsigned)(((double)cl->sockBw * 7. +
+                               (double)stats.deliveryRate) / 8.);
+  }
+
+  if (cl->sockBw > 0) {
+    lowat = (unsigned)min((double)cl->sockBw *
+                          (double)max(stats.minRTT, 1) / 1000. * CWND_GAIN,
+                          (double)MAXIMUM_NOTSENT_LOWAT);
+    lowat = max(lowat, MINIMUM_NOTSENT_LOWAT);
+    /* Avoid a system call for every update. */
+    if (lowat > cl->notsentLowat + cl->notsentLowat / 4 ||
+        lowat < cl->notsentLowat - cl->notsentLowat / 4)
+      SetNotSentLowat(cl, lowat);
+  }
+
+  return stats.notsent > cl->notsentLowat;
 }
 
 
@@ -268,7 +582,12 @@ static void UpdateCongestion(rfbClientPtr cl)
 Bool rfbSendFence(rfbClientPtr cl, CARD32 flags, unsigned len,
                   const char *data)
 {
-  rfbFenceMsg f;
+  /* The payload immediately follows the sz_rfbFenceMsg-byte header, so the
+     message is built in a buffer that is aligned for rfbFenceMsg. */
+  union {
+    rfbFenceMsg f;
+    char buf[sz_rfbFenceMsg + 64];
+  } msg;
 
   if (!cl->enableFence) {
     rfbLog("ERROR in rfbSendFence: Client does not support fence extension\n");
@@ -283,18 +602,14 @@ Bool rfbSendFence(rfbClientPtr cl, CARD32 flags, unsigned len,
     return FALSE;
   }
 
-  memset(&f, 0, sz_rfbFenceMsg);
-  f.type = rfbFence;
-  f.flags = Swap32IfLE(flags);
-  f.length = len;
+  memset(&msg.f, 0, sz_rfbFenceMsg);
+  msg.f.type = rfbFence;
+  msg.f.flags = Swap32IfLE(flags);
+  msg.f.length = len;
+  if (len > 0) memcpy(&msg.buf[sz_rfbFenceMsg], data, len);
 
-  if (WriteExact(cl, (char *)&f, sz_rfbFenceMsg) < 0) {
-    rfbLogPerror("rfbSendFence: write");
-    rfbCloseClient(cl);
-    return FALSE;
-  }
-
-  if (WriteExact(cl, (char *)data, len) < 0) {
+  /* Send the header and payload with a single write. */
+  if (WriteExact(cl, msg.buf, sz_rfbFenceMsg + len) < 0) {
     rfbLogPerror("rfbSendFence: write");
     rfbCloseClient(cl);
     return FALSE;
@@ -308,7 +623,7 @@ Bool rfbIsCongested(rfbClientPtr cl)
   int offset;  time_t sockIdleTime;
 
   if (!cl->enableFence)
-    return FALSE;
+    return IsSocketCongested(cl);
 
   sockIdleTime = msSince(&cl->lastWrite);
 
@@ -350,6 +665,8 @@ Bool rfbIsCongested(rfbClientPtr cl)
   if (cl->pingCounter == 1)
     return FALSE;
 
+  cl->aqCongested = TRUE;
+  cl->windowLimited = TRUE;
   return TRUE;
 }
 
@@ -375,3 +692,174 @@ Bool rfbSendEndOfCU(rfbClientPtr cl)
 
   return TRUE;
 }
+
+
+/*
+ * Adaptive quality
+ *
+ * If a target frame rate was specified, then the JPEG quality and chroma
+ * subsampling used for each Tight client are stepped down whenever the
+ * estimated throughput of the connection cannot sustain that frame rate at
+ * the current update size, and they are stepped back up (never beyond what
+ * the viewer requested) once there is sufficient headroom.  The throughput is
+ * estimated using the same fence-based RTT measurements that drive the
+ * congestion window, so this requires a viewer that supports the fence
+ * extension.
+ */
+
+static const char *subsampName[4] = { "1X", "4X", "2X", "Gray" };
+
+/* Order the subsampling levels from finest to coarsest. */
+static int SubsampRank(int subsamp)
+{
+  switch (subsamp) {
+    case TVNC_1X:  return 0;
+    case TVNC_2X:  return 1;
+    case TVNC_4X:  return 2;
+    default:       return 3;
+  }
+}
+
+
+void rfbAQApply(rfbClientPtr cl)
+{
+  int subsamp;
+
+  if (cl->aqCeiling < 0)
+    return;
+
+  if (cl->aqLevel >= cl->aqCeiling) {
+    cl->tightQualityLevel = cl->aqMaxQuality;
+    cl->tightSubsampLevel = cl->aqMaxSubsamp;
+    return;
+  }
+
+  /* Never use finer subsampling than the viewer requested. */
+  subsamp = aqLadder[cl->aqLevel].subsamp;
+  if (SubsampRank(cl->aqMaxSubsamp) > SubsampRank(subsamp))
+    subsamp = cl->aqMaxSubsamp;
+
+  cl->tightQualityLevel = aqLadder[cl->aqLevel].quality;
+  cl->tightSubsampLevel = subsamp;
+}
+
+
+/*
+ * This is called whenever the client sends a SetEncodings message.  The
+ * quality and subsampling that the client requested become the upper limit
+ * for the adaptive quality controller.
+ */
+
+void rfbAQReset(rfbClientPtr cl)
+{
+  int level;
+
+  cl->aqCeiling = -1;
+  if (rfbAQTargetFPS <= 0 || cl->preferredEncoding != rfbEncodingTight ||
+      cl->tightQualityLevel < 0)
+    return;
+
+  for (level = 0; level < AQ_LEVELS - 1; level++) {
+    if (aqLadder[level + 1].quality > cl->tightQualityLevel)
+      break;
+  }
+
+  cl->aqMaxQuality = cl->tightQualityLevel;
+  cl->aqMaxSubsamp = cl->tightSubsampLevel;
+  cl->aqCeiling = cl->aqLevel = level;
+  cl->aqRaise = 0;
+  cl->aqRaiseIntervals = AQ_RAISE_INTERVALS;
+  cl->aqProbing = FALSE;
+  cl->aqUpdates = 0;
+  cl->aqSockOffset = cl->sockOffset;
+  cl->aqAckedOffset = cl->ackedOffset;
+  cl->aqCongested = FALSE;
+  gettimeofday(&cl->aqStart, NULL);
+}
+
+
+/*
+ * This is called after each framebuffer update has been sent.
+ */
+
+void rfbAQUpdate(rfbClientPtr cl)
+{
+  time_t elapsed;
+  double bytesPerUpdate, throughput, fps;
+  int oldLevel = cl->aqLevel;
+
+  /* Broadcast group leaders encode on behalf of several clients, so their
+     settings have to remain fixed. */
+  if (cl->aqCeiling < 0 || !cl->enableFence || cl->bcastMembers > 0)
+    return;
+
+  cl->aqUpdates++;
+
+  elapsed = msSince(&cl->aqStart);
+  if (elapsed < AQ_INTERVAL)
+    return;
+
+  bytesPerUpdate = (double)(cl->sockOffset - cl->aqSockOffset) /
+                   (double)cl->aqUpdates;
+
+  /* If updates were held back by the congestion window, then the connection
+     was saturated, and the rate at which the client acknowledged data is the
+     best measure of its throughput.  Otherwise, the frame rate was limited
+     by the application rather than the network, so there is no reason to
+     lower the quality, and the congestion window divided by the wire latency
+     is used to judge whether there is headroom to raise it. */
+  throughput = (double)(cl->ackedOffset - cl->aqAckedOffset) * 1000. /
+               (double)elapsed;
+  if (!cl->aqCongested) {
+    double windowRate = (double)cl->congWindow * 1000. /
+                        (double)max(cl->baseRTT, 1);
+
+    if (windowRate > throughput)
+      throughput = windowRate;
+  }
+
+  fps = bytesPerUpdate > 0. ? throughput / bytesPerUpdate : 0.;
+
+  if (cl->aqCongested && bytesPerUpdate > 0. &&
+      fps < (double)rfbAQTargetFPS) {
+    if (cl->aqLevel > 0)
+      cl->aqLevel--;
+    if (cl->aqProbing)
+      cl->aqRaiseIntervals = min(cl->aqRaiseIntervals * 2,
+                                 AQ_MAX_RAISE_INTERVALS);
+    cl->aqRaise = 0;
+    cl->aqProbing = FALSE;
+  } else {
+    if (cl->aqProbing) {
+      /* The last raise held up. */
+      cl->aqRaiseIntervals = AQ_RAISE_INTERVALS;
+      cl->aqProbing = FALSE;
+    }
+    if (bytesPerUpdate <= 0. ||
+        fps >= (double)rfbAQTargetFPS * AQ_HEADROOM) {
+      if (++cl->aqRaise >= cl->aqRaiseIntervals) {
+        if (cl->aqLevel < cl->aqCeiling) {
+          cl->aqLevel++;
+          cl->aqProbing = TRUE;
+        }
+        cl->aqRaise = 0;
+      }
+    } else
+      cl->aqRaise = 0;
+  }
+
+  if (cl->aqLevel != oldLevel) {
+    rfbAQApply(cl);
+    rfbLog("Adaptive quality: %.2f Mbps, %.1f KB/update, %.1f fps est.\n",
+           throughput * 8. / 1000000., bytesPerUpdate / 1024., fps);
+    rfbLog("  Using JPEG subsampling %s, Q%d for client %s\n",
+           subsampName[cl->tightSubsampLevel & 3], cl->tightQualityLevel,
+           cl->host);
+  }
+
+  cl->aqUpdates = 0;
+  cl->aqSockOffset = cl->sockOffset;
+  cl->aqAckedOffset = cl->ackedOffset;
+  cl->aqCongested = FALSE;
+  gettimeofday(&cl->aqStart, NULL);
+}
@@ -40,7 +40,7 @@ Bool rfbSendRectEncodingHextile(rfbClientPtr cl, int x, int y, int w, int h)
 {
   rfbFramebufferUpdateRectHeader rect;
 
-  if (ublen + sz_rfbFramebufferUpdateRectHeader > UPDATE_BUF_SIZE) {
+  if (cl->ublen + sz_rfbFramebufferUpdateRectHeader > UPDATE_BUF_SIZE) {
     if (!rfbSendUpdateBuf(cl))
       return FALSE;
   }
@@ -51,8 +51,10 @@ Bool rfbSendRectEncodingHextile(rfbClientPtr cl, int x, int y, int w, int h)
   rect.r.h = Swap16IfLE(h);
   rect.encoding = Swap32IfLE(rfbEncodingHextile);
 
-  memcpy(&updateBuf[ublen], (char *)&rect, sz_rfbFramebufferUpdateRectHeader);
-  ublen += sz_rfbFramebufferUpdateRectHeader;
+  memcpy(&cl->updateBuf[cl->ublen], (char *)&rect,
+
+         sz_rfbFramebufferUpdateRectHeader);
+  cl->ublen += sz_rfbFramebufferUpdateRectHeader;
 
   cl->rfbRectanglesSent[rfbEncodingHextile]++;
   cl->rfbBytesSent[rfbEncodingHextile] += sz_rfbFramebufferUpdateRectHeader;
@@ -71,22 +73,22 @@ Bool rfbSendRectEncodingHextile(rfbClientPtr cl, int x, int y, int w, int h)
 }
 
 
-#define PUT_PIXEL8(pix) (updateBuf[ublen++] = (pix))
+#define PUT_PIXEL8(pix) (cl->updateBuf[cl->ublen++] = (pix))
 
-#define PUT_PIXEL16(pix) (updateBuf[ublen++] = ((char *)&(pix))[0],  \
-                          updateBuf[ublen++] = ((char *)&(pix))[1])
+#define PUT_PIXEL16(pix) (cl->updateBuf[cl->ublen++] = ((char *)&(pix))[0],  \
+                          cl->updateBuf[cl->ublen++] = ((char *)&(pix))[1])
 
-#define PUT_PIXEL32(pix) (updateBuf[ublen++] = ((char *)&(pix))[0],  \
-                          updateBuf[ublen++] = ((char *)&(pix))[1],  \
-                          updateBuf[ublen++] = ((char *)&(pix))[2],  \
-                          updateBuf[ublen++] = ((char *)&(pix))[3])
+#define PUT_PIXEL32(pix) (cl->updateBuf[cl->ublen++] = ((char *)&(pix))[0],  \
+                          cl->updateBuf[cl->ublen++] = ((char *)&(pix))[1],  \
+                          cl->updateBuf[cl->ublen++] = ((char *)&(pix))[2],  \
+                          cl->updateBuf[cl->ublen++] = ((char *)&(pix))[3])
 
 
 #define DEFINE_SEND_HEXTILES(bpp)                                             \
                                                                               \
                                                                               \
-static Bool subrectEncode##bpp(CARD##bpp *data, int w, int h, CARD##bpp bg,   \
-                               CARD##bpp fg, Bool mono);                      \
+static Bool subrectEncode##bpp(rfbClientPtr cl, CARD##bpp *data, int w,       \
+                               int h, CARD##bpp bg, CARD##bpp fg, Bool mono); \
 static void testColours##bpp(CARD##bpp *data, int size, Bool *mono,           \
                              Bool *solid, CARD##bpp *bg, CARD##bpp *fg);      \
                                                                               \
@@ -115,7 +117,7 @@ static Bool sendHextiles##bpp(rfbClientPtr cl, int rx, int ry,                \
       if (ry + rh - y < 16)                                                   \
         h = ry + rh - y;                                                      \
                                                                               \
-      if ((ublen + 1 + (2 + 16 * 16) * (bpp / 8)) > UPDATE_BUF_SIZE) {        \
+      if ((cl->ublen + 1 + (2 + 16 * 16) * (bpp / 8)) > UPDATE_BUF_SIZE) {    \
         if (!rfbSendUpdateBuf(cl))                                            \
           return FALSE;                                                       \
       }                                                                       \
@@ -127,9 +129,9 @@ static Bool sendHextiles##bpp(rfbClientPtr cl, int rx, int ry,                \
                           &cl->format, fbptr, (char *)clientPixelData,        \
                           rfbFB.paddedWidthInBytes, w, h);                    \
                                                                               \
-      startUblen = ublen;                                                     \
-      updateBuf[startUblen] = 0;                                              \
-      ublen++;                                                                \
+      startUblen = cl->ublen;                                                 \
+      cl->updateBuf[startUblen] = 0;                                          \
+      cl->ublen++;                                                            \
                                                                               \
       testColours##bpp(clientPixelData, w * h, &mono, &solid,                 \
                        &newBg, &newFg);                                       \
@@ -137,46 +139,46 @@ static Bool sendHextiles##bpp(rfbClientPtr cl, int rx, int ry,                \
       if (!validBg || (newBg != bg)) {                                        \
         validBg = TRUE;                                                       \
         bg = newBg;                                                           \
-        updateBuf[startUblen] |= rfbHextileBackgroundSpecified;               \
+        cl->updateBuf[startUblen] |= rfbHextileBackgroundSpecified;           \
         PUT_PIXEL##bpp(bg);                                                   \
       }                                                                       \
                                                                               \
       if (solid) {                                                            \
-        cl->rfbBytesSent[rfbEncodingHextile] += ublen - startUblen;           \
+        cl->rfbBytesSent[rfbEncodingHextile] += cl->ublen - startUblen;       \
         continue;                                                             \
       }                                                                       \
                                                                               \
-      updateBuf[startUblen] |= rfbHextileAnySubrects;                         \
+      cl->updateBuf[startUblen] |= rfbHextileAnySubrects;                     \
                                                                               \
       if (mono) {                                                             \
         if (!validFg || (newFg != fg)) {                                      \
           validFg = TRUE;                                                     \
           fg = newFg;                                                         \
-          updateBuf[startUblen] |= rfbHextileForegroundSpecified;             \
+          cl->updateBuf[startUblen] |= rfbHextileForegroundSpecified;         \
           PUT_PIXEL##bpp(fg);                                                 \
         }                                                                     \
       } else {                                                                \
         validFg = FALSE;                                                      \
-        updateBuf[startUblen] |= rfbHextileSubrectsColoured;                  \
+        cl->updateBuf[startUblen] |= rfbHextileSubrectsColoured;              \
       }                                                                       \
                                                                               \
-      if (!subrectEncode##bpp(clientPixelData, w, h, bg, fg, mono)) {         \
+      if (!subrectEncode##bpp(cl, clientPixelData, w, h, bg, fg, mono)) {     \
         /* encoding was too large, use raw */                                 \
         validBg = FALSE;                                                      \
         validFg = FALSE;                                                      \
-        ublen = startUblen;                                                   \
-        updateBuf[ublen++] = rfbHextileRaw;                                   \
+        cl->ublen = startUblen;                                               \
+        cl->updateBuf[cl->ublen++] = rfbHextileRaw;                           \
         (*cl->translateFn) (cl->translateLookupTable, &rfbServerFormat,       \
                             &cl->format, fbptr, (char *)clientPixelData,      \
                             rfbFB.paddedWidthInBytes, w, h);                  \
                                                                               \
-        memcpy(&updateBuf[ublen], (char *)clientPixelData,                    \
+        memcpy(&cl->updateBuf[cl->ublen], (char *)clientPixelData,            \
                w * h * (bpp / 8));                                            \
                                                                               \
-        ublen += w * h * (bpp / 8);                                           \
+        cl->ublen += w * h * (bpp / 8);                                       \
       }                                                                       \
                                                                               \
-      cl->rfbBytesSent[rfbEncodingHextile] += ublen - startUblen;             \
+      cl->rfbBytesSent[rfbEncodingHextile] += cl->ublen - startUblen;         \
     }                                                                         \
   }                                                                           \
                                                                               \
@@ -184,10 +186,10 @@ static Bool sendHextiles##bpp(rfbClientPtr cl, int rx, int ry,                \
 }                                                                             \
                                                                               \
                                                                               \
-static Bool subrectEncode##bpp(CARD##bpp *data, int w, int h, CARD##bpp bg,   \
-                               CARD##bpp fg, Bool mono)                       \
+static Bool subrectEncode##bpp(rfbClientPtr cl, CARD##bpp *data, int w,       \
+                               int h, CARD##bpp bg, CARD##bpp fg, Bool mono)  \
 {                                                                             \
-  CARD##bpp cl;                                                               \
+  CARD##bpp colour;                                                           \
   int x, y;                                                                   \
   int i, j;                                                                   \
   int hx = 0, hy, vx = 0, vy;                                                 \
@@ -200,21 +202,21 @@ static Bool subrectEncode##bpp(CARD##bpp *data, int w, int h, CARD##bpp bg,   \
   int newLen;                                                                 \
   int nSubrectsUblen;                                                         \
                                                                               \
-  nSubrectsUblen = ublen;                                                     \
-  ublen++;                                                                    \
+  nSubrectsUblen = cl->ublen;                                                 \
+  cl->ublen++;                                                                \
                                                                               \
   for (y = 0; y < h; y++) {                                                   \
     line = data + (y * w);                                                    \
     for (x = 0; x < w; x++) {                                                 \
       if (line[x] != bg) {                                                    \
-        cl = line[x];                                                         \
+        colour = line[x];                                                     \
         hy = y - 1;                                                           \
         hyflag = 1;                                                           \
         for (j = y; j < h; j++) {                                             \
           seg = data + (j * w);                                               \
-          if (seg[x] != cl) break;                                            \
+          if (seg[x] != colour) break;                                        \
           i = x;                                                              \
-          while ((seg[i] == cl) && (i < w)) i += 1;                           \
+          while ((seg[i] == colour) && (i < w)) i += 1;                       \
           i -= 1;                                                             \
           if (j == y) vx = hx = i;                                            \
           if (i < vx) vx = i;                                                 \
@@ -245,19 +247,19 @@ static Bool subrectEncode##bpp(CARD##bpp *data, int w, int h, CARD##bpp bg,   \
         }                                                                     \
                                                                               \
         if (mono)                                                             \
-          newLen = ublen - nSubrectsUblen + 2;                                \
+          newLen = cl->ublen - nSubrectsUblen + 2;                            \
         else                                                                  \
-          newLen = ublen - nSubrectsUblen + bpp / 8 + 2;                      \
+          newLen = cl->ublen - nSubrectsUblen + bpp / 8 + 2;                  \
                                                                               \
         if (newLen > (w * h * (bpp / 8)))                                     \
           return FALSE;                                                       \
                                                                               \
         numsubs += 1;                                                         \
                                                                               \
-        if (!mono) PUT_PIXEL##bpp(cl);                                        \
+        if (!mono) PUT_PIXEL##bpp(colour);                                    \
                                                                               \
-        updateBuf[ublen++] = rfbHextilePackXY(thex, they);                    \
-        updateBuf[ublen++] = rfbHextilePackWH(thew, theh);                    \
+        cl->updateBuf[cl->ublen++] = rfbHextilePackXY(thex, they);            \
+        cl->updateBuf[cl->ublen++] = rfbHextilePackWH(thew, theh);            \
                                                                               \
         /*                                                                    \
          * Now mark the subrect as done.                                      \
@@ -269,7 +271,7 @@ static Bool subrectEncode##bpp(CARD##bpp *data, int w, int h, CARD##bpp bg,   \
     }                                                                         \
   }                                                                           \
                                                                               \
-  updateBuf[nSubrectsUblen] = numsubs;                                        \
+  cl->updateBuf[nSubrectsUblen] = numsubs;                                    \
                                                                               \
   return TRUE;                                                                \
 }                                                                             \
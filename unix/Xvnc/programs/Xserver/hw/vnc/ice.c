@@ -0,0 +1,265 @@
+/*
+ * ice.c
+ *
+ * Hash-based interframe comparison
+ */
+
+/*
+ *  This is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This software is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this software; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301,
+ *  USA.
+ */
+
+/* Rather than keeping a copy of the framebuffer for each client, the
+   hash-based interframe comparison engine divides the framebuffer into a grid
+   of blocks and keeps, for each client, a 64-bit hash of each block as of the
+   last time that the client received the whole block.  (A hash of 0 means
+   that the client's copy of the block is unknown.)  The hashes of the current
+   framebuffer contents are cached in a table that is shared by all clients.
+   A cached hash remains valid until rfbFBGeneration changes, so a block is
+   hashed only once per frame, regardless of the number of clients. */
+
+#include <stdlib.h>
+#include <string.h>
+#include "rfb.h"
+
+
+Bool rfbICEHash = FALSE;
+
+static CARD64 *hashCache = NULL;
+static unsigned long *hashCacheGen = NULL;
+static int cacheBlocksX = 0, cacheBlocksY = 0, cacheBlockSize = 0;
+
+
+#define PRIME64_1  0x9E3779B185EBCA87ULL
+#define PRIME64_2  0xC2B2AE3D27D4EB4FULL
+#define PRIME64_3  0x165667B19E3779F9ULL
+#define PRIME64_4  0x85EBCA77C2B2AE63ULL
+
+#define ROTL64(x, r)  (((x) << (r)) | ((x) >> (64 - (r))))
+
+#define ROUND(acc, in) {  \
+  acc += (in) * PRIME64_2;  \
+  acc = ROTL64(acc, 31);  \
+  acc *= PRIME64_1;  \
+}
+
+static inline CARD64 Read64(const char *ptr)
+{
+  CARD64 val;
+
+  memcpy(&val, ptr, 8);
+  return val;
+}
+
+
+/*
+ * Compute a 64-bit hash of a block of pixels.  The hash uses the same round
+ * function as xxHash64, with four independent accumulators, so the compiler
+ * can keep four multiply/rotate chains in flight (or vectorize them) and the
+ * hash runs at close to memory speed.  Each row is processed separately, since
+ * the rows of a block are not contiguous in the framebuffer.
+ */
+
+static CARD64 HashBlock(const char *ptr, int rowBytes, int pitch, int h)
+{
+  CARD64 acc[4] = {
+    PRIME64_1 + PRIME64_2, PRIME64_2, 0, (CARD64)0 - PRIME64_1
+  };
+  CARD64 hash;
+  int i;
+
+  while (h--) {
+    const char *p = ptr, *end = ptr + rowBytes;
+
+    while (end - p >= 32) {
+      ROUND(acc[0], Read64(p));
+      ROUND(acc[1], Read64(p + 8));
+      ROUND(acc[2], Read64(p + 16));
+      ROUND(acc[3], Read64(p + 24));
+      p += 32;
+    }
+    for (i = 0; end - p >= 8; i++, p += 8)
+      ROUND(acc[i], Read64(p));
+    if (p < end) {
+      CARD64 tail = 0;
+
+      memcpy(&tail, p, end - p);
+      ROUND(acc[i & 3], tail);
+    }
+    ptr += pitch;
+  }
+
+  hash = ROTL64(acc[0], 1) + ROTL64(acc[1], 7) + ROTL64(acc[2], 12) +
+         ROTL64(acc[3], 18);
+  for (i = 0; i < 4; i++) {
+    CARD64 val = acc[i];
+
+    ROUND(val, 0);
+    hash ^= val;
+    hash = hash * PRIME64_1 + PRIME64_4;
+  }
+  hash ^= hash >> 33;
+  hash *= PRIME64_2;
+  hash ^= hash >> 29;
+  hash *= PRIME64_3;
+  hash ^= hash >> 32;
+
+  /* 0 is reserved for "unknown" */
+  return hash ? hash : 1;
+}
+
+
+static int BlockSize(void)
+{
+  /* Full-rectangle comparison (rfbICEBlockSize == 0) is not possible with
+     hashes, since the hashes have to be kept on a fixed grid. */
+  return rfbICEBlockSize > 0 ? rfbICEBlockSize : 256;
+}
+
+
+/*
+ * Allocate the client's hash table.  All of the client's blocks start out
+ * unknown, so the first update after this is not culled.
+ */
+
+Bool rfbICEHashInit(rfbClientPtr cl)
+{
+  int bs = BlockSize();
+
+  cl->iceBlocksX = (rfbFB.width + bs - 1) / bs;
+  cl->iceBlocksY = (rfbFB.height + bs - 1) / bs;
+  cl->iceHashes = (CARD64 *)calloc(cl->iceBlocksX * cl->iceBlocksY,
+                                   sizeof(CARD64));
+  if (!cl->iceHashes) return FALSE;
+
+  /* The framebuffer may have changed while no clients were connected. */
+  rfbFBGeneration++;
+  return TRUE;
+}
+
+
+void rfbICEHashFree(rfbClientPtr cl)
+{
+  free(cl->iceHashes);
+  cl->iceHashes = NULL;
+  cl->iceBlocksX = cl->iceBlocksY = 0;
+}
+
+
+/*
+ * Return the hash of the current contents of the given block, computing it
+ * only if the cached value is out of date.
+ */
+
+static CARD64 GetBlockHash(int bx, int by, BoxPtr block)
+{
+  int bs = BlockSize(), i;
+  int bxs = (rfbFB.width + bs - 1) / bs, bys = (rfbFB.height + bs - 1) / bs;
+  int pitch = rfbFB.paddedWidthInBytes;
+  int ps = rfbServerFormat.bitsPerPixel / 8;
+
+  if (bxs != cacheBlocksX || bys != cacheBlocksY || bs != cacheBlockSize) {
+    free(hashCache);
+    free(hashCacheGen);
+    hashCache = (CARD64 *)rfbAlloc(bxs * bys * sizeof(CARD64));
+    hashCacheGen = (unsigned long *)rfbAlloc0(bxs * bys *
+                                              sizeof(unsigned long));
+    cacheBlocksX = bxs;  cacheBlocksY = bys;  cacheBlockSize = bs;
+    for (i = 0; i < bxs * bys; i++)
+      hashCacheGen[i] = rfbFBGeneration - 1;
+  }
+
+  i = by * bxs + bx;
+  if (hashCacheGen[i] != rfbFBGeneration) {
+    hashCache[i] =
+      HashBlock(&rfbFB.pfbMemory[block->y1 * pitch + block->x1 * ps],
+                (block->x2 - block->x1) * ps, pitch, block->y2 - block->y1);
+    hashCacheGen[i] = rfbFBGeneration;
+  }
+  return hashCache[i];
+}
+
+
+/*
+ * Compare the blocks that intersect reg against the client's hash table, and
+ * add the parts of reg that have changed to changedRegion.  The client's hash
+ * for a block is updated only if the whole block is in reg and will thus be
+ * sent to the client.  Returns the number of pixels that were culled.
+ */
+
+unsigned long rfbICEHashCompare(rfbClientPtr cl, RegionPtr reg,
+                                RegionPtr changedRegion)
+{
+  int bs = BlockSize(), bx, by;
+  BoxPtr extents = REGION_EXTENTS(pScreen, reg);
+  unsigned long identical = 0;
+
+  if (!REGION_NOTEMPTY(pScreen, reg)) return 0;
+
+  for (by = extents->y1 / bs; by <= (extents->y2 - 1) / bs; by++) {
+    for (bx = extents->x1 / bs; bx <= (extents->x2 - 1) / bs; bx++) {
+      BoxRec block;
+      RegionRec tmpRegion;
+      CARD64 hash, *clHash = &cl->iceHashes[by * cl->iceBlocksX + bx];
+      int overlap;
+
+      block.x1 = bx * bs;
+      block.y1 = by * bs;
+      block.x2 = min(block.x1 + bs, rfbFB.width);
+      block.y2 = min(block.y1 + bs, rfbFB.height);
+
+      overlap = RECT_IN_REGION(pScreen, reg, &block);
+      if (overlap == rgnOUT) continue;
+
+      REGION_INIT(pScreen, &tmpRegion, &block, 1);
+      if (overlap == rgnPART)
+        REGION_INTERSECT(pScreen, &tmpRegion, &tmpRegion, reg);
+
+      hash = GetBlockHash(bx, by, &block);
+      if (*clHash != 0 && *clHash == hash) {
+        BoxPtr rects = REGION_RECTS(&tmpRegion);
+        int i;
+
+        for (i = 0; i < REGION_NUM_RECTS(&tmpRegion); i++)
+          identical += (rects[i].x2 - rects[i].x1) *
+                       (rects[i].y2 - rects[i].y1);
+      } else {
+        REGION_UNION(pScreen, changedRegion, changedRegion, &tmpRegion);
+        *clHash = (overlap == rgnIN) ? hash : 0;
+      }
+      REGION_UNINIT(pScreen, &tmpRegion);
+    }
+  }
+
+  return identical;
+}
+
+
+/*
+ * Mark the client's copies of the blocks that intersect the given rectangle
+ * as unknown.  This is used when the client's framebuffer is changed by means
+ * other than sending it pixels (such as CopyRect.)
+ */
+
+void rfbICEHashInvalidate(rfbClientPtr cl, int x, int y, int w, int h)
+{
+  int bs = BlockSize(), bx, by;
+
+  if (w <= 0 || h <= 0) return;
+
+  for (by = y / bs; by <= (y + h - 1) / bs && by < cl->iceBlocksY; by++)
+    for (bx = x / bs; bx <= (x + w - 1) / bs && bx < cl->iceBlocksX; bx++)
+      cl->iceHashes[by * cl->iceBlocksX + bx] = 0;
+}
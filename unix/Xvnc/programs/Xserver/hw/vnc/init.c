@@ -81,6 +81,7 @@ from the X Consortium.
 #include "micmap.h"
 #include "eventstr.h"
 #include "rfb.h"
+#include "simd.h"
 #include <time.h>
 #include "tvnc_version.h"
 #include "input-xkb.h"
@@ -210,9 +211,23 @@ int ddxProcessArgument(int argc, char *argv[], int i)
     return 2;
   }
 
+  if (strcasecmp(argv[i], "-capturekeyframe") == 0) {  /* -capturekeyframe s */
+    if (i + 1 >= argc) UseMsg();
+    rfbCaptureKeyframeInterval = atoi(argv[i + 1]);
+    if (rfbCaptureKeyframeInterval < 0) UseMsg();
+    return 2;
+  }
+
   if (strcasecmp(argv[i], "-deferupdate") == 0) {  /* -deferupdate ms */
     if (i + 1 >= argc) UseMsg();
-    rfbDeferUpdateTime = atoi(argv[i + 1]);
+    if (!strcasecmp(argv[i + 1], "auto")) {
+      rfbAdaptiveDefer = TRUE;
+      rfbDeferUpdateTime = DEFAULT_DEFER_UPDATE_TIME;
+    } else {
+      rfbAdaptiveDefer = FALSE;
+      rfbDeferUpdateTime = atoi(argv[i + 1]);
+      if (rfbDeferUpdateTime < 0) UseMsg();
+    }
     return 2;
   }
 
@@ -328,6 +343,26 @@ int ddxProcessArgument(int argc, char *argv[], int i)
     return 2;
   }
 
+  if (strcasecmp(argv[i], "-maxfps") == 0) {  /* -maxfps fps */
+    if (i + 1 >= argc) UseMsg();
+    rfbMaxFPS = atoi(argv[i + 1]);
+    if (rfbMaxFPS < 1) UseMsg();
+    return 2;
+  }
+
+  if (strcasecmp(argv[i], "-maxqueue") == 0) {  /* -maxqueue bytes */
+    if (i + 1 >= argc) UseMsg();
+    rfbMaxClientQueue = atoi(argv[i + 1]);
+    if (rfbMaxClientQueue < 1) UseMsg();
+    return 2;
+  }
+
+  if (strcasecmp(argv[i], "-metricssocket") == 0) {  /* -metricssocket path */
+    if (i + 1 >= argc) UseMsg();
+    rfbMetricsSocket = strdup(argv[i + 1]);
+    return 2;
+  }
+
   if (strcasecmp(argv[i], "-nevershared") == 0) {
     rfbNeverShared = TRUE;
     return 1;
@@ -526,6 +561,13 @@ int ddxProcessArgument(int argc, char *argv[], int i)
 
   /***** TurboVNC encoding options *****/
 
+  if (strcasecmp(argv[i], "-adaptqual") == 0) {  /* -adaptqual fps */
+    if (i + 1 >= argc) UseMsg();
+    rfbAQTargetFPS = atoi(argv[i + 1]);
+    if (rfbAQTargetFPS < 1) UseMsg();
+    return 2;
+  }
+
   if (strcasecmp(argv[i], "-alr") == 0) {
     if (i + 1 >= argc) UseMsg();
     rfbAutoLosslessRefresh = atof(argv[i + 1]);
@@ -540,6 +582,25 @@ int ddxProcessArgument(int argc, char *argv[], int i)
     return 2;
   }
 
+  if (strcasecmp(argv[i], "-alrsteps") == 0) {
+    char *str, *ptr, *tok;
+    int last = 0;
+
+    if (i + 1 >= argc) UseMsg();
+    if (!(str = strdup(argv[i + 1]))) FatalError("Out of memory");
+    rfbALRNumSteps = 0;
+    ptr = str;
+    while ((tok = strsep(&ptr, ",")) != NULL) {
+      int quality = atoi(tok);
+      if (rfbALRNumSteps >= MAX_ALR_STEPS || quality <= last ||
+          quality > 100)
+        UseMsg();
+      rfbALRSteps[rfbALRNumSteps++] = last = quality;
+    }
+    free(str);
+    return 2;
+  }
+
   if (strcasecmp(argv[i], "-alrsamp") == 0) {
     if (i + 1 >= argc) UseMsg();
     switch (toupper(argv[i + 1][0])) {
@@ -557,6 +618,11 @@ int ddxProcessArgument(int argc, char *argv[], int i)
     return 2;
   }
 
+  if (strcmp(argv[i], "-bcastviewonly") == 0) {
+    rfbBroadcast = TRUE;
+    return 1;
+  }
+
   if (strcasecmp(argv[i], "-economictranslate") == 0) {
     rfbEconomicTranslate = TRUE;
     return 1;
@@ -589,6 +655,40 @@ int ddxProcessArgument(int argc, char *argv[], int i)
   }
 #endif
 
+  if (strcasecmp(argv[i], "-recorddamage") == 0) {
+    if (i + 1 >= argc) UseMsg();
+    rfbRecordDamageFile = strdup(argv[i + 1]);
+    return 2;
+  }
+
+  if (strcasecmp(argv[i], "-replaydamage") == 0) {
+    if (i + 1 >= argc) UseMsg();
+    rfbReplayDamageFile = strdup(argv[i + 1]);
+    return 2;
+  }
+
+  if (strcasecmp(argv[i], "-replayspeed") == 0) {
+    if (i + 1 >= argc) UseMsg();
+    if (!strcasecmp(argv[i + 1], "max"))
+      rfbReplaySpeed = 0.0;
+    else {
+      rfbReplaySpeed = atof(argv[i + 1]);
+      if (rfbReplaySpeed <= 0.0) UseMsg();
+    }
+    return 2;
+  }
+
+  if (strcasecmp(argv[i], "-scrolldetect") == 0) {
+    rfbScrollDetect = TRUE;
+    return 1;
+  }
+
+  if (strcasecmp(argv[i], "-trace") == 0) {  /* -trace file */
+    if (i + 1 >= argc) UseMsg();
+    rfbTraceFile = strdup(argv[i + 1]);
+    return 2;
+  }
+
   /***** TurboVNC security and authentication options *****/
 
   if (strcasecmp(argv[i], "-maxauthfails") == 0) {
@@ -708,6 +808,7 @@ void InitOutput(ScreenInfo *screenInfo, int argc, char **argv)
 
   rfbLog("Desktop name '%s' (%s:%s)\n", desktopName, rfbThisHost, display);
   rfbLog("Protocol versions supported: 3.3, 3.7, 3.8, 3.7t, 3.8t\n");
+  rfbLog("SIMD extensions: %s\n", rfbSIMDInit());
 
   VNC_LAST_CLIENT_ID =
     MakeAtom("VNC_LAST_CLIENT_ID", strlen("VNC_LAST_CLIENT_ID"), TRUE);
@@ -727,6 +828,8 @@ void InitOutput(ScreenInfo *screenInfo, int argc, char **argv)
   rfbInitSockets();
   if (inetdSock == -1)
     httpInitSockets();
+  rfbInitMetrics();
+  rfbTraceInit();
 
   /* Initialize pixmap formats */
 
@@ -768,9 +871,6 @@ static Bool rfbScreenInit(ScreenPtr pScreen, int argc, char **argv)
   int ret;
   char *pbits;
   VisualPtr vis;
-#ifdef RENDER
-  PictureScreenPtr ps;
-#endif
   BOOL bigEndian = !(*(char *)&rfbEndianTest);
 
   if (monitorResolution != 0) {
@@ -909,17 +1009,13 @@ static Bool rfbScreenInit(ScreenPtr pScreen, int argc, char **argv)
   prfb->cursorIsDrawn = FALSE;
   prfb->dontSendFramebufferUpdate = FALSE;
 
+  prfb->pDamage = NULL;
+
   prfb->CloseScreen = pScreen->CloseScreen;
+  prfb->CreateScreenResources = pScreen->CreateScreenResources;
+  prfb->BlockHandler = pScreen->BlockHandler;
   prfb->CreateGC = pScreen->CreateGC;
   prfb->CopyWindow = pScreen->CopyWindow;
-  prfb->ClearToBackground = pScreen->ClearToBackground;
-#ifdef RENDER
-  ps = GetPictureScreenIfSet(pScreen);
-  if (ps) {
-    prfb->Composite = ps->Composite;
-    prfb->Glyphs = ps->Glyphs;
-  }
-#endif
   prfb->InstallColormap = pScreen->InstallColormap;
   prfb->UninstallColormap = pScreen->UninstallColormap;
   prfb->ListInstalledColormaps = pScreen->ListInstalledColormaps;
@@ -927,15 +1023,10 @@ static Bool rfbScreenInit(ScreenPtr pScreen, int argc, char **argv)
   prfb->SaveScreen = pScreen->SaveScreen;
 
   pScreen->CloseScreen = rfbCloseScreen;
+  pScreen->CreateScreenResources = rfbCreateScreenResources;
+  pScreen->BlockHandler = rfbBlockHandler;
   pScreen->CreateGC = rfbCreateGC;
   pScreen->CopyWindow = rfbCopyWindow;
-  pScreen->ClearToBackground = rfbClearToBackground;
-#ifdef RENDER
-  if (ps) {
-    ps->Composite = rfbComposite;
-    ps->Glyphs = rfbGlyphs;
-  }
-#endif
   pScreen->InstallColormap = rfbInstallColormap;
   pScreen->UninstallColormap = rfbUninstallColormap;
   pScreen->ListInstalledColormaps = rfbListInstalledColormaps;
@@ -1532,6 +1623,8 @@ void ddxGiveUp(enum ExitCode error)
     rfbPAMEnd(cl);
 #endif
   ShutdownTightThreads();
+  rfbShutdownDamageTrace();
+  rfbShutdownMetrics();
   free(rfbFB.pfbMemory);
   if (initOutputCalled) {
     char unixSocketName[32];
@@ -1602,8 +1695,13 @@ void ddxUseMsg(void)
   ErrorF("-alwaysshared          always treat new connections as shared\n");
   ErrorF("-capture file          capture the data sent to the first connected viewer to\n");
   ErrorF("                       the specified file\n");
-  ErrorF("-deferupdate time      time in ms to defer updates [default: %d]\n",
+  ErrorF("-capturekeyframe s     interval in seconds between lossless keyframes in the\n");
+  ErrorF("                       capture file, or 0 to disable keyframes [default: %d]\n",
+         DEFAULT_CAPTURE_KEYFRAME_INTERVAL);
+  ErrorF("-deferupdate time      time in ms to defer updates [default: %d], or \"auto\"\n",
          DEFAULT_DEFER_UPDATE_TIME);
+  ErrorF("                       to choose the time for each viewer based on its damage\n");
+  ErrorF("                       rate, encoding time, and network latency\n");
   ErrorF("-desktop name          VNC desktop name [default: %s]\n",
          DEFAULT_DESKTOP_NAME);
   ErrorF("-disconnect            disconnect existing viewers when a new non-shared\n"
@@ -1622,6 +1720,12 @@ void ddxUseMsg(void)
          MAX_MAX_CONNECTIONS);
   ErrorF("                       viewer connections [default: %d]\n",
          DEFAULT_MAX_CONNECTIONS);
+  ErrorF("-maxfps N              send no more than N updates/second to each viewer\n");
+  ErrorF("-maxqueue B            queue no more than B bytes of output for a viewer whose\n");
+  ErrorF("                       connection can't keep up [default: %d]\n",
+         DEFAULT_MAX_CLIENT_QUEUE);
+  ErrorF("-metricssocket path    serve per-viewer metrics in the Prometheus text format\n");
+  ErrorF("                       on the specified Unix domain socket\n");
   ErrorF("-nevershared           never treat new connections as shared\n");
   ErrorF("-noclipboardrecv       disable client->server clipboard synchronization\n");
   ErrorF("-noclipboardsend       disable server->client clipboard synchronization\n");
@@ -1674,6 +1778,10 @@ void ddxUseMsg(void)
 
   ErrorF("\nTurboVNC encoding options\n");
   ErrorF("=========================\n");
+  ErrorF("-adaptqual FPS         lower JPEG quality for Tight viewers that support the\n");
+  ErrorF("                       fence extension whenever the measured bandwidth cannot\n");
+  ErrorF("                       sustain FPS updates/second, and raise it again (up to\n");
+  ErrorF("                       the level the viewer requested) when it can\n");
   ErrorF("-alr S                 enable automatic lossless refresh and set timer to S\n");
   ErrorF("                       seconds (S is floating point)\n");
   ErrorF("-alrqual Q             send automatic lossless refresh as a JPEG image with\n");
@@ -1681,6 +1789,12 @@ void ddxUseMsg(void)
   ErrorF("                       image\n");
   ErrorF("-alrsamp S             specify chroma subsampling factor for automatic lossless\n");
   ErrorF("                       refresh JPEG images (S = 1x, 2x, 4x, or gray)\n");
+  ErrorF("-alrsteps Q1[,Q2...]   refresh lossy areas with JPEG quality Q1, then Q2, etc.\n");
+  ErrorF("                       (up to %d steps), before the final automatic lossless\n",
+         MAX_ALR_STEPS);
+  ErrorF("                       refresh\n");
+  ErrorF("-bcastviewonly         encode updates only once for each group of view-only\n");
+  ErrorF("                       viewers that use the same encoding settings\n");
   ErrorF("-economictranslate     use less memory-hungry pixel format translation if\n");
   ErrorF("                       depth=16\n");
   ErrorF("-interframe            always use interframe comparison\n");
@@ -1692,6 +1806,19 @@ void ddxUseMsg(void)
   ErrorF("                       multithreaded Tight encoding [default: 1 per CPU core,\n");
   ErrorF("                       max. 4]\n");
 #endif
+  ErrorF("-recorddamage file     record the drawing done to the framebuffer to the\n");
+  ErrorF("                       specified damage trace file\n");
+  ErrorF("-replaydamage file     replay the specified damage trace file once a viewer\n");
+  ErrorF("                       connects\n");
+  ErrorF("-replayspeed S         replay the damage trace S times as fast as it was\n");
+  ErrorF("                       recorded, or \"max\" to replay each part as soon as\n");
+  ErrorF("                       the viewers have received the previous part\n");
+  ErrorF("                       [default: 1.0]\n");
+  ErrorF("-scrolldetect          detect scrolled content that was redrawn rather than\n");
+  ErrorF("                       copied, and send it using CopyRect encoding\n");
+  ErrorF("-trace file            record timing spans for the update pipeline, and write\n");
+  ErrorF("                       the most recent spans to the specified file in the\n");
+  ErrorF("                       Chrome trace format when Xvnc receives SIGUSR2\n");
 
   ErrorF("\nTurboVNC security and authentication options\n");
   ErrorF("============================================\n");
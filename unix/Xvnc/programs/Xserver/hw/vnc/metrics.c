@@ -0,0 +1,431 @@
+/*
+ * metrics.c
+ *
+ * Per-client metrics in the Prometheus text format
+ */
+
+/*
+ *  This is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This software is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this software; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301,
+ *  USA.
+ */
+
+/* If -metricssocket is specified, then the server listens on a Unix domain
+   socket (which, unlike the HTTP server, is only reachable from the local
+   machine), and each connection to it receives a snapshot of the metrics for
+   all connected viewers, as an HTTP/1.0 response containing a Prometheus text
+   exposition.  The socket can be read with, for instance,
+
+     curl --unix-socket <path> http://localhost/metrics
+
+   The update latency is measured from the time at which the framebuffer was
+   first modified after the previous update to the time at which the update
+   was written to the socket, so it includes the time spent waiting for the
+   deferred update timer, for the viewer to request an update, and for the
+   congestion window to open. */
+
+#include <errno.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include "rfb.h"
+
+
+char *rfbMetricsSocket = NULL;
+
+/* Upper bounds (in seconds) of the histogram buckets.  The last bucket
+   (+Inf) is implied. */
+static const double bucketBounds[METRICS_BUCKETS] = {
+  0.001, 0.002, 0.005, 0.01, 0.02, 0.05, 0.1, 0.2, 0.5, 1., 2., 5.
+};
+
+static int metricsListenSock = -1;
+
+/* Only one scrape is served at a time.  If another connection arrives before
+   the previous response has been written, then the previous connection is
+   dropped. */
+static int metricsSock = -1;
+static char *page = NULL;
+static size_t pageLen = 0, pageSize = 0, pageSent = 0;
+
+static void metricsSockNotify(int fd, int ready, void *data);
+
+
+/*
+ * rfbInitMetrics() sets up the Unix domain socket to listen for metrics
+ * requests.
+ */
+
+void rfbInitMetrics(void)
+{
+  struct sockaddr_un addr;
+  mode_t oldUmask;
+
+  if (!rfbMetricsSocket || metricsListenSock >= 0)
+    return;
+
+  if (strlen(rfbMetricsSocket) >= sizeof(addr.sun_path)) {
+    rfbLog("Metrics socket path %s is too long\n", rfbMetricsSocket);
+    exit(1);
+  }
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, rfbMetricsSocket);
+
+  if ((metricsListenSock = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
+    rfbLogPerror("rfbInitMetrics: socket");
+    exit(1);
+  }
+  unlink(rfbMetricsSocket);
+
+  /* The metrics reveal the addresses of the connected viewers, so only the
+     session owner can connect. */
+  oldUmask = umask(0077);
+  if (bind(metricsListenSock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+    umask(oldUmask);
+    rfbLogPerror("rfbInitMetrics: bind");
+    exit(1);
+  }
+  umask(oldUmask);
+
+  if (listen(metricsListenSock, 5) < 0) {
+    rfbLogPerror("rfbInitMetrics: listen");
+    exit(1);
+  }
+
+  rfbLog("Listening for metrics requests on %s\n", rfbMetricsSocket);
+  SetNotifyFd(metricsListenSock, metricsSockNotify, X_NOTIFY_READ, NULL);
+}
+
+
+void rfbShutdownMetrics(void)
+{
+  if (metricsListenSock < 0)
+    return;
+
+  close(metricsListenSock);
+  metricsListenSock = -1;
+  unlink(rfbMetricsSocket);
+}
+
+
+/*
+ * rfbMetricsNoteDamage() is called whenever the framebuffer is modified, in
+ * order to record the start of the update latency for each client.
+ */
+
+void rfbMetricsNoteDamage(void)
+{
+  rfbClientPtr cl;
+  double now = 0.;
+
+  for (cl = rfbClientHead; cl; cl = cl->next) {
+    if (cl->damageStart == 0.) {
+      if (now == 0.) now = gettime();
+      cl->damageStart = now;
+    }
+  }
+}
+
+
+static void HistogramAdd(rfbHistogram *hist, double value)
+{
+  int i;
+
+  for (i = 0; i < METRICS_BUCKETS; i++) {
+    if (value <= bucketBounds[i])
+      break;
+  }
+  hist->buckets[i]++;
+  hist->count++;
+  hist->sum += value;
+}
+
+
+/*
+ * rfbMetricsUpdateSent() is called once a framebuffer update has been
+ * written to the client's socket (or queued.)
+ */
+
+void rfbMetricsUpdateSent(rfbClientPtr cl)
+{
+  double now = gettime();
+
+  HistogramAdd(&cl->encodeHist, now - cl->tUpdateStart - cl->tUpdateWait);
+  if (cl->damageStart != 0.) {
+    HistogramAdd(&cl->latencyHist, now - cl->damageStart);
+    cl->damageStart = 0.;
+  }
+}
+
+
+/*
+ * Page generation
+ */
+
+static void PagePrintf(const char *format, ...)
+{
+  va_list args;
+  int len;
+
+  for (;;) {
+    va_start(args, format);
+    len = vsnprintf(&page[pageLen], pageSize - pageLen, format, args);
+    va_end(args);
+    if (len < 0)
+      return;
+    if (pageLen + len < pageSize)
+      break;
+    pageSize = max(pageSize * 2, pageLen + len + 1);
+    page = (char *)rfbRealloc(page, pageSize);
+  }
+  pageLen += len;
+}
+
+
+static void PrintHeader(const char *name, const char *type, const char *help)
+{
+  PagePrintf("# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+
+/* The host is a numeric address, so it never needs escaping. */
+#define LABELS(cl)  "client=\"%s\",sock=\"%d\""
+#define LABEL_ARGS(cl)  (cl)->host, (cl)->sock
+
+static void PrintHistogram(rfbClientPtr cl, const char *name,
+                           rfbHistogram *hist)
+{
+  unsigned long long cumulative = 0;
+  int i;
+
+  for (i = 0; i < METRICS_BUCKETS; i++) {
+    cumulative += hist->buckets[i];
+    PagePrintf("%s_bucket{" LABELS(cl) ",le=\"%g\"} %llu\n", name,
+               LABEL_ARGS(cl), bucketBounds[i], cumulative);
+  }
+  PagePrintf("%s_bucket{" LABELS(cl) ",le=\"+Inf\"} %llu\n", name,
+             LABEL_ARGS(cl), hist->count);
+  PagePrintf("%s_sum{" LABELS(cl) "} %f\n", name, LABEL_ARGS(cl), hist->sum);
+  PagePrintf("%s_count{" LABELS(cl) "} %llu\n", name, LABEL_ARGS(cl),
+             hist->count);
+}
+
+
+static void BuildPage(void)
+{
+  rfbClientPtr cl;
+  int nClients = 0, i;
+
+  pageLen = 0;
+  if (!page) {
+    pageSize = 65536;
+    page = (char *)rfbAlloc(pageSize);
+  }
+
+  /* The end of the body is marked by closing the connection. */
+  PagePrintf("HTTP/1.0 200 OK\r\n"
+             "Content-Type: text/plain; version=0.0.4\r\n\r\n");
+
+  for (cl = rfbClientHead; cl; cl = cl->next)
+    if (cl->state == RFB_NORMAL) nClients++;
+
+  PrintHeader("tvnc_clients", "gauge", "Number of connected viewers");
+  PagePrintf("tvnc_clients %d\n", nClients);
+
+  PrintHeader("tvnc_client_updates_total", "counter",
+              "Framebuffer updates sent");
+  for (cl = rfbClientHead; cl; cl = cl->next) {
+    if (cl->state != RFB_NORMAL) continue;
+    PagePrintf("tvnc_client_updates_total{" LABELS(cl) "} %d\n",
+               LABEL_ARGS(cl), cl->rfbFramebufferUpdateMessagesSent);
+  }
+
+  PrintHeader("tvnc_client_bytes_total", "counter",
+              "Bytes of rectangle data sent, by encoding");
+  for (cl = rfbClientHead; cl; cl = cl->next) {
+    if (cl->state != RFB_NORMAL) continue;
+    for (i = 0; i < MAX_ENCODINGS; i++) {
+      if (cl->rfbRectanglesSent[i] == 0) continue;
+      PagePrintf("tvnc_client_bytes_total{" LABELS(cl) ",encoding=\"%s\"} "
+                 "%lld\n", LABEL_ARGS(cl), rfbEncodingName(i),
+                 cl->rfbBytesSent[i]);
+    }
+  }
+
+  PrintHeader("tvnc_client_rectangles_total", "counter",
+              "Rectangles sent, by encoding");
+  for (cl = rfbClientHead; cl; cl = cl->next) {
+    if (cl->state != RFB_NORMAL) continue;
+    for (i = 0; i < MAX_ENCODINGS; i++) {
+      if (cl->rfbRectanglesSent[i] == 0) continue;
+      PagePrintf("tvnc_client_rectangles_total{" LABELS(cl) ",encoding="
+                 "\"%s\"} %d\n", LABEL_ARGS(cl), rfbEncodingName(i),
+                 cl->rfbRectanglesSent[i]);
+    }
+  }
+
+  PrintHeader("tvnc_client_raw_bytes_total", "counter",
+              "Size of the rectangles sent, before encoding");
+  for (cl = rfbClientHead; cl; cl = cl->next) {
+    if (cl->state != RFB_NORMAL) continue;
+    PagePrintf("tvnc_client_raw_bytes_total{" LABELS(cl) "} %lld\n",
+               LABEL_ARGS(cl), cl->rfbRawBytesEquivalent);
+  }
+
+  PrintHeader("tvnc_client_ice_compared_pixels_total", "counter",
+              "Pixels checked by interframe comparison");
+  for (cl = rfbClientHead; cl; cl = cl->next) {
+    if (cl->state != RFB_NORMAL || !ICE_ENABLED(cl)) continue;
+    PagePrintf("tvnc_client_ice_compared_pixels_total{" LABELS(cl) "} "
+               "%lld\n", LABEL_ARGS(cl), cl->rfbICEPixelsCompared);
+  }
+
+  PrintHeader("tvnc_client_ice_identical_pixels_total", "counter",
+              "Pixels found by interframe comparison to be unchanged");
+  for (cl = rfbClientHead; cl; cl = cl->next) {
+    if (cl->state != RFB_NORMAL || !ICE_ENABLED(cl)) continue;
+    PagePrintf("tvnc_client_ice_identical_pixels_total{" LABELS(cl) "} "
+               "%lld\n", LABEL_ARGS(cl), cl->rfbICEPixelsIdentical);
+  }
+
+  PrintHeader("tvnc_client_ice_hit_ratio", "gauge",
+              "Fraction of the compared pixels that were unchanged");
+  for (cl = rfbClientHead; cl; cl = cl->next) {
+    if (cl->state != RFB_NORMAL || !ICE_ENABLED(cl)) continue;
+    PagePrintf("tvnc_client_ice_hit_ratio{" LABELS(cl) "} %f\n",
+               LABEL_ARGS(cl), cl->rfbICEPixelsCompared ?
+               (double)cl->rfbICEPixelsIdentical /
+               (double)cl->rfbICEPixelsCompared : 0.);
+  }
+
+  PrintHeader("tvnc_client_congestion_window_bytes", "gauge",
+              "Congestion window");
+  for (cl = rfbClientHead; cl; cl = cl->next) {
+    if (cl->state != RFB_NORMAL || !cl->enableFence) continue;
+    PagePrintf("tvnc_client_congestion_window_bytes{" LABELS(cl) "} %u\n",
+               LABEL_ARGS(cl), cl->congWindow);
+  }
+
+  PrintHeader("tvnc_client_base_rtt_seconds", "gauge",
+              "Round-trip time of an empty network path");
+  for (cl = rfbClientHead; cl; cl = cl->next) {
+    if (cl->state != RFB_NORMAL || !cl->enableFence) continue;
+    PagePrintf("tvnc_client_base_rtt_seconds{" LABELS(cl) "} %f\n",
+               LABEL_ARGS(cl), (double)cl->baseRTT / 1000.);
+  }
+
+  PrintHeader("tvnc_client_min_rtt_seconds", "gauge",
+              "Minimum round-trip time during the last measurement round");
+  for (cl = rfbClientHead; cl; cl = cl->next) {
+    if (cl->state != RFB_NORMAL || !cl->enableFence) continue;
+    PagePrintf("tvnc_client_min_rtt_seconds{" LABELS(cl) "} %f\n",
+               LABEL_ARGS(cl), (double)cl->minRTT / 1000.);
+  }
+
+  PrintHeader("tvnc_client_output_queue_bytes", "gauge",
+              "Update data waiting to be written to the socket");
+  for (cl = rfbClientHead; cl; cl = cl->next) {
+    if (cl->state != RFB_NORMAL) continue;
+    PagePrintf("tvnc_client_output_queue_bytes{" LABELS(cl) "} %d\n",
+               LABEL_ARGS(cl), cl->outQueued);
+  }
+
+  PrintHeader("tvnc_client_encode_seconds", "histogram",
+              "Time from the start of an update to the end of its encoding");
+  for (cl = rfbClientHead; cl; cl = cl->next) {
+    if (cl->state != RFB_NORMAL) continue;
+    PrintHistogram(cl, "tvnc_client_encode_seconds", &cl->encodeHist);
+  }
+
+  PrintHeader("tvnc_client_update_latency_seconds", "histogram",
+              "Time from framebuffer damage to the update that sends it");
+  for (cl = rfbClientHead; cl; cl = cl->next) {
+    if (cl->state != RFB_NORMAL) continue;
+    PrintHistogram(cl, "tvnc_client_update_latency_seconds",
+                   &cl->latencyHist);
+  }
+}
+
+
+static void CloseMetricsSock(void)
+{
+  RemoveNotifyFd(metricsSock);
+  close(metricsSock);
+  metricsSock = -1;
+}
+
+
+static void metricsSockNotify(int fd, int ready, void *data)
+{
+  if (fd == metricsListenSock) {
+    int flags;
+
+    if (metricsSock >= 0)
+      CloseMetricsSock();
+
+    if ((metricsSock = accept(metricsListenSock, NULL, NULL)) < 0) {
+      rfbLogPerror("metricsSockNotify: accept");
+      return;
+    }
+
+    flags = fcntl(metricsSock, F_GETFL);
+    if (flags == -1 ||
+        fcntl(metricsSock, F_SETFL, flags | O_NONBLOCK) == -1) {
+      rfbLogPerror("metricsSockNotify: fcntl");
+      close(metricsSock);
+      metricsSock = -1;
+      return;
+    }
+
+    /* Wait for the request, so the client isn't still writing it when the
+       connection is closed. */
+    pageLen = pageSent = 0;
+    SetNotifyFd(metricsSock, metricsSockNotify, X_NOTIFY_READ, NULL);
+    return;
+  }
+
+  if (fd != metricsSock)
+    return;
+
+  if (pageLen == 0) {
+    char buf[256];
+
+    /* The request itself is ignored. */
+    while (read(metricsSock, buf, sizeof(buf)) > 0);
+    BuildPage();
+    SetNotifyFd(metricsSock, metricsSockNotify, X_NOTIFY_WRITE, NULL);
+  }
+
+  while (pageSent < pageLen) {
+    ssize_t n = write(metricsSock, &page[pageSent], pageLen - pageSent);
+
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      if (errno == EAGAIN || errno == EWOULDBLOCK) return;
+      CloseMetricsSock();
+      return;
+    }
+    pageSent += n;
+  }
+
+  CloseMetricsSock();
+}
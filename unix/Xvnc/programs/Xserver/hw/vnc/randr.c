@@ -489,9 +489,14 @@ static int vncScreenSetSize(ScreenPtr pScreen, CARD16 width, CARD16 height,
 
   rfbFB.blockUpdates = FALSE;
 
+  /* Every client is about to receive the whole framebuffer, so any damage
+     from before the resize is redundant. */
+  if (rfbFB.pDamage)
+    DamageEmpty(rfbFB.pDamage);
+
   for (cl = rfbClientHead; cl; cl = nextCl) {
     RegionRec tmpRegion;  BoxRec box;
-    Bool reEnableInterframe = (cl->compareFB != NULL);
+    Bool reEnableInterframe = ICE_ENABLED(cl);
     nextCl = cl->next;
     InterframeOff(cl);
     if (reEnableInterframe) {
@@ -501,6 +506,14 @@ static int vncScreenSetSize(ScreenPtr pScreen, CARD16 width, CARD16 height,
         continue;
       }
     }
+    if (cl->scrollFB) {
+      rfbScrollFree(cl);
+      if (!rfbScrollInit(cl)) {
+        rfbCloseClient(cl);
+        ret = rfbEDSResultInvalid;
+        continue;
+      }
+    }
     cl->deferredUpdateScheduled = FALSE;
     /* Reset all of the regions, so the next FBU will behave as if it
        was the first. */
@@ -517,6 +530,8 @@ static int vncScreenSetSize(ScreenPtr pScreen, CARD16 width, CARD16 height,
       REGION_EMPTY(pScreen, &cl->alrRegion);
       REGION_EMPTY(pScreen, &cl->alrEligibleRegion);
       REGION_EMPTY(pScreen, &cl->lossyRegion);
+      REGION_EMPTY(pScreen, &cl->alrPending);
+      cl->alrStep = 0;
       cl->firstUpdate = TRUE;
     }
     if (cl->continuousUpdates) {
@@ -50,6 +50,7 @@
 #include <sys/time.h>
 #ifdef RENDER
 #include "picturestr.h"
+#include "damage.h"
 #endif
 #ifdef RANDR
 #include "randrstr.h"
@@ -87,6 +88,14 @@
    the CPU count */
 #define MAX_ENCODING_THREADS 8
 
+/* Maximum number of intermediate JPEG quality steps for automatic lossless
+   refresh */
+#define MAX_ALR_STEPS 4
+
+/* Number of rounds over which the bottleneck bandwidth of a client's
+   connection is estimated (see flowcontrol.c) */
+#define BW_FILTER_ROUNDS 10
+
 /* Maximum number of client connections.  The default of 100 should be more
    than enough for most use cases.  The ceiling is set to 500 to give us plenty
    of room to avoid exceeding the Xvnc process's allotment of file descriptors,
@@ -96,6 +105,15 @@
 
 #define DEFAULT_MAX_CLIENT_WAIT 20000
 
+/* Maximum amount of output (in bytes) that will be queued for a viewer whose
+   network connection can't keep up.  Beyond this, writes to that viewer block
+   until the queue drains. */
+#define DEFAULT_MAX_CLIENT_QUEUE (32 * 1024 * 1024)
+
+/* Interval (in seconds) between keyframes in a session capture.  0 disables
+   keyframes. */
+#define DEFAULT_CAPTURE_KEYFRAME_INTERVAL 30
+
 
 /*
  * Per-screen (framebuffer) structure.  There is only one of these, since we
@@ -159,19 +177,20 @@ typedef struct {
   /* wrapped screen functions */
 
   CloseScreenProcPtr                    CloseScreen;
+  CreateScreenResourcesProcPtr          CreateScreenResources;
+  ScreenBlockHandlerProcPtr             BlockHandler;
   CreateGCProcPtr                       CreateGC;
   CopyWindowProcPtr                     CopyWindow;
-  ClearToBackgroundProcPtr              ClearToBackground;
-#ifdef RENDER
-  CompositeProcPtr                      Composite;
-  GlyphsProcPtr                         Glyphs;
-#endif
   InstallColormapProcPtr                InstallColormap;
   UninstallColormapProcPtr              UninstallColormap;
   ListInstalledColormapsProcPtr         ListInstalledColormaps;
   StoreColorsProcPtr                    StoreColors;
   SaveScreenProcPtr                     SaveScreen;
 
+  DamagePtr pDamage;                 /* damage to the screen pixmap that has
+                                        not yet been added to the clients'
+                                        modified regions */
+
 } rfbFBInfo, *rfbFBInfoPtr;
 
 
@@ -227,6 +246,50 @@ typedef struct {
 } rfbDevInfo, *rfbDevInfoPtr;
 
 
+/*
+ * Output queue block.  Data that a client's socket cannot accept immediately
+ * is stored in a linked list of these and sent when the socket becomes
+ * writable.  The data is normally stored in the block itself, but a block can
+ * also refer to a separately allocated buffer (such as the output of a
+ * compressor), which is freed along with the block, or to the data of another
+ * block (see rfbRefOutputBlock()), which is freed along with the last block
+ * that refers to it.  If extSize is nonzero, then the external buffer is
+ * returned to the Tight encoder's buffer pool (see rfbTightFreeBuf()) rather
+ * than being freed.
+ */
+
+typedef struct rfbOutputBlock {
+  struct rfbOutputBlock *next;
+  int len, offset;              /* length of data and number of bytes sent */
+  char *ext;                    /* external buffer, or NULL to use data[] */
+  struct rfbOutputBlock *owner; /* block whose data ext refers to, or NULL */
+  int refCount;                 /* number of blocks that refer to this one */
+  int extSize;                  /* size of a pooled external buffer, or 0 */
+  char data[];
+} rfbOutputBlock;
+
+#define BLOCK_DATA(block)  ((block)->ext ? (block)->ext : (block)->data)
+
+/* Compressed payloads of at least this many bytes are passed to the output
+   queue by reference rather than being copied into the update buffer. */
+#define MIN_ZERO_COPY_SIZE  16384
+
+
+/*
+ * Latency histogram (see metrics.c).  buckets[i] counts the samples that fell
+ * into bucket i (not cumulatively), and buckets[METRICS_BUCKETS] counts the
+ * samples that were larger than the largest bucket bound.
+ */
+
+#define METRICS_BUCKETS  12
+
+typedef struct {
+  unsigned long long buckets[METRICS_BUCKETS + 1];
+  unsigned long long count;
+  double sum;                   /* seconds */
+} rfbHistogram;
+
+
 /*
  * Per-client structure.
  */
@@ -322,6 +385,9 @@ typedef struct rfbClientRec {
 
   RegionRec modifiedRegion;     /* the region of the screen modified in any
                                    other way */
+  unsigned long damageGen;      /* the framebuffer generation as of which
+                                   the damage grid was last collected into
+                                   modifiedRegion (see draw.c) */
 
   /* As part of the FramebufferUpdateRequest, a client can express interest
      in a subrectangle of the whole framebuffer.  This is stored in the
@@ -339,6 +405,10 @@ typedef struct rfbClientRec {
   Bool deferredUpdateScheduled;
   OsTimerPtr deferredUpdateTimer;
   double deferredUpdateStart;
+  int deferUpdateTime;              /* ms (see rfbAdaptDeferTime()) */
+  double damageRate;                /* screens per second, averaged */
+  double encodeTime;                /* ms per update, averaged */
+  double lastUpdateTime;            /* start of the most recent update */
 
   /* translateFn points to the translation function which is used to copy
      and translate a rectangle from the framebuffer to an output buffer. */
@@ -363,6 +433,13 @@ typedef struct rfbClientRec {
   long long rfbRawBytesEquivalent;
   int rfbKeyEventsRcvd;
   int rfbPointerEventsRcvd;
+  int rfbWriteCalls;            /* write() and writev() system calls */
+  int rfbWritevCalls;
+  long long rfbICEPixelsCompared;
+  long long rfbICEPixelsIdentical;
+  double damageStart;           /* time of the oldest damage that hasn't been
+                                   sent, or 0 (see metrics.c) */
+  rfbHistogram encodeHist, latencyHist;
 
   /* zlib encoding -- necessary compression state info per client */
 
@@ -381,13 +458,21 @@ typedef struct rfbClientRec {
 
   /* tight encoding -- preserve zlib streams' state for each client */
 
-  z_stream zsStruct[4];
+  z_streamp zsStruct[4];
   Bool zsActive[4];
   int zsLevel[4];
+  Bool zsReset[4];                  /* reset the stream before its next use */
   int tightCompressLevel;
   int tightSubsampLevel;
   int tightQualityLevel;
   int imageQualityLevel;
+  void *tightData;                  /* encoding context (see tight.c) */
+  Bool updateDue;                   /* set by rfbDeferredUpdateCallback() */
+  Bool updateInProgress;            /* Tight encoding job is outstanding */
+  Bool updateLastRect;
+  double tUpdateStart;
+  double tUpdateWait;               /* time spent waiting for other clients'
+                                       Tight encoding jobs */
 
   Bool enableLastRectEncoding;      /* client supports LastRect encoding */
   Bool enableCursorShapeUpdates;    /* client supports cursor shape updates */
@@ -408,11 +493,20 @@ typedef struct rfbClientRec {
   Bool firstUpdate;
   OsTimerPtr alrTimer;
   RegionRec lossyRegion, alrRegion, alrEligibleRegion;
+  RegionRec alrPending;             /* remainder of the current ALR pass */
+  int alrStep;                      /* index of the current ALR pass */
+  double alrBytesPerPixel;          /* estimated size of ALR updates */
 
   /* Interframe comparison */
   char *compareFB, *fb;
   Bool firstCompare;
   RegionRec ifRegion;
+  CARD64 *iceHashes;                /* hash-based ICE (see ice.c) */
+  int iceBlocksX, iceBlocksY;
+
+  /* Scroll detection (see scroll.c) */
+  char *scrollFB;
+  RegionRec scrollValid;
 
   struct rfbClientRec *prev, *next;
 
@@ -433,13 +527,57 @@ typedef struct rfbClientRec {
   unsigned congWindow;
   int ackedOffset, sentOffset, sockOffset;
   unsigned minRTT;
-  Bool seenCongestion;
   unsigned pingCounter;
+  struct timeval rtPropStamp;       /* when baseRTT was last measured */
+  unsigned bwSamples[BW_FILTER_ROUNDS];  /* delivery rates (bytes/s) */
+  unsigned bwRound;
+  unsigned bwFullBw;                /* bandwidth at the start of the plateau */
+  int bwFullCount;                  /* rounds without significant growth */
+  Bool bwFull;                      /* the startup phase is complete */
+  Bool probeRTT;                    /* draining the queue to measure baseRTT */
+  struct timeval probeRTTStart;
+  unsigned probeMinRTT;
+  Bool windowLimited;               /* the window held back data this round */
+  int roundAckedOffset;             /* ackedOffset at the start of the round */
+  struct timeval roundStart;
+  unsigned notsentLowat;            /* TCP_NOTSENT_LOWAT (0 = unsupported) */
+  unsigned sockBw;                  /* kernel's delivery rate, averaged */
   OsTimerPtr updateTimer;
   OsTimerPtr congestionTimer;
   Bool congestionTimerRunning;
   struct timeval lastWrite;
 
+  /* adaptive quality (see flowcontrol.c) */
+  int aqLevel;                      /* current step of the quality ladder */
+  int aqCeiling;                    /* step requested by the viewer, or -1 if
+                                       adaptive quality is disabled */
+  int aqMaxQuality, aqMaxSubsamp;   /* JPEG settings requested by the viewer */
+  int aqRaise;                      /* consecutive intervals with headroom */
+  int aqRaiseIntervals;             /* intervals required before a raise */
+  Bool aqProbing;                   /* the last change was a raise */
+  int aqUpdates;                    /* updates sent during this interval */
+  int aqSockOffset, aqAckedOffset;  /* offsets at the start of the interval */
+  Bool aqCongested;                 /* updates were held back by the
+                                       congestion window */
+  struct timeval aqStart;
+
+  /* asynchronous output */
+
+  rfbOutputBlock *outHead, *outTail;
+  int outQueued;                /* bytes waiting in the output queue */
+  int outBlocks;                /* blocks in the output queue */
+  Bool writePending;            /* waiting for the socket to become writable */
+  Bool updateDeferred;          /* an update was held back by the queue */
+  OsTimerPtr writeTimer;
+
+  /* update buffer.  The encoders write framebuffer updates into updateBuf,
+     which is the data area of an output block.  rfbSendUpdateBuf() moves the
+     block onto the output queue once it fills. */
+
+  rfbOutputBlock *ubBlock;
+  char *updateBuf;
+  int ublen;
+
   Bool pendingDesktopResize, pendingExtDesktopResize;
   int reason, result;
 
@@ -451,13 +589,38 @@ typedef struct rfbClientRec {
   rfbDevInfo devices[MAXDEVICES];
   int numDevices;
 
-  /* Session capture */
+  /* Session capture (see capture.c) */
   int captureFD;
   Bool captureEnable;
+  OsTimerPtr keyframeTimer;
+
+  /* Broadcast groups (see bcast.c) */
+  struct rfbClientRec *bcastLeader; /* client whose updates this client
+                                       receives, or NULL */
+  int bcastMembers;                 /* number of clients that receive this
+                                       client's updates */
+  Bool bcastReceiving;              /* will receive the leader's current
+                                       update */
+  Bool bcastSending;                /* current update is being recorded for
+                                       the members */
+  Bool bcastKeyframe;               /* streams must be reset in the next
+                                       update */
+  Bool bcastEjected;                /* removed from a group for falling
+                                       behind */
+  double bcastWaitStart;            /* time at which the client started
+                                       waiting for the members */
+  rfbOutputBlock *bcastHead, *bcastTail;  /* current update */
 
 } rfbClientRec, *rfbClientPtr;
 
 
+/*
+ * This macro is used to test whether interframe comparison is enabled for the
+ * client, using either a framebuffer copy or hashes.
+ */
+
+#define ICE_ENABLED(cl)  ((cl)->compareFB != NULL || (cl)->iceHashes != NULL)
+
 /*
  * This macro is used to test whether there is a framebuffer update needing to
  * be sent to the client.
@@ -468,7 +631,8 @@ typedef struct rfbClientRec {
    ((cl)->enableCursorShapeUpdates && (cl)->cursorWasChanged) ||  \
    ((cl)->enableCursorPosUpdates && (cl)->cursorWasMoved) ||  \
    REGION_NOTEMPTY((pScreen), &(cl)->copyRegion) ||  \
-   REGION_NOTEMPTY((pScreen), &(cl)->modifiedRegion))
+   REGION_NOTEMPTY((pScreen), &(cl)->modifiedRegion) ||  \
+   rfbDamageGen > (cl)->damageGen)
 
 /*
  * This macro creates an empty region (ie. a region with no areas) if it is
@@ -500,12 +664,14 @@ typedef struct rfbClientRec {
 
 /*
  * An rfbGCRec is where we store the pointers to the original GC funcs and ops
- * which we wrap (NULL means not wrapped).
+ * which we wrap (NULL means not wrapped), along with the copy of the original
+ * ops in which the few ops that we wrap are replaced.
  */
 
 typedef struct {
   const GCFuncs *wrapFuncs;
   const GCOps *wrapOps;
+  GCOps ops;
 } rfbGCRec, *rfbGCPtr;
 
 
@@ -583,6 +749,22 @@ extern int traceLevel;
 }
 
 
+/*
+ * These record a span in the calling thread's trace buffer (see trace.c),
+ * without writing to the log.  TRACE_START() sets the given variable to the
+ * start time of the span, or to 0 if tracing is disabled, and TRACE_END()
+ * records the span along with one named integer argument.
+ */
+
+#define TRACE_START(start) {  \
+  start = rfbTraceEnabled ? gettime() : 0.;  \
+}
+
+#define TRACE_END(start, name, argName, arg) {  \
+  if ((start) != 0.) rfbTraceSpan(name, start, argName, arg);  \
+}
+
+
 /* auth.c */
 
 void rfbAuthInit(void);
@@ -688,6 +870,31 @@ extern void vncHandleSelection(Atom selection, Atom target, Atom property,
 extern void vncSelectionInit(void);
 
 
+/* capture.c */
+
+extern char *captureFile;
+extern int rfbCaptureKeyframeInterval;
+
+extern void rfbCaptureOpen(rfbClientPtr cl);
+extern void rfbCaptureClose(rfbClientPtr cl);
+extern void rfbWriteCapture(rfbClientPtr cl, char *buf, int len);
+
+
+/* damagetrace.c */
+
+extern char *rfbRecordDamageFile;
+extern char *rfbReplayDamageFile;
+extern double rfbReplaySpeed;
+extern Bool rfbRecordingDamage;
+extern Bool rfbReplayingDamage;
+
+extern void rfbInitDamageTrace(ScreenPtr pScreen);
+extern void rfbShutdownDamageTrace(void);
+extern void rfbRecordDamage(ScreenPtr pScreen, RegionPtr reg, Bool alr);
+extern void rfbRecordCopy(ScreenPtr pScreen, RegionPtr src, RegionPtr dst,
+                          int dx, int dy);
+
+
 /* dispcur.c */
 
 extern Bool rfbDCInitialize(ScreenPtr, miPointerScreenFuncPtr);
@@ -696,33 +903,50 @@ extern Bool rfbDCInitialize(ScreenPtr, miPointerScreenFuncPtr);
 /* draw.c */
 
 extern int rfbDeferUpdateTime;
+extern Bool rfbAdaptiveDefer;
+extern int rfbMaxFPS;
+extern unsigned long rfbFBGeneration;
+extern unsigned long rfbDamageGen;
+
+extern void rfbCollectDamage(rfbClientPtr cl);
+extern int rfbPacingDelay(rfbClientPtr cl);
+extern void rfbAdaptDeferTime(rfbClientPtr cl, double encodeTime);
 
 extern void ClipToScreen(ScreenPtr pScreen, RegionPtr pRegion);
 void PrintRegion(ScreenPtr pScreen, RegionPtr reg, const char *msg);
 
-#ifdef RENDER
-extern void rfbComposite(CARD8 op, PicturePtr pSrc, PicturePtr pMask,
-                         PicturePtr pDst, INT16 xSrc, INT16 ySrc, INT16 xMask,
-                         INT16 yMask, INT16 xDst, INT16 yDst, CARD16 width,
-                         CARD16 height);
-
-extern void rfbGlyphs(CARD8 op, PicturePtr pSrc, PicturePtr pDst,
-                      PictFormatPtr maskFormat, INT16 xSrc, INT16 ySrc,
-                      int nlists, GlyphListPtr lists, GlyphPtr *glyphs);
-#endif
+extern void rfbAddCursorDamage(ScreenPtr pScreen, BoxPtr box);
+extern void rfbAddALRDamage(ScreenPtr pScreen, RegionPtr reg);
 
 extern Bool rfbCloseScreen(ScreenPtr);
+extern Bool rfbCreateScreenResources(ScreenPtr);
+extern void rfbBlockHandler(ScreenPtr, void *timeout);
 extern Bool rfbCreateGC(GCPtr);
 extern void rfbPaintWindowBackground(WindowPtr, RegionPtr, int what);
 extern void rfbPaintWindowBorder(WindowPtr, RegionPtr, int what);
 extern void rfbCopyWindow(WindowPtr, DDXPointRec, RegionPtr);
-extern void rfbClearToBackground(WindowPtr, int x, int y, int w, int h,
-                                 Bool generateExposures);
 extern RegionPtr rfbRestoreAreas(WindowPtr, RegionPtr);
 
 
+/* bcast.c */
+
+extern Bool rfbBroadcast;
+
+extern Bool rfbBcastCheck(rfbClientPtr cl);
+extern Bool rfbBcastReady(rfbClientPtr cl);
+extern void rfbBcastBegin(rfbClientPtr cl);
+extern void rfbBcastQueue(rfbClientPtr cl, char *buf, int len);
+extern void rfbBcastQueueBlock(rfbClientPtr cl, rfbOutputBlock *block);
+extern void rfbBcastFinish(rfbClientPtr cl);
+extern void rfbBcastLeave(rfbClientPtr cl);
+
+
 /* flowcontrol.c */
 
+extern int rfbAQTargetFPS;
+extern void rfbAQApply(rfbClientPtr cl);
+extern void rfbAQReset(rfbClientPtr cl);
+extern void rfbAQUpdate(rfbClientPtr cl);
 extern void HandleFence(rfbClientPtr cl, CARD32 flags, unsigned len,
                         const char *data);
 extern void rfbInitFlowControl(rfbClientPtr cl);
@@ -747,6 +971,16 @@ extern char *httpDir;
 extern void httpInitSockets(void);
 
 
+/* ice.c */
+
+extern Bool rfbICEHash;
+extern Bool rfbICEHashInit(rfbClientPtr cl);
+extern void rfbICEHashFree(rfbClientPtr cl);
+extern unsigned long rfbICEHashCompare(rfbClientPtr cl, RegionPtr reg,
+                                       RegionPtr changedRegion);
+extern void rfbICEHashInvalidate(rfbClientPtr cl, int x, int y, int w, int h);
+
+
 /* init.c */
 
 extern char *desktopName;
@@ -795,6 +1029,16 @@ extern void KbdReleaseAllKeys(void);
 extern char *stristr(const char *s1, const char *s2);
 
 
+/* metrics.c */
+
+extern char *rfbMetricsSocket;
+
+extern void rfbInitMetrics(void);
+extern void rfbShutdownMetrics(void);
+extern void rfbMetricsNoteDamage(void);
+extern void rfbMetricsUpdateSent(rfbClientPtr cl);
+
+
 /* nvctrlext.c */
 
 extern char *nvCtrlDisplay;
@@ -831,14 +1075,14 @@ void rfbRemoveScreens(struct xorg_list *list);
 /*
  * UPDATE_BUF_SIZE must be big enough to send at least one whole line of the
  * framebuffer.  So for a max screen width of say 2K with 32-bit pixels this
- * means 8K minimum.
+ * means 8K minimum.  Each client's update buffer (cl->updateBuf) is this size.
  */
 
 #define UPDATE_BUF_SIZE 30000
-extern char updateBuf[UPDATE_BUF_SIZE];
-extern int ublen;
 
 extern double gettime(void);
+extern Bool rfbProfile;
+extern int rfbICEBlockSize;
 
 extern rfbClientPtr rfbClientHead;
 extern rfbClientPtr pointerClient;
@@ -861,6 +1105,8 @@ extern Bool rfbCongestionControl;
 extern double rfbAutoLosslessRefresh;
 extern int rfbALRQualityLevel;
 extern int rfbALRSubsampLevel;
+extern int rfbALRSteps[MAX_ALR_STEPS];
+extern int rfbALRNumSteps;
 extern int rfbInterframe;
 extern int rfbMaxClipboard;
 extern Bool rfbVirtualTablet;
@@ -869,8 +1115,6 @@ extern Bool rfbVirtualTablet;
 extern Bool rfbMT;
 extern int rfbNumThreads;
 
-extern char *captureFile;
-
 #define debugregion(r, m)  \
   rfbLog(m" %d, %d %d x %d\n", (r).extents.x1, (r).extents.y1,  \
          (r).extents.x2 - (r).extents.x1, (r).extents.y2 - (r).extents.y1)
@@ -882,11 +1126,15 @@ extern void rfbProcessClientMessage(rfbClientPtr cl);
 extern void rfbNewUDPConnection(int sock);
 extern void rfbProcessUDPInput(int sock);
 extern Bool rfbSendFramebufferUpdate(rfbClientPtr cl);
+extern void rfbSendFramebufferUpdates(void);
 extern Bool rfbSendRectEncodingRaw(rfbClientPtr cl, int x, int y, int w,
                                    int h);
 extern Bool rfbSendUpdateBuf(rfbClientPtr cl);
+extern Bool rfbSendUpdateBlock(rfbClientPtr cl, rfbOutputBlock *block);
 extern Bool rfbSendSetColourMapEntries(rfbClientPtr cl, int firstColour,
                                        int nColours);
+extern Bool rfbSendDesktopSize(rfbClientPtr cl);
+extern Bool rfbSendExtDesktopSize(rfbClientPtr cl);
 extern void rfbSendBell(void);
 extern void rfbSendServerCutText(char *str, int len);
 
@@ -915,10 +1163,20 @@ extern Bool rfbSendRectEncodingRRE(rfbClientPtr cl, int x, int y, int w,
                                    int h);
 
 
+/* scroll.c */
+
+extern Bool rfbScrollDetect;
+extern Bool rfbScrollInit(rfbClientPtr cl);
+extern void rfbScrollFree(rfbClientPtr cl);
+extern void rfbScrollUpdate(rfbClientPtr cl, RegionPtr reg);
+extern void rfbScrollDetectRegion(rfbClientPtr cl);
+
+
 /* sockets.c */
 
 extern int rfbMaxClientConnections;
 extern int rfbMaxClientWait;
+extern int rfbMaxClientQueue;
 
 extern int udpPort;
 extern int udpSock;
@@ -931,6 +1189,7 @@ extern void rfbInitSockets(void);
 extern void rfbDisconnectUDPSock(void);
 extern void rfbCloseSock(int);
 extern void rfbCloseClient(rfbClientPtr cl);
+extern void rfbFreeOutputQueue(rfbClientPtr cl);
 extern int rfbConnect(char *host, int port);
 extern void rfbCorkSock(int sock);
 extern void rfbUncorkSock(int sock);
@@ -938,6 +1197,14 @@ extern void rfbUncorkSock(int sock);
 extern int ReadExact(rfbClientPtr cl, char *buf, int len);
 extern int SkipExact(rfbClientPtr cl, int len);
 extern int WriteExact(rfbClientPtr cl, char *buf, int len);
+extern int WriteBlock(rfbClientPtr cl, rfbOutputBlock *block);
+extern int QueueBlock(rfbClientPtr cl, rfbOutputBlock *block);
+extern rfbOutputBlock *rfbNewOutputBlock(int size);
+extern rfbOutputBlock *rfbNewExternalBlock(char *buf, int len);
+extern rfbOutputBlock *rfbRefOutputBlock(rfbOutputBlock *block);
+extern void rfbFreeOutputBlock(rfbOutputBlock *block);
+extern int QueueExact(rfbClientPtr cl, char *buf, int len);
+extern int FlushOutput(rfbClientPtr cl);
 extern int ListenOnTCPPort(int port);
 extern int ListenOnUDPPort(int port);
 extern int ConnectToTcpAddr(char *host, int port);
@@ -949,6 +1216,7 @@ extern const char *sockaddr_string(rfbSockAddr *addr, char *buf, int len);
 
 extern void rfbResetStats(rfbClientPtr cl);
 extern void rfbPrintStats(rfbClientPtr cl);
+extern const char *rfbEncodingName(int encoding);
 
 
 /* strsep.c */
@@ -970,6 +1238,28 @@ extern Bool rfbSendRectEncodingTight(rfbClientPtr cl, int x, int y, int w,
                                      int h);
 extern int rfbTightCompressLevel(rfbClientPtr cl);
 extern void ShutdownTightThreads(void);
+extern void rfbFreeTightData(rfbClientPtr cl);
+extern void rfbTightQueueRect(rfbClientPtr cl, int x, int y, int w, int h);
+extern Bool rfbTightStartJob(rfbClientPtr cl);
+extern Bool rfbTightFinishJob(rfbClientPtr cl);
+extern void rfbTightPrintProfile(void);
+extern void rfbTightFreeBuf(char *buf, int size);
+extern Bool rfbRunParallelJobs(int nThreads,
+                               Bool (*func)(int id, void *arg), void *arg);
+
+
+/* trace.c */
+
+extern Bool rfbTraceEnabled;
+extern char *rfbTraceFile;
+
+extern void rfbTraceInit(void);
+extern void rfbTraceSpan(const char *name, double start, const char *argName,
+                         long arg);
+extern void rfbTraceAsyncSpan(const char *name, double start,
+                              const char *argName, long arg);
+extern void rfbTraceThreadName(int slot, const char *name);
+extern void rfbTraceDump(void);
 
 
 /* translate.c */
@@ -41,14 +41,12 @@
 #include <sys/time.h>
 #include <arpa/inet.h>
 #include "windowstr.h"
+#include "inputstr.h"
 #include "rfb.h"
 #include "sprite.h"
 
 /* #define GII_DEBUG */
 
-char updateBuf[UPDATE_BUF_SIZE];
-int ublen;
-
 rfbClientPtr rfbClientHead = NULL;
 rfbClientPtr pointerClient = NULL;  /* Mutex for pointer events */
 
@@ -80,25 +78,15 @@ static void rfbProcessClientProtocolVersion(rfbClientPtr cl);
 static void rfbProcessClientInitMessage(rfbClientPtr cl);
 static void rfbSendInteractionCaps(rfbClientPtr cl);
 static void rfbProcessClientNormalMessage(rfbClientPtr cl);
+static void rfbNewUpdateBuf(rfbClientPtr cl);
 static Bool rfbSendCopyRegion(rfbClientPtr cl, RegionPtr reg, int dx, int dy);
+static Bool rfbStartFramebufferUpdate(rfbClientPtr cl, Bool async);
+static Bool rfbFinishFramebufferUpdate(rfbClientPtr cl);
 static Bool rfbSendLastRectMarker(rfbClientPtr cl);
 Bool rfbSendDesktopSize(rfbClientPtr cl);
 Bool rfbSendExtDesktopSize(rfbClientPtr cl);
 
 
-/*
- * Session capture
- */
-
-char *captureFile = NULL;
-
-static void WriteCapture(int captureFD, char *buf, int len)
-{
-  if (write(captureFD, buf, len) < len)
-    rfbLogPerror("WriteCapture: Could not write to capture file");
-}
-
-
 /*
  * Idle timeout
  */
@@ -129,7 +117,7 @@ void IdleTimerCheck(void)
  * Profiling stuff
  */
 
-static BOOL rfbProfile = FALSE;
+Bool rfbProfile = FALSE;
 static double tUpdate = 0., tStart = -1., tElapsed, mpixels = 0.,
   idmpixels = 0.;
 static unsigned long iter = 0;
@@ -146,10 +134,222 @@ double gettime(void)
 
 /*
  * Auto Lossless Refresh
+ *
+ * Rather than sending the whole lossy region in one update, which would cause
+ * a bandwidth spike and a visible stall on slow links, the ALR is sent in
+ * slices of ALR_TILE_SIZE x ALR_TILE_SIZE tiles, starting with the tiles
+ * nearest the pointer.  A slice is sent only when the client's output queue
+ * has drained and (if the client supports the flow control extensions) the
+ * congestion window has room for it, and the slice is sized to fill that
+ * room.  If -alrsteps was specified, then the lossy region is refreshed in
+ * several passes, each using a higher JPEG quality, before the final
+ * (lossless or -alrqual) pass.
  */
 
+#define ALR_TILE_SIZE        64
+#define ALR_POLL_INTERVAL    10      /* ms */
+#define ALR_SLICE_BYTES      262144  /* for clients without flow control */
+#define ALR_MIN_SLICE_BYTES  4096
+
+int rfbALRSteps[MAX_ALR_STEPS];
+int rfbALRNumSteps = 0;
+
 static Bool putImageOnly = TRUE, alrCopyRect = TRUE;
 
+typedef struct {
+  BoxRec box;
+  double dist;
+} PriorityBox;
+
+static int ComparePriorityBoxes(const void *arg1, const void *arg2)
+{
+  const PriorityBox *box1 = (const PriorityBox *)arg1,
+    *box2 = (const PriorityBox *)arg2;
+
+  return (box1->dist > box2->dist) - (box1->dist < box2->dist);
+}
+
+
+/*
+ * Add tiles of the client's pending ALR region to sliceRegion, nearest the
+ * pointer first, until the slice contains at least maxPixels pixels.
+ */
+
+static void GetALRSlice(rfbClientPtr cl, RegionPtr sliceRegion,
+                        long maxPixels)
+{
+  ScreenPtr pScreen = screenInfo.screens[0];
+  BoxPtr extents = REGION_EXTENTS(pScreen, &cl->alrPending);
+  int tx1 = extents->x1 / ALR_TILE_SIZE, tx2 = extents->x2 / ALR_TILE_SIZE;
+  int ty1 = extents->y1 / ALR_TILE_SIZE, ty2 = extents->y2 / ALR_TILE_SIZE;
+  int px, py, tx, ty, nTiles = 0, i;
+  PriorityBox *tiles;
+
+  if (!(tiles = (PriorityBox *)malloc((tx2 - tx1 + 1) * (ty2 - ty1 + 1) *
+                                      sizeof(PriorityBox)))) {
+    REGION_COPY(pScreen, sliceRegion, &cl->alrPending);
+    return;
+  }
+
+  rfbSpriteGetCursorPos(pScreen, &px, &py);
+
+  for (ty = ty1; ty <= ty2; ty++) {
+    for (tx = tx1; tx <= tx2; tx++) {
+      PriorityBox *tile = &tiles[nTiles];
+      long dx, dy;
+
+      tile->box.x1 = tx * ALR_TILE_SIZE;
+      tile->box.y1 = ty * ALR_TILE_SIZE;
+      tile->box.x2 = tile->box.x1 + ALR_TILE_SIZE;
+      tile->box.y2 = tile->box.y1 + ALR_TILE_SIZE;
+      if (RECT_IN_REGION(pScreen, &cl->alrPending, &tile->box) == rgnOUT)
+        continue;
+      dx = tile->box.x1 + ALR_TILE_SIZE / 2 - px;
+      dy = tile->box.y1 + ALR_TILE_SIZE / 2 - py;
+      tile->dist = (double)(dx * dx + dy * dy);
+      nTiles++;
+    }
+  }
+
+  qsort(tiles, nTiles, sizeof(PriorityBox), ComparePriorityBoxes);
+
+  for (i = 0; i < nTiles && maxPixels > 0; i++) {
+    RegionRec tmpRegion;
+    BoxPtr rects;
+    int j;
+
+    REGION_INIT(pScreen, &tmpRegion, &tiles[i].box, 1);
+    REGION_INTERSECT(pScreen, &tmpRegion, &tmpRegion, &cl->alrPending);
+    rects = REGION_RECTS(&tmpRegion);
+    for (j = 0; j < REGION_NUM_RECTS(&tmpRegion); j++)
+      maxPixels -= (rects[j].x2 - rects[j].x1) * (rects[j].y2 - rects[j].y1);
+    REGION_UNION(pScreen, sliceRegion, sliceRegion, &tmpRegion);
+    REGION_UNINIT(pScreen, &tmpRegion);
+  }
+
+  free(tiles);
+}
+
+
+/*
+ * Update ordering
+ *
+ * The rectangles of a framebuffer update are sent in order of priority
+ * rather than in the order in which they appear in the update region, so
+ * that, on a slow link, the areas of the screen that the user is most likely
+ * to be looking at become visible first.  Rectangles that overlap the window
+ * with the input focus are sent first, and within each group, rectangles are
+ * sent nearest the pointer first.  Rectangles larger than PRIORITY_TILE_SIZE
+ * in either dimension are split, so that the part of a large rectangle that
+ * is nearest the pointer isn't held back by the rest of it.  (The Tight
+ * encoder never sends subrectangles larger than this, and the tiles of the
+ * other encoders are aligned with it, so splitting costs only a few
+ * rectangle headers.)
+ */
+
+#define PRIORITY_TILE_SIZE 256
+
+static Bool GetFocusBox(BoxPtr box)
+{
+  DeviceIntPtr dev = inputInfo.keyboard;
+  WindowPtr pWin;
+
+  if (!dev || !dev->focus)
+    return FALSE;
+  pWin = dev->focus->win;
+  if (pWin == NoneWin || pWin == PointerRootWin ||
+      pWin == FollowKeyboardWin || !pWin->parent || !pWin->viewable)
+    return FALSE;
+
+  box->x1 = pWin->drawable.x;
+  box->y1 = pWin->drawable.y;
+  box->x2 = box->x1 + pWin->drawable.width;
+  box->y2 = box->y1 + pWin->drawable.height;
+  return TRUE;
+}
+
+
+/*
+ * Return the rectangles of the given region in priority order.  The returned
+ * array is reused by the next call.
+ */
+
+static BoxPtr GetUpdateOrder(RegionPtr reg, int *nBoxes)
+{
+  static PriorityBox *pboxes = NULL;
+  static BoxPtr boxes = NULL;
+  static int boxesSize = 0;
+  ScreenPtr pScreen = screenInfo.screens[0];
+  BoxPtr rects = REGION_RECTS(reg), focusBox = NULL;
+  BoxRec fbox;
+  int nRects = REGION_NUM_RECTS(reg), n = 0, i, px, py;
+
+  for (i = 0; i < nRects; i++)
+    n += ((rects[i].x2 - rects[i].x1 - 1) / PRIORITY_TILE_SIZE + 1) *
+         ((rects[i].y2 - rects[i].y1 - 1) / PRIORITY_TILE_SIZE + 1);
+
+  if (n <= 1) {
+    *nBoxes = nRects;
+    return rects;
+  }
+
+  if (n > boxesSize) {
+    PriorityBox *newPBoxes =
+      (PriorityBox *)realloc(pboxes, n * sizeof(PriorityBox));
+    BoxPtr newBoxes;
+
+    if (newPBoxes) pboxes = newPBoxes;
+    newBoxes = (BoxPtr)realloc(boxes, n * sizeof(BoxRec));
+    if (newBoxes) boxes = newBoxes;
+    if (!newPBoxes || !newBoxes) {
+      *nBoxes = nRects;
+      return rects;
+    }
+    boxesSize = n;
+  }
+
+  rfbSpriteGetCursorPos(pScreen, &px, &py);
+  if (GetFocusBox(&fbox))
+    focusBox = &fbox;
+
+  n = 0;
+  for (i = 0; i < nRects; i++) {
+    int x, y;
+
+    for (y = rects[i].y1; y < rects[i].y2; y += PRIORITY_TILE_SIZE) {
+      for (x = rects[i].x1; x < rects[i].x2; x += PRIORITY_TILE_SIZE) {
+        PriorityBox *pbox = &pboxes[n++];
+        double dx, dy;
+
+        pbox->box.x1 = x;
+        pbox->box.y1 = y;
+        pbox->box.x2 = min(x + PRIORITY_TILE_SIZE, rects[i].x2);
+        pbox->box.y2 = min(y + PRIORITY_TILE_SIZE, rects[i].y2);
+
+        /* Distance from the pointer to the nearest edge of the box */
+        dx = max(max(pbox->box.x1 - px, px - (pbox->box.x2 - 1)), 0);
+        dy = max(max(pbox->box.y1 - py, py - (pbox->box.y2 - 1)), 0);
+        pbox->dist = dx * dx + dy * dy;
+
+        /* Boxes outside the focus window go after all of the boxes inside
+           it. */
+        if (focusBox &&
+            (pbox->box.x2 <= focusBox->x1 || pbox->box.x1 >= focusBox->x2 ||
+             pbox->box.y2 <= focusBox->y1 || pbox->box.y1 >= focusBox->y2))
+          pbox->dist += 1.0e12;
+      }
+    }
+  }
+
+  qsort(pboxes, n, sizeof(PriorityBox), ComparePriorityBoxes);
+  for (i = 0; i < n; i++)
+    boxes[i] = pboxes[i].box;
+
+  *nBoxes = n;
+  return boxes;
+}
+
+
 static CARD32 alrCallback(OsTimerPtr timer, CARD32 time, pointer arg)
 {
   RegionRec copyRegionSave, modifiedRegionSave, requestedRegionSave,
@@ -157,69 +357,161 @@ static CARD32 alrCallback(OsTimerPtr timer, CARD32 time, pointer arg)
   rfbClientPtr cl = (rfbClientPtr)arg;
   int tightCompressLevelSave, tightQualityLevelSave, copyDXSave, copyDYSave,
     tightSubsampLevelSave;
-  RegionRec tmpRegion;
+  RegionRec tmpRegion, sliceRegion;
+  Bool finalPass;
+  long budget, pixels;
+  unsigned offset;
+
+  /* The modified region is saved and restored below, so any damage that is
+     waiting in the grid has to be collected first. */
+  rfbCollectDamage(cl);
+
+  /* The whole of the first update is eligible for ALR, regardless of how it
+     was drawn.  This has to persist until all slices of it have been sent. */
+  if (cl->firstUpdate) {
+    if (putImageOnly)
+      REGION_UNION(pScreen, &cl->alrRegion, &cl->alrRegion, &cl->lossyRegion);
+    cl->firstUpdate = FALSE;
+  }
 
   REGION_INIT(pScreen, &tmpRegion, NullBox, 0);
-  if (putImageOnly && !cl->firstUpdate)
+  if (putImageOnly)
     REGION_INTERSECT(pScreen, &tmpRegion, &cl->alrRegion, &cl->lossyRegion);
   else
     REGION_COPY(pScreen, &tmpRegion, &cl->lossyRegion);
-  if (cl->firstUpdate) cl->firstUpdate = FALSE;
-
-  if (REGION_NOTEMPTY(pScreen, &tmpRegion)) {
-
-    tightCompressLevelSave = cl->tightCompressLevel;
-    tightQualityLevelSave = cl->tightQualityLevel;
-    tightSubsampLevelSave = cl->tightSubsampLevel;
-    copyDXSave = cl->copyDX;
-    copyDYSave = cl->copyDY;
-    REGION_INIT(pScreen, &copyRegionSave, NullBox, 0);
-    REGION_COPY(pScreen, &copyRegionSave, &cl->copyRegion);
-    REGION_INIT(pScreen, &modifiedRegionSave, NullBox, 0);
-    REGION_COPY(pScreen, &modifiedRegionSave, &cl->modifiedRegion);
-    REGION_INIT(pScreen, &requestedRegionSave, NullBox, 0);
-    REGION_COPY(pScreen, &requestedRegionSave, &cl->requestedRegion);
-    REGION_INIT(pScreen, &ifRegionSave, NullBox, 0);
-    REGION_COPY(pScreen, &ifRegionSave, &cl->ifRegion);
-
-    cl->tightCompressLevel = 1;
-    cl->tightQualityLevel = rfbALRQualityLevel;
-    cl->tightSubsampLevel = rfbALRSubsampLevel;
-    cl->copyDX = cl->copyDY = 0;
-    REGION_EMPTY(pScreen, &cl->copyRegion);
-    REGION_EMPTY(pScreen, &cl->modifiedRegion);
-    REGION_UNION(pScreen, &cl->modifiedRegion, &cl->modifiedRegion,
-                 &tmpRegion);
-    REGION_EMPTY(pScreen, &cl->requestedRegion);
-    REGION_UNION(pScreen, &cl->requestedRegion, &cl->requestedRegion,
-                 &tmpRegion);
-    if (cl->compareFB) {
-      REGION_EMPTY(pScreen, &cl->ifRegion);
-      REGION_UNION(pScreen, &cl->ifRegion, &cl->ifRegion, &tmpRegion);
-    }
 
-    if (!rfbSendFramebufferUpdate(cl)) return 0;
-
-    REGION_EMPTY(pScreen, &cl->lossyRegion);
-    REGION_EMPTY(pScreen, &cl->alrRegion);
-    cl->tightCompressLevel = tightCompressLevelSave;
-    cl->tightQualityLevel = tightQualityLevelSave;
-    cl->tightSubsampLevel = tightSubsampLevelSave;
-    cl->copyDX = copyDXSave;
-    cl->copyDY = copyDYSave;
-    REGION_COPY(pScreen, &cl->copyRegion, &copyRegionSave);
-    REGION_COPY(pScreen, &cl->modifiedRegion, &modifiedRegionSave);
-    REGION_COPY(pScreen, &cl->requestedRegion, &requestedRegionSave);
+  if (!REGION_NOTEMPTY(pScreen, &tmpRegion)) {
+    REGION_EMPTY(pScreen, &cl->alrPending);
+    cl->alrStep = 0;
+    REGION_UNINIT(pScreen, &tmpRegion);
+    return 0;
+  }
+
+  /* Wait until the client has room for more data. */
+
+  if (cl->outHead || rfbIsCongested(cl) || rfbPacingDelay(cl) > 0) {
+    REGION_UNINIT(pScreen, &tmpRegion);
+    cl->alrTimer = TimerSet(cl->alrTimer, 0, ALR_POLL_INTERVAL, alrCallback,
+                            cl);
+    return 0;
+  }
+
+  /* Parts of the pending region that have since been refreshed by other
+     means are dropped.  If nothing is left, then start a new pass, skipping
+     any steps that would not improve on the quality the client requested. */
+
+  REGION_INTERSECT(pScreen, &cl->alrPending, &cl->alrPending, &tmpRegion);
+  if (!REGION_NOTEMPTY(pScreen, &cl->alrPending)) {
+    REGION_COPY(pScreen, &cl->alrPending, &tmpRegion);
+    while (cl->alrStep < rfbALRNumSteps &&
+           rfbALRSteps[cl->alrStep] <= cl->tightQualityLevel)
+      cl->alrStep++;
+  }
+  finalPass = (cl->alrStep >= rfbALRNumSteps);
+
+  if (cl->enableFence) {
+    budget = (long)cl->congWindow - (long)(cl->sockOffset - cl->ackedOffset);
+    if (budget < ALR_MIN_SLICE_BYTES) budget = ALR_MIN_SLICE_BYTES;
+  } else
+    budget = ALR_SLICE_BYTES;
+
+  pixels = (long)((double)budget / cl->alrBytesPerPixel);
+  REGION_INIT(pScreen, &sliceRegion, NullBox, 0);
+  GetALRSlice(cl, &sliceRegion, pixels);
+  REGION_UNINIT(pScreen, &tmpRegion);
+
+  tightCompressLevelSave = cl->tightCompressLevel;
+  tightQualityLevelSave = cl->tightQualityLevel;
+  tightSubsampLevelSave = cl->tightSubsampLevel;
+  copyDXSave = cl->copyDX;
+  copyDYSave = cl->copyDY;
+  REGION_INIT(pScreen, &copyRegionSave, NullBox, 0);
+  REGION_COPY(pScreen, &copyRegionSave, &cl->copyRegion);
+  REGION_INIT(pScreen, &modifiedRegionSave, NullBox, 0);
+  REGION_COPY(pScreen, &modifiedRegionSave, &cl->modifiedRegion);
+  REGION_INIT(pScreen, &requestedRegionSave, NullBox, 0);
+  REGION_COPY(pScreen, &requestedRegionSave, &cl->requestedRegion);
+  REGION_INIT(pScreen, &ifRegionSave, NullBox, 0);
+  REGION_COPY(pScreen, &ifRegionSave, &cl->ifRegion);
+
+  cl->tightCompressLevel = 1;
+  cl->tightQualityLevel =
+    finalPass ? rfbALRQualityLevel : rfbALRSteps[cl->alrStep];
+  cl->tightSubsampLevel = rfbALRSubsampLevel;
+  cl->copyDX = cl->copyDY = 0;
+  REGION_EMPTY(pScreen, &cl->copyRegion);
+  REGION_EMPTY(pScreen, &cl->modifiedRegion);
+  REGION_UNION(pScreen, &cl->modifiedRegion, &cl->modifiedRegion,
+               &sliceRegion);
+  REGION_EMPTY(pScreen, &cl->requestedRegion);
+  REGION_UNION(pScreen, &cl->requestedRegion, &cl->requestedRegion,
+               &sliceRegion);
+  if (ICE_ENABLED(cl)) {
+    REGION_EMPTY(pScreen, &cl->ifRegion);
+    REGION_UNION(pScreen, &cl->ifRegion, &cl->ifRegion, &sliceRegion);
+  }
+
+  offset = cl->sockOffset;
+  if (!rfbSendFramebufferUpdate(cl)) {
+    REGION_UNINIT(pScreen, &sliceRegion);
     REGION_UNINIT(pScreen, &copyRegionSave);
     REGION_UNINIT(pScreen, &modifiedRegionSave);
     REGION_UNINIT(pScreen, &requestedRegionSave);
-    if (cl->compareFB) {
-      REGION_COPY(pScreen, &cl->ifRegion, &ifRegionSave);
-      REGION_UNINIT(pScreen, &ifRegionSave);
+    REGION_UNINIT(pScreen, &ifRegionSave);
+    return 0;
+  }
+
+  /* Keep a running estimate of the number of bytes per pixel in an ALR
+     update, so the next slice can be sized to fit the available room. */
+  if (cl->sockOffset != offset) {
+    BoxPtr rects = REGION_RECTS(&sliceRegion);
+    double area = 0.;
+    int i;
+
+    for (i = 0; i < REGION_NUM_RECTS(&sliceRegion); i++)
+      area += (double)(rects[i].x2 - rects[i].x1) *
+              (double)(rects[i].y2 - rects[i].y1);
+    cl->alrBytesPerPixel = (cl->alrBytesPerPixel +
+                            (double)(cl->sockOffset - offset) / area) / 2.;
+    if (cl->alrBytesPerPixel < 0.01) cl->alrBytesPerPixel = 0.01;
+  }
+
+  REGION_SUBTRACT(pScreen, &cl->alrPending, &cl->alrPending, &sliceRegion);
+  if (finalPass) {
+    REGION_SUBTRACT(pScreen, &cl->lossyRegion, &cl->lossyRegion,
+                    &sliceRegion);
+    REGION_SUBTRACT(pScreen, &cl->alrRegion, &cl->alrRegion, &sliceRegion);
+  }
+  REGION_UNINIT(pScreen, &sliceRegion);
+
+  cl->tightCompressLevel = tightCompressLevelSave;
+  cl->tightQualityLevel = tightQualityLevelSave;
+  cl->tightSubsampLevel = tightSubsampLevelSave;
+  /* The adaptive quality controller may have changed its mind while the
+     slice was being sent. */
+  rfbAQApply(cl);
+  cl->copyDX = copyDXSave;
+  cl->copyDY = copyDYSave;
+  REGION_COPY(pScreen, &cl->copyRegion, &copyRegionSave);
+  REGION_COPY(pScreen, &cl->modifiedRegion, &modifiedRegionSave);
+  REGION_COPY(pScreen, &cl->requestedRegion, &requestedRegionSave);
+  REGION_UNINIT(pScreen, &copyRegionSave);
+  REGION_UNINIT(pScreen, &modifiedRegionSave);
+  REGION_UNINIT(pScreen, &requestedRegionSave);
+  if (ICE_ENABLED(cl))
+    REGION_COPY(pScreen, &cl->ifRegion, &ifRegionSave);
+  REGION_UNINIT(pScreen, &ifRegionSave);
+
+  /* Schedule the next slice, unless this was the end of the final pass. */
+  if (!REGION_NOTEMPTY(pScreen, &cl->alrPending)) {
+    if (finalPass) {
+      cl->alrStep = 0;
+      return 0;
     }
+    cl->alrStep++;
   }
-
-  REGION_UNINIT(pScreen, &tmpRegion);
+  cl->alrTimer = TimerSet(cl->alrTimer, 0, ALR_POLL_INTERVAL, alrCallback,
+                          cl);
   return 0;
 }
 
@@ -241,6 +533,19 @@ int rfbInterframe = -1;  /* -1 = auto (determined by compression level) */
 
 Bool InterframeOn(rfbClientPtr cl)
 {
+  if (rfbICEHash) {
+    if (!cl->iceHashes) {
+      if (!rfbICEHashInit(cl)) {
+        rfbLogPerror("InterframeOn: couldn't allocate hash table");
+        return FALSE;
+      }
+      REGION_INIT(pScreen, &cl->ifRegion, NullBox, 0);
+      rfbLog("Interframe comparison enabled (using hashes)\n");
+    }
+    cl->fb = rfbFB.pfbMemory;
+    return TRUE;
+  }
+
   if (!cl->compareFB) {
     if (!(cl->compareFB =
           (char *)malloc(rfbFB.paddedWidthInBytes * rfbFB.height))) {
@@ -258,8 +563,9 @@ Bool InterframeOn(rfbClientPtr cl)
 
 void InterframeOff(rfbClientPtr cl)
 {
-  if (cl->compareFB) {
+  if (ICE_ENABLED(cl)) {
     free(cl->compareFB);
+    rfbICEHashFree(cl);
     REGION_UNINIT(pScreen, &cl->ifRegion);
     rfbLog("Interframe comparison disabled\n");
   }
@@ -317,6 +623,7 @@ rfbClientPtr rfbReverseConnection(char *host, int port, int id)
     memset(temps, 0, 250);
     snprintf(temps, 250, "ID:%d", id);
     rfbLog("UltraVNC Repeater Mode II ID is %d\n", id);
+    memset(&cl, 0, sizeof(rfbClientRec));
     cl.sock = sock;
     if (WriteExact(&cl, temps, 250) < 0) {
       rfbLogPerror("rfbReverseConnection: write");
@@ -356,15 +663,9 @@ static rfbClientPtr rfbNewClient(int sock)
 
   cl = (rfbClientPtr)rfbAlloc0(sizeof(rfbClientRec));
 
-  if (rfbClientHead == NULL && captureFile) {
-    cl->captureFD = open(captureFile, O_CREAT | O_EXCL | O_WRONLY,
-                         S_IRUSR | S_IWUSR);
-    if (cl->captureFD < 0)
-      rfbLogPerror("Could not open capture file");
-    else
-      rfbLog("Opened capture file %s\n", captureFile);
-  } else
-    cl->captureFD = -1;
+  cl->captureFD = -1;
+  if (rfbClientHead == NULL && captureFile)
+    rfbCaptureOpen(cl);
 
   cl->sock = sock;
   getpeername(sock, &addr.u.sa, &addrlen);
@@ -383,10 +684,12 @@ static rfbClientPtr rfbNewClient(int sock)
   box.x2 = rfbFB.width;
   box.y2 = rfbFB.height;
   REGION_INIT(pScreen, &cl->modifiedRegion, &box, 0);
+  cl->damageGen = rfbFBGeneration;
 
   REGION_INIT(pScreen, &cl->requestedRegion, NullBox, 0);
 
   cl->deferredUpdateStart = gettime();
+  cl->deferUpdateTime = rfbDeferUpdateTime;
 
   cl->format = rfbServerFormat;
   cl->translateFn = rfbTranslateNone;
@@ -395,6 +698,7 @@ static rfbClientPtr rfbNewClient(int sock)
   cl->tightSubsampLevel = TIGHT_DEFAULT_SUBSAMP;
   cl->tightQualityLevel = -1;
   cl->imageQualityLevel = -1;
+  cl->aqCeiling = -1;
 
   cl->next = rfbClientHead;
   cl->prev = NULL;
@@ -403,6 +707,7 @@ static rfbClientPtr rfbNewClient(int sock)
   rfbClientHead = cl;
 
   rfbResetStats(cl);
+  rfbNewUpdateBuf(cl);
 
   cl->zlibCompressLevel = 5;
 
@@ -420,6 +725,9 @@ static rfbClientPtr rfbNewClient(int sock)
   if ((env = getenv("TVNC_ICEDEBUG")) != NULL && !strcmp(env, "1"))
     rfbInterframeDebug = TRUE;
 
+  if ((env = getenv("TVNC_ICEHASH")) != NULL && !strcmp(env, "1"))
+    rfbICEHash = TRUE;
+
   if ((env = getenv("TVNC_ICEBLOCKSIZE")) != NULL) {
     int iceBlockSize = atoi(env);
     if (iceBlockSize >= 0) rfbICEBlockSize = iceBlockSize;
@@ -445,6 +753,8 @@ static rfbClientPtr rfbNewClient(int sock)
       alrCopyRect = FALSE;
     REGION_INIT(pScreen, &cl->alrRegion, NullBox, 0);
     REGION_INIT(pScreen, &cl->alrEligibleRegion, NullBox, 0);
+    REGION_INIT(pScreen, &cl->alrPending, NullBox, 0);
+    cl->alrBytesPerPixel = 1.0;
   }
 
   if ((env = getenv("TVNC_MT")) != NULL && !strcmp(env, "0"))
@@ -484,6 +794,12 @@ static rfbClientPtr rfbNewClient(int sock)
   } else
     InterframeOff(cl);
 
+  if (rfbScrollDetect && !rfbScrollInit(cl)) {
+    rfbLogPerror("rfbNewClient: couldn't allocate scroll detection buffer");
+    rfbCloseClient(cl);
+    return NULL;
+  }
+
   return cl;
 }
 
@@ -504,10 +820,17 @@ void rfbClientConnectionGone(rfbClientPtr cl)
   if (cl->next)
     cl->next->prev = cl->prev;
 
+  rfbBcastLeave(cl);
+
+  /* This waits for any encoding job that is still using the client. */
+  rfbFreeTightData(cl);
+
   TimerFree(cl->alrTimer);
   TimerFree(cl->deferredUpdateTimer);
   TimerFree(cl->updateTimer);
   TimerFree(cl->congestionTimer);
+  rfbFreeOutputQueue(cl);
+  free(cl->ubBlock);
 
 #ifdef XVNC_AuthPAM
   rfbPAMEnd(cl);
@@ -520,11 +843,13 @@ void rfbClientConnectionGone(rfbClientPtr cl)
   }
   free(cl->host);
 
-  ShutdownTightThreads();
+  if (!rfbClientHead)
+    ShutdownTightThreads();
 
   if (rfbAutoLosslessRefresh > 0.0) {
     REGION_UNINIT(pScreen, &cl->lossyRegion);
     REGION_UNINIT(pScreen, &cl->alrRegion);
+    REGION_UNINIT(pScreen, &cl->alrPending);
     REGION_UNINIT(pScreen, &cl->alrEligibleRegion);
   }
 
@@ -534,7 +859,8 @@ void rfbClientConnectionGone(rfbClientPtr cl)
 
   for (i = 0; i < 4; i++) {
     if (cl->zsActive[i])
-      deflateEnd(&cl->zsStruct[i]);
+      deflateEnd(cl->zsStruct[i]);
+    free(cl->zsStruct[i]);
   }
 
   if (pointerClient == cl)
@@ -552,13 +878,13 @@ void rfbClientConnectionGone(rfbClientPtr cl)
   free(cl->cutText);
 
   InterframeOff(cl);
+  rfbScrollFree(cl);
 
   i = cl->numDevices;
   while (i-- > 0)
     RemoveExtInputDevice(cl, 0);
 
-  if (cl->captureFD >= 0)
-    close(cl->captureFD);
+  rfbCaptureClose(cl);
 
   free(cl);
 
@@ -879,6 +1205,8 @@ static void rfbProcessClientNormalMessage(rfbClientPtr cl)
 
       READ(((char *)&msg) + 1, sz_rfbSetPixelFormatMsg - 1)
 
+      rfbBcastLeave(cl);
+
       cl->format.bitsPerPixel = msg.spf.format.bitsPerPixel;
       cl->format.depth = msg.spf.format.depth;
       cl->format.bigEndian = (msg.spf.format.bigEndian ? 1 : 0);
@@ -912,6 +1240,8 @@ static void rfbProcessClientNormalMessage(rfbClientPtr cl)
 
       READ(((char *)&msg) + 1, sz_rfbSetEncodingsMsg - 1)
 
+      rfbBcastLeave(cl);
+
       msg.se.nEncodings = Swap16IfLE(msg.se.nEncodings);
 
       cl->preferredEncoding = -1;
@@ -1106,6 +1436,8 @@ static void rfbProcessClientNormalMessage(rfbClientPtr cl)
       if (cl->preferredEncoding == -1)
         cl->preferredEncoding = rfbEncodingTight;
 
+      rfbAQReset(cl);
+
       if (cl->preferredEncoding == rfbEncodingTight && logTightCompressLevel)
         rfbLog("Using Tight compression level %d for client %s\n",
                rfbTightCompressLevel(cl), cl->host);
@@ -1175,6 +1507,9 @@ static void rfbProcessClientNormalMessage(rfbClientPtr cl)
       }
 
       if (!msg.fur.incremental) {
+        /* A member of a broadcast group rejoins the group, so that the
+           whole group receives a keyframe. */
+        rfbBcastLeave(cl);
         REGION_UNION(pScreen, &cl->modifiedRegion, &cl->modifiedRegion,
                      &tmpRegion);
         REGION_SUBTRACT(pScreen, &cl->copyRegion, &cl->copyRegion, &tmpRegion);
@@ -1183,9 +1518,9 @@ static void rfbProcessClientNormalMessage(rfbClientPtr cl)
       }
 
       if (FB_UPDATE_PENDING(cl) &&
-          (!cl->deferredUpdateScheduled || rfbDeferUpdateTime == 0 ||
+          (!cl->deferredUpdateScheduled || cl->deferUpdateTime == 0 ||
            gettime() - cl->deferredUpdateStart >=
-           (double)rfbDeferUpdateTime)) {
+           (double)cl->deferUpdateTime / 1000.)) {
         if (rfbSendFramebufferUpdate(cl))
           cl->deferredUpdateScheduled = FALSE;
       }
@@ -1760,11 +2095,74 @@ static void rfbProcessClientNormalMessage(rfbClientPtr cl)
  */
 
 Bool rfbSendFramebufferUpdate(rfbClientPtr cl)
+{
+  return rfbStartFramebufferUpdate(cl, FALSE);
+}
+
+
+/*
+ * rfbSendFramebufferUpdates - send framebuffer updates to all clients whose
+ * updateDue flag is set.  The Tight encoding work for each of the clients is
+ * passed to the worker pool, so that the updates are encoded in parallel.
+ *
+ * Starting an update removes the cursor from the framebuffer or draws it,
+ * depending on whether the client receives cursor shape updates, while the
+ * jobs of the clients that were started earlier may be reading the
+ * framebuffer.  Thus, only the clients whose cursor mode matches that of the
+ * first client are encoded in parallel, and the others are sent their
+ * updates afterward, one at a time.
+ */
+
+void rfbSendFramebufferUpdates(void)
+{
+  rfbClientPtr cl, nextCl;
+  Bool cursorShapes = FALSE, first = TRUE;
+
+  for (cl = rfbClientHead; cl; cl = nextCl) {
+    nextCl = cl->next;
+    if (!cl->updateDue) continue;
+    if (first) {
+      cursorShapes = cl->enableCursorShapeUpdates;
+      first = FALSE;
+    } else if (cl->enableCursorShapeUpdates != cursorShapes)
+      continue;
+    cl->updateDue = FALSE;
+    TimerCancel(cl->deferredUpdateTimer);
+    if (rfbStartFramebufferUpdate(cl, TRUE))
+      cl->deferredUpdateScheduled = FALSE;
+  }
+
+  for (cl = rfbClientHead; cl; cl = nextCl) {
+    nextCl = cl->next;
+    if (cl->updateInProgress)
+      rfbFinishFramebufferUpdate(cl);
+  }
+
+  for (cl = rfbClientHead; cl; cl = nextCl) {
+    nextCl = cl->next;
+    if (!cl->updateDue) continue;
+    cl->updateDue = FALSE;
+    TimerCancel(cl->deferredUpdateTimer);
+    if (rfbSendFramebufferUpdate(cl))
+      cl->deferredUpdateScheduled = FALSE;
+  }
+}
+
+
+/*
+ * rfbStartFramebufferUpdate - compute and encode the pending framebuffer
+ * update.  If async is TRUE, then the Tight rectangles are encoded by the
+ * worker pool, and the caller must call rfbFinishFramebufferUpdate() if
+ * cl->updateInProgress is set on return.  Otherwise, the update is sent
+ * before returning.
+ */
+
+static Bool rfbStartFramebufferUpdate(rfbClientPtr cl, Bool async)
 {
   ScreenPtr pScreen = screenInfo.screens[0];
   int i;
   int nUpdateRegionRects;
-  rfbFramebufferUpdateMsg *fu = (rfbFramebufferUpdateMsg *)updateBuf;
+  rfbFramebufferUpdateMsg *fu = (rfbFramebufferUpdateMsg *)cl->updateBuf;
   RegionRec _updateRegion, *updateRegion = &_updateRegion, updateCopyRegion,
     idRegion;
   Bool emptyUpdateRegion = FALSE;
@@ -1773,6 +2171,8 @@ Bool rfbSendFramebufferUpdate(rfbClientPtr cl)
   Bool sendCursorShape = FALSE;
   Bool sendCursorPos = FALSE;
   double tUpdateStart = 0.0;
+  int delay, nBoxes;
+  BoxPtr boxes;
 
   TimerCancel(cl->updateTimer);
 
@@ -1786,9 +2186,21 @@ Bool rfbSendFramebufferUpdate(rfbClientPtr cl)
 
   if (cl->state != RFB_NORMAL) return TRUE;
 
-  if (rfbProfile) {
-    tUpdateStart = gettime();
-    if (tStart < 0.) tStart = tUpdateStart;
+  /* A member of a broadcast group receives the leader's updates rather than
+     encoding its own. */
+
+  if (rfbBroadcast && !rfbBcastCheck(cl)) return TRUE;
+
+  tUpdateStart = gettime();
+  if (rfbProfile && tStart < 0.) tStart = tUpdateStart;
+
+  /* If the client's socket hasn't yet accepted all of the previous update,
+     then hold this one back until the output queue drains.  Otherwise, a
+     slow client would cause updates to pile up in memory. */
+
+  if (cl->outHead) {
+    cl->updateDeferred = TRUE;
+    return TRUE;
   }
 
   /* Check that we actually have some space on the link and retry in a
@@ -1799,6 +2211,15 @@ Bool rfbSendFramebufferUpdate(rfbClientPtr cl)
     return TRUE;
   }
 
+  /* Hold the update back if sending it now would exceed the maximum frame
+     rate. */
+
+  if ((delay = rfbPacingDelay(cl)) > 0) {
+    cl->updateTimer = TimerSet(cl->updateTimer, 0, delay, updateCallback,
+                               cl);
+    return TRUE;
+  }
+
   /* In continuous mode, we will be outputting at least three distinct
      messages.  We need to aggregate these in order to not clog up TCP's
      congestion window. */
@@ -1842,6 +2263,11 @@ Bool rfbSendFramebufferUpdate(rfbClientPtr cl)
   if (cl->enableCursorPosUpdates && cl->cursorWasMoved)
     sendCursorPos = TRUE;
 
+  rfbCollectDamage(cl);
+
+  if (cl->scrollFB)
+    rfbScrollDetectRegion(cl);
+
   /*
    * The modifiedRegion may overlap the destination copyRegion.  We remove
    * any overlapping bits from the copyRegion (since they'd only be
@@ -1873,6 +2299,31 @@ Bool rfbSendFramebufferUpdate(rfbClientPtr cl)
     return TRUE;
   }
 
+  /* The leader of a broadcast group has to wait until all members of the
+     group are ready for the update. */
+
+  if (cl->bcastMembers && !rfbBcastReady(cl)) {
+    REGION_UNINIT(pScreen, updateRegion);
+    rfbUncorkSock(cl->sock);
+    cl->updateTimer = TimerSet(cl->updateTimer, 0, 10, updateCallback, cl);
+    return TRUE;
+  }
+
+  /* Keep a running average of the damage rate, which determines how long
+     the next update will be deferred. */
+
+  if (rfbAdaptiveDefer) {
+    BoxPtr rects = REGION_RECTS(updateRegion);
+    double area = 0., interval = max(tUpdateStart - cl->lastUpdateTime, 0.001);
+
+    for (i = 0; i < REGION_NUM_RECTS(updateRegion); i++)
+      area += (double)(rects[i].x2 - rects[i].x1) *
+              (double)(rects[i].y2 - rects[i].y1);
+    area /= (double)rfbFB.width * (double)rfbFB.height;
+    cl->damageRate = (cl->damageRate * 3. + area / interval) / 4.;
+  }
+  cl->lastUpdateTime = tUpdateStart;
+
   /*
    * We assume that the client doesn't have any pixel data outside the
    * requestedRegion.  In other words, both the source and destination of a
@@ -1942,7 +2393,19 @@ Bool rfbSendFramebufferUpdate(rfbClientPtr cl)
     ClipToScreen(pScreen, updateRegion);
   }
 
-  if (cl->compareFB) {
+  /* Once this update has been sent, the client's copy of the updated area
+     will match the framebuffer. */
+
+  if (cl->scrollFB) {
+    rfbScrollUpdate(cl, updateRegion);
+    rfbScrollUpdate(cl, &updateCopyRegion);
+  }
+
+  if (ICE_ENABLED(cl)) {
+    long long icePixels = cl->rfbICEPixelsCompared;
+    double tICE;
+
+    TRACE_START(tICE);
     if ((cl->ifRegion.extents.x2 > pScreen->width ||
          cl->ifRegion.extents.y2 > pScreen->height) &&
         REGION_NUM_RECTS(&cl->ifRegion) > 0)
@@ -1950,71 +2413,90 @@ Bool rfbSendFramebufferUpdate(rfbClientPtr cl)
 
     updateRegion = &cl->ifRegion;
     emptyUpdateRegion = TRUE;
-    if (rfbInterframeDebug)
-      REGION_INIT(pScreen, &idRegion, NullBox, 0);
     for (i = 0; i < REGION_NUM_RECTS(&_updateRegion); i++) {
-      int x = REGION_RECTS(&_updateRegion)[i].x1;
-      int y = REGION_RECTS(&_updateRegion)[i].y1;
-      int w = REGION_RECTS(&_updateRegion)[i].x2 - x;
-      int h = REGION_RECTS(&_updateRegion)[i].y2 - y;
-      int pitch = rfbFB.paddedWidthInBytes;
-      int ps = rfbServerFormat.bitsPerPixel / 8;
-      char *src = &rfbFB.pfbMemory[y * pitch + x * ps];
-      char *dst = &cl->compareFB[y * pitch + x * ps];
-      int row, col;
-      int hBlockSize = rfbICEBlockSize == 0 ? w : rfbICEBlockSize;
-      int vBlockSize = rfbICEBlockSize == 0 ? h : rfbICEBlockSize;
-
-      for (row = 0; row < h; row += vBlockSize) {
-        for (col = 0; col < w; col += hBlockSize) {
-
-          Bool different = FALSE;
-          int compareWidth = min(hBlockSize, w - col);
-          int compareHeight = min(vBlockSize, h - row);
-          int rows = compareHeight;
-          char *srcPtr = &src[row * pitch + col * ps];
-          char *dstPtr = &dst[row * pitch + col * ps];
-
-          while (rows--) {
-            if (cl->firstCompare ||
-                memcmp(srcPtr, dstPtr, compareWidth * ps)) {
-              memcpy(dstPtr, srcPtr, compareWidth * ps);
-              different = TRUE;
+      BoxPtr box = &REGION_RECTS(&_updateRegion)[i];
+      cl->rfbICEPixelsCompared +=
+        (long long)(box->x2 - box->x1) * (long long)(box->y2 - box->y1);
+    }
+    if (cl->iceHashes) {
+      unsigned long identicalPixels =
+        rfbICEHashCompare(cl, &_updateRegion, &cl->ifRegion);
+      double identical = (double)identicalPixels / 1000000.;
+
+      cl->rfbICEPixelsIdentical += identicalPixels;
+      if (rfbProfile) {
+        idmpixels += identical;
+        mpixels += identical;
+      }
+    } else {
+      if (rfbInterframeDebug)
+        REGION_INIT(pScreen, &idRegion, NullBox, 0);
+      for (i = 0; i < REGION_NUM_RECTS(&_updateRegion); i++) {
+        int x = REGION_RECTS(&_updateRegion)[i].x1;
+        int y = REGION_RECTS(&_updateRegion)[i].y1;
+        int w = REGION_RECTS(&_updateRegion)[i].x2 - x;
+        int h = REGION_RECTS(&_updateRegion)[i].y2 - y;
+        int pitch = rfbFB.paddedWidthInBytes;
+        int ps = rfbServerFormat.bitsPerPixel / 8;
+        char *src = &rfbFB.pfbMemory[y * pitch + x * ps];
+        char *dst = &cl->compareFB[y * pitch + x * ps];
+        int row, col;
+        int hBlockSize = rfbICEBlockSize == 0 ? w : rfbICEBlockSize;
+        int vBlockSize = rfbICEBlockSize == 0 ? h : rfbICEBlockSize;
+
+        for (row = 0; row < h; row += vBlockSize) {
+          for (col = 0; col < w; col += hBlockSize) {
+
+            Bool different = FALSE;
+            int compareWidth = min(hBlockSize, w - col);
+            int compareHeight = min(vBlockSize, h - row);
+            int rows = compareHeight;
+            char *srcPtr = &src[row * pitch + col * ps];
+            char *dstPtr = &dst[row * pitch + col * ps];
+
+            while (rows--) {
+              if (cl->firstCompare ||
+                  memcmp(srcPtr, dstPtr, compareWidth * ps)) {
+                memcpy(dstPtr, srcPtr, compareWidth * ps);
+                different = TRUE;
+              }
+              srcPtr += pitch;
+              dstPtr += pitch;
             }
-            srcPtr += pitch;
-            dstPtr += pitch;
-          }
-          if (different || rfbInterframeDebug) {
-            RegionRec tmpRegion;
-            BoxRec box;
-            box.x1 = x + col;
-            box.y1 = y + row;
-            box.x2 = box.x1 + compareWidth;
-            box.y2 = box.y1 + compareHeight;
-
-            REGION_INIT(pScreen, &tmpRegion, &box, 1);
-            if (!different && rfbInterframeDebug &&
-                !RECT_IN_REGION(pScreen, &cl->ifRegion, &box)) {
-              int pad = pitch - compareWidth * ps;
-
-              dstPtr = &dst[row * pitch + col * ps];
-              REGION_UNION(pScreen, &idRegion, &idRegion, &tmpRegion);
-              rows = compareHeight;
-
-              while (rows--) {
-                char *endOfRow = &dstPtr[compareWidth * ps];
-                while (dstPtr < endOfRow)
-                  *dstPtr++ ^= 0xFF;
-                dstPtr += pad;
+            if (different || rfbInterframeDebug) {
+              RegionRec tmpRegion;
+              BoxRec box;
+              box.x1 = x + col;
+              box.y1 = y + row;
+              box.x2 = box.x1 + compareWidth;
+              box.y2 = box.y1 + compareHeight;
+
+              REGION_INIT(pScreen, &tmpRegion, &box, 1);
+              if (!different && rfbInterframeDebug &&
+                  !RECT_IN_REGION(pScreen, &cl->ifRegion, &box)) {
+                int pad = pitch - compareWidth * ps;
+
+                dstPtr = &dst[row * pitch + col * ps];
+                REGION_UNION(pScreen, &idRegion, &idRegion, &tmpRegion);
+                rows = compareHeight;
+
+                while (rows--) {
+                  char *endOfRow = &dstPtr[compareWidth * ps];
+                  while (dstPtr < endOfRow)
+                    *dstPtr++ ^= 0xFF;
+                  dstPtr += pad;
+                }
               }
+              REGION_UNION(pScreen, &cl->ifRegion, &cl->ifRegion, &tmpRegion);
+              REGION_UNINIT(pScreen, &tmpRegion);
+            }
+            if (!different)
+              cl->rfbICEPixelsIdentical += compareWidth * compareHeight;
+            if (!different && rfbProfile) {
+              idmpixels += (double)(compareWidth * compareHeight) / 1000000.;
+              if (!rfbInterframeDebug)
+                mpixels += (double)(compareWidth * compareHeight) / 1000000.;
             }
-            REGION_UNION(pScreen, &cl->ifRegion, &cl->ifRegion, &tmpRegion);
-            REGION_UNINIT(pScreen, &tmpRegion);
-          }
-          if (!different && rfbProfile) {
-            idmpixels += (double)(compareWidth * compareHeight) / 1000000.;
-            if (!rfbInterframeDebug)
-              mpixels += (double)(compareWidth * compareHeight) / 1000000.;
           }
         }
       }
@@ -2022,6 +2504,7 @@ Bool rfbSendFramebufferUpdate(rfbClientPtr cl)
     REGION_UNINIT(pScreen, &_updateRegion);
     REGION_NULL(pScreen, &_updateRegion);
     cl->firstCompare = FALSE;
+    TRACE_END(tICE, "ice", "pixels", cl->rfbICEPixelsCompared - icePixels);
 
     /* The Windows TurboVNC Viewer (and probably some other VNC viewers as
        well) will ignore any empty FBUs and stop sending FBURs when it
@@ -2043,36 +2526,40 @@ Bool rfbSendFramebufferUpdate(rfbClientPtr cl)
     goto abort;
 
   cl->rfbFramebufferUpdateMessagesSent++;
+  cl->tUpdateStart = tUpdateStart;
+  cl->tUpdateWait = 0.0;
+
+  boxes = GetUpdateOrder(updateRegion, &nBoxes);
 
   if (cl->preferredEncoding == rfbEncodingCoRRE) {
     nUpdateRegionRects = 0;
 
-    for (i = 0; i < REGION_NUM_RECTS(updateRegion); i++) {
-      int x = REGION_RECTS(updateRegion)[i].x1;
-      int y = REGION_RECTS(updateRegion)[i].y1;
-      int w = REGION_RECTS(updateRegion)[i].x2 - x;
-      int h = REGION_RECTS(updateRegion)[i].y2 - y;
+    for (i = 0; i < nBoxes; i++) {
+      int x = boxes[i].x1;
+      int y = boxes[i].y1;
+      int w = boxes[i].x2 - x;
+      int h = boxes[i].y2 - y;
       nUpdateRegionRects += (((w - 1) / cl->correMaxWidth + 1) *
                              ((h - 1) / cl->correMaxHeight + 1));
     }
   } else if (cl->preferredEncoding == rfbEncodingZlib) {
     nUpdateRegionRects = 0;
 
-    for (i = 0; i < REGION_NUM_RECTS(updateRegion); i++) {
-      int x = REGION_RECTS(updateRegion)[i].x1;
-      int y = REGION_RECTS(updateRegion)[i].y1;
-      int w = REGION_RECTS(updateRegion)[i].x2 - x;
-      int h = REGION_RECTS(updateRegion)[i].y2 - y;
+    for (i = 0; i < nBoxes; i++) {
+      int x = boxes[i].x1;
+      int y = boxes[i].y1;
+      int w = boxes[i].x2 - x;
+      int h = boxes[i].y2 - y;
       nUpdateRegionRects += (((h - 1) / (ZLIB_MAX_SIZE(w) / w)) + 1);
     }
   } else if (cl->preferredEncoding == rfbEncodingTight) {
     nUpdateRegionRects = 0;
 
-    for (i = 0; i < REGION_NUM_RECTS(updateRegion); i++) {
-      int x = REGION_RECTS(updateRegion)[i].x1;
-      int y = REGION_RECTS(updateRegion)[i].y1;
-      int w = REGION_RECTS(updateRegion)[i].x2 - x;
-      int h = REGION_RECTS(updateRegion)[i].y2 - y;
+    for (i = 0; i < nBoxes; i++) {
+      int x = boxes[i].x1;
+      int y = boxes[i].y1;
+      int w = boxes[i].x2 - x;
+      int h = boxes[i].y2 - y;
       int n = rfbNumCodedRectsTight(cl, x, y, w, h);
       if (n == 0) {
         nUpdateRegionRects = 0xFFFF;
@@ -2081,7 +2568,7 @@ Bool rfbSendFramebufferUpdate(rfbClientPtr cl)
       nUpdateRegionRects += n;
     }
   } else {
-    nUpdateRegionRects = REGION_NUM_RECTS(updateRegion);
+    nUpdateRegionRects = nBoxes;
   }
 
   fu->type = rfbFramebufferUpdate;
@@ -2092,9 +2579,11 @@ Bool rfbSendFramebufferUpdate(rfbClientPtr cl)
   } else {
     fu->nRects = 0xFFFF;
   }
-  ublen = sz_rfbFramebufferUpdateMsg;
+  cl->ublen = sz_rfbFramebufferUpdateMsg;
 
   cl->captureEnable = TRUE;
+  if (cl->bcastMembers)
+    rfbBcastBegin(cl);
 
   if (sendCursorShape) {
     cl->cursorWasChanged = FALSE;
@@ -2116,11 +2605,11 @@ Bool rfbSendFramebufferUpdate(rfbClientPtr cl)
   REGION_UNINIT(pScreen, &updateCopyRegion);
   REGION_NULL(pScreen, &updateCopyRegion);
 
-  for (i = 0; i < REGION_NUM_RECTS(updateRegion); i++) {
-    int x = REGION_RECTS(updateRegion)[i].x1;
-    int y = REGION_RECTS(updateRegion)[i].y1;
-    int w = REGION_RECTS(updateRegion)[i].x2 - x;
-    int h = REGION_RECTS(updateRegion)[i].y2 - y;
+  for (i = 0; i < nBoxes; i++) {
+    int x = boxes[i].x1;
+    int y = boxes[i].y1;
+    int w = boxes[i].x2 - x;
+    int h = boxes[i].y2 - y;
 
     cl->rfbRawBytesEquivalent += (sz_rfbFramebufferUpdateRectHeader +
                                  w * (cl->format.bitsPerPixel / 8) * h);
@@ -2154,14 +2643,18 @@ Bool rfbSendFramebufferUpdate(rfbClientPtr cl)
           goto abort;
         break;
       case rfbEncodingTight:
+        if (async) {
+          rfbTightQueueRect(cl, x, y, w, h);
+          break;
+        }
         if (!rfbSendRectEncodingTight(cl, x, y, w, h))
           goto abort;
         break;
     }
   }
 
-  if (cl->compareFB) {
-    if (rfbInterframeDebug) {
+  if (ICE_ENABLED(cl)) {
+    if (rfbInterframeDebug && cl->compareFB) {
       for (i = 0; i < REGION_NUM_RECTS(&idRegion); i++) {
         int x = REGION_RECTS(&idRegion)[i].x1;
         int y = REGION_RECTS(&idRegion)[i].y1;
@@ -2187,19 +2680,80 @@ Bool rfbSendFramebufferUpdate(rfbClientPtr cl)
     REGION_NULL(pScreen, updateRegion);
   }
 
-  if (nUpdateRegionRects == 0xFFFF && !rfbSendLastRectMarker(cl))
-    goto abort;
+  cl->updateLastRect = (nUpdateRegionRects == 0xFFFF);
+
+  if (async && rfbTightStartJob(cl)) {
+    cl->updateInProgress = TRUE;
+    return TRUE;
+  }
+
+  return rfbFinishFramebufferUpdate(cl);
+
+  abort:
+  if (!REGION_NIL(&updateCopyRegion))
+    REGION_UNINIT(pScreen, &updateCopyRegion);
+  if (rfbInterframeDebug && !REGION_NIL(&idRegion))
+    REGION_UNINIT(pScreen, &idRegion);
+  if (emptyUpdateRegion) {
+    /* Make sure cl hasn't been freed */
+    for (cl2 = rfbClientHead; cl2; cl2 = cl2->next) {
+      if (cl2 == cl) {
+        REGION_EMPTY(pScreen, updateRegion);
+        break;
+      }
+    }
+  } else if (!REGION_NIL(&_updateRegion)) {
+    REGION_UNINIT(pScreen, &_updateRegion);
+  }
+  return FALSE;
+}
+
+
+/*
+ * rfbFinishFramebufferUpdate - complete a framebuffer update that was started
+ * by rfbStartFramebufferUpdate().
+ */
+
+static Bool rfbFinishFramebufferUpdate(rfbClientPtr cl)
+{
+  if (cl->updateInProgress) {
+    cl->updateInProgress = FALSE;
+    if (!rfbTightFinishJob(cl))
+      return FALSE;
+  }
+
+  if (cl->updateLastRect && !rfbSendLastRectMarker(cl))
+    return FALSE;
 
   if (!rfbSendUpdateBuf(cl))
-    goto abort;
+    return FALSE;
 
   cl->captureEnable = FALSE;
+  if (cl->bcastSending)
+    rfbBcastFinish(cl);
 
   if (!rfbSendRTTPing(cl))
-    goto abort;
+    return FALSE;
+
+  /* Write the update to the socket (if rfbSendRTTPing() hasn't already done
+     so.) */
+  if (FlushOutput(cl) < 0) {
+    rfbLogPerror("rfbSendFramebufferUpdate: write");
+    rfbCloseClient(cl);
+    return FALSE;
+  }
+
+  rfbAQUpdate(cl);
+  if (rfbMetricsSocket)
+    rfbMetricsUpdateSent(cl);
+  if (rfbTraceEnabled)
+    rfbTraceAsyncSpan("update", cl->tUpdateStart, "update",
+                      cl->rfbFramebufferUpdateMessagesSent);
+  if (rfbAdaptiveDefer)
+    rfbAdaptDeferTime(cl, gettime() - cl->tUpdateStart - cl->tUpdateWait);
 
   if (rfbProfile) {
-    tUpdate += gettime() - tUpdateStart;
+    tUpdate += gettime() - cl->tUpdateStart;
     tElapsed = gettime() - tStart;
     iter++;
 
@@ -2210,11 +2764,12 @@ Bool rfbSendFramebufferUpdate(rfbClientPtr cl)
       rfbLog("Time/update:  Encode = %.3f ms,  Other = %.3f ms\n",
              tUpdate / (double)iter * 1000.,
              (tElapsed - tUpdate) / (double)iter * 1000.);
-      if (cl->compareFB) {
+      if (ICE_ENABLED(cl)) {
         rfbLog("Identical Mpixels/sec:  %.2f  (%f %%)\n",
                (double)idmpixels / tElapsed, idmpixels / mpixels * 100.0);
         idmpixels = 0.;
       }
+      if (rfbNumThreads > 1) rfbTightPrintProfile();
       tUpdate = 0.;
       iter = 0;
       mpixels = 0.;
@@ -2237,24 +2792,6 @@ Bool rfbSendFramebufferUpdate(rfbClientPtr cl)
 
   rfbUncorkSock(cl->sock);
   return TRUE;
-
-  abort:
-  if (!REGION_NIL(&updateCopyRegion))
-    REGION_UNINIT(pScreen, &updateCopyRegion);
-  if (rfbInterframeDebug && !REGION_NIL(&idRegion))
-    REGION_UNINIT(pScreen, &idRegion);
-  if (emptyUpdateRegion) {
-    /* Make sure cl hasn't been freed */
-    for (cl2 = rfbClientHead; cl2; cl2 = cl2->next) {
-      if (cl2 == cl) {
-        REGION_EMPTY(pScreen, updateRegion);
-        break;
-      }
-    }
-  } else if (!REGION_NIL(&_updateRegion)) {
-    REGION_UNINIT(pScreen, &_updateRegion);
-  }
-  return FALSE;
 }
 
 
@@ -2329,7 +2866,7 @@ static Bool rfbSendCopyRegion(rfbClientPtr cl, RegionPtr reg, int dx, int dy)
       thisRect = firstInNextBand - y_inc;
 
     while (nrectsInBand > 0) {
-      if ((ublen + sz_rfbFramebufferUpdateRectHeader + sz_rfbCopyRect) >
+      if ((cl->ublen + sz_rfbFramebufferUpdateRectHeader + sz_rfbCopyRect) >
           UPDATE_BUF_SIZE) {
         if (!rfbSendUpdateBuf(cl))
           return FALSE;
@@ -2340,7 +2877,9 @@ static Bool rfbSendCopyRegion(rfbClientPtr cl, RegionPtr reg, int dx, int dy)
       w = REGION_RECTS(reg)[thisRect].x2 - x;
       h = REGION_RECTS(reg)[thisRect].y2 - y;
 
-      if (cl->compareFB) {
+      if (cl->iceHashes)
+        rfbICEHashInvalidate(cl, x, y, w, h);
+      else if (cl->compareFB) {
         int pitch = rfbFB.paddedWidthInBytes;
         int ps = rfbServerFormat.bitsPerPixel / 8, rows = h;
         char *src = &rfbFB.pfbMemory[y * pitch + x * ps];
@@ -2366,15 +2905,15 @@ static Bool rfbSendCopyRegion(rfbClientPtr cl, RegionPtr reg, int dx, int dy)
       rect.r.h = Swap16IfLE(h);
       rect.encoding = Swap32IfLE(rfbEncodingCopyRect);
 
-      memcpy(&updateBuf[ublen], (char *)&rect,
+      memcpy(&cl->updateBuf[cl->ublen], (char *)&rect,
              sz_rfbFramebufferUpdateRectHeader);
-      ublen += sz_rfbFramebufferUpdateRectHeader;
+      cl->ublen += sz_rfbFramebufferUpdateRectHeader;
 
       cr.srcX = Swap16IfLE(x - dx);
       cr.srcY = Swap16IfLE(y - dy);
 
-      memcpy(&updateBuf[ublen], (char *)&cr, sz_rfbCopyRect);
-      ublen += sz_rfbCopyRect;
+      memcpy(&cl->updateBuf[cl->ublen], (char *)&cr, sz_rfbCopyRect);
+      cl->ublen += sz_rfbCopyRect;
 
       cl->rfbRectanglesSent[rfbEncodingCopyRect]++;
       cl->rfbBytesSent[rfbEncodingCopyRect] +=
@@ -2404,7 +2943,7 @@ Bool rfbSendRectEncodingRaw(rfbClientPtr cl, int x, int y, int w, int h)
     (cl->fb + (rfbFB.paddedWidthInBytes * y) + (x * (rfbFB.bitsPerPixel / 8)));
 
   /* Flush the buffer to guarantee correct alignment for translateFn(). */
-  if (ublen > 0) {
+  if (cl->ublen > 0) {
     if (!rfbSendUpdateBuf(cl))
       return FALSE;
   }
@@ -2415,24 +2954,25 @@ Bool rfbSendRectEncodingRaw(rfbClientPtr cl, int x, int y, int w, int h)
   rect.r.h = Swap16IfLE(h);
   rect.encoding = Swap32IfLE(rfbEncodingRaw);
 
-  memcpy(&updateBuf[ublen], (char *)&rect, sz_rfbFramebufferUpdateRectHeader);
-  ublen += sz_rfbFramebufferUpdateRectHeader;
+  memcpy(&cl->updateBuf[cl->ublen], (char *)&rect,
+         sz_rfbFramebufferUpdateRectHeader);
+  cl->ublen += sz_rfbFramebufferUpdateRectHeader;
 
   cl->rfbRectanglesSent[rfbEncodingRaw]++;
   cl->rfbBytesSent[rfbEncodingRaw] +=
     sz_rfbFramebufferUpdateRectHeader + bytesPerLine * h;
 
-  nlines = (UPDATE_BUF_SIZE - ublen) / bytesPerLine;
+  nlines = (UPDATE_BUF_SIZE - cl->ublen) / bytesPerLine;
 
   while (TRUE) {
     if (nlines > h)
       nlines = h;
 
     (*cl->translateFn) (cl->translateLookupTable, &rfbServerFormat,
-                        &cl->format, fbptr, &updateBuf[ublen],
+                        &cl->format, fbptr, &cl->updateBuf[cl->ublen],
                         rfbFB.paddedWidthInBytes, w, nlines);
 
-    ublen += nlines * bytesPerLine;
+    cl->ublen += nlines * bytesPerLine;
     h -= nlines;
 
     if (h == 0)         /* rect fitted in buffer, do next one */
@@ -2445,7 +2985,7 @@ Bool rfbSendRectEncodingRaw(rfbClientPtr cl, int x, int y, int w, int h)
 
     fbptr += (rfbFB.paddedWidthInBytes * nlines);
 
-    nlines = (UPDATE_BUF_SIZE - ublen) / bytesPerLine;
+    nlines = (UPDATE_BUF_SIZE - cl->ublen) / bytesPerLine;
     if (nlines == 0) {
       rfbLog("rfbSendRectEncodingRaw: send buffer too small for %d bytes per line\n",
              bytesPerLine);
@@ -2467,7 +3007,7 @@ static Bool rfbSendLastRectMarker(rfbClientPtr cl)
 {
   rfbFramebufferUpdateRectHeader rect;
 
-  if (ublen + sz_rfbFramebufferUpdateRectHeader > UPDATE_BUF_SIZE) {
+  if (cl->ublen + sz_rfbFramebufferUpdateRectHeader > UPDATE_BUF_SIZE) {
     if (!rfbSendUpdateBuf(cl))
       return FALSE;
   }
@@ -2478,8 +3018,9 @@ static Bool rfbSendLastRectMarker(rfbClientPtr cl)
   rect.r.w = 0;
   rect.r.h = 0;
 
-  memcpy(&updateBuf[ublen], (char *)&rect, sz_rfbFramebufferUpdateRectHeader);
-  ublen += sz_rfbFramebufferUpdateRectHeader;
+  memcpy(&cl->updateBuf[cl->ublen], (char *)&rect,
+         sz_rfbFramebufferUpdateRectHeader);
+  cl->ublen += sz_rfbFramebufferUpdateRectHeader;
 
   cl->rfbLastRectMarkersSent++;
   cl->rfbLastRectBytesSent += sz_rfbFramebufferUpdateRectHeader;
@@ -2489,30 +3030,101 @@ static Bool rfbSendLastRectMarker(rfbClientPtr cl)
 
 
 /*
- * Send the contents of updateBuf.  Returns 1 if successful, -1 if
- * not (errno should be set).
+ * Allocate a new update buffer for the client.
+ */
+
+static void rfbNewUpdateBuf(rfbClientPtr cl)
+{
+  cl->ubBlock =
+    (rfbOutputBlock *)rfbAlloc(sizeof(rfbOutputBlock) + UPDATE_BUF_SIZE);
+  memset(cl->ubBlock, 0, sizeof(rfbOutputBlock));
+  cl->updateBuf = cl->ubBlock->data;
+  cl->ublen = 0;
+}
+
+
+/*
+ * Send the contents of cl->updateBuf.  The update buffer is moved onto the
+ * client's output queue and replaced with a new one, and the queued data is
+ * written to the socket once the whole update has been encoded.  Returns
+ * TRUE if successful, FALSE if not (errno should be set).
  */
 
 Bool rfbSendUpdateBuf(rfbClientPtr cl)
 {
+  rfbOutputBlock *block = cl->ubBlock;
+
   /*
   int i;
-  for (i = 0; i < ublen; i++) {
-    fprintf(stderr, "%02x ", ((unsigned char *)updateBuf)[i]);
+  for (i = 0; i < cl->ublen; i++) {
+    fprintf(stderr, "%02x ", ((unsigned char *)cl->updateBuf)[i]);
   }
   fprintf(stderr, "\n");
   */
 
-  if (ublen > 0 && WriteExact(cl, updateBuf, ublen) < 0) {
+  if (cl->ublen == 0)
+    return TRUE;
+
+  if (cl->captureEnable && cl->captureFD >= 0)
+    rfbWriteCapture(cl, cl->updateBuf, cl->ublen);
+
+  /* If the buffer is mostly empty, then queue a copy of its contents rather
+     than tying up the whole buffer in the output queue. */
+  if (cl->ublen < UPDATE_BUF_SIZE / 2) {
+    if (cl->bcastSending)
+      rfbBcastQueue(cl, cl->updateBuf, cl->ublen);
+    if (QueueExact(cl, cl->updateBuf, cl->ublen) < 0) {
+      rfbLogPerror("rfbSendUpdateBuf: write");
+      rfbCloseClient(cl);
+      return FALSE;
+    }
+    cl->ublen = 0;
+    return TRUE;
+  }
+
+  block->len = cl->ublen;
+  rfbNewUpdateBuf(cl);
+
+  if (cl->bcastSending)
+    rfbBcastQueueBlock(cl, block);
+
+  if (WriteBlock(cl, block) < 0) {
     rfbLogPerror("rfbSendUpdateBuf: write");
     rfbCloseClient(cl);
     return FALSE;
   }
 
-  if (cl->captureEnable && cl->captureFD >= 0 && ublen > 0)
-    WriteCapture(cl->captureFD, updateBuf, ublen);
+  return TRUE;
+}
+
+
+/*
+ * Append an output block that was filled by an encoder (such as a block of
+ * compressed data or the output of an encoding thread) to the current update,
+ * after the contents of cl->updateBuf.  The block is passed to the output
+ * queue by reference, and the queue takes ownership of it.  Returns TRUE if
+ * successful, FALSE if not.
+ */
+
+Bool rfbSendUpdateBlock(rfbClientPtr cl, rfbOutputBlock *block)
+{
+  if (!rfbSendUpdateBuf(cl)) {
+    rfbFreeOutputBlock(block);
+    return FALSE;
+  }
+
+  if (cl->captureEnable && cl->captureFD >= 0)
+    rfbWriteCapture(cl, BLOCK_DATA(block), block->len);
+
+  if (cl->bcastSending)
+    rfbBcastQueueBlock(cl, block);
+
+  if (WriteBlock(cl, block) < 0) {
+    rfbLogPerror("rfbSendUpdateBlock: write");
+    rfbCloseClient(cl);
+    return FALSE;
+  }
 
-  ublen = 0;
   return TRUE;
 }
 
@@ -2560,7 +3172,7 @@ Bool rfbSendSetColourMapEntries(rfbClientPtr cl, int firstColour, int nColours)
   }
 
   if (cl->captureFD >= 0)
-    WriteCapture(cl->captureFD, buf, len);
+    rfbWriteCapture(cl, buf, len);
 
   return TRUE;
 }
@@ -2586,7 +3198,7 @@ void rfbSendBell(void)
       continue;
     }
     if (cl->captureFD >= 0)
-      WriteCapture(cl->captureFD, (char *)&b, sz_rfbBellMsg);
+      rfbWriteCapture(cl, (char *)&b, sz_rfbBellMsg);
   }
 }
 
@@ -2627,7 +3239,7 @@ void rfbSendServerCutText(char *str, int len)
       continue;
     }
     if (cl->captureFD >= 0)
-      WriteCapture(cl->captureFD, str, len);
+      rfbWriteCapture(cl, str, len);
   }
   LogMessage(X_DEBUG, "Sent server clipboard: '%.*s%s' (%d bytes)\n",
              len <= 20 ? len : 20, str, len <= 20 ? "" : "...", len);
@@ -209,6 +209,11 @@ int rfbssl_write(rfbClientPtr cl, const char *buf, int bufsize)
   int ret;
 
   while ((ret = gnutls_record_send(ctx->session, buf, bufsize)) < 0) {
+    if (ret == GNUTLS_E_AGAIN) {
+      /* Let the caller retry the write later with the same data. */
+      errno = EAGAIN;
+      return -1;
+    }
     if (gnutls_error_is_fatal(ret))
       break;
   }
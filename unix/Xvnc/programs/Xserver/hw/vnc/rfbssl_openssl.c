@@ -23,6 +23,7 @@
  */
 
 #include "rfb.h"
+#include <errno.h>
 #ifdef DLOPENSSL
 #define OPENSSL_API_COMPAT 0x10100000L
 #endif
@@ -435,6 +436,8 @@ rfbSslCtx *rfbssl_init(rfbClientPtr cl, Bool anon)
     }
   }
   ssl.SSL_CTX_ctrl(ctx->ssl_ctx, SSL_CTRL_SET_ECDH_AUTO, 1, NULL);
+  ssl.SSL_CTX_ctrl(ctx->ssl_ctx, SSL_CTRL_MODE,
+                   SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER, NULL);
   if ((ctx->ssl = ssl.SSL_new(ctx->ssl_ctx)) == NULL) {
     rfbssl_error("SSL_new()");
     goto bailout;
@@ -505,9 +508,13 @@ int rfbssl_write(rfbClientPtr cl, const char *buf, int bufsize)
     return -1;
 #endif
 
-  while ((ret = ssl.SSL_write(ctx->ssl, buf, bufsize)) <= 0) {
-    if (ssl.SSL_get_error(ctx->ssl, ret) != SSL_ERROR_WANT_WRITE)
-      break;
+  /* If the socket isn't writable, then let the caller retry the write later
+     (possibly with the same data at a different address.) */
+  if ((ret = ssl.SSL_write(ctx->ssl, buf, bufsize)) <= 0) {
+    if (ssl.SSL_get_error(ctx->ssl, ret) == SSL_ERROR_WANT_WRITE) {
+      errno = EAGAIN;
+      return -1;
+    }
   }
 
   return ret;
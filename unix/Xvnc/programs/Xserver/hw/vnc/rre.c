@@ -110,7 +110,7 @@ Bool rfbSendRectEncodingRRE(rfbClientPtr cl, int x, int y, int w, int h)
   cl->rfbBytesSent[rfbEncodingRRE] +=
     (sz_rfbFramebufferUpdateRectHeader + sz_rfbRREHeader + rreAfterBufLen);
 
-  if (ublen + sz_rfbFramebufferUpdateRectHeader + sz_rfbRREHeader >
+  if (cl->ublen + sz_rfbFramebufferUpdateRectHeader + sz_rfbRREHeader >
       UPDATE_BUF_SIZE) {
     if (!rfbSendUpdateBuf(cl))
       return FALSE;
@@ -122,27 +122,29 @@ Bool rfbSendRectEncodingRRE(rfbClientPtr cl, int x, int y, int w, int h)
   rect.r.h = Swap16IfLE(h);
   rect.encoding = Swap32IfLE(rfbEncodingRRE);
 
-  memcpy(&updateBuf[ublen], (char *)&rect, sz_rfbFramebufferUpdateRectHeader);
-  ublen += sz_rfbFramebufferUpdateRectHeader;
+  memcpy(&cl->updateBuf[cl->ublen], (char *)&rect,
+
+         sz_rfbFramebufferUpdateRectHeader);
+  cl->ublen += sz_rfbFramebufferUpdateRectHeader;
 
   hdr.nSubrects = Swap32IfLE(nSubrects);
 
-  memcpy(&updateBuf[ublen], (char *)&hdr, sz_rfbRREHeader);
-  ublen += sz_rfbRREHeader;
+  memcpy(&cl->updateBuf[cl->ublen], (char *)&hdr, sz_rfbRREHeader);
+  cl->ublen += sz_rfbRREHeader;
 
   for (i = 0; i < rreAfterBufLen;) {
 
-    int bytesToCopy = UPDATE_BUF_SIZE - ublen;
+    int bytesToCopy = UPDATE_BUF_SIZE - cl->ublen;
 
     if (i + bytesToCopy > rreAfterBufLen)
       bytesToCopy = rreAfterBufLen - i;
 
-    memcpy(&updateBuf[ublen], &rreAfterBuf[i], bytesToCopy);
+    memcpy(&cl->updateBuf[cl->ublen], &rreAfterBuf[i], bytesToCopy);
 
-    ublen += bytesToCopy;
+    cl->ublen += bytesToCopy;
     i += bytesToCopy;
 
-    if (ublen == UPDATE_BUF_SIZE) {
+    if (cl->ublen == UPDATE_BUF_SIZE) {
       if (!rfbSendUpdateBuf(cl))
         return FALSE;
     }
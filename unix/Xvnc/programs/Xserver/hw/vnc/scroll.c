@@ -0,0 +1,367 @@
+/*
+ * scroll.c
+ *
+ * Detection of scrolled and moved content in damaged regions
+ */
+
+/*
+ *  This is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This software is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this software; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301,
+ *  USA.
+ */
+
+/* Most modern toolkits scroll by redrawing the scrolled area with PutImage or
+   Composite rather than CopyArea, so rfbCopyArea() never sees the scroll.  To
+   catch these scrolls, we keep a copy of the framebuffer as the client last
+   saw it (scrollFB) along with the region of that copy that is known to be
+   valid (scrollValid.)  Before an update is encoded, each large rectangle of
+   the modified region is hashed one row (or column) at a time, both in the
+   framebuffer and in scrollFB.  Rows that have changed vote for the shift that
+   maps them onto a unique row of the old contents, and the longest run of
+   rows that match under the winning shift is moved from the modified region to
+   the copy region, so it will be sent as a CopyRect. */
+
+#include <stdlib.h>
+#include <string.h>
+#include "rfb.h"
+
+
+Bool rfbScrollDetect = FALSE;
+
+/* Rectangles smaller than this in either dimension are not examined */
+#define SCROLL_MIN_SIZE  64
+
+/* Minimum number of rows or columns that must match under a shift */
+#define SCROLL_MIN_LINES  16
+
+#define PRIME64_1  0x9E3779B185EBCA87ULL
+#define PRIME64_2  0xC2B2AE3D27D4EB4FULL
+
+#define ROTL64(x, r)  (((x) << (r)) | ((x) >> (64 - (r))))
+
+#define MIX(h, v) {  \
+  h ^= (v) * PRIME64_2;  \
+  h = ROTL64(h, 31) * PRIME64_1;  \
+}
+
+/* Index of the old line referenced by an entry in the line table */
+#define TABLE_INDEX(e)  ((e) >= 0 ? (e) : -(e) - 2)
+
+static CARD64 *newHashes = NULL, *oldHashes = NULL;
+static int *votes = NULL, *table = NULL;
+static BoxPtr boxes = NULL;
+static int hashesSize = 0, boxesSize = 0;
+
+
+Bool rfbScrollInit(rfbClientPtr cl)
+{
+  if (!(cl->scrollFB =
+        (char *)malloc(rfbFB.paddedWidthInBytes * rfbFB.height)))
+    return FALSE;
+  REGION_INIT(pScreen, &cl->scrollValid, NullBox, 0);
+  return TRUE;
+}
+
+
+void rfbScrollFree(rfbClientPtr cl)
+{
+  if (cl->scrollFB) {
+    free(cl->scrollFB);
+    REGION_UNINIT(pScreen, &cl->scrollValid);
+  }
+  cl->scrollFB = NULL;
+}
+
+
+/*
+ * Record that the client's copy of the given region now matches the
+ * framebuffer.
+ */
+
+void rfbScrollUpdate(rfbClientPtr cl, RegionPtr reg)
+{
+  int pitch = rfbFB.paddedWidthInBytes;
+  int ps = rfbServerFormat.bitsPerPixel / 8, i;
+
+  if (!cl->scrollFB || !REGION_NOTEMPTY(pScreen, reg)) return;
+
+  for (i = 0; i < REGION_NUM_RECTS(reg); i++) {
+    BoxPtr box = &REGION_RECTS(reg)[i];
+    int offset = box->y1 * pitch + box->x1 * ps, rows = box->y2 - box->y1;
+    char *src = &rfbFB.pfbMemory[offset], *dst = &cl->scrollFB[offset];
+
+    while (rows--) {
+      memcpy(dst, src, (box->x2 - box->x1) * ps);
+      src += pitch;
+      dst += pitch;
+    }
+  }
+  REGION_UNION(pScreen, &cl->scrollValid, &cl->scrollValid, reg);
+}
+
+
+static Bool AllocScratch(int n)
+{
+  if (n > hashesSize) {
+    int size = 1;
+
+    while (size < n * 2) size <<= 1;
+    free(newHashes);  free(oldHashes);  free(votes);  free(table);
+    newHashes = (CARD64 *)malloc(n * sizeof(CARD64));
+    oldHashes = (CARD64 *)malloc(n * sizeof(CARD64));
+    votes = (int *)malloc((n * 2 + 1) * sizeof(int));
+    table = (int *)malloc(size * sizeof(int));
+    if (!newHashes || !oldHashes || !votes || !table) {
+      free(newHashes);  free(oldHashes);  free(votes);  free(table);
+      newHashes = oldHashes = NULL;  votes = table = NULL;
+      hashesSize = 0;
+      return FALSE;
+    }
+    hashesSize = n;
+  }
+  return TRUE;
+}
+
+
+/*
+ * Compute a hash of each row of the given box.
+ */
+
+static void HashRows(const char *fb, BoxPtr box, CARD64 *hashes)
+{
+  int pitch = rfbFB.paddedWidthInBytes;
+  int ps = rfbServerFormat.bitsPerPixel / 8;
+  int rowBytes = (box->x2 - box->x1) * ps, y;
+  const char *ptr = &fb[box->y1 * pitch + box->x1 * ps];
+
+  for (y = box->y1; y < box->y2; y++, ptr += pitch) {
+    CARD64 h = PRIME64_1, val;
+    const char *p = ptr, *end = ptr + rowBytes;
+
+    while (end - p >= 8) {
+      memcpy(&val, p, 8);
+      MIX(h, val);
+      p += 8;
+    }
+    if (p < end) {
+      val = 0;
+      memcpy(&val, p, end - p);
+      MIX(h, val);
+    }
+    *hashes++ = h ^ (h >> 32);
+  }
+}
+
+
+/*
+ * Compute a hash of each column of the given box.  The framebuffer is still
+ * traversed one row at a time, so that the memory accesses are sequential.
+ */
+
+static void HashColumns(const char *fb, BoxPtr box, CARD64 *hashes)
+{
+  int pitch = rfbFB.paddedWidthInBytes;
+  int ps = rfbServerFormat.bitsPerPixel / 8;
+  int w = box->x2 - box->x1, x, y;
+  const char *ptr = &fb[box->y1 * pitch + box->x1 * ps];
+
+  for (x = 0; x < w; x++)
+    hashes[x] = PRIME64_1;
+
+  for (y = box->y1; y < box->y2; y++, ptr += pitch) {
+    switch (ps) {
+      case 4:
+      {
+        const CARD32 *p = (const CARD32 *)ptr;
+        for (x = 0; x < w; x++) MIX(hashes[x], (CARD64)p[x]);
+        break;
+      }
+      case 2:
+      {
+        const CARD16 *p = (const CARD16 *)ptr;
+        for (x = 0; x < w; x++) MIX(hashes[x], (CARD64)p[x]);
+        break;
+      }
+      default:
+      {
+        const CARD8 *p = (const CARD8 *)ptr;
+        for (x = 0; x < w; x++) MIX(hashes[x], (CARD64)p[x]);
+      }
+    }
+  }
+
+  for (x = 0; x < w; x++)
+    hashes[x] ^= hashes[x] >> 32;
+}
+
+
+/*
+ * Given the hashes of n lines (rows or columns) in the new and old contents of
+ * a box, find the shift that maps the most changed lines onto unique lines of
+ * the old contents.  If such a shift exists, return the longest run of lines
+ * [*start, *end) for which new line i matches old line i - *shift.
+ */
+
+static Bool FindShift(int n, int *shift, int *start, int *end)
+{
+  int mask, i, best = 0, bestVotes = 0, runStart = -1;
+
+  for (mask = 1; mask < n * 2; mask <<= 1);
+  mask--;
+
+  /* Build an index of the old lines.  Lines that occur more than once (such
+     as blank lines) are marked as ambiguous (negative), since they can't be
+     used to determine the shift. */
+
+  for (i = 0; i <= mask; i++) table[i] = -1;
+  for (i = 0; i < n; i++) {
+    int j = (int)(oldHashes[i] & mask);
+
+    while (table[j] != -1 && oldHashes[TABLE_INDEX(table[j])] != oldHashes[i])
+      j = (j + 1) & mask;
+    table[j] = (table[j] == -1) ? i : -TABLE_INDEX(table[j]) - 2;
+  }
+
+  memset(votes, 0, (n * 2 + 1) * sizeof(int));
+  for (i = 0; i < n; i++) {
+    int j = (int)(newHashes[i] & mask);
+
+    if (newHashes[i] == oldHashes[i]) continue;
+    while (table[j] != -1 && oldHashes[TABLE_INDEX(table[j])] != newHashes[i])
+      j = (j + 1) & mask;
+    if (table[j] >= 0 && ++votes[i - table[j] + n] > bestVotes) {
+      bestVotes = votes[i - table[j] + n];
+      best = i - table[j];
+    }
+  }
+  if (bestVotes < SCROLL_MIN_LINES) return FALSE;
+
+  *start = *end = 0;
+  for (i = max(0, best); i <= min(n, n + best); i++) {
+    if (i < min(n, n + best) && newHashes[i] == oldHashes[i - best]) {
+      if (runStart < 0) runStart = i;
+    } else if (runStart >= 0) {
+      if (i - runStart > *end - *start) {
+        *start = runStart;  *end = i;
+      }
+      runStart = -1;
+    }
+  }
+  *shift = best;
+  return *end - *start >= SCROLL_MIN_LINES;
+}
+
+
+static Bool DetectShift(rfbClientPtr cl, BoxPtr box, int *dx, int *dy,
+                        BoxPtr dst)
+{
+  int w = box->x2 - box->x1, h = box->y2 - box->y1, shift, start, end;
+
+  if (!AllocScratch(max(w, h))) return FALSE;
+
+  HashRows(rfbFB.pfbMemory, box, newHashes);
+  HashRows(cl->scrollFB, box, oldHashes);
+  if (FindShift(h, &shift, &start, &end)) {
+    dst->x1 = box->x1;  dst->x2 = box->x2;
+    dst->y1 = box->y1 + start;  dst->y2 = box->y1 + end;
+    *dx = 0;  *dy = shift;
+    return TRUE;
+  }
+
+  HashColumns(rfbFB.pfbMemory, box, newHashes);
+  HashColumns(cl->scrollFB, box, oldHashes);
+  if (FindShift(w, &shift, &start, &end)) {
+    dst->x1 = box->x1 + start;  dst->x2 = box->x1 + end;
+    dst->y1 = box->y1;  dst->y2 = box->y2;
+    *dx = shift;  *dy = 0;
+    return TRUE;
+  }
+
+  return FALSE;
+}
+
+
+/*
+ * Look for scrolled or moved content in the client's modified region, and
+ * convert any that is found into a copy.  Only one translation can be sent
+ * per update, so a shift that differs from that of the existing copy region
+ * is ignored.  At most one framebuffer's worth of pixels is examined per
+ * update.
+ */
+
+void rfbScrollDetectRegion(rfbClientPtr cl)
+{
+  int nBoxes = 0, i, budget = rfbFB.width * rfbFB.height;
+
+  if (!cl->scrollFB || !cl->useCopyRect ||
+      !REGION_NOTEMPTY(pScreen, &cl->modifiedRegion))
+    return;
+
+  /* A region is stored as bands of rectangles, so a damaged area that shares
+     rows with some other damage is split into several rectangles.  Merge
+     vertically adjacent rectangles that span the same columns, so that each
+     scrolled area is examined as a whole. */
+
+  if (REGION_NUM_RECTS(&cl->modifiedRegion) > boxesSize) {
+    free(boxes);
+    boxesSize = REGION_NUM_RECTS(&cl->modifiedRegion);
+    if (!(boxes = (BoxPtr)malloc(boxesSize * sizeof(BoxRec)))) {
+      boxesSize = 0;
+      return;
+    }
+  }
+  for (i = 0; i < REGION_NUM_RECTS(&cl->modifiedRegion); i++) {
+    BoxPtr rect = &REGION_RECTS(&cl->modifiedRegion)[i];
+    int j;
+
+    if (rect->x2 - rect->x1 < SCROLL_MIN_SIZE) continue;
+    for (j = nBoxes - 1; j >= 0; j--) {
+      if (boxes[j].x1 == rect->x1 && boxes[j].x2 == rect->x2 &&
+          boxes[j].y2 == rect->y1) {
+        boxes[j].y2 = rect->y2;
+        break;
+      }
+    }
+    if (j < 0) boxes[nBoxes++] = *rect;
+  }
+
+  for (i = 0; i < nBoxes; i++) {
+    BoxRec dst, src;
+    int w = boxes[i].x2 - boxes[i].x1, h = boxes[i].y2 - boxes[i].y1;
+    int dx, dy;
+    RegionRec tmpRegion;
+
+    if (w < SCROLL_MIN_SIZE || h < SCROLL_MIN_SIZE || w * h > budget)
+      continue;
+    budget -= w * h;
+
+    if (!DetectShift(cl, &boxes[i], &dx, &dy, &dst)) continue;
+    if (REGION_NOTEMPTY(pScreen, &cl->copyRegion) &&
+        (dx != cl->copyDX || dy != cl->copyDY))
+      continue;
+
+    /* The client must have a valid copy of the source. */
+    src.x1 = dst.x1 - dx;  src.x2 = dst.x2 - dx;
+    src.y1 = dst.y1 - dy;  src.y2 = dst.y2 - dy;
+    if (RECT_IN_REGION(pScreen, &cl->scrollValid, &src) != rgnIN) continue;
+
+    REGION_INIT(pScreen, &tmpRegion, &dst, 1);
+    REGION_UNION(pScreen, &cl->copyRegion, &cl->copyRegion, &tmpRegion);
+    REGION_SUBTRACT(pScreen, &cl->modifiedRegion, &cl->modifiedRegion,
+                    &tmpRegion);
+    REGION_UNINIT(pScreen, &tmpRegion);
+    cl->copyDX = dx;
+    cl->copyDY = dy;
+  }
+}
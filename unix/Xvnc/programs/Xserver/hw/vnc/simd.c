@@ -0,0 +1,545 @@
+/*
+ * simd.c - SIMD pixel-scanning and translation kernels
+ */
+
+/*
+ *  This is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This software is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this software; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301,
+ *  USA.
+ */
+
+/* The Tight encoder spends much of its time at low compression levels
+   checking whether tiles are solid and counting the colors in subrectangles.
+   Both operations boil down to finding the end of a run of pixels that are
+   equal to one (or one of two) colors, so they are implemented here as
+   kernels that compare a whole vector of pixels at once.  This file also
+   contains kernels that translate 32-bit pixels into the most common viewer
+   pixel formats using byte shuffles.  It does not depend on the X server, so
+   it can also be linked with simdbench. */
+
+#include <stdlib.h>
+#include <string.h>
+#include <X11/Xmd.h>
+#include <rfbproto.h>
+#include "simd.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__)) && \
+  (defined(__clang__) || __GNUC__ > 4 || \
+   (__GNUC__ == 4 && __GNUC_MINOR__ >= 9))
+#define SIMD_X86
+#include <cpuid.h>
+#include <immintrin.h>
+#elif defined(__GNUC__) && defined(__aarch64__)
+#define SIMD_NEON
+#include <arm_neon.h>
+#endif
+
+
+#define DEFINE_SCALAR_FUNCTIONS(bpp)                                          \
+                                                                              \
+static int ScanRun##bpp##_C(const CARD##bpp *p, int n, CARD##bpp c,           \
+                            CARD##bpp mask)                                   \
+{                                                                             \
+  int i;                                                                      \
+                                                                              \
+  for (i = 0; i < n && (CARD##bpp)(p[i] & mask) == c; i++);                   \
+  return i;                                                                   \
+}                                                                             \
+                                                                              \
+static int ScanTwo##bpp##_C(const CARD##bpp *p, int n, CARD##bpp c0,          \
+                            CARD##bpp c1, CARD##bpp mask, int *n0)            \
+{                                                                             \
+  int i, count0 = 0;                                                          \
+                                                                              \
+  for (i = 0; i < n; i++) {                                                   \
+    CARD##bpp pix = p[i] & mask;                                              \
+                                                                              \
+    if (pix == c0)                                                            \
+      count0++;                                                               \
+    else if (pix != c1)                                                       \
+      break;                                                                  \
+  }                                                                           \
+  *n0 += count0;                                                              \
+  return i;                                                                   \
+}
+
+DEFINE_SCALAR_FUNCTIONS(8)
+DEFINE_SCALAR_FUNCTIONS(16)
+DEFINE_SCALAR_FUNCTIONS(32)
+
+
+/*
+ * The scalar translation functions are used only to translate the pixels at
+ * the end of a row that do not fill a whole vector.  They compute exactly
+ * the same values as the lookup tables in translate.c.
+ */
+
+static void Swizzle32_C(const CARD32 *in, CARD32 *out, int n,
+                        const rfbTranslateParams *params)
+{
+  const CARD8 *ip = (const CARD8 *)in;
+  CARD8 *op = (CARD8 *)out;
+  int i, k;
+
+  for (i = 0; i < n; i++, ip += 4, op += 4) {
+    for (k = 0; k < 4; k++)
+      op[k] = (params->shuffle[k] & 0x80) ? 0 : ip[params->shuffle[k]];
+  }
+}
+
+
+/* (v * outMax + 127) / 255 == (t + (t >> 8)) >> 8, where t =
+   v * outMax + 128, for all v and outMax in 0..255. */
+
+static void Pack32to16_C(const CARD32 *in, CARD16 *out, int n,
+                         const rfbTranslateParams *params)
+{
+  int i, c;
+
+  for (i = 0; i < n; i++) {
+    CARD32 result = 0;
+
+    for (c = 0; c < 3; c++) {
+      CARD32 t = ((in[i] >> params->inShift[c]) & 0xFF) * params->outMax[c] +
+                 128;
+
+      result |= ((t + (t >> 8)) >> 8) << params->outShift[c];
+    }
+    if (params->swap)
+      result = (result >> 8) | (result << 8);
+    out[i] = (CARD16)result;
+  }
+}
+
+
+static const rfbSIMDFuncs scalarFuncs = {
+  "none",
+  ScanRun8_C, ScanRun16_C, ScanRun32_C,
+  ScanTwo8_C, ScanTwo16_C, ScanTwo32_C,
+  NULL, NULL
+};
+
+rfbSIMDFuncs rfbSIMD = {
+  "none",
+  ScanRun8_C, ScanRun16_C, ScanRun32_C,
+  ScanTwo8_C, ScanTwo16_C, ScanTwo32_C,
+  NULL, NULL
+};
+
+
+#ifdef SIMD_X86
+
+/*
+ * The SSE2 and AVX2 kernels are generated from the same template.  Each
+ * iteration compares one vector of pixels against the color(s), and the
+ * byte mask returned by movemask tells us where the first mismatch is.  The
+ * pixels at the end of the row that do not fill a whole vector are handed off
+ * to the "tail" function (the SSE2 function for AVX2, since Tight's 16x16
+ * tiles are often narrower than an AVX2 vector, and the scalar function for
+ * SSE2.)
+ */
+
+#define SSE2_ATTR  __attribute__((target("sse2")))
+#define AVX2_ATTR  __attribute__((target("avx2,popcnt")))
+
+#define DEFINE_X86_FUNCTIONS(bpp, isa, attr, pre, vtype, si, full, tail)      \
+                                                                              \
+attr static int ScanRun##bpp##_##isa(const CARD##bpp *p, int n, CARD##bpp c,  \
+                                     CARD##bpp mask)                          \
+{                                                                             \
+  const vtype vc = pre##_set1_epi##bpp(c), vm = pre##_set1_epi##bpp(mask);    \
+  const int pix = sizeof(vtype) / (bpp / 8);                                  \
+  int i;                                                                      \
+                                                                              \
+  for (i = 0; i <= n - pix; i += pix) {                                       \
+    vtype v = pre##_and_##si(pre##_loadu_##si((const vtype *)&p[i]), vm);     \
+    unsigned int eq = pre##_movemask_epi8(pre##_cmpeq_epi##bpp(v, vc));       \
+                                                                              \
+    if (eq != full)                                                           \
+      return i + __builtin_ctz(~eq) / (bpp / 8);                              \
+  }                                                                           \
+  return i + ScanRun##bpp##_##tail(&p[i], n - i, c, mask);                    \
+}                                                                             \
+                                                                              \
+attr static int ScanTwo##bpp##_##isa(const CARD##bpp *p, int n,               \
+                                     CARD##bpp c0, CARD##bpp c1,              \
+                                     CARD##bpp mask, int *n0)                 \
+{                                                                             \
+  const vtype vc0 = pre##_set1_epi##bpp(c0), vc1 = pre##_set1_epi##bpp(c1);   \
+  const vtype vm = pre##_set1_epi##bpp(mask);                                 \
+  const int pix = sizeof(vtype) / (bpp / 8);                                  \
+  int i, count0 = 0;                                                          \
+                                                                              \
+  for (i = 0; i <= n - pix; i += pix) {                                       \
+    vtype v = pre##_and_##si(pre##_loadu_##si((const vtype *)&p[i]), vm);     \
+    vtype eq0 = pre##_cmpeq_epi##bpp(v, vc0);                                 \
+    unsigned int eq = pre##_movemask_epi8(                                    \
+      pre##_or_##si(eq0, pre##_cmpeq_epi##bpp(v, vc1)));                      \
+                                                                              \
+    /* Let the tail function find the mismatch and count the pixels before   \
+       it. */                                                                 \
+    if (eq != full)                                                           \
+      break;                                                                  \
+    count0 +=                                                                 \
+      __builtin_popcount(pre##_movemask_epi8(eq0)) / (bpp / 8);               \
+  }                                                                           \
+  *n0 += count0;                                                              \
+  return i + ScanTwo##bpp##_##tail(&p[i], n - i, c0, c1, mask, n0);           \
+}
+
+DEFINE_X86_FUNCTIONS(8, SSE2, SSE2_ATTR, _mm, __m128i, si128, 0xFFFFU, C)
+DEFINE_X86_FUNCTIONS(16, SSE2, SSE2_ATTR, _mm, __m128i, si128, 0xFFFFU, C)
+DEFINE_X86_FUNCTIONS(32, SSE2, SSE2_ATTR, _mm, __m128i, si128, 0xFFFFU, C)
+
+static const rfbSIMDFuncs sse2Funcs = {
+  "SSE2",
+  ScanRun8_SSE2, ScanRun16_SSE2, ScanRun32_SSE2,
+  ScanTwo8_SSE2, ScanTwo16_SSE2, ScanTwo32_SSE2,
+  NULL, NULL
+};
+
+
+/*
+ * Translation kernels.  The 32-bit to 32-bit swizzle is a single pshufb per
+ * vector.  The 32-bit to 16-bit packing rescales each component in 32-bit
+ * lanes (using a 16-bit multiply, since both factors fit in 8 bits) and then
+ * uses pshufb to gather the low 16 bits of each lane, byte-swapping them if
+ * necessary.
+ */
+
+#define SSSE3_ATTR  __attribute__((target("ssse3")))
+
+SSSE3_ATTR static void Swizzle32_SSSE3(const CARD32 *in, CARD32 *out, int n,
+                                       const rfbTranslateParams *params)
+{
+  const __m128i ctl = _mm_loadu_si128((const __m128i *)params->shuffle);
+  int i;
+
+  for (i = 0; i <= n - 4; i += 4)
+    _mm_storeu_si128((__m128i *)&out[i],
+                     _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)&in[i]),
+                                      ctl));
+  Swizzle32_C(&in[i], &out[i], n - i, params);
+}
+
+
+SSSE3_ATTR static void Pack32to16_SSSE3(const CARD32 *in, CARD16 *out, int n,
+                                        const rfbTranslateParams *params)
+{
+  const __m128i ff = _mm_set1_epi32(0xFF), round = _mm_set1_epi32(128);
+  const __m128i ctl = params->swap ?
+    _mm_setr_epi8(1, 0, 5, 4, 9, 8, 13, 12, -1, -1, -1, -1, -1, -1, -1, -1) :
+    _mm_setr_epi8(0, 1, 4, 5, 8, 9, 12, 13, -1, -1, -1, -1, -1, -1, -1, -1);
+  __m128i outMax[3], inShift[3], outShift[3];
+  int i, c;
+
+  for (c = 0; c < 3; c++) {
+    outMax[c] = _mm_set1_epi32(params->outMax[c]);
+    inShift[c] = _mm_cvtsi32_si128(params->inShift[c]);
+    outShift[c] = _mm_cvtsi32_si128(params->outShift[c]);
+  }
+
+  for (i = 0; i <= n - 4; i += 4) {
+    __m128i pix = _mm_loadu_si128((const __m128i *)&in[i]);
+    __m128i result = _mm_setzero_si128();
+
+    for (c = 0; c < 3; c++) {
+      __m128i t = _mm_and_si128(_mm_srl_epi32(pix, inShift[c]), ff);
+
+      t = _mm_add_epi32(_mm_mullo_epi16(t, outMax[c]), round);
+      t = _mm_srli_epi32(_mm_add_epi32(t, _mm_srli_epi32(t, 8)), 8);
+      result = _mm_or_si128(result, _mm_sll_epi32(t, outShift[c]));
+    }
+    _mm_storel_epi64((__m128i *)&out[i], _mm_shuffle_epi8(result, ctl));
+  }
+  Pack32to16_C(&in[i], &out[i], n - i, params);
+}
+
+static const rfbSIMDFuncs ssse3Funcs = {
+  "SSSE3",
+  ScanRun8_SSE2, ScanRun16_SSE2, ScanRun32_SSE2,
+  ScanTwo8_SSE2, ScanTwo16_SSE2, ScanTwo32_SSE2,
+  Swizzle32_SSSE3, Pack32to16_SSSE3
+};
+
+DEFINE_X86_FUNCTIONS(8, AVX2, AVX2_ATTR, _mm256, __m256i, si256,
+                     0xFFFFFFFFU, SSE2)
+DEFINE_X86_FUNCTIONS(16, AVX2, AVX2_ATTR, _mm256, __m256i, si256,
+                     0xFFFFFFFFU, SSE2)
+DEFINE_X86_FUNCTIONS(32, AVX2, AVX2_ATTR, _mm256, __m256i, si256,
+                     0xFFFFFFFFU, SSE2)
+
+
+/* vpshufb shuffles each 128-bit lane separately, which is fine for the
+   swizzle, since pixels never cross lanes.  For the packing, the 16-bit
+   results end up in the low half of each lane, so vpermq is used to combine
+   them. */
+
+AVX2_ATTR static void Swizzle32_AVX2(const CARD32 *in, CARD32 *out, int n,
+                                     const rfbTranslateParams *params)
+{
+  const __m256i ctl =
+    _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)
+                                                params->shuffle));
+  int i;
+
+  for (i = 0; i <= n - 8; i += 8)
+    _mm256_storeu_si256((__m256i *)&out[i],
+                        _mm256_shuffle_epi8(_mm256_loadu_si256((const __m256i *)
+                                                               &in[i]), ctl));
+  Swizzle32_SSSE3(&in[i], &out[i], n - i, params);
+}
+
+
+AVX2_ATTR static void Pack32to16_AVX2(const CARD32 *in, CARD16 *out, int n,
+                                      const rfbTranslateParams *params)
+{
+  const __m256i ff = _mm256_set1_epi32(0xFF), round = _mm256_set1_epi32(128);
+  const __m256i ctl = params->swap ?
+    _mm256_setr_epi8(1, 0, 5, 4, 9, 8, 13, 12, -1, -1, -1, -1, -1, -1, -1, -1,
+                     1, 0, 5, 4, 9, 8, 13, 12, -1, -1, -1, -1, -1, -1, -1, -1) :
+    _mm256_setr_epi8(0, 1, 4, 5, 8, 9, 12, 13, -1, -1, -1, -1, -1, -1, -1, -1,
+                     0, 1, 4, 5, 8, 9, 12, 13, -1, -1, -1, -1, -1, -1, -1, -1);
+  __m256i outMax[3];
+  __m128i inShift[3], outShift[3];
+  int i, c;
+
+  for (c = 0; c < 3; c++) {
+    outMax[c] = _mm256_set1_epi32(params->outMax[c]);
+    inShift[c] = _mm_cvtsi32_si128(params->inShift[c]);
+    outShift[c] = _mm_cvtsi32_si128(params->outShift[c]);
+  }
+
+  for (i = 0; i <= n - 8; i += 8) {
+    __m256i pix = _mm256_loadu_si256((const __m256i *)&in[i]);
+    __m256i result = _mm256_setzero_si256();
+
+    for (c = 0; c < 3; c++) {
+      __m256i t = _mm256_and_si256(_mm256_srl_epi32(pix, inShift[c]), ff);
+
+      t = _mm256_add_epi32(_mm256_mullo_epi16(t, outMax[c]), round);
+      t = _mm256_srli_epi32(_mm256_add_epi32(t, _mm256_srli_epi32(t, 8)), 8);
+      result = _mm256_or_si256(result, _mm256_sll_epi32(t, outShift[c]));
+    }
+    result = _mm256_permute4x64_epi64(_mm256_shuffle_epi8(result, ctl), 0x08);
+    _mm_storeu_si128((__m128i *)&out[i], _mm256_castsi256_si128(result));
+  }
+  Pack32to16_SSSE3(&in[i], &out[i], n - i, params);
+}
+
+static const rfbSIMDFuncs avx2Funcs = {
+  "AVX2",
+  ScanRun8_AVX2, ScanRun16_AVX2, ScanRun32_AVX2,
+  ScanTwo8_AVX2, ScanTwo16_AVX2, ScanTwo32_AVX2,
+  Swizzle32_AVX2, Pack32to16_AVX2
+};
+
+
+#define CPU_SSE2   1
+#define CPU_SSSE3  2
+#define CPU_AVX2   4
+
+static int GetCPUFlags(void)
+{
+  static int flags = -1;
+  unsigned int eax, ebx, ecx, edx;
+
+  if (flags >= 0) return flags;
+
+  flags = 0;
+  if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx))
+    return flags;
+  if (edx & bit_SSE2)
+    flags |= CPU_SSE2;
+  if (ecx & bit_SSSE3)
+    flags |= CPU_SSSE3;
+
+  /* AVX2 can be used only if the O/S saves the YMM registers on context
+     switches. */
+  if ((ecx & bit_OSXSAVE) && (ecx & bit_AVX) && (ecx & bit_POPCNT) &&
+      __get_cpuid_max(0, NULL) >= 7) {
+    unsigned int xcr0, xcr0h;
+
+    __asm__ __volatile__("xgetbv" : "=a" (xcr0), "=d" (xcr0h) : "c" (0));
+    if ((xcr0 & 6) == 6) {
+      __cpuid_count(7, 0, eax, ebx, ecx, edx);
+      if (ebx & bit_AVX2)
+        flags |= CPU_AVX2;
+    }
+  }
+
+  return flags;
+}
+
+#endif  /* SIMD_X86 */
+
+
+#ifdef SIMD_NEON
+
+/*
+ * NEON has no equivalent of movemask, so each iteration only checks whether
+ * the whole vector matches, and the scalar function locates the mismatch.
+ */
+
+#define DEFINE_NEON_FUNCTIONS(bpp, lanes)                                     \
+                                                                              \
+static int ScanRun##bpp##_NEON(const CARD##bpp *p, int n, CARD##bpp c,        \
+                               CARD##bpp mask)                                \
+{                                                                             \
+  const uint##bpp##x##lanes##_t vc = vdupq_n_u##bpp(c),                       \
+    vm = vdupq_n_u##bpp(mask);                                                \
+  int i;                                                                      \
+                                                                              \
+  for (i = 0; i <= n - lanes; i += lanes) {                                   \
+    uint##bpp##x##lanes##_t eq =                                              \
+      vceqq_u##bpp(vandq_u##bpp(vld1q_u##bpp(&p[i]), vm), vc);                \
+                                                                              \
+    if (vminvq_u##bpp(eq) != (CARD##bpp)~0)                                   \
+      break;                                                                  \
+  }                                                                           \
+  return i + ScanRun##bpp##_C(&p[i], n - i, c, mask);                         \
+}                                                                             \
+                                                                              \
+static int ScanTwo##bpp##_NEON(const CARD##bpp *p, int n, CARD##bpp c0,       \
+                               CARD##bpp c1, CARD##bpp mask, int *n0)         \
+{                                                                             \
+  const uint##bpp##x##lanes##_t vc0 = vdupq_n_u##bpp(c0),                     \
+    vc1 = vdupq_n_u##bpp(c1), vm = vdupq_n_u##bpp(mask);                      \
+  int i, count0 = 0;                                                          \
+                                                                              \
+  for (i = 0; i <= n - lanes; i += lanes) {                                   \
+    uint##bpp##x##lanes##_t v = vandq_u##bpp(vld1q_u##bpp(&p[i]), vm);        \
+    uint##bpp##x##lanes##_t eq0 = vceqq_u##bpp(v, vc0);                       \
+                                                                              \
+    if (vminvq_u##bpp(vorrq_u##bpp(eq0, vceqq_u##bpp(v, vc1))) !=             \
+        (CARD##bpp)~0)                                                        \
+      break;                                                                  \
+    count0 += vaddvq_u##bpp(vshrq_n_u##bpp(eq0, bpp - 1));                    \
+  }                                                                           \
+  *n0 += count0;                                                              \
+  return i + ScanTwo##bpp##_C(&p[i], n - i, c0, c1, mask, n0);                \
+}
+
+DEFINE_NEON_FUNCTIONS(8, 16)
+DEFINE_NEON_FUNCTIONS(16, 8)
+DEFINE_NEON_FUNCTIONS(32, 4)
+
+static const rfbSIMDFuncs neonFuncs = {
+  "NEON",
+  ScanRun8_NEON, ScanRun16_NEON, ScanRun32_NEON,
+  ScanTwo8_NEON, ScanTwo16_NEON, ScanTwo32_NEON,
+  NULL, NULL
+};
+
+#endif  /* SIMD_NEON */
+
+
+const rfbSIMDFuncs *rfbSIMDGetFuncs(int type)
+{
+  switch (type) {
+    case SIMD_NONE:
+      return &scalarFuncs;
+#ifdef SIMD_X86
+    case SIMD_SSE2:
+      return (GetCPUFlags() & CPU_SSE2) ? &sse2Funcs : NULL;
+    case SIMD_SSSE3:
+      return (GetCPUFlags() & CPU_SSSE3) ? &ssse3Funcs : NULL;
+    case SIMD_AVX2:
+      return (GetCPUFlags() & CPU_AVX2) ? &avx2Funcs : NULL;
+#endif
+#ifdef SIMD_NEON
+    case SIMD_NEON:
+      /* NEON is mandatory on AArch64. */
+      return &neonFuncs;
+#endif
+    default:
+      return NULL;
+  }
+}
+
+
+const char *rfbSIMDInit(void)
+{
+  const rfbSIMDFuncs *funcs = NULL;
+  char *env = getenv("TVNC_SIMD");
+  int type;
+
+  if (!env || strcmp(env, "0"))
+    for (type = SIMD_NUMTYPES - 1; type > SIMD_NONE && !funcs; type--)
+      funcs = rfbSIMDGetFuncs(type);
+  if (!funcs)
+    funcs = &scalarFuncs;
+
+  rfbSIMD = *funcs;
+  return rfbSIMD.name;
+}
+
+
+int rfbSIMDGetTranslateParams(const rfbPixelFormat *in,
+                              const rfbPixelFormat *out,
+                              rfbTranslateParams *params)
+{
+  const int inShift[3] = { in->redShift, in->greenShift, in->blueShift };
+  const int outShift[3] = { out->redShift, out->greenShift, out->blueShift };
+  const int outMax[3] = { out->redMax, out->greenMax, out->blueMax };
+  const int endianTest = 1;
+  int hostBigEndian = !(*(const char *)&endianTest);
+  int swap = (out->bigEndian != in->bigEndian);
+  int c, k;
+
+  if (in->bitsPerPixel != 32 || !in->trueColour || !out->trueColour ||
+      in->redMax != 255 || in->greenMax != 255 || in->blueMax != 255)
+    return TRANSLATE_NONE;
+  for (c = 0; c < 3; c++) {
+    if (inShift[c] > 24) return TRANSLATE_NONE;
+  }
+
+  if (out->bitsPerPixel == 32) {
+    /* The translation tables pass 8-bit components through unchanged, so if
+       all of the components are byte-aligned, then translation is just a
+       byte shuffle.  Like the tables, this reads and writes pixels in host
+       byte order and swaps the output if the endianness differs. */
+    memset(params->shuffle, 0x80, 16);
+    for (c = 0; c < 3; c++) {
+      int inByte = inShift[c] / 8, outByte = outShift[c] / 8;
+
+      if (outMax[c] != 255 || inShift[c] % 8 || outShift[c] % 8 ||
+          outShift[c] > 24)
+        return TRANSLATE_NONE;
+      if (hostBigEndian) inByte = 3 - inByte;
+      if (hostBigEndian != swap) outByte = 3 - outByte;
+      if (params->shuffle[outByte] != 0x80)
+        return TRANSLATE_NONE;
+      params->shuffle[outByte] = inByte;
+    }
+    for (k = 4; k < 16; k++)
+      params->shuffle[k] = (params->shuffle[k % 4] == 0x80) ?
+                           0x80 : params->shuffle[k % 4] + (k & ~3);
+    return TRANSLATE_SWIZZLE32;
+  }
+
+  if (out->bitsPerPixel == 16) {
+    for (c = 0; c < 3; c++) {
+      if (outMax[c] > 255 || outShift[c] > 15)
+        return TRANSLATE_NONE;
+      params->inShift[c] = inShift[c];
+      params->outMax[c] = outMax[c];
+      params->outShift[c] = outShift[c];
+    }
+    params->swap = swap;
+    return TRANSLATE_PACK32TO16;
+  }
+
+  return TRANSLATE_NONE;
+}
@@ -0,0 +1,100 @@
+/*
+ * simd.h - SIMD pixel-scanning and translation kernels
+ */
+
+/*
+ *  This is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This software is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this software; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301,
+ *  USA.
+ */
+
+#ifndef __SIMD_H__
+#define __SIMD_H__
+
+/* rfbproto.h has no include guard, so it must be included before this
+   file. */
+
+#include <X11/Xmd.h>
+
+
+/*
+ * Parameters for the pixel format translation kernels.  swizzle32() uses
+ * shuffle, which contains, for each output byte in a group of 4 pixels, the
+ * index of the input byte to copy (or 0x80 to store 0.)  pack32to16() uses
+ * the other fields: each 8-bit input component is shifted right by inShift,
+ * rescaled to 0..outMax, and shifted left by outShift, and the 16-bit result
+ * is byte-swapped if swap is set.
+ */
+
+typedef struct {
+  CARD8 shuffle[16];
+  int inShift[3], outMax[3], outShift[3], swap;
+} rfbTranslateParams;
+
+enum { TRANSLATE_NONE = 0, TRANSLATE_SWIZZLE32, TRANSLATE_PACK32TO16 };
+
+/*
+ * scanRun*() returns the number of leading pixels in p[0..n-1] that are equal
+ * to c after being ANDed with mask.
+ *
+ * scanTwo*() returns the number of leading pixels in p[0..n-1] that are equal
+ * to either c0 or c1 after being ANDed with mask, and it adds the number of
+ * those pixels that are equal to c0 to *n0.
+ *
+ * The SIMD implementations produce exactly the same results as the scalar
+ * implementations.
+ */
+
+typedef struct {
+  const char *name;
+  int (*scanRun8) (const CARD8 *p, int n, CARD8 c, CARD8 mask);
+  int (*scanRun16) (const CARD16 *p, int n, CARD16 c, CARD16 mask);
+  int (*scanRun32) (const CARD32 *p, int n, CARD32 c, CARD32 mask);
+  int (*scanTwo8) (const CARD8 *p, int n, CARD8 c0, CARD8 c1, CARD8 mask,
+                   int *n0);
+  int (*scanTwo16) (const CARD16 *p, int n, CARD16 c0, CARD16 c1,
+                    CARD16 mask, int *n0);
+  int (*scanTwo32) (const CARD32 *p, int n, CARD32 c0, CARD32 c1,
+                    CARD32 mask, int *n0);
+  /* These are NULL if the instruction set has no translation kernels. */
+  void (*swizzle32) (const CARD32 *in, CARD32 *out, int n,
+                     const rfbTranslateParams *params);
+  void (*pack32to16) (const CARD32 *in, CARD16 *out, int n,
+                      const rfbTranslateParams *params);
+} rfbSIMDFuncs;
+
+enum {
+  SIMD_NONE = 0, SIMD_SSE2, SIMD_SSSE3, SIMD_AVX2, SIMD_NEON, SIMD_NUMTYPES
+};
+
+/* The functions that are currently in use */
+extern rfbSIMDFuncs rfbSIMD;
+
+/* Returns the functions for the given SIMD type, or NULL if the type is not
+   supported by this build or by this CPU */
+extern const rfbSIMDFuncs *rfbSIMDGetFuncs(int type);
+
+/* Selects the fastest functions that the CPU supports (or the scalar
+   functions, if the TVNC_SIMD environment variable is set to 0) and returns
+   their name */
+extern const char *rfbSIMDInit(void);
+
+/* Returns the translation kernel (TRANSLATE_*) that can convert pixels from
+   the given input format to the given output format, and fills in params
+   for that kernel */
+extern int rfbSIMDGetTranslateParams(const rfbPixelFormat *in,
+                                     const rfbPixelFormat *out,
+                                     rfbTranslateParams *params);
+
+#endif  /* __SIMD_H__ */
@@ -0,0 +1,498 @@
+/*
+ * simdbench.c - verify and benchmark the SIMD kernels
+ */
+
+/*
+ *  This is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This software is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this software; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301,
+ *  USA.
+ */
+
+/* This program first checks that each set of SIMD kernels supported by the
+   CPU returns exactly the same results as the scalar kernels, using random
+   pixel runs, masks, and alignments.  It then measures the throughput of each
+   set of kernels on workloads that resemble those of the Tight encoder:
+   solid 16x16 tiles (CheckSolidTile()), long solid rows (FindBestSolidArea()
+   and ExtendSolidArea()), and two-color and many-color subrectangles
+   (FillPalette() and FastFillPalette().)  Finally, it verifies the pixel
+   format translation kernels against the RGB lookup tables in translate.c and
+   measures their throughput for each of the viewer pixel formats that they
+   support.  The exit status is nonzero if any results differ. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <X11/Xmd.h>
+#include <rfbproto.h>
+#include "simd.h"
+
+
+#define BUFSIZE  65536
+#define VERIFY_ITERATIONS  200000
+
+static double benchTime = 0.25;
+static volatile int sink;
+
+
+static double gettime(void)
+{
+  struct timeval tv;
+
+  gettimeofday(&tv, NULL);
+  return (double)tv.tv_sec + (double)tv.tv_usec * 0.000001;
+}
+
+
+/*
+ * Fill buf with runs of colors chosen from a small set, so that the kernels
+ * see matches and mismatches at every possible position within a vector.
+ */
+
+static void FillRuns(CARD32 *buf, int n, const CARD32 *colors, int nColors,
+                     int maxRun)
+{
+  int i = 0;
+
+  while (i < n) {
+    CARD32 c = colors[rand() % nColors];
+    int run = 1 + rand() % maxRun;
+
+    while (run-- && i < n)
+      buf[i++] = c;
+  }
+}
+
+
+#define DEFINE_VERIFY_FUNCTION(bpp)                                           \
+                                                                              \
+static int Verify##bpp(const rfbSIMDFuncs *funcs, CARD##bpp *buf)             \
+{                                                                             \
+  const rfbSIMDFuncs *ref = rfbSIMDGetFuncs(SIMD_NONE);                       \
+  CARD32 colors[3], tmp[BUFSIZE / 16];                                        \
+  int iter, i;                                                                \
+                                                                              \
+  for (iter = 0; iter < VERIFY_ITERATIONS; iter++) {                          \
+    int offset = rand() % 64, n = rand() % (BUFSIZE / 16 - 64);              \
+    CARD##bpp mask = (rand() % 4 == 0) ? (CARD##bpp)rand() : (CARD##bpp)~0;   \
+    CARD##bpp *p = &buf[offset];                                              \
+    int r1, r2, n01 = 0, n02 = 0;                                             \
+                                                                              \
+    for (i = 0; i < 3; i++)                                                   \
+      colors[i] = (CARD##bpp)rand();                                          \
+    FillRuns(tmp, n, colors, 3, 1 + rand() % 200);                            \
+    /* Occasionally flip bits outside of the mask */                          \
+    for (i = 0; i < n; i++) {                                                 \
+      p[i] = (CARD##bpp)tmp[i];                                               \
+      if (rand() % 16 == 0) p[i] ^= (CARD##bpp)~mask & (CARD##bpp)rand();     \
+    }                                                                         \
+                                                                              \
+    r1 = ref->scanRun##bpp(p, n, colors[0] & mask, mask);                     \
+    r2 = funcs->scanRun##bpp(p, n, colors[0] & mask, mask);                   \
+    if (r1 != r2) {                                                           \
+      printf("    scanRun%d: n=%d offset=%d: %d != %d\n", bpp, n, offset, r2, \
+             r1);                                                             \
+      return 0;                                                               \
+    }                                                                         \
+                                                                              \
+    r1 = ref->scanTwo##bpp(p, n, colors[0] & mask, colors[1] & mask, mask,    \
+                           &n01);                                             \
+    r2 = funcs->scanTwo##bpp(p, n, colors[0] & mask, colors[1] & mask, mask,  \
+                             &n02);                                           \
+    if (r1 != r2 || n01 != n02) {                                             \
+      printf("    scanTwo%d: n=%d offset=%d: %d/%d != %d/%d\n", bpp, n,       \
+             offset, r2, n02, r1, n01);                                       \
+      return 0;                                                               \
+    }                                                                         \
+  }                                                                           \
+                                                                              \
+  return 1;                                                                   \
+}
+
+DEFINE_VERIFY_FUNCTION(8)
+DEFINE_VERIFY_FUNCTION(16)
+DEFINE_VERIFY_FUNCTION(32)
+
+
+/*
+ * Each benchmark scans BUFSIZE pixels per iteration and returns the
+ * throughput in Mpixels/sec.
+ */
+
+#define DEFINE_BENCH_FUNCTIONS(bpp)                                           \
+                                                                              \
+static double BenchTile##bpp(const rfbSIMDFuncs *funcs, CARD##bpp *buf)       \
+{                                                                             \
+  double start = gettime(), elapsed;                                          \
+  int iter = 0, i, sum = 0;                                                   \
+                                                                              \
+  do {                                                                        \
+    for (i = 0; i < BUFSIZE; i += 16)                                         \
+      sum += funcs->scanRun##bpp(&buf[i], 16, buf[0], (CARD##bpp)~0);         \
+    iter++;                                                                   \
+  } while ((elapsed = gettime() - start) < benchTime);                        \
+                                                                              \
+  sink = sum;                                                                 \
+  return (double)BUFSIZE * iter / elapsed / 1000000.;                         \
+}                                                                             \
+                                                                              \
+static double BenchRow##bpp(const rfbSIMDFuncs *funcs, CARD##bpp *buf)        \
+{                                                                             \
+  double start = gettime(), elapsed;                                          \
+  int iter = 0, i, sum = 0;                                                   \
+                                                                              \
+  do {                                                                        \
+    for (i = 0; i < BUFSIZE; i += 2048)                                       \
+      sum += funcs->scanRun##bpp(&buf[i], 2048, buf[0], (CARD##bpp)~0);       \
+    iter++;                                                                   \
+  } while ((elapsed = gettime() - start) < benchTime);                        \
+                                                                              \
+  sink = sum;                                                                 \
+  return (double)BUFSIZE * iter / elapsed / 1000000.;                         \
+}                                                                             \
+                                                                              \
+static double BenchTwo##bpp(const rfbSIMDFuncs *funcs, CARD##bpp *buf)        \
+{                                                                             \
+  double start = gettime(), elapsed;                                          \
+  int iter = 0, n0 = 0;                                                       \
+                                                                              \
+  do {                                                                        \
+    sink = funcs->scanTwo##bpp(buf, BUFSIZE, buf[0], buf[0] ^ 1,              \
+                               (CARD##bpp)~0, &n0);                           \
+    iter++;                                                                   \
+  } while ((elapsed = gettime() - start) < benchTime);                        \
+                                                                              \
+  sink += n0;                                                                 \
+  return (double)BUFSIZE * iter / elapsed / 1000000.;                         \
+}                                                                             \
+                                                                              \
+static double BenchRuns##bpp(const rfbSIMDFuncs *funcs, CARD##bpp *buf)       \
+{                                                                             \
+  double start = gettime(), elapsed;                                          \
+  int iter = 0, i, sum = 0;                                                   \
+                                                                              \
+  /* This mimics the palette loop in FillPalette(), which calls scanRun()    \
+     only for runs of two or more pixels. */                                  \
+  do {                                                                        \
+    for (i = 0; i < BUFSIZE; i++) {                                           \
+      if (i + 1 < BUFSIZE && buf[i + 1] == buf[i])                            \
+        i += funcs->scanRun##bpp(&buf[i + 1], BUFSIZE - i - 1, buf[i],        \
+                                 (CARD##bpp)~0);                              \
+      sum++;                                                                  \
+    }                                                                         \
+    iter++;                                                                   \
+  } while ((elapsed = gettime() - start) < benchTime);                        \
+                                                                              \
+  sink = sum;                                                                 \
+  return (double)BUFSIZE * iter / elapsed / 1000000.;                         \
+}
+
+DEFINE_BENCH_FUNCTIONS(8)
+DEFINE_BENCH_FUNCTIONS(16)
+DEFINE_BENCH_FUNCTIONS(32)
+
+
+typedef struct {
+  const char *name;
+  double (*bench8) (const rfbSIMDFuncs *, CARD8 *);
+  double (*bench16) (const rfbSIMDFuncs *, CARD16 *);
+  double (*bench32) (const rfbSIMDFuncs *, CARD32 *);
+  int nColors, maxRun;
+} BENCHMARK;
+
+static const BENCHMARK benchmarks[] = {
+  { "Solid 16x16 tiles", BenchTile8, BenchTile16, BenchTile32, 1, 1 },
+  { "Solid 2048-pixel rows", BenchRow8, BenchRow16, BenchRow32, 1, 1 },
+  { "Two colors", BenchTwo8, BenchTwo16, BenchTwo32, 2, 8 },
+  { "Many colors, long runs", BenchRuns8, BenchRuns16, BenchRuns32, 64, 64 },
+  { "Many colors, short runs", BenchRuns8, BenchRuns16, BenchRuns32, 64, 4 }
+};
+
+
+/*
+ * Pixel format translation.  The reference implementation below is the same
+ * as rfbInitOneRGBTable*() and rfbTranslateWithRGBTables32to*() in
+ * translate.c, which the SIMD kernels must match bit for bit.
+ */
+
+#define SWAP16(v)  ((CARD16)(((v) << 8) | ((v) >> 8)))
+#define SWAP32(v)  \
+  (((v) << 24) | (((v) & 0xff00) << 8) | (((v) >> 8) & 0xff00) | ((v) >> 24))
+
+#define TRANS_WIDTH  1024
+#define TRANS_HEIGHT  32
+#define TRANS_PITCH  1920
+
+typedef struct {
+  const char *name;
+  rfbPixelFormat pf;
+} FORMAT;
+
+static const FORMAT formats[] = {
+  { "32-bit BGRX", { 32, 24, 0, 1, 255, 255, 255, 0, 8, 16, 0, 0 } },
+  { "32-bit XRGB, big endian", { 32, 24, 1, 1, 255, 255, 255, 16, 8, 0, 0,
+                                 0 } },
+  { "16-bit RGB565", { 16, 16, 0, 1, 31, 63, 31, 11, 5, 0, 0, 0 } },
+  { "16-bit RGB565, big endian", { 16, 16, 1, 1, 31, 63, 31, 11, 5, 0, 0,
+                                   0 } },
+  { "16-bit BGR565", { 16, 16, 0, 1, 31, 63, 31, 0, 5, 11, 0, 0 } },
+  { "16-bit RGB555", { 16, 15, 0, 1, 31, 31, 31, 10, 5, 0, 0, 0 } }
+};
+
+static CARD32 table[3][256];
+
+
+static void InitTables(const rfbPixelFormat *in, const rfbPixelFormat *out)
+{
+  int inMax[3] = { in->redMax, in->greenMax, in->blueMax };
+  int outMax[3] = { out->redMax, out->greenMax, out->blueMax };
+  int outShift[3] = { out->redShift, out->greenShift, out->blueShift };
+  int c, i;
+
+  for (c = 0; c < 3; c++) {
+    for (i = 0; i <= inMax[c]; i++) {
+      CARD32 v = ((i * outMax[c] + inMax[c] / 2) / inMax[c]) << outShift[c];
+
+      if (out->bigEndian != in->bigEndian)
+        v = out->bitsPerPixel == 32 ? SWAP32(v) : SWAP16(v);
+      table[c][i] = v;
+    }
+  }
+}
+
+
+static void TranslateTables(const rfbPixelFormat *in,
+                            const rfbPixelFormat *out, const CARD32 *ip,
+                            void *optr, int n)
+{
+  int i;
+
+  for (i = 0; i < n; i++) {
+    CARD32 v = table[0][(ip[i] >> in->redShift) & in->redMax] |
+               table[1][(ip[i] >> in->greenShift) & in->greenMax] |
+               table[2][(ip[i] >> in->blueShift) & in->blueMax];
+
+    if (out->bitsPerPixel == 32) ((CARD32 *)optr)[i] = v;
+    else ((CARD16 *)optr)[i] = (CARD16)v;
+  }
+}
+
+
+static void Translate(const rfbSIMDFuncs *funcs, int kernel,
+                      const rfbTranslateParams *params,
+                      const rfbPixelFormat *in, const rfbPixelFormat *out,
+                      const CARD32 *ip, void *optr, int n)
+{
+  if (!funcs)
+    TranslateTables(in, out, ip, optr, n);
+  else if (kernel == TRANSLATE_SWIZZLE32)
+    funcs->swizzle32(ip, (CARD32 *)optr, n, params);
+  else
+    funcs->pack32to16(ip, (CARD16 *)optr, n, params);
+}
+
+
+static int HasKernel(const rfbSIMDFuncs *funcs, int kernel)
+{
+  return kernel == TRANSLATE_SWIZZLE32 ? funcs->swizzle32 != NULL :
+         funcs->pack32to16 != NULL;
+}
+
+
+static int VerifyTranslate(const rfbSIMDFuncs *funcs, int kernel,
+                           const rfbTranslateParams *params,
+                           const rfbPixelFormat *in,
+                           const rfbPixelFormat *out, CARD32 *buf)
+{
+  CARD32 *ref = (CARD32 *)malloc(1088 * 4), *test = (CARD32 *)malloc(1088 * 4);
+  int iter, i, ok = 1, ps = out->bitsPerPixel / 8;
+
+  if (!ref || !test) {
+    free(ref);  free(test);
+    return 0;
+  }
+
+  for (iter = 0; iter < VERIFY_ITERATIONS / 100 && ok; iter++) {
+    int offset = rand() % 64, n = 1 + rand() % 1024;
+
+    for (i = 0; i < n; i++)
+      buf[offset + i] = ((CARD32)rand() << 16) ^ (CARD32)rand();
+    /* Cover every component value */
+    if (iter == 0) {
+      for (i = 0; i < 256 && i < n; i++)
+        buf[offset + i] = (CARD32)i * 0x01010101;
+    }
+    memset(ref, 0xAA, 1088 * 4);
+    memset(test, 0xAA, 1088 * 4);
+    TranslateTables(in, out, &buf[offset], ref, n);
+    Translate(funcs, kernel, params, in, out, &buf[offset], test, n);
+    /* Also checks that the kernel does not write past the end of the row */
+    if (memcmp(ref, test, (n + 16) * ps)) ok = 0;
+  }
+
+  free(ref);  free(test);
+  return ok;
+}
+
+
+static double BenchTranslate(const rfbSIMDFuncs *funcs, int kernel,
+                             const rfbTranslateParams *params,
+                             const rfbPixelFormat *in,
+                             const rfbPixelFormat *out, const CARD32 *buf,
+                             void *obuf)
+{
+  double start = gettime(), elapsed;
+  int iter = 0, y, ps = out->bitsPerPixel / 8;
+
+  /* This mimics rfbTranslateSwizzle32() and rfbTranslatePack32to16(), which
+     translate a rectangle of the framebuffer one row at a time. */
+  do {
+    for (y = 0; y < TRANS_HEIGHT; y++)
+      Translate(funcs, kernel, params, in, out, &buf[y * TRANS_PITCH],
+                (char *)obuf + y * TRANS_WIDTH * ps, TRANS_WIDTH);
+    iter++;
+  } while ((elapsed = gettime() - start) < benchTime);
+
+  return (double)TRANS_WIDTH * TRANS_HEIGHT * iter / elapsed / 1000000.;
+}
+
+
+static int RunTranslateBenchmarks(const rfbSIMDFuncs **funcs, CARD32 *buf)
+{
+  /* This is the same as rfbServerFormat on a little-endian host. */
+  rfbPixelFormat in = { 32, 24, 0, 1, 255, 255, 255, 16, 8, 0, 0, 0 };
+  CARD32 *obuf;
+  int f, i, type, retval = 0;
+
+  if ((obuf = (CARD32 *)malloc(TRANS_WIDTH * TRANS_HEIGHT * 4)) == NULL) {
+    fprintf(stderr, "Memory allocation failure\n");
+    return 1;
+  }
+  for (i = 0; i < TRANS_PITCH * TRANS_HEIGHT; i++)
+    buf[i] = ((CARD32)rand() << 16) ^ (CARD32)rand();
+
+  for (f = 0; f < (int)(sizeof(formats) / sizeof(FORMAT)); f++) {
+    const rfbPixelFormat *out = &formats[f].pf;
+    rfbTranslateParams params;
+    int kernel = rfbSIMDGetTranslateParams(&in, out, &params);
+    double baseline;
+
+    printf("\nTranslate to %s:\n", formats[f].name);
+    if (kernel == TRANSLATE_NONE) {
+      printf("  No SIMD kernel for this format\n");
+      continue;
+    }
+    InitTables(&in, out);
+    baseline = BenchTranslate(NULL, kernel, &params, &in, out, buf, obuf);
+    printf("  %-6s %10.2f Mpixels/sec\n", "Tables", baseline);
+
+    for (type = 0; type < SIMD_NUMTYPES; type++) {
+      double mpps;
+      int ok;
+
+      if (!funcs[type] || !HasKernel(funcs[type], kernel)) continue;
+      ok = VerifyTranslate(funcs[type], kernel, &params, &in, out,
+                           &buf[TRANS_PITCH * TRANS_HEIGHT]);
+      mpps = BenchTranslate(funcs[type], kernel, &params, &in, out, buf,
+                            obuf);
+      printf("  %-6s %10.2f Mpixels/sec  (%.2fx)  %s\n", funcs[type]->name,
+             mpps, mpps / baseline, ok ? "bit-exact" : "MISMATCH");
+      if (!ok) retval = 1;
+    }
+  }
+
+  free(obuf);
+  return retval;
+}
+
+
+int main(int argc, char **argv)
+{
+  const rfbSIMDFuncs *funcs[SIMD_NUMTYPES];
+  CARD8 *buf8;
+  CARD16 *buf16;
+  CARD32 *buf32, colors[64];
+  double baseline = 0.;
+  int type, bpp, b, i, retval = 0;
+
+  if (argc > 1) {
+    if ((benchTime = atof(argv[1])) <= 0.) {
+      fprintf(stderr, "USAGE: %s [seconds per test]\n", argv[0]);
+      return 1;
+    }
+  }
+
+  if ((buf8 = (CARD8 *)malloc(BUFSIZE + 64)) == NULL ||
+      (buf16 = (CARD16 *)malloc((BUFSIZE + 64) * 2)) == NULL ||
+      (buf32 = (CARD32 *)malloc((BUFSIZE + 64) * 4)) == NULL) {
+    fprintf(stderr, "Memory allocation failure\n");
+    return 1;
+  }
+  srand(1);
+
+  for (type = 0; type < SIMD_NUMTYPES; type++)
+    funcs[type] = rfbSIMDGetFuncs(type);
+
+  printf("Verifying kernels against scalar code:\n");
+  for (type = SIMD_NONE + 1; type < SIMD_NUMTYPES; type++) {
+    int ok;
+
+    if (!funcs[type]) continue;
+    ok = Verify8(funcs[type], buf8) && Verify16(funcs[type], buf16) &&
+         Verify32(funcs[type], buf32);
+    printf("  %-6s %s\n", funcs[type]->name, ok ? "bit-exact" : "MISMATCH");
+    if (!ok) retval = 1;
+  }
+
+  for (b = 0; b < (int)(sizeof(benchmarks) / sizeof(BENCHMARK)); b++) {
+    const BENCHMARK *bench = &benchmarks[b];
+
+    for (i = 0; i < bench->nColors; i++)
+      colors[i] = (CARD32)rand() & ~1;
+    for (bpp = 8; bpp <= 32; bpp *= 2) {
+      CARD32 *tmp = buf32;
+
+      printf("\n%s, %d-bit:\n", bench->name, bpp);
+      /* buf32 doubles as the scratch buffer for the 8-bit and 16-bit
+         tests. */
+      FillRuns(tmp, BUFSIZE, colors, bench->nColors, bench->maxRun);
+      if (bench->nColors == 2) {
+        /* BenchTwo*() uses buf[0] and buf[0] ^ 1 as the two colors. */
+        for (i = 0; i < BUFSIZE; i++)
+          tmp[i] = colors[0] ^ (tmp[i] == colors[1]);
+      }
+      for (i = 0; i < BUFSIZE; i++) {
+        if (bpp == 8) buf8[i] = (CARD8)tmp[i];
+        else if (bpp == 16) buf16[i] = (CARD16)tmp[i];
+      }
+
+      for (type = 0; type < SIMD_NUMTYPES; type++) {
+        double mpps;
+
+        if (!funcs[type]) continue;
+        if (bpp == 8) mpps = bench->bench8(funcs[type], buf8);
+        else if (bpp == 16) mpps = bench->bench16(funcs[type], buf16);
+        else mpps = bench->bench32(funcs[type], buf32);
+        if (type == SIMD_NONE) baseline = mpps;
+        printf("  %-6s %10.2f Mpixels/sec  (%.2fx)\n", funcs[type]->name,
+               mpps, mpps / baseline);
+      }
+    }
+  }
+
+  if (RunTranslateBenchmarks(funcs, buf32)) retval = 1;
+
+  free(buf8);  free(buf16);  free(buf32);
+  return retval;
+}
@@ -47,6 +47,7 @@
 #include <stdlib.h>
 #include <sys/types.h>
 #include <sys/time.h>
+#include <sys/uio.h>
 #include <arpa/inet.h>
 #include <netinet/tcp.h>
 #include <netdb.h>
@@ -83,6 +84,7 @@ static rfbSockAddr udpRemoteAddr;
 extern unsigned long long sendBytes;
 
 static void rfbSockNotify(int fd, int ready, void *data);
+static void rfbFlushOutputQueue(rfbClientPtr cl);
 
 
 /*
@@ -277,6 +279,12 @@ static void rfbSockNotify(int fd, int ready, void *data)
   for (cl = rfbClientHead; cl; cl = nextCl) {
     nextCl = cl->next;
     if (fd == cl->sock) {
+      if (ready & X_NOTIFY_WRITE) {
+        rfbFlushOutputQueue(cl);
+        CHECK_CLIENT_PTR(cl, break)
+      }
+      if (!(ready & X_NOTIFY_READ))
+        continue;
 #if USETLS
       do {
         rfbProcessClientMessage(cl);
@@ -494,79 +502,530 @@ int SkipExact(rfbClientPtr cl, int len)
 
 
 /*
- * WriteExact writes an exact number of bytes on a TCP socket.  Returns 1 if
- * those bytes have been written, or -1 if an error occurred (errno is set to
- * ETIMEDOUT if it timed out).
+ * WriteSome writes as much of the given data as the socket will accept without
+ * blocking, using writev() if the data is split across more than one buffer.
+ * Returns the number of bytes written (0 if the socket isn't writable), or -1
+ * if an error occurred.
  */
 
-int WriteExact(rfbClientPtr cl, char *buf, int len)
+static int WriteSome(rfbClientPtr cl, const struct iovec *iov, int iovcnt)
+{
+  int n;
+  double tStart;
+
+  TRACE_START(tStart);
+  do {
+#if USETLS
+    if (cl->sslctx)
+      n = rfbssl_write(cl, iov[0].iov_base, iov[0].iov_len);
+    else
+#endif
+    if (iovcnt > 1) {
+      n = writev(cl->sock, iov, iovcnt);
+      cl->rfbWritevCalls++;
+    } else
+      n = write(cl->sock, iov[0].iov_base, iov[0].iov_len);
+    cl->rfbWriteCalls++;
+  } while (n < 0 && errno == EINTR);
+  TRACE_END(tStart, "send", "bytes", n);
+
+  if (n > 0) {
+    sendBytes += n;
+    gettimeofday(&cl->lastWrite, NULL);
+    return n;
+  } else if (n == 0) {
+    rfbLog("WriteExact: write returned 0?\n");
+    exit(1);
+  }
+
+  if (errno == EWOULDBLOCK || errno == EAGAIN || errno == 0)
+    return 0;
+  return -1;
+}
+
+
+/*
+ * WaitForWritable waits until the socket is writable.  Returns 1 if the socket
+ * is writable, 0 if it isn't writable yet, or -1 if an error occurred (errno
+ * is set to ETIMEDOUT if the total time waited exceeds rfbMaxClientWait.)
+ */
+
+static int WaitForWritable(int sock, int *totalTimeWaited)
 {
-  int n, bytesWritten = 0;
   fd_set fds;
   struct timeval tv;
-  int totalTimeWaited = 0;
-  int sock = cl->sock;
+  int n;
+
+  /* Retry every 5 seconds until we exceed rfbMaxClientWait.  We need to do
+     this because select doesn't necessarily return immediately when the other
+     end has gone away */
+
+  FD_ZERO(&fds);
+  FD_SET(sock, &fds);
+  tv.tv_sec = 5;
+  tv.tv_usec = 0;
+  do {
+    n = select(sock + 1, NULL, &fds, NULL, &tv);
+  } while (n < 0 && errno == EINTR);
+  if (n < 0) {
+    rfbLogPerror("WriteExact: select");
+    return n;
+  }
+  if (n == 0) {
+    *totalTimeWaited += 5000;
+    if (*totalTimeWaited >= rfbMaxClientWait) {
+      errno = ETIMEDOUT;
+      return -1;
+    }
+    return 0;
+  }
+  *totalTimeWaited = 0;
+  return 1;
+}
+
+
+/*
+ * Asynchronous output
+ *
+ * Once a client has entered the normal protocol state, data that its socket
+ * won't accept immediately is appended to a per-client output queue rather
+ * than waiting for the socket to drain.  The queue is drained by
+ * rfbFlushOutputQueue() whenever the X server's poll loop reports that the
+ * socket is writable, so a slow client can no longer stall the X server or
+ * the other clients.  rfbSendFramebufferUpdate() holds back new updates while
+ * the queue is non-empty, so the queue normally holds no more than one
+ * update.  If it grows beyond rfbMaxClientQueue bytes anyway, WriteExact()
+ * falls back to waiting for the socket, as it did prior to the introduction
+ * of the queue.
+ *
+ * The encoders also use the queue to assemble framebuffer updates.  Each
+ * client's update buffer is an output block, and rfbSendUpdateBuf() passes
+ * it to WriteBlock() once it fills.  WriteBlock() appends the block to the
+ * queue without writing it, and the whole update is then written by
+ * FlushOutput() (or by the next call to WriteExact()) using a single writev()
+ * call, rather than one write() call per update buffer.  Large compressed
+ * payloads and the output of encoding threads are appended to the queue by
+ * reference (see rfbSendUpdateBlock()), so they are never copied after they
+ * have been encoded.
+ */
+
+int rfbMaxClientQueue = DEFAULT_MAX_CLIENT_QUEUE;
+
+/* Maximum number of output blocks that will be written with a single writev()
+   call.  WriteBlock() also writes the queue if this many blocks are waiting,
+   so that large updates are pipelined with encoding. */
+#define MAX_IOV 64
+
+static CARD32 writeTimeoutCallback(OsTimerPtr timer, CARD32 now, pointer arg);
+
+
+static void SetWritePending(rfbClientPtr cl, Bool pending)
+{
+  if (pending == cl->writePending)
+    return;
+
+  SetNotifyFd(cl->sock, rfbSockNotify,
+              pending ? X_NOTIFY_READ | X_NOTIFY_WRITE : X_NOTIFY_READ, NULL);
+  cl->writePending = pending;
+
+  if (pending)
+    cl->writeTimer = TimerSet(cl->writeTimer, 0, rfbMaxClientWait,
+                              writeTimeoutCallback, cl);
+  else
+    TimerCancel(cl->writeTimer);
+}
+
+
+static void AppendOutputBlock(rfbClientPtr cl, rfbOutputBlock *block)
+{
+  block->next = NULL;
+  if (cl->outTail)
+    cl->outTail->next = block;
+  else
+    cl->outHead = block;
+  cl->outTail = block;
+  cl->outQueued += block->len - block->offset;
+  cl->outBlocks++;
+}
+
+
+/*
+ * rfbNewOutputBlock allocates an output block that can hold size bytes of
+ * data, and rfbNewExternalBlock allocates an output block that refers to a
+ * buffer allocated with malloc().  The block takes ownership of the buffer.
+ * rfbRefOutputBlock allocates an output block that refers to the data of an
+ * existing block, so that the same data can be queued for several clients
+ * without copying it.  The data is freed once the original block and all of
+ * the blocks that refer to it have been freed.  All three return NULL if
+ * there is not enough memory.
+ */
+
+rfbOutputBlock *rfbNewOutputBlock(int size)
+{
+  rfbOutputBlock *block;
+
+  block = (rfbOutputBlock *)malloc(sizeof(rfbOutputBlock) + size);
+  if (!block)
+    return NULL;
+  block->next = NULL;
+  block->len = block->offset = 0;
+  block->ext = NULL;
+  block->owner = NULL;
+  block->refCount = 0;
+  block->extSize = 0;
+  return block;
+}
+
+
+rfbOutputBlock *rfbNewExternalBlock(char *buf, int len)
+{
+  rfbOutputBlock *block = rfbNewOutputBlock(0);
+
+  if (!block)
+    return NULL;
+  block->len = len;
+  block->ext = buf;
+  return block;
+}
+
+
+rfbOutputBlock *rfbRefOutputBlock(rfbOutputBlock *block)
+{
+  rfbOutputBlock *ref = rfbNewOutputBlock(0);
+
+  if (!ref)
+    return NULL;
+  if (block->owner)
+    block = block->owner;
+  ref->len = block->len;
+  ref->ext = BLOCK_DATA(block);
+  ref->owner = block;
+  block->refCount++;
+  return ref;
+}
+
+
+void rfbFreeOutputBlock(rfbOutputBlock *block)
+{
+  if (block->owner) {
+    rfbOutputBlock *owner = block->owner;
+
+    free(block);
+    block = owner;
+  }
+  if (block->refCount > 0) {
+    block->refCount--;
+    return;
+  }
+  if (block->extSize)
+    rfbTightFreeBuf(block->ext, block->extSize);
+  else
+    free(block->ext);
+  free(block);
+}
+
+
+static Bool QueueOutput(rfbClientPtr cl, const char *buf, int len)
+{
+  rfbOutputBlock *block;
+
+  block = rfbNewOutputBlock(len);
+  if (!block) {
+    rfbLogPerror("QueueOutput: couldn't allocate output block");
+    return FALSE;
+  }
+  block->len = len;
+  memcpy(block->data, buf, len);
+  AppendOutputBlock(cl, block);
+  return TRUE;
+}
+
+
+/*
+ * FlushOutputQueue sends as much of the output queue as the socket will
+ * accept without blocking.  Returns 1 if the queue is now empty, 0 if data
+ * remains queued, or -1 if an error occurred.
+ */
+
+static int FlushOutputQueue(rfbClientPtr cl)
+{
+  Bool progress = FALSE;
+  int maxiov = MAX_IOV;
 
-  while (len > 0) {
-    do {
 #if USETLS
-      if (cl->sslctx)
-        n = rfbssl_write(cl, buf, len);
-      else
+  /* The TLS libraries have no equivalent of writev(). */
+  if (cl->sslctx) maxiov = 1;
 #endif
-      n = write(sock, buf, len);
-    } while (n < 0 && errno == EINTR);
 
-    if (n > 0) {
+  while (cl->outHead) {
+    struct iovec iov[MAX_IOV];
+    rfbOutputBlock *block;
+    int iovcnt = 0, bytesToWrite = 0, written, n;
 
-      buf += n;
-      len -= n;
-      bytesWritten += n;
-      sendBytes += n;
+    for (block = cl->outHead; block && iovcnt < maxiov; block = block->next) {
+      iov[iovcnt].iov_base = &BLOCK_DATA(block)[block->offset];
+      iov[iovcnt].iov_len = block->len - block->offset;
+      bytesToWrite += iov[iovcnt++].iov_len;
+    }
 
-    } else if (n == 0) {
+    if ((written = n = WriteSome(cl, iov, iovcnt)) < 0)
+      return -1;
+    if (n == 0)
+      break;
+
+    progress = TRUE;
+    cl->outQueued -= n;
+    while (n > 0) {
+      block = cl->outHead;
+      if (n < block->len - block->offset) {
+        block->offset += n;
+        break;
+      }
+      n -= block->len - block->offset;
+      cl->outHead = block->next;
+      if (!cl->outHead) cl->outTail = NULL;
+      cl->outBlocks--;
+      rfbFreeOutputBlock(block);
+    }
 
-      rfbLog("WriteExact: write returned 0?\n");
-      exit(1);
+    /* If the socket didn't accept all of the data, then it is full, so there
+       is no point in trying again until it becomes writable. */
+    if (written < bytesToWrite)
+      break;
+  }
 
-    } else {
-      if (errno != EWOULDBLOCK && errno != EAGAIN && errno != 0)
-        return n;
+  if (!cl->outHead) {
+    SetWritePending(cl, FALSE);
+    return 1;
+  }
 
-      /* Retry every 5 seconds until we exceed rfbMaxClientWait.  We
-         need to do this because select doesn't necessarily return
-         immediately when the other end has gone away */
+  /* The client is still making progress, so restart the timeout. */
+  if (progress && cl->writePending)
+    cl->writeTimer = TimerSet(cl->writeTimer, 0, rfbMaxClientWait,
+                              writeTimeoutCallback, cl);
+  SetWritePending(cl, TRUE);
+  return 0;
+}
 
-      FD_ZERO(&fds);
-      FD_SET(sock, &fds);
-      tv.tv_sec = 5;
-      tv.tv_usec = 0;
-      do {
-        n = select(sock + 1, NULL, &fds, NULL, &tv);
-      } while (n < 0 && errno == EINTR);
-      if (n < 0) {
-        rfbLogPerror("WriteExact: select");
+
+/*
+ * DrainOutputQueue waits until no more than limit bytes remain in the output
+ * queue.  Returns 1 if successful or -1 if an error occurred (errno is set to
+ * ETIMEDOUT if it timed out.)
+ */
+
+static int DrainOutputQueue(rfbClientPtr cl, int limit)
+{
+  int n, totalTimeWaited = 0;
+
+  if (limit < 0) limit = 0;
+
+  while (cl->outHead && cl->outQueued > limit) {
+    if ((n = FlushOutputQueue(cl)) < 0)
+      return -1;
+    if (!cl->outHead || cl->outQueued <= limit)
+      break;
+    if (WaitForWritable(cl->sock, &totalTimeWaited) < 0)
+      return -1;
+  }
+  return 1;
+}
+
+
+void rfbFreeOutputQueue(rfbClientPtr cl)
+{
+  while (cl->outHead) {
+    rfbOutputBlock *block = cl->outHead;
+    cl->outHead = block->next;
+    rfbFreeOutputBlock(block);
+  }
+  cl->outTail = NULL;
+  cl->outQueued = 0;
+  cl->outBlocks = 0;
+  TimerFree(cl->writeTimer);
+  cl->writeTimer = NULL;
+}
+
+
+/*
+ * writeTimeoutCallback() is called if a client's output queue has made no
+ * progress for rfbMaxClientWait ms.
+ */
+
+static CARD32 writeTimeoutCallback(OsTimerPtr timer, CARD32 now, pointer arg)
+{
+  rfbClientPtr cl = (rfbClientPtr)arg;
+
+  rfbLog("Client %s has not accepted any data in %d ms-- disconnecting\n",
+         cl->host, rfbMaxClientWait);
+  rfbCloseClient(cl);
+  return 0;
+}
+
+
+/*
+ * rfbFlushOutputQueue is called when a client's socket becomes writable.  If
+ * the queue drains completely and an update was held back while it was
+ * draining, then the update is sent.
+ */
+
+static void rfbFlushOutputQueue(rfbClientPtr cl)
+{
+  int n = FlushOutputQueue(cl);
+
+  if (n < 0) {
+    rfbLogPerror("rfbFlushOutputQueue: write");
+    rfbCloseClient(cl);
+    return;
+  }
+
+  if (n > 0 && cl->updateDeferred) {
+    cl->updateDeferred = FALSE;
+    rfbSendFramebufferUpdate(cl);
+  }
+}
+
+
+/*
+ * WriteExact writes an exact number of bytes on a TCP socket.  Returns 1 if
+ * those bytes have been written (or queued), or -1 if an error occurred (errno
+ * is set to ETIMEDOUT if it timed out).
+ */
+
+int WriteExact(rfbClientPtr cl, char *buf, int len)
+{
+  int n, totalTimeWaited = 0, bytesToWrite = len;
+  struct iovec iov;
+
+  if (len <= 0)
+    return 1;
+
+  if (cl->state == RFB_NORMAL) {
+    if (DrainOutputQueue(cl, rfbMaxClientQueue - len) < 0)
+      return -1;
+
+    if (cl->outHead) {
+      /* Data has to be sent in order, so the new data is appended to the
+         queue, and as much of the queue as possible is then written at
+         once (unless the socket is known to be full.) */
+      if (!QueueOutput(cl, buf, len))
+        return -1;
+      if (!cl->writePending && FlushOutputQueue(cl) < 0)
+        return -1;
+    } else {
+      iov.iov_base = buf;
+      iov.iov_len = len;
+      if ((n = WriteSome(cl, &iov, 1)) < 0)
         return n;
-      }
-      if (n == 0) {
-        totalTimeWaited += 5000;
-        if (totalTimeWaited >= rfbMaxClientWait) {
-          errno = ETIMEDOUT;
+      if (n < len) {
+        if (!QueueOutput(cl, buf + n, len - n))
           return -1;
-        }
-      } else {
-        totalTimeWaited = 0;
+        SetWritePending(cl, TRUE);
       }
     }
+
+    cl->sockOffset += bytesToWrite;
+    return 1;
+  }
+
+  while (len > 0) {
+    iov.iov_base = buf;
+    iov.iov_len = len;
+    if ((n = WriteSome(cl, &iov, 1)) < 0)
+      return n;
+
+    if (n > 0) {
+      buf += n;
+      len -= n;
+    } else if (WaitForWritable(cl->sock, &totalTimeWaited) < 0)
+      return -1;
+  }
+
+  cl->sockOffset += bytesToWrite;
+
+  return 1;
+}
+
+
+/*
+ * WriteBlock appends an output block (such as a full update buffer) to a
+ * client's output queue without writing it.  The queue takes ownership of the
+ * block.  The queue is written if it has grown large enough to fill a writev()
+ * call, but otherwise, the data is not written until the next call to
+ * FlushOutput() or WriteExact().  Returns 1 if successful or -1 if an error
+ * occurred.
+ */
+
+int WriteBlock(rfbClientPtr cl, rfbOutputBlock *block)
+{
+  int n;
+
+  if (cl->state != RFB_NORMAL) {
+    n = WriteExact(cl, BLOCK_DATA(block), block->len);
+    rfbFreeOutputBlock(block);
+    return n;
   }
 
-  gettimeofday(&cl->lastWrite, NULL);
-  cl->sockOffset += bytesWritten;
+  if (QueueBlock(cl, block) < 0)
+    return -1;
+
+  return DrainOutputQueue(cl, rfbMaxClientQueue);
+}
+
+
+/*
+ * QueueBlock is like WriteBlock, except that it never waits for the socket to
+ * accept data, so the output queue can grow beyond rfbMaxClientQueue bytes.
+ * The client must be in the RFB_NORMAL state.
+ */
+
+int QueueBlock(rfbClientPtr cl, rfbOutputBlock *block)
+{
+  block->offset = 0;
+  AppendOutputBlock(cl, block);
+  cl->sockOffset += block->len;
+
+  if (cl->outBlocks >= MAX_IOV && !cl->writePending &&
+      FlushOutputQueue(cl) < 0)
+    return -1;
 
   return 1;
 }
 
 
+/*
+ * QueueExact is like WriteBlock, except that it appends a copy of the given
+ * data to the output queue.
+ */
+
+int QueueExact(rfbClientPtr cl, char *buf, int len)
+{
+  if (cl->state != RFB_NORMAL)
+    return WriteExact(cl, buf, len);
+
+  if (!QueueOutput(cl, buf, len))
+    return -1;
+  cl->sockOffset += len;
+
+  return DrainOutputQueue(cl, rfbMaxClientQueue);
+}
+
+
+/*
+ * FlushOutput writes as much of the output queue as the socket will accept
+ * without blocking.  If the socket is known to be full, then nothing is
+ * written until it becomes writable.  Returns 1 if successful or -1 if an
+ * error occurred.
+ */
+
+int FlushOutput(rfbClientPtr cl)
+{
+  if (!cl->outHead || cl->writePending)
+    return 1;
+  return FlushOutputQueue(cl) < 0 ? -1 : 1;
+}
+
+
 int ListenOnTCPPort(int port)
 {
   rfbSockAddr addr;
@@ -897,7 +897,8 @@ rfbSpriteRemoveCursor(DeviceIntPtr pDev, ScreenPtr pScreen)
                                 pCursorInfo->saved.y2 -
                                 pCursorInfo->saved.y1)) {
         rfbSpriteIsUp(pCursorInfo);
-    }
+    } else
+        rfbAddCursorDamage(pScreen, &pCursorInfo->saved);
     rfbSpriteEnableDamage(pScreen, pScreenPriv);
     DamageDrawInternal(pScreen, FALSE);
 
@@ -980,6 +981,7 @@ rfbSpriteRestoreCursor(DeviceIntPtr pDev, ScreenPtr pScreen)
                          pScreenPriv->colors[MASK_COLOR].pixel)) {
         rfbSpriteIsUp(pCursorInfo);
         pCursorInfo->pScreen = pScreen;
+        rfbAddCursorDamage(pScreen, &pCursorInfo->saved);
     }
     rfbSpriteEnableDamage(pScreen, pScreenPriv);
     DamageDrawInternal(pScreen, FALSE);
@@ -25,6 +25,7 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include "rfb.h"
 
 static char *encNames[MAX_ENCODINGS] = {
@@ -53,6 +54,21 @@ void rfbResetStats(rfbClientPtr cl)
   cl->rfbRawBytesEquivalent = 0;
   cl->rfbKeyEventsRcvd = 0;
   cl->rfbPointerEventsRcvd = 0;
+  cl->rfbWriteCalls = 0;
+  cl->rfbWritevCalls = 0;
+  cl->rfbICEPixelsCompared = 0;
+  cl->rfbICEPixelsIdentical = 0;
+  cl->damageStart = 0.;
+  memset(&cl->encodeHist, 0, sizeof(rfbHistogram));
+  memset(&cl->latencyHist, 0, sizeof(rfbHistogram));
+}
+
+
+const char *rfbEncodingName(int encoding)
+{
+  if (encoding < 0 || encoding >= MAX_ENCODINGS)
+    return "[Unknown]";
+  return encNames[encoding];
 }
 
 
@@ -83,6 +99,19 @@ void rfbPrintStats(rfbClientPtr cl)
          cl->rfbFramebufferUpdateMessagesSent, totalRectanglesSent,
          totalBytesSent);
 
+  if (cl->rfbWriteCalls != 0)
+    rfbLog("  socket write calls %d (writev %d), per update %.2f\n",
+           cl->rfbWriteCalls, cl->rfbWritevCalls,
+           cl->rfbFramebufferUpdateMessagesSent ?
+           (double)cl->rfbWriteCalls /
+           (double)cl->rfbFramebufferUpdateMessagesSent : 0.0);
+
+  if (cl->rfbICEPixelsCompared != 0)
+    rfbLog("  interframe comparison %.2f Mpixels, identical %.2f %%\n",
+           (double)cl->rfbICEPixelsCompared / 1000000.,
+           (double)cl->rfbICEPixelsIdentical /
+           (double)cl->rfbICEPixelsCompared * 100.);
+
   if (cl->rfbLastRectMarkersSent != 0)
     rfbLog("    LastRect markers %d, bytes %d\n", cl->rfbLastRectMarkersSent,
            cl->rfbLastRectBytesSent);
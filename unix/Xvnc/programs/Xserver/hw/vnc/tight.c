@@ -30,10 +30,12 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <pthread.h>
 #include <errno.h>
 #include <unistd.h>
 #include "rfb.h"
+#include "simd.h"
 #include "turbojpeg.h"
 
 
@@ -45,9 +47,15 @@
 #define MIN_SOLID_SUBRECT_SIZE  2048
 #define MAX_SPLIT_TILE_SIZE       16
 
-/* This variable is set on every rfbSendRectEncodingTight() call. */
-static Bool usePixelFormat24;
-
+/* Content classification stuff (see UpdateContentMap()) */
+#define CLASS_TILE_SIZE           64
+#define CLASS_VIDEO_RATE         8.0  /* updates/second */
+#define CLASS_IDLE_TIME          1.0  /* seconds */
+#define CLASS_MAX_SCORE            8
+#define CLASS_VIDEO_SCORE          4
+#define CLASS_TEXT_SCORE          -4
+#define CLASS_PROBE_INTERVAL      16
+#define CLASS_TEXT_MAX_COLORS    256
 
 /* ALR stuff */
 #define ADD_TO_LOSSY_REGION(x, y, w, h)  \
@@ -91,10 +99,6 @@ static TIGHT_CONF tightConf[4] = {
   { 65536, 2048,  32, 7, 7, 5,  96, 256 }  /* 9 */
 };
 
-static int compressLevel;
-static int qualityLevel;
-static int subsampLevel;
-
 static const int subsampLevel2tjsubsamp[TVNC_SAMPOPT] = {
   TJ_444, TJ_420, TJ_422, TJ_GRAYSCALE
 };
@@ -120,33 +124,87 @@ typedef struct PALETTE_s {
 } PALETTE;
 
 
-/* Globals for multi-threading */
+/* Stuff dealing with content classification. */
 
-static Bool threadInit = FALSE;
-static pthread_t thnd[MAX_ENCODING_THREADS] = { 0, 0, 0, 0, 0, 0, 0, 0 };
+enum { CLASS_UNKNOWN, CLASS_VIDEO, CLASS_TEXT };
+
+typedef struct CONTENT_TILE_s {
+  double lastUpdate;
+  double updateRate;
+  unsigned int nUpdates;
+  signed char score;            /* > 0 = many colors, < 0 = few colors */
+  CARD8 class;
+  CARD16 nLossy, nLossless;     /* subrectangles encoded since last update */
+} CONTENT_TILE;
+
+
+/* Encoding contexts and the shared worker pool
+
+   A threadparam structure holds the settings and scratch buffers for one
+   encoding job, so the encoder itself has no global state.  Each client has
+   its own context (cl->tightData), and tparam[] holds the additional contexts
+   that are used to split a large rectangle among several threads.  Jobs are
+   placed on a queue that is serviced by a pool of rfbNumThreads - 1 worker
+   threads shared by all clients.  A thread that is waiting for a job that no
+   worker has picked up yet runs the job itself. */
+
+enum { JOB_IDLE, JOB_QUEUED, JOB_RUNNING, JOB_DONE };
 
 typedef struct _threadparam {
   rfbClientPtr cl;
   int x, y, w, h, id, _ublen, *ublen;
+  int compressLevel, qualityLevel, subsampLevel;
+  Bool usePixelFormat24;
+  Bool direct;                  /* encode into the client's update buffer */
   char *tightBeforeBuf;
   int tightBeforeBufSize;
   char *tightAfterBuf;
   int tightAfterBufSize;
   char *updateBuf;
   int updateBufSize;
+  rfbOutputBlock *block;        /* private output block (holds updateBuf) */
+  rfbOutputBlock *outHead, *outTail;  /* finished private output blocks */
   int paletteNumColors, paletteMaxColors;
   CARD32 monoBackground, monoForeground;
   PALETTE palette;
+  struct CONTENT_TILE_s *contentMap;  /* see UpdateContentMap() */
+  int contentMapWidth, contentMapHeight;
   tjhandle j;
   int bytessent, rectsent;
   int streamId, baseStreamId, nStreams;
-  pthread_mutex_t ready, done;
-  Bool status, deadyet;
+  z_streamp zs;                 /* used by threads 5 and beyond */
+  Bool zsActive, resetStream, streamUsed;
+  int zsLevel;
+  Bool status;
   RegionRec lossyRegion, losslessRegion;
+  BoxPtr rects;                 /* rectangles encoded by an asynchronous job */
+  int nRects, rectsSize;
+  double tQueued, tJobStart, tJobEnd;  /* timing of an asynchronous job */
+  Bool (*func)(struct _threadparam *t);
+  Bool (*extFunc)(int id, void *arg);  /* job submitted by another encoder */
+  void *extArg;
+  int jobState;
+  struct _threadparam *next;
 } threadparam;
 
+static Bool threadInit = FALSE;
+static pthread_t thnd[MAX_ENCODING_THREADS] = { 0, 0, 0, 0, 0, 0, 0, 0 };
 static threadparam tparam[MAX_ENCODING_THREADS];
 
+static pthread_mutex_t jobMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t jobReady = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t jobDone = PTHREAD_COND_INITIALIZER;
+static threadparam *jobHead = NULL, *jobTail = NULL;
+static Bool poolShutdown = FALSE;
+
+static pthread_mutex_t contentMutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* Pool of compression buffers (see SendCompressedData()) */
+#define MAX_SPARE_BUFS  (MAX_ENCODING_THREADS * 2)
+static char *spareBufs[MAX_SPARE_BUFS];
+static int spareBufSizes[MAX_SPARE_BUFS], nSpareBufs = 0;
+static pthread_mutex_t spareBufMutex = PTHREAD_MUTEX_INITIALIZER;
+
 
 /* Prototypes for static functions. */
 
@@ -176,6 +234,8 @@ static Bool SendFullColorRect(threadparam *t, int w, int h);
 static Bool CompressData(threadparam *t, int streamId, int dataLen,
                          int zlibLevel, int zlibStrategy);
 static Bool SendCompressedData(threadparam *t, char *buf, int compressedLen);
+static CARD8 StreamControl(threadparam *t, int streamId);
+static void ReturnStream(threadparam *t);
 
 static void FillPalette8(threadparam *t, int count);
 static void FillPalette16(threadparam *t, int count);
@@ -204,6 +264,18 @@ static Bool SendRectEncodingTight(threadparam *t, int x, int y, int w, int h);
 
 static void *TightThreadFunc(void *param);
 static Bool CheckUpdateBuf(threadparam *t, int bytes);
+static Bool EncodeTilesJob(threadparam *t);
+static void BeginPrivateBuf(threadparam *t);
+static void NewPrivateBlock(threadparam *t, int size);
+static void AppendPrivateBlock(threadparam *t, rfbOutputBlock *block);
+static void FreePrivateBufs(threadparam *t);
+static Bool SendPrivateBufs(threadparam *t);
+static Bool EncodeRectsJob(threadparam *t);
+static void UpdateContentMap(threadparam *t, int x, int y, int w, int h);
+static int GetContentClass(threadparam *t, int x, int y, int w, int h,
+                           Bool *probe);
+static void RecordContent(threadparam *t, int x, int y, int w, int h,
+                          int class, Bool lossy);
 
 
 /*
@@ -212,7 +284,7 @@ static Bool CheckUpdateBuf(threadparam *t, int bytes);
 
 int rfbNumCodedRectsTight(rfbClientPtr cl, int x, int y, int w, int h)
 {
-  int maxRectSize, maxRectWidth;
+  int compressLevel, maxRectSize, maxRectWidth;
   int subrectMaxWidth, subrectMaxHeight;
 
   /* No matter how many rectangles we will send if LastRect markers
@@ -220,6 +292,7 @@ int rfbNumCodedRectsTight(rfbClientPtr cl, int x, int y, int w, int h)
   if (cl->enableLastRectEncoding && w * h >= MIN_SPLIT_RECT_SIZE)
     return 0;
 
+  compressLevel = rfbTightCompressLevel(cl);
   maxRectSize = tightConf[compressLevel].maxRectSize;
   maxRectWidth = tightConf[compressLevel].maxRectWidth;
 
@@ -287,26 +360,15 @@ static void InitThreads(void)
   if (threadInit) return;
 
   memset(tparam, 0, sizeof(threadparam) * MAX_ENCODING_THREADS);
-  tparam[0].ublen = &ublen;
-  tparam[0].updateBuf = updateBuf;
-  for (i = 1; i < MAX_ENCODING_THREADS; i++) {
-    tparam[i].ublen = &tparam[i]._ublen;
+  for (i = 1; i < MAX_ENCODING_THREADS; i++)
     tparam[i].id = i;
-  }
-  rfbLog("Using %d thread%s for Tight encoding\n", rfbNumThreads,
+  rfbLog("Using %d thread%s for Tight and ZRLE encoding\n", rfbNumThreads,
          rfbNumThreads == 1 ? "" : "s");
+  poolShutdown = FALSE;
   if (rfbNumThreads > 1) {
     for (i = 1; i < rfbNumThreads; i++) {
-      if (!tparam[i].updateBuf) {
-        tparam[i].updateBufSize = UPDATE_BUF_SIZE;
-        tparam[i].updateBuf = (char *)rfbAlloc(tparam[i].updateBufSize);
-      }
-      pthread_mutex_init(&tparam[i].ready, NULL);
-      pthread_mutex_lock(&tparam[i].ready);
-      pthread_mutex_init(&tparam[i].done, NULL);
-      pthread_mutex_lock(&tparam[i].done);
       if ((err = pthread_create(&thnd[i], NULL, TightThreadFunc,
-                                &tparam[i])) != 0) {
+                                (void *)(long)(i + 1))) != 0) {
         rfbLog("Could not start thread %d: %s\n", i + 1,
                strerror(err == -1 ? errno : err));
         return;
@@ -316,163 +378,954 @@ static void InitThreads(void)
   threadInit = TRUE;
 }
 
+static void FreeContext(threadparam *t)
+{
+  free(t->tightAfterBuf);
+  free(t->tightBeforeBuf);
+  FreePrivateBufs(t);
+  free(t->rects);
+  free(t->contentMap);
+  if (t->j) tjDestroy(t->j);
+  if (t->zsActive) deflateEnd(t->zs);
+  free(t->zs);
+  if (!REGION_NAR(&t->lossyRegion))
+    REGION_UNINIT(pScreen, &t->lossyRegion);
+  if (!REGION_NAR(&t->losslessRegion))
+    REGION_UNINIT(pScreen, &t->losslessRegion);
+  memset(t, 0, sizeof(threadparam));
+}
+
 void ShutdownTightThreads(void)
 {
   int i;
 
   if (!threadInit) return;
   if (rfbNumThreads > 1) {
+    pthread_mutex_lock(&jobMutex);
+    poolShutdown = TRUE;
+    pthread_cond_broadcast(&jobReady);
+    pthread_mutex_unlock(&jobMutex);
     for (i = 1; i < rfbNumThreads; i++) {
       if (thnd[i]) {
-        tparam[i].deadyet = TRUE;
-        pthread_mutex_unlock(&tparam[i].ready);
         pthread_join(thnd[i], NULL);
         thnd[i] = 0;
-        pthread_mutex_destroy(&tparam[i].ready);
-        pthread_mutex_destroy(&tparam[i].done);
       }
     }
   }
-  for (i = 0; i < rfbNumThreads; i++) {
-    free(tparam[i].tightAfterBuf);
-    free(tparam[i].tightBeforeBuf);
-    if (i != 0) free(tparam[i].updateBuf);
-    if (tparam[i].j) tjDestroy(tparam[i].j);
-    if (!REGION_NAR(&tparam[i].losslessRegion))
-      REGION_UNINIT(pScreen, &tparam[i].losslessRegion);
-    if (!REGION_NAR(&tparam[i].lossyRegion))
-      REGION_UNINIT(pScreen, &tparam[i].lossyRegion);
-    memset(&tparam[i], 0, sizeof(threadparam));
-  }
+  for (i = 1; i < rfbNumThreads; i++)
+    FreeContext(&tparam[i]);
+  pthread_mutex_lock(&spareBufMutex);
+  while (nSpareBufs > 0)
+    free(spareBufs[--nSpareBufs]);
+  pthread_mutex_unlock(&spareBufMutex);
   threadInit = FALSE;
 }
 
 static void *TightThreadFunc(void *param)
 {
-  threadparam *t = (threadparam *)param;
+  threadparam *t;
+  char name[32];
+
+  snprintf(name, sizeof(name), "Encoding thread %d", (int)(long)param);
+  rfbTraceThreadName((int)(long)param - 1, name);
+
+  pthread_mutex_lock(&jobMutex);
+  while (!poolShutdown) {
+    if (!jobHead) {
+      pthread_cond_wait(&jobReady, &jobMutex);
+      continue;
+    }
+    t = jobHead;
+    jobHead = t->next;
+    if (!jobHead) jobTail = NULL;
+    t->jobState = JOB_RUNNING;
+    pthread_mutex_unlock(&jobMutex);
 
-  while (!t->deadyet) {
-    pthread_mutex_lock(&t->ready);
-    if (t->deadyet) break;
-    t->status = SendRectEncodingTight(t, t->x, t->y, t->w, t->h);
-    pthread_mutex_unlock(&t->done);
+    t->status = t->func(t);
+
+    pthread_mutex_lock(&jobMutex);
+    t->jobState = JOB_DONE;
+    pthread_cond_broadcast(&jobDone);
   }
+  pthread_mutex_unlock(&jobMutex);
   return NULL;
 }
 
 
+/*
+ * Queue a job for the worker pool.  If there are no worker threads, then the
+ * job will be run by WaitForJob().
+ */
+
+static void QueueJob(threadparam *t, Bool (*func)(threadparam *t))
+{
+  t->func = func;
+  t->next = NULL;
+  t->status = TRUE;
+
+  pthread_mutex_lock(&jobMutex);
+  t->jobState = JOB_QUEUED;
+  if (jobTail)
+    jobTail->next = t;
+  else
+    jobHead = t;
+  jobTail = t;
+  pthread_cond_signal(&jobReady);
+  pthread_mutex_unlock(&jobMutex);
+}
+
+
+/*
+ * Wait for a job to complete, and return its status.  If no worker thread
+ * has picked up the job yet, then it is removed from the queue and run in the
+ * calling thread.
+ */
+
+static Bool WaitForJob(threadparam *t)
+{
+  pthread_mutex_lock(&jobMutex);
+
+  if (t->jobState == JOB_QUEUED) {
+    threadparam **prev = &jobHead, *tail = NULL;
+
+    while (*prev != t) {
+      tail = *prev;
+      prev = &(*prev)->next;
+    }
+    *prev = t->next;
+    if (jobTail == t) jobTail = tail;
+    t->jobState = JOB_RUNNING;
+    pthread_mutex_unlock(&jobMutex);
+
+    t->status = t->func(t);
+
+    pthread_mutex_lock(&jobMutex);
+    t->jobState = JOB_DONE;
+  }
+
+  while (t->jobState == JOB_RUNNING)
+    pthread_cond_wait(&jobDone, &jobMutex);
+  t->jobState = JOB_IDLE;
+
+  pthread_mutex_unlock(&jobMutex);
+  return t->status;
+}
+
+
+/*
+ * Run func(0, arg) through func(nThreads - 1, arg) in parallel, using the
+ * calling thread for the first job and the worker pool for the others, and
+ * return FALSE if any of the jobs failed.  This allows other encoders (such
+ * as ZRLE) to share the Tight encoder's worker pool.  The contexts in
+ * tparam[] are free whenever the calling thread is not inside
+ * rfbSendRectEncodingTight(), since that function always waits for its
+ * jobs.
+ */
+
+static Bool ExternalJob(threadparam *t)
+{
+  return t->extFunc(t->id, t->extArg);
+}
+
+Bool rfbRunParallelJobs(int nThreads, Bool (*func)(int id, void *arg),
+                        void *arg)
+{
+  Bool status;
+  int i;
+
+  if (!threadInit) {
+    InitThreads();
+    if (!threadInit) return FALSE;
+  }
+  nThreads = min(nThreads, rfbNumThreads);
+
+  for (i = 1; i < nThreads; i++) {
+    tparam[i].extFunc = func;
+    tparam[i].extArg = arg;
+    QueueJob(&tparam[i], ExternalJob);
+  }
+  status = func(0, arg);
+  for (i = 1; i < nThreads; i++)
+    status &= WaitForJob(&tparam[i]);
+
+  return status;
+}
+
+
 static Bool CheckUpdateBuf(threadparam *t, int bytes)
 {
   rfbClientPtr cl = t->cl;
 
-  if (t->id == 0) {
-    if (ublen + bytes > UPDATE_BUF_SIZE) {
+  if (t->direct) {
+    if (cl->ublen + bytes > UPDATE_BUF_SIZE) {
       if (!rfbSendUpdateBuf(cl))
         return FALSE;
+      t->updateBuf = cl->updateBuf;
     }
   } else {
-    if ((*t->ublen) + bytes > t->updateBufSize) {
-      t->updateBufSize += UPDATE_BUF_SIZE;
-      t->updateBuf = (char *)rfbRealloc(t->updateBuf, t->updateBufSize);
-    }
+    if ((*t->ublen) + bytes > t->updateBufSize)
+      NewPrivateBlock(t, bytes);
   }
   return TRUE;
 }
 
 
-Bool rfbSendRectEncodingTight(rfbClientPtr cl, int x, int y, int w, int h)
+/*
+ * Return the client's encoding context, allocating it if necessary, and load
+ * the client's current encoding settings into it.
+ */
+
+static threadparam *GetClientContext(rfbClientPtr cl)
 {
-  Bool status = TRUE;
-  int i, nt;
+  threadparam *t = (threadparam *)cl->tightData;
 
-  if (!threadInit) {
-    InitThreads();
-    if (!threadInit) return FALSE;
+  if (!t) {
+    t = (threadparam *)rfbAlloc0(sizeof(threadparam));
+    t->ublen = &t->_ublen;
+    cl->tightData = t;
   }
-
-  compressLevel = rfbTightCompressLevel(cl);
-  qualityLevel = cl->tightQualityLevel;
-  subsampLevel = cl->tightSubsampLevel;
+  t->cl = cl;
+  t->compressLevel = rfbTightCompressLevel(cl);
+  t->qualityLevel = cl->tightQualityLevel;
+  t->subsampLevel = cl->tightSubsampLevel;
 
   if (cl->format.depth == 24 && cl->format.redMax == 0xFF &&
       cl->format.greenMax == 0xFF && cl->format.blueMax == 0xFF)
-    usePixelFormat24 = TRUE;
+    t->usePixelFormat24 = TRUE;
   else
-    usePixelFormat24 = FALSE;
+    t->usePixelFormat24 = FALSE;
 
-  nt = min(rfbNumThreads, w * h / tightConf[compressLevel].maxRectSize);
-  if (nt < 1) nt = 1;
+  return t;
+}
 
-  for (i = 0; i < nt; i++) {
-    tparam[i].status = TRUE;
-    tparam[i].cl = cl;
-    tparam[i].x = x;
-    tparam[i].y = h / nt * i + y;
-    tparam[i].w = w;
-    tparam[i].h = (i == nt - 1) ? (h - (h / nt * i)) : h / nt;
-    tparam[i].bytessent = tparam[i].rectsent = 0;
-    if (rfbAutoLosslessRefresh > 0.0) {
-      REGION_INIT(pScreen, &tparam[i].lossyRegion, NullBox, 0);
-      REGION_INIT(pScreen, &tparam[i].losslessRegion, NullBox, 0);
+
+void rfbFreeTightData(rfbClientPtr cl)
+{
+  threadparam *t = (threadparam *)cl->tightData;
+
+  if (!t) return;
+  if (t->jobState != JOB_IDLE)
+    WaitForJob(t);
+  t->direct = FALSE;
+  t->updateBuf = NULL;
+  FreeContext(t);
+  free(t);
+  cl->tightData = NULL;
+}
+
+
+/*
+ * Private output buffers
+ *
+ * A context that runs concurrently with other threads can't encode into the
+ * client's update buffer, since flushing the update buffer may close the
+ * client.  Such a context instead encodes into its own chain of output
+ * blocks.  t->updateBuf is the data area of the current block (t->block), and
+ * when it fills, it is moved to the end of the chain (t->outHead) and a new
+ * block is started.  Large compressed payloads are also added to the chain by
+ * reference (see SendCompressedData().)  Once the context's job is finished,
+ * the whole chain is appended to the client's output queue without being
+ * copied.
+ */
+
+static void AppendPrivateBlock(threadparam *t, rfbOutputBlock *block)
+{
+  block->next = NULL;
+  if (t->outTail)
+    t->outTail->next = block;
+  else
+    t->outHead = block;
+  t->outTail = block;
+}
+
+
+/*
+ * Move the current private block to the end of the chain, if the block
+ * contains any data.
+ */
+
+static void CutPrivateBlock(threadparam *t)
+{
+  rfbOutputBlock *block = t->block;
+
+  if (!block || t->_ublen == 0) return;
+
+  block->len = t->_ublen;
+  /* Don't tie up a mostly empty block in the output queue.  (Shrinking a
+     block does not normally move it.) */
+  if (block->len < t->updateBufSize / 2)
+    block = (rfbOutputBlock *)rfbRealloc(block, sizeof(rfbOutputBlock) +
+                                                block->len);
+  AppendPrivateBlock(t, block);
+  t->block = NULL;
+  t->updateBuf = NULL;
+  t->updateBufSize = t->_ublen = 0;
+}
+
+
+/*
+ * Start a new private block that can hold at least the given number of bytes.
+ */
+
+static void NewPrivateBlock(threadparam *t, int size)
+{
+  CutPrivateBlock(t);
+
+  size = max(size, UPDATE_BUF_SIZE);
+  if (t->block && t->updateBufSize >= size) return;
+
+  free(t->block);
+  t->block = (rfbOutputBlock *)rfbAlloc(sizeof(rfbOutputBlock) + size);
+  memset(t->block, 0, sizeof(rfbOutputBlock));
+  t->updateBuf = t->block->data;
+  t->updateBufSize = size;
+  t->_ublen = 0;
+}
+
+
+static void BeginPrivateBuf(threadparam *t)
+{
+  t->direct = FALSE;
+  t->ublen = &t->_ublen;
+  t->_ublen = 0;
+  if (t->block)
+    t->updateBuf = t->block->data;
+  else
+    NewPrivateBlock(t, 0);
+}
+
+
+static void FreePrivateBufs(threadparam *t)
+{
+  while (t->outHead) {
+    rfbOutputBlock *block = t->outHead;
+
+    t->outHead = block->next;
+    rfbFreeOutputBlock(block);
+  }
+  t->outTail = NULL;
+  free(t->block);
+  t->block = NULL;
+  if (!t->direct) {
+    t->updateBuf = NULL;
+    t->updateBufSize = t->_ublen = 0;
+  }
+}
+
+
+/*
+ * Append a context's private output blocks to the client's update.  This is
+ * called from the main thread once the context's job has finished.
+ */
+
+static Bool SendPrivateBufs(threadparam *t)
+{
+  rfbClientPtr cl = t->cl;
+
+  CutPrivateBlock(t);
+
+  while (t->outHead) {
+    rfbOutputBlock *block = t->outHead;
+
+    t->outHead = block->next;
+    if (!rfbSendUpdateBlock(cl, block)) {
+      FreePrivateBufs(t);
+      return FALSE;
     }
-    if (i < 4) {
-      int n = min(nt, 4);
-      tparam[i].baseStreamId = 4 / n * i;
-      if (i == n - 1) tparam[i].nStreams = 4 - tparam[i].baseStreamId;
-      else tparam[i].nStreams = 4 / n;
-      tparam[i].streamId = tparam[i].baseStreamId;
+  }
+  t->outTail = NULL;
+  return TRUE;
+}
+
+
+/*
+ * Add the lossy and lossless regions that were accumulated by a context to
+ * the client's lossy region.
+ */
+
+static void MergeALRRegions(rfbClientPtr cl, threadparam *t)
+{
+  if (rfbAutoLosslessRefresh <= 0.0) return;
+
+  REGION_UNION(pScreen, &cl->lossyRegion, &cl->lossyRegion, &t->lossyRegion);
+  REGION_UNINIT(pScreen, &t->lossyRegion);
+  memset(&t->lossyRegion, 0, sizeof(RegionRec));
+  REGION_SUBTRACT(pScreen, &cl->lossyRegion, &cl->lossyRegion,
+                  &t->losslessRegion);
+  REGION_UNINIT(pScreen, &t->losslessRegion);
+  memset(&t->losslessRegion, 0, sizeof(RegionRec));
+}
+
+
+/*
+ * Tile scheduler
+ *
+ * A rectangle that is large enough to be split among several threads is cut
+ * into horizontal tiles, each of which is as tall as the largest subrectangle
+ * that SendRectSimple() would send.  (Thus, splitting the rectangle into
+ * tiles does not change the number of subrectangles that are sent to clients
+ * that don't support LastRect.)  Each thread starts with a contiguous range
+ * of tiles, which it encodes from top to bottom.  A thread that runs out of
+ * tiles steals the lower half of the largest range that remains, so a thread
+ * that gets stuck with a JPEG-heavy part of the screen does not hold up the
+ * others.  Each thread appends its output to its own buffer, and since the
+ * subrectangles of a Tight update can be sent in any order, the buffers are
+ * simply concatenated.  That preserves the order in which each thread used
+ * its zlib streams.
+ */
+
+typedef struct {
+  pthread_mutex_t mutex;
+  int next, end;
+} TILE_RANGE;
+
+static struct {
+  int x, y, w, h, tileHeight, nThreads;
+  TILE_RANGE range[MAX_ENCODING_THREADS];
+} tileSched;
+
+static pthread_once_t tileSchedOnce = PTHREAD_ONCE_INIT;
+
+/* Profiling stuff (used only if TVNC_PROFILE=1) */
+static double tileBusy[MAX_ENCODING_THREADS], tileWall = 0.;
+static unsigned long tilesEncoded[MAX_ENCODING_THREADS],
+  tilesStolen[MAX_ENCODING_THREADS];
+static unsigned long contentRects[3];
+
+
+static void InitTileSched(void)
+{
+  int i;
+
+  for (i = 0; i < MAX_ENCODING_THREADS; i++)
+    pthread_mutex_init(&tileSched.range[i].mutex, NULL);
+}
+
+
+static double GetThreadTime(void)
+{
+#ifdef CLOCK_THREAD_CPUTIME_ID
+  struct timespec ts;
+
+  if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts) == 0)
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1000000000.;
+#endif
+  return gettime();
+}
+
+
+/*
+ * Take the next tile from the thread's own range, or steal some tiles from
+ * another thread if the thread's range is empty.  Returns -1 if there are no
+ * tiles left.
+ */
+
+static int GetTile(int id)
+{
+  TILE_RANGE *r = &tileSched.range[id];
+  int i, tile = -1;
+
+  pthread_mutex_lock(&r->mutex);
+  if (r->next < r->end) tile = r->next++;
+  pthread_mutex_unlock(&r->mutex);
+  if (tile >= 0) return tile;
+
+  for (;;) {
+    int victim = -1, most = 0, start, end;
+
+    for (i = 0; i < tileSched.nThreads; i++) {
+      int left;
+
+      if (i == id) continue;
+      pthread_mutex_lock(&tileSched.range[i].mutex);
+      left = tileSched.range[i].end - tileSched.range[i].next;
+      pthread_mutex_unlock(&tileSched.range[i].mutex);
+      if (left > most) {
+        most = left;  victim = i;
+      }
     }
+    if (victim < 0) return -1;
+
+    pthread_mutex_lock(&tileSched.range[victim].mutex);
+    end = tileSched.range[victim].end;
+    start = end - (end - tileSched.range[victim].next) / 2;
+    if (start >= end && tileSched.range[victim].next < end) start = end - 1;
+    tileSched.range[victim].end = start;
+    pthread_mutex_unlock(&tileSched.range[victim].mutex);
+    /* Another thread may have emptied the range in the meantime. */
+    if (start >= end) continue;
+
+    pthread_mutex_lock(&r->mutex);
+    r->next = start + 1;
+    r->end = end;
+    pthread_mutex_unlock(&r->mutex);
+    if (rfbProfile) tilesStolen[id] += end - start;
+    return start;
   }
-  if (nt > 1) {
-    for (i = 1; i < nt; i++) pthread_mutex_unlock(&tparam[i].ready);
+}
+
+
+static Bool EncodeTilesJob(threadparam *t)
+{
+  int tile, y, h;
+  double tStart = 0.;
+
+  if (rfbProfile) tStart = GetThreadTime();
+
+  while ((tile = GetTile(t->id)) >= 0) {
+    double tRect;
+
+    y = tileSched.y + tile * tileSched.tileHeight;
+    h = min(tileSched.tileHeight, tileSched.y + tileSched.h - y);
+    TRACE_START(tRect);
+    if (!SendRectEncodingTight(t, tileSched.x, y, tileSched.w, h))
+      return FALSE;
+    TRACE_END(tRect, "rect", "pixels", tileSched.w * h);
+    if (rfbProfile) tilesEncoded[t->id]++;
+  }
+
+  if (rfbProfile) tileBusy[t->id] += GetThreadTime() - tStart;
+  return TRUE;
+}
+
+
+/*
+ * Report the per-thread utilization of the tile scheduler.  This is called
+ * from the profiling code in rfbserver.c.
+ */
+
+void rfbTightPrintProfile(void)
+{
+  char str[256];
+  int i, len = 0;
+
+  pthread_mutex_lock(&contentMutex);
+  if (contentRects[CLASS_VIDEO] || contentRects[CLASS_TEXT] ||
+      contentRects[CLASS_UNKNOWN]) {
+    rfbLog("Tight content classes (subrects video/text/other): %lu/%lu/%lu\n",
+           contentRects[CLASS_VIDEO], contentRects[CLASS_TEXT],
+           contentRects[CLASS_UNKNOWN]);
+    memset(contentRects, 0, sizeof(contentRects));
   }
+  pthread_mutex_unlock(&contentMutex);
 
-  status &= SendRectEncodingTight(&tparam[0], tparam[0].x, tparam[0].y,
-                                  tparam[0].w, tparam[0].h);
-  if (!status) return FALSE;
-  cl->rfbBytesSent[rfbEncodingTight] += tparam[0].bytessent;
-  cl->rfbRectanglesSent[rfbEncodingTight] += tparam[0].rectsent;
+  if (tileWall <= 0.) return;
 
-  if (nt > 1) {
-    for (i = 1; i < nt; i++) {
-      pthread_mutex_lock(&tparam[i].done);
-      status &= tparam[i].status;
+  for (i = 0; i < rfbNumThreads && len < (int)sizeof(str); i++) {
+    len += snprintf(&str[len], sizeof(str) - len, "  %d: %.1f%% (%lu/%lu)",
+                    i, tileBusy[i] / tileWall * 100., tilesEncoded[i],
+                    tilesStolen[i]);
+    tileBusy[i] = 0.;
+    tilesEncoded[i] = tilesStolen[i] = 0;
+  }
+  rfbLog("Tight thread utilization (tiles encoded/stolen):\n");
+  rfbLog("%s\n", str);
+  tileWall = 0.;
+}
+
+
+/*
+ * Content classification
+ *
+ * When JPEG is enabled, SendSubrect() normally decides between JPEG and
+ * palette-based encoding by counting the colors in each subrectangle.  That
+ * wastes CPU time on areas of the screen, such as video windows, that are
+ * updated often and almost never fit in a palette, and it occasionally sends
+ * anti-aliased text with JPEG because the text uses a few more colors than
+ * palMaxColorsWithJPEG.  Thus, each client's context keeps a history for
+ * each CLASS_TILE_SIZE x CLASS_TILE_SIZE tile of the framebuffer: the rate at
+ * which the tile is updated and a score that is raised whenever the
+ * subrectangles overlapping the tile had too many colors for a palette and
+ * lowered whenever they didn't.  A tile that is updated at least
+ * CLASS_VIDEO_RATE times per second and has a high score is classified as
+ * video, and the subrectangles that lie entirely within video tiles are sent
+ * with JPEG (at the client's current JPEG quality, which -adaptqual adapts to
+ * the available bandwidth) without counting their colors.  Every
+ * CLASS_PROBE_INTERVAL updates, a video tile is analyzed as usual, so that a
+ * tile whose contents change to something else is eventually reclassified.
+ * A tile with a low score is classified as text, and the subrectangles that
+ * overlap text tiles may use a palette of up to CLASS_TEXT_MAX_COLORS colors,
+ * so they remain lossless.  Counting the colors of a colorful subrectangle
+ * that far is expensive, so the colors are counted beyond the usual limit
+ * only in the subrectangles that overlap text tiles, tiles that may contain
+ * text (tiles whose score isn't positive), or tiles that are due to be
+ * analyzed.
+ *
+ * The tile history is updated by the main thread (in UpdateContentMap()),
+ * before the rectangles of an update are encoded, and the encoding threads
+ * only read the tile history and count their results (under contentMutex.)
+ */
+
+static void UpdateContentMap(threadparam *t, int x, int y, int w, int h)
+{
+  rfbClientPtr cl = t->cl;
+  int mapWidth = (rfbFB.width + CLASS_TILE_SIZE - 1) / CLASS_TILE_SIZE;
+  int mapHeight = (rfbFB.height + CLASS_TILE_SIZE - 1) / CLASS_TILE_SIZE;
+  int tx, ty;
+  double now = cl->tUpdateStart;
+
+  if (t->qualityLevel == -1 || rfbFB.bitsPerPixel == 8 || w <= 0 || h <= 0)
+    return;
+
+  if (!t->contentMap || t->contentMapWidth != mapWidth ||
+      t->contentMapHeight != mapHeight) {
+    free(t->contentMap);
+    t->contentMap = (CONTENT_TILE *)rfbAlloc0(mapWidth * mapHeight *
+                                              sizeof(CONTENT_TILE));
+    t->contentMapWidth = mapWidth;
+    t->contentMapHeight = mapHeight;
+  }
+
+  pthread_mutex_lock(&contentMutex);
+
+  for (ty = y / CLASS_TILE_SIZE;
+       ty <= (y + h - 1) / CLASS_TILE_SIZE && ty < mapHeight; ty++) {
+    for (tx = x / CLASS_TILE_SIZE;
+         tx <= (x + w - 1) / CLASS_TILE_SIZE && tx < mapWidth; tx++) {
+      CONTENT_TILE *tile = &t->contentMap[ty * mapWidth + tx];
+      double interval = now - tile->lastUpdate;
+
+      /* A tile can be covered by several rectangles of the same update. */
+      if (interval <= 0.) continue;
+
+      if (interval > CLASS_IDLE_TIME)
+        tile->updateRate = 0.;
+      else
+        tile->updateRate = tile->updateRate * 0.75 + 0.25 / interval;
+      tile->lastUpdate = now;
+      tile->nUpdates++;
+
+      if (tile->nLossy > tile->nLossless &&
+          tile->score < CLASS_MAX_SCORE)
+        tile->score++;
+      else if (tile->nLossless > tile->nLossy &&
+               tile->score > -CLASS_MAX_SCORE)
+        tile->score--;
+      tile->nLossy = tile->nLossless = 0;
+
+      if (tile->updateRate >= CLASS_VIDEO_RATE &&
+          tile->score >= CLASS_VIDEO_SCORE &&
+          tile->nUpdates % CLASS_PROBE_INTERVAL != 0)
+        tile->class = CLASS_VIDEO;
+      else if (tile->score <= CLASS_TEXT_SCORE)
+        tile->class = CLASS_TEXT;
+      else
+        tile->class = CLASS_UNKNOWN;
     }
-    if (status == FALSE) return FALSE;
-    if (ublen > 0) {
-      if (!rfbSendUpdateBuf(cl))
-        return FALSE;
+  }
+
+  pthread_mutex_unlock(&contentMutex);
+}
+
+
+/*
+ * Return CLASS_VIDEO if the given subrectangle lies entirely within video
+ * tiles, CLASS_TEXT if it overlaps any text tiles, or CLASS_UNKNOWN
+ * otherwise.  *probe is set to TRUE if the subrectangle overlaps any tiles
+ * that may contain text (tiles whose score isn't positive) or that are due
+ * to be analyzed.
+ */
+
+static int GetContentClass(threadparam *t, int x, int y, int w, int h,
+                           Bool *probe)
+{
+  threadparam *ct = (threadparam *)t->cl->tightData;
+  int tx, ty, nVideo = 0, nTiles = 0;
+
+  *probe = FALSE;
+  if (t->qualityLevel == -1 || !ct || !ct->contentMap)
+    return CLASS_UNKNOWN;
+
+  for (ty = y / CLASS_TILE_SIZE;
+       ty <= (y + h - 1) / CLASS_TILE_SIZE && ty < ct->contentMapHeight;
+       ty++) {
+    for (tx = x / CLASS_TILE_SIZE;
+         tx <= (x + w - 1) / CLASS_TILE_SIZE && tx < ct->contentMapWidth;
+         tx++) {
+      CONTENT_TILE *tile = &ct->contentMap[ty * ct->contentMapWidth + tx];
+
+      if (tile->class == CLASS_TEXT) return CLASS_TEXT;
+      if (tile->class == CLASS_VIDEO) nVideo++;
+      else if (tile->score <= 0 ||
+               tile->nUpdates % CLASS_PROBE_INTERVAL == 0)
+        *probe = TRUE;
+      nTiles++;
     }
-    for (i = 1; i < nt; i++) {
-      if ((*tparam[i].ublen) > 0 &&
-          WriteExact(cl, tparam[i].updateBuf, *tparam[i].ublen) < 0) {
-        rfbLogPerror("rfbSendRectEncodingTight: write");
-        rfbCloseClient(cl);
-        return FALSE;
+  }
+
+  return nTiles > 0 && nVideo == nTiles ? CLASS_VIDEO : CLASS_UNKNOWN;
+}
+
+
+/*
+ * Count a subrectangle that was (lossy = TRUE) or wasn't (lossy = FALSE) too
+ * colorful for a palette against the tiles that it overlaps.
+ */
+
+static void RecordContent(threadparam *t, int x, int y, int w, int h,
+                          int class, Bool lossy)
+{
+  threadparam *ct = (threadparam *)t->cl->tightData;
+  int tx, ty;
+
+  if (t->qualityLevel == -1 || !ct || !ct->contentMap)
+    return;
+
+  pthread_mutex_lock(&contentMutex);
+
+  if (class != CLASS_VIDEO) {
+    for (ty = y / CLASS_TILE_SIZE;
+         ty <= (y + h - 1) / CLASS_TILE_SIZE && ty < ct->contentMapHeight;
+         ty++) {
+      for (tx = x / CLASS_TILE_SIZE;
+           tx <= (x + w - 1) / CLASS_TILE_SIZE && tx < ct->contentMapWidth;
+           tx++) {
+        CONTENT_TILE *tile = &ct->contentMap[ty * ct->contentMapWidth + tx];
+
+        if (lossy) {
+          if (tile->nLossy < 0xFFFF) tile->nLossy++;
+        } else {
+          if (tile->nLossless < 0xFFFF) tile->nLossless++;
+        }
       }
-      (*tparam[i].ublen) = 0;
-      cl->rfbBytesSent[rfbEncodingTight] += tparam[i].bytessent;
-      cl->rfbRectanglesSent[rfbEncodingTight] += tparam[i].rectsent;
     }
   }
+  if (rfbProfile) contentRects[class]++;
+
+  pthread_mutex_unlock(&contentMutex);
+}
+
+
+Bool rfbSendRectEncodingTight(rfbClientPtr cl, int x, int y, int w, int h)
+{
+  Bool status = TRUE;
+  int i, nt, nTiles;
+  threadparam *tp[MAX_ENCODING_THREADS];
+  double tStart = 0., tRect;
+
+  if (!threadInit) {
+    InitThreads();
+    if (!threadInit) return FALSE;
+  }
 
+  /* The client's own context encodes directly into the client's update
+     buffer, and the contexts in tparam[] encode into their own buffers. */
+  tp[0] = GetClientContext(cl);
+  tp[0]->direct = TRUE;
+  tp[0]->ublen = &cl->ublen;
+  tp[0]->updateBuf = cl->updateBuf;
+  tp[0]->bytessent = tp[0]->rectsent = 0;
   if (rfbAutoLosslessRefresh > 0.0) {
+    REGION_INIT(pScreen, &tp[0]->lossyRegion, NullBox, 0);
+    REGION_INIT(pScreen, &tp[0]->losslessRegion, NullBox, 0);
+  }
+  tp[0]->baseStreamId = tp[0]->streamId = 0;
+  tp[0]->nStreams = 4;
+  UpdateContentMap(tp[0], x, y, w, h);
+
+  nt = min(rfbNumThreads,
+           w * h / tightConf[tp[0]->compressLevel].maxRectSize);
+
+  if (nt < 2) {
+    TRACE_START(tRect);
+    status = SendRectEncodingTight(tp[0], x, y, w, h);
+    if (!status) return FALSE;
+    TRACE_END(tRect, "rect", "pixels", w * h);
+    cl->rfbBytesSent[rfbEncodingTight] += tp[0]->bytessent;
+    cl->rfbRectanglesSent[rfbEncodingTight] += tp[0]->rectsent;
+    MergeALRRegions(cl, tp[0]);
+    return TRUE;
+  }
+
+  BeginPrivateBuf(tp[0]);
+  pthread_once(&tileSchedOnce, InitTileSched);
+  tileSched.x = x;
+  tileSched.y = y;
+  tileSched.w = w;
+  tileSched.h = h;
+  tileSched.tileHeight = tightConf[tp[0]->compressLevel].maxRectSize /
+                         min(w, tightConf[tp[0]->compressLevel].maxRectWidth);
+  nTiles = (h + tileSched.tileHeight - 1) / tileSched.tileHeight;
+  nt = min(nt, nTiles);
+  tileSched.nThreads = nt;
+
+  for (i = 0; i < nt; i++) {
+    if (i > 0) {
+      tp[i] = &tparam[i];
+      tp[i]->compressLevel = tp[0]->compressLevel;
+      tp[i]->qualityLevel = tp[0]->qualityLevel;
+      tp[i]->subsampLevel = tp[0]->subsampLevel;
+      tp[i]->usePixelFormat24 = tp[0]->usePixelFormat24;
+      tp[i]->cl = cl;
+      tp[i]->bytessent = tp[i]->rectsent = 0;
+      BeginPrivateBuf(tp[i]);
+      if (rfbAutoLosslessRefresh > 0.0) {
+        REGION_INIT(pScreen, &tp[i]->lossyRegion, NullBox, 0);
+        REGION_INIT(pScreen, &tp[i]->losslessRegion, NullBox, 0);
+      }
+    }
+    if (i < 4) {
+      int n = min(nt, 4);
+      tp[i]->baseStreamId = 4 / n * i;
+      if (i == n - 1) tp[i]->nStreams = 4 - tp[i]->baseStreamId;
+      else tp[i]->nStreams = 4 / n;
+    } else {
+      tp[i]->baseStreamId = i % 4;
+      tp[i]->nStreams = 1;
+      tp[i]->resetStream = TRUE;
+      tp[i]->streamUsed = FALSE;
+    }
+    tp[i]->streamId = tp[i]->baseStreamId;
+    tileSched.range[i].next = nTiles * i / nt;
+    tileSched.range[i].end = nTiles * (i + 1) / nt;
+  }
+
+  if (rfbProfile) tStart = gettime();
+
+  for (i = 1; i < nt; i++) QueueJob(tp[i], EncodeTilesJob);
+
+  status = EncodeTilesJob(tp[0]);
+  if (!status) {
+    /* Let the other threads finish quickly. */
     for (i = 0; i < nt; i++) {
-      REGION_UNION(pScreen, &cl->lossyRegion, &cl->lossyRegion,
-                   &tparam[i].lossyRegion);
-      REGION_UNINIT(pScreen, &tparam[i].lossyRegion);
-      memset(&tparam[i].lossyRegion, 0, sizeof(RegionRec));
-      REGION_SUBTRACT(pScreen, &cl->lossyRegion, &cl->lossyRegion,
-                      &tparam[i].losslessRegion);
-      REGION_UNINIT(pScreen, &tparam[i].losslessRegion);
-      memset(&tparam[i].losslessRegion, 0, sizeof(RegionRec));
+      pthread_mutex_lock(&tileSched.range[i].mutex);
+      tileSched.range[i].end = tileSched.range[i].next;
+      pthread_mutex_unlock(&tileSched.range[i].mutex);
+    }
+  }
+  for (i = 1; i < nt; i++)
+    status &= WaitForJob(tp[i]);
+  for (i = 4; i < nt; i++)
+    ReturnStream(tp[i]);
+  if (!status) {
+    for (i = 0; i < nt; i++)
+      FreePrivateBufs(tp[i]);
+    return FALSE;
+  }
+
+  if (rfbProfile) tileWall += gettime() - tStart;
+
+  for (i = 0; i < nt; i++) {
+    if (!SendPrivateBufs(tp[i])) {
+      while (++i < nt)
+        FreePrivateBufs(tp[i]);
+      return FALSE;
     }
+    cl->rfbBytesSent[rfbEncodingTight] += tp[i]->bytessent;
+    cl->rfbRectanglesSent[rfbEncodingTight] += tp[i]->rectsent;
   }
 
+  for (i = 0; i < nt; i++)
+    MergeALRRegions(cl, tp[i]);
+
   return status;
 }
 
 
+/*
+ * Asynchronous encoding
+ *
+ * When several clients need updates at the same time,
+ * rfbSendFramebufferUpdates() passes each client's Tight rectangles to
+ * rfbTightQueueRect() rather than encoding them immediately.
+ * rfbTightStartJob() then hands all of the rectangles to the worker pool as a
+ * single job, which encodes them in order (so that the client's zlib streams
+ * are used in order) into a private buffer.  The jobs for different clients
+ * run in parallel, and rfbTightFinishJob() waits for a client's job and
+ * appends its output to the update.
+ */
+
+void rfbTightQueueRect(rfbClientPtr cl, int x, int y, int w, int h)
+{
+  threadparam *t = GetClientContext(cl);
+
+  if (t->nRects >= t->rectsSize) {
+    t->rectsSize = t->rectsSize ? t->rectsSize * 2 : 16;
+    t->rects = (BoxPtr)rfbRealloc(t->rects, t->rectsSize * sizeof(BoxRec));
+  }
+  t->rects[t->nRects].x1 = x;
+  t->rects[t->nRects].y1 = y;
+  t->rects[t->nRects].x2 = x + w;
+  t->rects[t->nRects].y2 = y + h;
+  t->nRects++;
+  UpdateContentMap(t, x, y, w, h);
+}
+
+
+static Bool EncodeRectsJob(threadparam *t)
+{
+  int i;
+
+  t->tJobStart = gettime();
+  for (i = 0; i < t->nRects; i++) {
+    BoxPtr box = &t->rects[i];
+    double tRect;
+
+    TRACE_START(tRect);
+    if (!SendRectEncodingTight(t, box->x1, box->y1, box->x2 - box->x1,
+                               box->y2 - box->y1))
+      return FALSE;
+    TRACE_END(tRect, "rect", "pixels",
+              (box->x2 - box->x1) * (box->y2 - box->y1));
+  }
+  t->tJobEnd = gettime();
+  return TRUE;
+}
+
+
+Bool rfbTightStartJob(rfbClientPtr cl)
+{
+  threadparam *t = (threadparam *)cl->tightData;
+
+  if (!t || t->nRects < 1) return FALSE;
+
+  if (!threadInit) {
+    InitThreads();
+    if (!threadInit) return FALSE;
+  }
+
+  BeginPrivateBuf(t);
+  t->bytessent = t->rectsent = 0;
+  t->baseStreamId = t->streamId = 0;
+  t->nStreams = 4;
+  if (rfbAutoLosslessRefresh > 0.0) {
+    REGION_INIT(pScreen, &t->lossyRegion, NullBox, 0);
+    REGION_INIT(pScreen, &t->losslessRegion, NullBox, 0);
+  }
+
+  t->tQueued = gettime();
+  QueueJob(t, EncodeRectsJob);
+  return TRUE;
+}
+
+
+Bool rfbTightFinishJob(rfbClientPtr cl)
+{
+  threadparam *t = (threadparam *)cl->tightData;
+  Bool status;
+
+  status = WaitForJob(t);
+  t->nRects = 0;
+  if (!status) {
+    FreePrivateBufs(t);
+    return FALSE;
+  }
+
+  /* The time that the job spent in the queue, and the time between the end
+     of the job and the return from WaitForJob(), was spent encoding other
+     clients' updates. */
+  cl->tUpdateWait = (t->tJobStart - t->tQueued) + (gettime() - t->tJobEnd);
+
+  if (!SendPrivateBufs(t))
+    return FALSE;
+  cl->rfbBytesSent[rfbEncodingTight] += t->bytessent;
+  cl->rfbRectanglesSent[rfbEncodingTight] += t->rectsent;
+  MergeALRRegions(cl, t);
+
+  return TRUE;
+}
+
+
 static Bool SendRectEncodingTight(threadparam *t, int x, int y, int w, int h)
 {
   int nMaxRows;
@@ -501,8 +1354,8 @@ static Bool SendRectEncodingTight(threadparam *t, int x, int y, int w, int h)
   {
     int maxRectSize, maxRectWidth, nMaxWidth;
 
-    maxRectSize = tightConf[compressLevel].maxRectSize;
-    maxRectWidth = tightConf[compressLevel].maxRectWidth;
+    maxRectSize = tightConf[t->compressLevel].maxRectSize;
+    maxRectWidth = tightConf[t->compressLevel].maxRectWidth;
     nMaxWidth = (w > maxRectWidth) ? maxRectWidth : w;
     nMaxRows = maxRectSize / nMaxWidth;
   }
@@ -530,7 +1383,7 @@ static Bool SendRectEncodingTight(threadparam *t, int x, int y, int w, int h)
 
       if (CheckSolidTile(cl, dx, dy, dw, dh, &colorValue, FALSE)) {
 
-        if (subsampLevel == TJ_GRAYSCALE && qualityLevel != -1) {
+        if (t->subsampLevel == TJ_GRAYSCALE && t->qualityLevel != -1) {
           CARD32 r = (colorValue >> 16) & 0xFF;
           CARD32 g = (colorValue >> 8) & 0xFF;
           CARD32 b = (colorValue) & 0xFF;
@@ -720,10 +1573,16 @@ static Bool CheckSolidTile##bpp(rfbClientPtr cl, int x, int y, int w, int h,  \
     return FALSE;                                                             \
                                                                               \
   for (dy = 0; dy < h; dy++) {                                                \
-    for (dx = 0; dx < w; dx++) {                                              \
-      if (colorValue != fbptr[dx])                                            \
-        return FALSE;                                                         \
-    }                                                                         \
+    /* The columns scanned by ExtendSolidArea() are too narrow to benefit     \
+       from SIMD. */                                                          \
+    if (w < 8) {                                                              \
+      for (dx = 0; dx < w; dx++) {                                            \
+        if (colorValue != fbptr[dx])                                          \
+          return FALSE;                                                       \
+      }                                                                       \
+    } else if (rfbSIMD.scanRun##bpp(fbptr, w, colorValue,                     \
+                                    (CARD##bpp)~0) < w)                       \
+      return FALSE;                                                           \
     fbptr = (CARD##bpp *)((CARD8 *)fbptr + rfbFB.paddedWidthInBytes);         \
   }                                                                           \
                                                                               \
@@ -745,8 +1604,8 @@ static Bool SendRectSimple(threadparam *t, int x, int y, int w, int h)
   int rw, rh;
   rfbClientPtr cl = t->cl;
 
-  maxRectSize = tightConf[compressLevel].maxRectSize;
-  maxRectWidth = tightConf[compressLevel].maxRectWidth;
+  maxRectSize = tightConf[t->compressLevel].maxRectSize;
+  maxRectWidth = tightConf[t->compressLevel].maxRectWidth;
 
   maxBeforeSize = maxRectSize * (cl->format.bitsPerPixel / 8);
   maxAfterSize = maxBeforeSize + (maxBeforeSize + 99) / 100 + 12;
@@ -795,14 +1654,8 @@ static Bool SendSubrect(threadparam *t, int x, int y, int w, int h)
   char *fbptr;
   Bool success = FALSE;
   rfbClientPtr cl = t->cl;
-
-  /* Send pending data if there is more than 128 bytes. */
-  if (t->id == 0) {
-    if (ublen > 128) {
-      if (!rfbSendUpdateBuf(cl))
-        return FALSE;
-    }
-  }
+  int class, maxColors;
+  Bool probe;
 
   if (!SendTightHeader(t, x, y, w, h))
     return FALSE;
@@ -810,18 +1663,33 @@ static Bool SendSubrect(threadparam *t, int x, int y, int w, int h)
   fbptr =
     (cl->fb + (rfbFB.paddedWidthInBytes * y) + (x * (rfbFB.bitsPerPixel / 8)));
 
-  if (subsampLevel == TJ_GRAYSCALE && qualityLevel != -1 &&
+  if (t->subsampLevel == TJ_GRAYSCALE && t->qualityLevel != -1 &&
       rfbFB.bitsPerPixel > 8)
-    return SendJpegRect(t, x, y, w, h, qualityLevel);
+    return SendJpegRect(t, x, y, w, h, t->qualityLevel);
+
+  class = GetContentClass(t, x, y, w, h, &probe);
+  if (class == CLASS_VIDEO && rfbFB.bitsPerPixel > 8) {
+    RecordContent(t, x, y, w, h, class, TRUE);
+    return SendJpegRect(t, x, y, w, h, t->qualityLevel);
+  }
 
-  t->paletteMaxColors = w * h / tightConf[compressLevel].idxMaxColorsDivisor;
-  if (qualityLevel != -1)
-    t->paletteMaxColors = tightConf[compressLevel].palMaxColorsWithJPEG;
+  t->paletteMaxColors =
+    w * h / tightConf[t->compressLevel].idxMaxColorsDivisor;
+  if (t->qualityLevel != -1)
+    t->paletteMaxColors = tightConf[t->compressLevel].palMaxColorsWithJPEG;
   if (t->paletteMaxColors < 2 &&
-      w * h >= tightConf[compressLevel].monoMinRectSize) {
+      w * h >= tightConf[t->compressLevel].monoMinRectSize) {
     t->paletteMaxColors = 2;
   }
 
+  /* Count up to CLASS_TEXT_MAX_COLORS colors in subrectangles that overlap
+     text tiles or tiles that are being probed, so we know whether the
+     subrectangle could have been sent losslessly. */
+  maxColors = t->paletteMaxColors;
+  if ((class == CLASS_TEXT || probe) &&
+      t->paletteMaxColors < CLASS_TEXT_MAX_COLORS)
+    t->paletteMaxColors = CLASS_TEXT_MAX_COLORS;
+
   if (cl->format.bitsPerPixel == rfbServerFormat.bitsPerPixel &&
       cl->format.redMax == rfbServerFormat.redMax &&
       cl->format.greenMax == rfbServerFormat.greenMax &&
@@ -840,7 +1708,7 @@ static Bool SendSubrect(threadparam *t, int x, int y, int w, int h)
                           h);
     }
 
-    if (t->paletteNumColors != 0 || qualityLevel == -1) {
+    if (t->paletteNumColors != 0 || t->qualityLevel == -1) {
       (*cl->translateFn) (cl->translateLookupTable, &rfbServerFormat,
                           &cl->format, fbptr, t->tightBeforeBuf,
                           rfbFB.paddedWidthInBytes, w, h);
@@ -862,11 +1730,15 @@ static Bool SendSubrect(threadparam *t, int x, int y, int w, int h)
     }
   }
 
+  RecordContent(t, x, y, w, h, class, t->paletteNumColors == 0);
+  if (t->paletteNumColors > maxColors && class != CLASS_TEXT)
+    t->paletteNumColors = 0;
+
   switch (t->paletteNumColors) {
     case 0:
       /* Truecolor image */
-      if (qualityLevel != -1) {
-        success = SendJpegRect(t, x, y, w, h, qualityLevel);
+      if (t->qualityLevel != -1) {
+        success = SendJpegRect(t, x, y, w, h, t->qualityLevel);
       } else {
         success = SendFullColorRect(t, w, h);
         ADD_TO_LOSSLESS_REGION(x, y, w, h);
@@ -924,7 +1796,7 @@ static Bool SendSolidRect(threadparam *t)
   int len;
   rfbClientPtr cl = t->cl;
 
-  if (usePixelFormat24) {
+  if (t->usePixelFormat24) {
     Pack24(t->tightBeforeBuf, &cl->format, 1);
     len = 3;
   } else
@@ -963,11 +1835,12 @@ static Bool SendMonoRect(threadparam *t, int w, int h)
   dataLen = (w + 7) / 8;
   dataLen *= h;
 
-  if (tightConf[compressLevel].monoZlibLevel == 0 || t->id > 3)
+  if (tightConf[t->compressLevel].monoZlibLevel == 0)
     t->updateBuf[(*t->ublen)++] =
       (char)((rfbTightNoZlib | rfbTightExplicitFilter) << 4);
   else
-    t->updateBuf[(*t->ublen)++] = (streamId | rfbTightExplicitFilter) << 4;
+    t->updateBuf[(*t->ublen)++] =
+      StreamControl(t, streamId) | (rfbTightExplicitFilter << 4);
   t->updateBuf[(*t->ublen)++] = rfbTightFilterPalette;
   t->updateBuf[(*t->ublen)++] = 1;
 
@@ -978,7 +1851,7 @@ static Bool SendMonoRect(threadparam *t, int w, int h)
 
       ((CARD32 *)t->tightAfterBuf)[0] = t->monoBackground;
       ((CARD32 *)t->tightAfterBuf)[1] = t->monoForeground;
-      if (usePixelFormat24) {
+      if (t->usePixelFormat24) {
         Pack24(t->tightAfterBuf, &cl->format, 2);
         paletteLen = 6;
       } else
@@ -1009,7 +1882,7 @@ static Bool SendMonoRect(threadparam *t, int w, int h)
   }
 
   return CompressData(t, streamId, dataLen,
-                      tightConf[compressLevel].monoZlibLevel,
+                      tightConf[t->compressLevel].monoZlibLevel,
                       Z_DEFAULT_STRATEGY);
 }
 
@@ -1031,11 +1904,12 @@ static Bool SendIndexedRect(threadparam *t, int w, int h)
   }
 
   /* Prepare tight encoding header. */
-  if (tightConf[compressLevel].idxZlibLevel == 0 || t->id > 3)
+  if (tightConf[t->compressLevel].idxZlibLevel == 0)
     t->updateBuf[(*t->ublen)++] =
       (char)((rfbTightNoZlib | rfbTightExplicitFilter) << 4);
   else
-    t->updateBuf[(*t->ublen)++] = (streamId | rfbTightExplicitFilter) << 4;
+    t->updateBuf[(*t->ublen)++] =
+      StreamControl(t, streamId) | (rfbTightExplicitFilter << 4);
   t->updateBuf[(*t->ublen)++] = rfbTightFilterPalette;
   t->updateBuf[(*t->ublen)++] = (char)(t->paletteNumColors - 1);
 
@@ -1046,7 +1920,7 @@ static Bool SendIndexedRect(threadparam *t, int w, int h)
 
       for (i = 0; i < t->paletteNumColors; i++)
         ((CARD32 *)t->tightAfterBuf)[i] = t->palette.entry[i].listNode->rgb;
-      if (usePixelFormat24) {
+      if (t->usePixelFormat24) {
         Pack24(t->tightAfterBuf, &cl->format, t->paletteNumColors);
         entryLen = 3;
       } else
@@ -1077,7 +1951,7 @@ static Bool SendIndexedRect(threadparam *t, int w, int h)
   }
 
   return CompressData(t, streamId, w * h,
-                      tightConf[compressLevel].idxZlibLevel,
+                      tightConf[t->compressLevel].idxZlibLevel,
                       Z_DEFAULT_STRATEGY);
 }
 
@@ -1097,30 +1971,92 @@ static Bool SendFullColorRect(threadparam *t, int w, int h)
       t->streamId = t->baseStreamId;
   }
 
-  if (tightConf[compressLevel].rawZlibLevel == 0 || t->id > 3)
+  if (tightConf[t->compressLevel].rawZlibLevel == 0)
     t->updateBuf[(*t->ublen)++] = (char)(rfbTightNoZlib << 4);
   else
-    t->updateBuf[(*t->ublen)++] = streamId << 4;
+    t->updateBuf[(*t->ublen)++] = StreamControl(t, streamId);
   t->bytessent++;
 
-  if (usePixelFormat24) {
+  if (t->usePixelFormat24) {
     Pack24(t->tightBeforeBuf, &cl->format, w * h);
     len = 3;
   } else
     len = cl->format.bitsPerPixel / 8;
 
   return CompressData(t, streamId, w * h * len,
-                      tightConf[compressLevel].rawZlibLevel,
+                      tightConf[t->compressLevel].rawZlibLevel,
                       Z_DEFAULT_STRATEGY);
 }
 
 
+/*
+ * Return the compression control byte for a subrectangle that will be
+ * compressed using the given stream.  If the thread is sharing the stream
+ * with one of the first 4 threads, then the first such subrectangle that the
+ * thread sends also tells the client to reset the stream.
+ */
+
+static CARD8 StreamControl(threadparam *t, int streamId)
+{
+  rfbClientPtr cl = t->cl;
+  CARD8 control = streamId << 4;
+
+  if (t->resetStream) {
+    if (t->zsActive && deflateReset(t->zs) != Z_OK) {
+      deflateEnd(t->zs);
+      t->zsActive = FALSE;
+    }
+    control |= 1 << streamId;
+    t->resetStream = FALSE;
+    t->streamUsed = TRUE;
+  } else if (t->id <= 3 && cl->zsReset[streamId]) {
+    /* The client's copy of the stream is out of sync with ours (see
+       bcast.c), so reset both. */
+    if (cl->zsActive[streamId] &&
+        deflateReset(cl->zsStruct[streamId]) != Z_OK) {
+      deflateEnd(cl->zsStruct[streamId]);
+      cl->zsActive[streamId] = FALSE;
+    }
+    control |= 1 << streamId;
+    cl->zsReset[streamId] = FALSE;
+  }
+  return control;
+}
+
+
+/*
+ * Once the output of a thread that shared one of the client's streams has been
+ * sent, the client's copy of the stream is in sync with the thread's
+ * compression stream, so the two compression streams are swapped.
+ */
+
+static void ReturnStream(threadparam *t)
+{
+  rfbClientPtr cl = t->cl;
+  int streamId = t->baseStreamId, level = cl->zsLevel[streamId];
+  z_streamp zs = cl->zsStruct[streamId];
+  Bool active = cl->zsActive[streamId];
+
+  if (!t->streamUsed) return;
+
+  cl->zsStruct[streamId] = t->zs;
+  cl->zsActive[streamId] = t->zsActive;
+  cl->zsLevel[streamId] = t->zsLevel;
+  t->zs = zs;
+  t->zsActive = active;
+  t->zsLevel = level;
+  t->streamUsed = FALSE;
+}
+
+
 static Bool CompressData(threadparam *t, int streamId, int dataLen,
                          int zlibLevel, int zlibStrategy)
 {
-  z_streamp pz;
-  int err;
+  z_streamp pz, *ppz;
+  Bool *active;
+  int err, *level;
   rfbClientPtr cl = t->cl;
+  double tStart;
 
   if (dataLen < TIGHT_MIN_TO_COMPRESS) {
     memcpy(&t->updateBuf[*t->ublen], t->tightBeforeBuf, dataLen);
@@ -1135,15 +2071,30 @@ static Bool CompressData(threadparam *t, int streamId, int dataLen,
      stream.  We divide the pool of 4 evenly among the available threads (up
      to the first 4 threads), and if each thread has more than one stream, it
      cycles between them in a round-robin fashion.  If we have more than 4
-     threads, then threads 5 and beyond must encode their data without Zlib
-     compression. */
-  if (zlibLevel == 0 || t->id > 3)
+     threads, then threads 5 and beyond share the client's streams with the
+     first 4 threads, but they compress using their own compression streams.
+     Because their output is sent after the output of the first 4 threads,
+     they can reset the client's stream before using it (see StreamControl()),
+     and their compression streams are handed over to the client afterward
+     (see ReturnStream().) */
+  if (zlibLevel == 0)
     return SendCompressedData(t, t->tightBeforeBuf, dataLen);
 
-  pz = &cl->zsStruct[streamId];
+  if (t->id > 3) {
+    ppz = &t->zs;
+    active = &t->zsActive;
+    level = &t->zsLevel;
+  } else {
+    ppz = &cl->zsStruct[streamId];
+    active = &cl->zsActive[streamId];
+    level = &cl->zsLevel[streamId];
+  }
+  if (!*ppz)
+    *ppz = (z_streamp)rfbAlloc0(sizeof(z_stream));
+  pz = *ppz;
 
   /* Initialize compression stream if needed. */
-  if (!cl->zsActive[streamId]) {
+  if (!*active) {
     pz->zalloc = Z_NULL;
     pz->zfree = Z_NULL;
     pz->opaque = Z_NULL;
@@ -1153,8 +2104,8 @@ static Bool CompressData(threadparam *t, int streamId, int dataLen,
     if (err != Z_OK)
       return FALSE;
 
-    cl->zsActive[streamId] = TRUE;
-    cl->zsLevel[streamId] = zlibLevel;
+    *active = TRUE;
+    *level = zlibLevel;
   }
 
   /* Prepare buffer pointers. */
@@ -1164,25 +2115,75 @@ static Bool CompressData(threadparam *t, int streamId, int dataLen,
   pz->avail_out = t->tightAfterBufSize;
 
   /* Change compression parameters if needed. */
-  if (zlibLevel != cl->zsLevel[streamId]) {
+  if (zlibLevel != *level) {
     if (deflateParams(pz, zlibLevel, zlibStrategy) != Z_OK)
       return FALSE;
-    cl->zsLevel[streamId] = zlibLevel;
+    *level = zlibLevel;
   }
 
   /* Actual compression. */
+  TRACE_START(tStart);
   if (deflate(pz, Z_SYNC_FLUSH) != Z_OK || pz->avail_in != 0 ||
       pz->avail_out == 0)
     return FALSE;
+  TRACE_END(tStart, "deflate", "bytes", dataLen);
 
   return SendCompressedData(t, t->tightAfterBuf,
                             t->tightAfterBufSize - pz->avail_out);
 }
 
 
+/*
+ * Large compressed payloads are passed to the output queue by reference, and
+ * the context's tightAfterBuf is replaced with a buffer from a small pool.
+ * Once the output block that refers to a payload has been freed, the
+ * payload's buffer is returned to the pool, so the buffers are recycled
+ * rather than being allocated (which, for buffers of this size, usually means
+ * mapping new pages) for each payload.
+ */
+
+static char *GetSpareBuf(int size, int *bufSize)
+{
+  int i;
+
+  pthread_mutex_lock(&spareBufMutex);
+  for (i = nSpareBufs - 1; i >= 0; i--) {
+    if (spareBufSizes[i] >= size) {
+      char *buf = spareBufs[i];
+
+      *bufSize = spareBufSizes[i];
+      nSpareBufs--;
+      spareBufs[i] = spareBufs[nSpareBufs];
+      spareBufSizes[i] = spareBufSizes[nSpareBufs];
+      pthread_mutex_unlock(&spareBufMutex);
+      return buf;
+    }
+  }
+  pthread_mutex_unlock(&spareBufMutex);
+
+  *bufSize = size;
+  return (char *)rfbAlloc(size);
+}
+
+
+void rfbTightFreeBuf(char *buf, int size)
+{
+  pthread_mutex_lock(&spareBufMutex);
+  if (nSpareBufs < MAX_SPARE_BUFS) {
+    spareBufs[nSpareBufs] = buf;
+    spareBufSizes[nSpareBufs] = size;
+    nSpareBufs++;
+    buf = NULL;
+  }
+  pthread_mutex_unlock(&spareBufMutex);
+  free(buf);
+}
+
+
 static Bool SendCompressedData(threadparam *t, char *buf, int compressedLen)
 {
   int i, portionLen;
+  rfbClientPtr cl = t->cl;
 
   t->updateBuf[(*t->ublen)++] = compressedLen & 0x7F;
   t->bytessent++;
@@ -1197,6 +2198,31 @@ static Bool SendCompressedData(threadparam *t, char *buf, int compressedLen)
     }
   }
 
+  /* Pass large payloads to the output queue by reference rather than
+     copying them, and replace tightAfterBuf with a pooled buffer that is at
+     least as large. */
+  if (compressedLen >= MIN_ZERO_COPY_SIZE && buf == t->tightAfterBuf) {
+    rfbOutputBlock *block;
+    int bufSize = t->tightAfterBufSize;
+
+    if ((block = rfbNewExternalBlock(buf, compressedLen)) == NULL) {
+      rfbLogPerror("SendCompressedData: couldn't allocate output block");
+      return FALSE;
+    }
+    block->extSize = bufSize;
+    t->tightAfterBuf = GetSpareBuf(bufSize, &t->tightAfterBufSize);
+    t->bytessent += compressedLen;
+    if (t->direct) {
+      if (!rfbSendUpdateBlock(cl, block))
+        return FALSE;
+      t->updateBuf = cl->updateBuf;
+    } else {
+      NewPrivateBlock(t, 0);
+      AppendPrivateBlock(t, block);
+    }
+    return TRUE;
+  }
+
   portionLen = UPDATE_BUF_SIZE;
   for (i = 0; i < compressedLen; i += portionLen) {
     if (i + portionLen > compressedLen)
@@ -1219,12 +2245,12 @@ static void FillPalette8(threadparam *t, int count)
 {
   CARD8 *data = (CARD8 *)t->tightBeforeBuf;
   CARD8 c0, c1;
-  int i, n0, n1;
+  int i, n0, n1, len;
 
   t->paletteNumColors = 0;
 
   c0 = data[0];
-  for (i = 1; i < count && data[i] == c0; i++);
+  i = rfbSIMD.scanRun8(data, count, c0, 0xFF);
   if (i == count) {
     t->paletteNumColors = 1;
     return;                     /* Solid rectangle */
@@ -1236,14 +2262,10 @@ static void FillPalette8(threadparam *t, int count)
   n0 = i;
   c1 = data[i];
   n1 = 0;
-  for (i++; i < count; i++) {
-    if (data[i] == c0)
-      n0++;
-    else if (data[i] == c1)
-      n1++;
-    else
-      break;
-  }
+  i++;
+  len = rfbSIMD.scanTwo8(&data[i], count - i, c1, c0, 0xFF, &n1);
+  n0 += len - n1;
+  i += len;
   if (i == count) {
     if (n0 > n1) {
       t->monoBackground = (CARD32)c0;
@@ -1263,10 +2285,10 @@ static void FillPalette##bpp(threadparam *t, int count)                       \
 {                                                                             \
   CARD##bpp *data = (CARD##bpp *)t->tightBeforeBuf;                           \
   CARD##bpp c0, c1, ci;                                                       \
-  int i, n0, n1, ni;                                                          \
+  int i, n0, n1, ni, len;                                                     \
                                                                               \
   c0 = data[0];                                                               \
-  for (i = 1; i < count && data[i] == c0; i++);                               \
+  i = rfbSIMD.scanRun##bpp(data, count, c0, (CARD##bpp)~0);                   \
   if (i >= count) {                                                           \
     t->paletteNumColors = 1;    /* Solid rectangle */                         \
     return;                                                                   \
@@ -1280,15 +2302,11 @@ static void FillPalette##bpp(threadparam *t, int count)                       \
   n0 = i;                                                                     \
   c1 = data[i];                                                               \
   n1 = 0;                                                                     \
-  for (i++; i < count; i++) {                                                 \
-    ci = data[i];                                                             \
-    if (ci == c0)                                                             \
-      n0++;                                                                   \
-    else if (ci == c1)                                                        \
-      n1++;                                                                   \
-    else                                                                      \
-      break;                                                                  \
-  }                                                                           \
+  i++;                                                                        \
+  len = rfbSIMD.scanTwo##bpp(&data[i], count - i, c1, c0, (CARD##bpp)~0,      \
+                             &n1);                                            \
+  n0 += len - n1;                                                             \
+  i += len;                                                                   \
   if (i >= count) {                                                           \
     if (n0 > n1) {                                                            \
       t->monoBackground = (CARD32)c0;                                         \
@@ -1305,10 +2323,13 @@ static void FillPalette##bpp(threadparam *t, int count)                       \
   PaletteInsert(t, c0, (CARD32)n0, bpp);                                      \
   PaletteInsert(t, c1, (CARD32)n1, bpp);                                      \
                                                                               \
+  ci = data[i];                                                               \
   ni = 1;                                                                     \
   for (i++; i < count; i++) {                                                 \
     if (data[i] == ci) {                                                      \
-      ni++;                                                                   \
+      len = rfbSIMD.scanRun##bpp(&data[i], count - i, ci, (CARD##bpp)~0);     \
+      ni += len;                                                              \
+      i += len - 1;                                                           \
     } else {                                                                  \
       if (!PaletteInsert(t, ci, (CARD32)ni, bpp))                             \
         return;                                                               \
@@ -1329,7 +2350,7 @@ static void FastFillPalette##bpp(threadparam *t, CARD##bpp *data,             \
                                  int w, int pitch, int h)                     \
 {                                                                             \
   CARD##bpp c0, c1, ci, mask, c0t, c1t, cit;                                  \
-  int i, j, i2 = 0, j2, n0, n1, ni;                                           \
+  int i, j, i2 = 0, j2, n0, n1, ni, len;                                      \
   rfbClientPtr cl = t->cl;                                                    \
                                                                               \
   if (cl->translateFn != rfbTranslateNone) {                                  \
@@ -1340,12 +2361,10 @@ static void FastFillPalette##bpp(threadparam *t, CARD##bpp *data,             \
                                                                               \
   c0 = data[0] & mask;                                                        \
   for (j = 0; j < h; j++) {                                                   \
-    for (i = 0; i < w; i++) {                                                 \
-      if ((data[j * pitch + i] & mask) != c0)                                 \
-        goto done;                                                            \
-    }                                                                         \
+    i = rfbSIMD.scanRun##bpp(&data[j * pitch], w, c0, mask);                  \
+    if (i < w)                                                                \
+      break;                                                                  \
   }                                                                           \
-  done:                                                                       \
   if (j >= h) {                                                               \
     t->paletteNumColors = 1;    /* Solid rectangle */                         \
     return;                                                                   \
@@ -1359,19 +2378,17 @@ static void FastFillPalette##bpp(threadparam *t, CARD##bpp *data,             \
   c1 = data[j * pitch + i] & mask;                                            \
   n1 = 0;                                                                     \
   i++;  if (i >= w) { i = 0;  j++; }                                          \
+  ni = 0;                                                                     \
   for (j2 = j; j2 < h; j2++) {                                                \
-    for (i2 = i; i2 < w; i2++) {                                              \
-      ci = data[j2 * pitch + i2] & mask;                                      \
-      if (ci == c0)                                                           \
-        n0++;                                                                 \
-      else if (ci == c1)                                                      \
-        n1++;                                                                 \
-      else                                                                    \
-        goto done2;                                                           \
-    }                                                                         \
+    len = rfbSIMD.scanTwo##bpp(&data[j2 * pitch + i], w - i, c1, c0, mask,    \
+                               &n1);                                          \
+    ni += len;                                                                \
+    i2 = i + len;                                                             \
+    if (i2 < w)                                                               \
+      break;                                                                  \
     i = 0;                                                                    \
   }                                                                           \
-  done2:                                                                      \
+  n0 += ni - n1;                                                              \
   (*cl->translateFn) (cl->translateLookupTable, &rfbServerFormat,             \
                       &cl->format, (char *)&c0, (char *)&c0t, bpp / 8,        \
                       1, 1);                                                  \
@@ -1394,12 +2411,15 @@ static void FastFillPalette##bpp(threadparam *t, CARD##bpp *data,             \
   PaletteInsert(t, c0t, (CARD32)n0, bpp);                                     \
   PaletteInsert(t, c1t, (CARD32)n1, bpp);                                     \
                                                                               \
+  ci = data[j2 * pitch + i2] & mask;                                          \
   ni = 1;                                                                     \
   i2++;  if (i2 >= w) { i2 = 0;  j2++; }                                      \
   for (j = j2; j < h; j++) {                                                  \
     for (i = i2; i < w; i++) {                                                \
       if ((data[j * pitch + i] & mask) == ci) {                               \
-        ni++;                                                                 \
+        len = rfbSIMD.scanRun##bpp(&data[j * pitch + i], w - i, ci, mask);    \
+        ni += len;                                                            \
+        i += len - 1;                                                         \
       } else {                                                                \
         (*cl->translateFn) (cl->translateLookupTable, &rfbServerFormat,       \
                             &cl->format, (char *)&ci, (char *)&cit, bpp / 8,  \
@@ -1673,12 +2693,13 @@ static Bool SendJpegRect(threadparam *t, int x, int y, int w, int h,
 {
   unsigned char *srcbuf;
   int ps = rfbServerFormat.bitsPerPixel / 8;
-  int subsamp = subsampLevel2tjsubsamp[subsampLevel];
+  int subsamp = subsampLevel2tjsubsamp[t->subsampLevel];
   unsigned long size = 0;
   int flags = 0, pitch;
   unsigned char *tmpbuf = NULL;
   unsigned long jpegDstDataLen;
   rfbClientPtr cl = t->cl;
+  double tStart;
 
   if (rfbServerFormat.bitsPerPixel == 8) {
     ADD_TO_LOSSLESS_REGION(x, y, w, h);
@@ -1724,6 +2745,7 @@ static Bool SendJpegRect(threadparam *t, int x, int y, int w, int h,
     pitch = rfbFB.paddedWidthInBytes;
   }
 
+  TRACE_START(tStart);
   if (tjCompress(t->j, srcbuf, w, pitch, h, ps,
                  (unsigned char *)t->tightAfterBuf, &size, subsamp, quality,
                  flags) == -1) {
@@ -1731,6 +2753,7 @@ static Bool SendJpegRect(threadparam *t, int x, int y, int w, int h,
     free(tmpbuf);  tmpbuf = NULL;
     return 0;
   }
+  TRACE_END(tStart, "jpeg", "pixels", w * h);
   jpegDstDataLen = (int)size;
 
   free(tmpbuf);  tmpbuf = NULL;
@@ -0,0 +1,333 @@
+/*
+ * trace.c
+ *
+ * Hot-path tracing
+ */
+
+/*
+ *  This is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This software is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this software; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301,
+ *  USA.
+ */
+
+/* If -trace is specified, then the TRACE_START()/TRACE_END() spans on the
+   hot paths (damage, the deferred update timer, interframe comparison, each
+   rectangle encoded by a Tight thread, JPEG compression, deflate, socket
+   writes, fence round trips, and whole updates) are recorded in memory, and
+   sending SIGUSR2 to Xvnc writes the most recent spans to the trace file in
+   the Chrome trace event format, which can be loaded into Perfetto or
+   chrome://tracing.
+
+   Each thread records its spans in its own ring buffer, which only that
+   thread writes, so recording a span takes no locks and makes no system calls
+   beyond reading the clock.  The X server thread and the encoding threads
+   use fixed ring buffer slots, so an encoding thread that is restarted (the
+   thread pool is shut down whenever the last viewer disconnects) continues
+   to use the ring buffer of the thread that it replaces.  The ring buffers
+   are read by the X server thread when the trace is written, while the
+   encoding threads may still be recording spans.  A thread publishes each
+   span by advancing the head of its ring buffer after the span has been
+   written, and spans that were overwritten while the ring buffer was being
+   read are discarded. */
+
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include "rfb.h"
+
+
+Bool rfbTraceEnabled = FALSE;
+char *rfbTraceFile = NULL;
+
+/* Number of spans kept for each thread */
+#define TRACE_RING_SIZE  32768
+
+/* Number of spans beyond the head of a ring buffer that are treated as
+   overwritten when the ring buffer is read while its thread is running */
+#define TRACE_GUARD  16
+
+/* Maximum number of threads that can record spans.  Slot 0 is used by the X
+   server thread, slots 1 through MAX_ENCODING_THREADS - 1 are used by the
+   encoding threads, and any other threads are assigned the remaining slots
+   in the order in which they record their first span. */
+#define MAX_TRACE_THREADS  (MAX_ENCODING_THREADS + 8)
+
+typedef struct {
+  double start, end;
+  const char *name;
+  const char *argName;          /* or NULL if the span has no argument */
+  long arg;
+  Bool async;                   /* may overlap the thread's other spans */
+} TraceSpan;
+
+typedef struct {
+  TraceSpan spans[TRACE_RING_SIZE];
+  unsigned long head;           /* number of spans recorded */
+  char name[32];
+} TraceRing;
+
+static TraceRing *rings[MAX_TRACE_THREADS];
+static int nOtherThreads = 0;
+static __thread TraceRing *threadRing = NULL;
+static __thread Bool threadRingFailed = FALSE;
+
+static double traceEpoch;
+static int tracePipe[2] = { -1, -1 };
+
+static void traceSignalNotify(int fd, int ready, void *data);
+
+
+/* Attach the calling thread to the ring buffer in the given slot, allocating
+   the ring buffer if no thread has used the slot before.  A slot is never
+   used by more than one thread at a time. */
+
+static TraceRing *AttachRing(int slot)
+{
+  TraceRing *ring = __atomic_load_n(&rings[slot], __ATOMIC_ACQUIRE);
+
+  if (!ring) {
+    ring = (TraceRing *)calloc(1, sizeof(TraceRing));
+    if (!ring) {
+      threadRingFailed = TRUE;
+      return NULL;
+    }
+    snprintf(ring->name, sizeof(ring->name), "Thread %d", slot + 1);
+    __atomic_store_n(&rings[slot], ring, __ATOMIC_RELEASE);
+  }
+  threadRingFailed = FALSE;
+  return threadRing = ring;
+}
+
+
+static TraceRing *GetThreadRing(void)
+{
+  int slot;
+
+  if (threadRing || threadRingFailed)
+    return threadRing;
+
+  slot = MAX_ENCODING_THREADS + __sync_fetch_and_add(&nOtherThreads, 1);
+  if (slot >= MAX_TRACE_THREADS) {
+    threadRingFailed = TRUE;
+    return NULL;
+  }
+  return AttachRing(slot);
+}
+
+
+static void RecordSpan(const char *name, double start, double end,
+                       const char *argName, long arg, Bool async)
+{
+  TraceRing *ring = GetThreadRing();
+  TraceSpan *span;
+  unsigned long head;
+
+  if (!ring)
+    return;
+
+  head = ring->head;
+  span = &ring->spans[head % TRACE_RING_SIZE];
+  span->start = start;
+  span->end = end;
+  span->name = name;
+  span->argName = argName;
+  span->arg = arg;
+  span->async = async;
+  __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+
+/*
+ * rfbTraceSpan() records a span that began at the given time (as returned by
+ * gettime()) and ends now.  Spans recorded with rfbTraceSpan() must nest
+ * within the calling thread's other spans.  rfbTraceAsyncSpan() records a
+ * span, such as a network round trip, that may overlap them.
+ */
+
+void rfbTraceSpan(const char *name, double start, const char *argName,
+                  long arg)
+{
+  RecordSpan(name, start, gettime(), argName, arg, FALSE);
+}
+
+
+void rfbTraceAsyncSpan(const char *name, double start, const char *argName,
+                       long arg)
+{
+  RecordSpan(name, start, gettime(), argName, arg, TRUE);
+}
+
+
+/*
+ * rfbTraceThreadName() assigns the calling thread to the given ring buffer
+ * slot (0 for the X server thread, or the thread ID for an encoding thread)
+ * and sets the name under which the thread's spans are shown.
+ */
+
+void rfbTraceThreadName(int slot, const char *name)
+{
+  TraceRing *ring;
+
+  if (!rfbTraceEnabled || slot < 0 || slot >= MAX_ENCODING_THREADS ||
+      !(ring = AttachRing(slot)))
+    return;
+  snprintf(ring->name, sizeof(ring->name), "%s", name);
+}
+
+
+/*
+ * SIGUSR2 handling.  The signal handler only wakes up the X server thread,
+ * which writes the trace.
+ */
+
+static void traceSignalHandler(int sig)
+{
+  int savedErrno = errno;
+  char c = 0;
+
+  if (write(tracePipe[1], &c, 1) < 0) {}
+  errno = savedErrno;
+}
+
+
+static void traceSignalNotify(int fd, int ready, void *data)
+{
+  char buf[16];
+
+  while (read(tracePipe[0], buf, sizeof(buf)) > 0);
+  rfbTraceDump();
+}
+
+
+void rfbTraceInit(void)
+{
+  int i;
+
+  if (!rfbTraceFile || rfbTraceEnabled)
+    return;
+
+  if (pipe(tracePipe) < 0) {
+    rfbLogPerror("rfbTraceInit: pipe");
+    return;
+  }
+  for (i = 0; i < 2; i++) {
+    int flags = fcntl(tracePipe[i], F_GETFL);
+
+    fcntl(tracePipe[i], F_SETFL, flags | O_NONBLOCK);
+    fcntl(tracePipe[i], F_SETFD, FD_CLOEXEC);
+  }
+
+  traceEpoch = gettime();
+  rfbTraceEnabled = TRUE;
+  rfbTraceThreadName(0, "X server");
+
+  SetNotifyFd(tracePipe[0], traceSignalNotify, X_NOTIFY_READ, NULL);
+  OsSignal(SIGUSR2, traceSignalHandler);
+  rfbLog("Tracing enabled.  Send SIGUSR2 to write the trace to %s\n",
+         rfbTraceFile);
+}
+
+
+/*
+ * rfbTraceDump() writes the contents of the ring buffers to the trace file.
+ */
+
+static void WriteArgs(FILE *file, TraceSpan *span)
+{
+  if (span->argName)
+    fprintf(file, ",\"args\":{\"%s\":%ld}", span->argName, span->arg);
+}
+
+
+void rfbTraceDump(void)
+{
+  static TraceSpan *spans = NULL;
+  FILE *file;
+  int pid = getpid(), i;
+  unsigned long nSpans = 0, asyncID = 0;
+  Bool first = TRUE;
+
+  if (!rfbTraceEnabled)
+    return;
+
+  if (!spans)
+    spans = (TraceSpan *)rfbAlloc(sizeof(TraceSpan) * TRACE_RING_SIZE);
+
+  if ((file = fopen(rfbTraceFile, "w")) == NULL) {
+    rfbLogPerror("rfbTraceDump: fopen");
+    return;
+  }
+
+  fprintf(file, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[");
+
+  for (i = 0; i < MAX_TRACE_THREADS; i++) {
+    TraceRing *ring = __atomic_load_n(&rings[i], __ATOMIC_ACQUIRE);
+    unsigned long head, start, newHead, skip = 0, j;
+
+    if (!ring)
+      continue;
+
+    /* Copy the ring buffer, then discard the spans that the thread may have
+       overwritten while it was being copied, along with a few more that it
+       may have been overwriting when the head was read again. */
+    head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    start = head > TRACE_RING_SIZE ? head - TRACE_RING_SIZE : 0;
+    for (j = start; j < head; j++)
+      spans[j - start] = ring->spans[j % TRACE_RING_SIZE];
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    newHead = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) + TRACE_GUARD;
+    if (newHead - start > TRACE_RING_SIZE)
+      skip = min(newHead - start - TRACE_RING_SIZE, head - start);
+
+    fprintf(file, "%s\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,"
+            "\"tid\":%d,\"args\":{\"name\":\"%s\"}}", first ? "" : ",", pid,
+            i + 1, ring->name);
+    first = FALSE;
+
+    for (j = skip; j < head - start; j++) {
+      TraceSpan *span = &spans[j];
+      double ts = (span->start - traceEpoch) * 1000000.;
+      double dur = (span->end - span->start) * 1000000.;
+
+      if (span->async) {
+        asyncID++;
+        fprintf(file, ",\n{\"name\":\"%s\",\"cat\":\"async\",\"ph\":\"b\","
+                "\"id\":%lu,\"ts\":%.1f,\"pid\":%d,\"tid\":%d", span->name,
+                asyncID, ts, pid, i + 1);
+        WriteArgs(file, span);
+        fprintf(file, "},\n{\"name\":\"%s\",\"cat\":\"async\",\"ph\":\"e\","
+                "\"id\":%lu,\"ts\":%.1f,\"pid\":%d,\"tid\":%d}", span->name,
+                asyncID, ts + dur, pid, i + 1);
+      } else {
+        fprintf(file, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"ts\":%.1f,"
+                "\"dur\":%.1f,\"pid\":%d,\"tid\":%d", span->name, ts, dur,
+                pid, i + 1);
+        WriteArgs(file, span);
+        fprintf(file, "}");
+      }
+      nSpans++;
+    }
+  }
+
+  fprintf(file, "\n]}\n");
+  if (fclose(file) != 0) {
+    rfbLogPerror("rfbTraceDump: fclose");
+    return;
+  }
+  rfbLog("Wrote %lu trace spans to %s\n", nSpans, rfbTraceFile);
+}
@@ -25,6 +25,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include "rfb.h"
+#include "simd.h"
 
 static void PrintPixelFormat(rfbPixelFormat *pf);
 static Bool rfbSetClientColourMapBGR233(rfbClientPtr cl);
@@ -173,12 +174,78 @@ void rfbTranslateNone(char *table, rfbPixelFormat *in, rfbPixelFormat *out,
 }
 
 
+/*
+ * rfbTranslateSwizzle32 and rfbTranslatePack32to16 use the SIMD kernels in
+ * simd.c to perform the most common 32-bit-to-32-bit and 32-bit-to-16-bit
+ * true colour translations.  They produce the same output as the RGB lookup
+ * tables, which are still used for narrow rectangles (such as the single
+ * pixels that the Tight encoder translates when building its palette.)
+ */
+
+#define SIMD_MIN_WIDTH 8
+
+static void rfbTranslateSwizzle32(char *table, rfbPixelFormat *in,
+                                  rfbPixelFormat *out, char *iptr,
+                                  char *optr, int bytesBetweenInputLines,
+                                  int width, int height)
+{
+  rfbTranslateParams params;
+
+  if (bytesBetweenInputLines == width * 4) {
+    width *= height;
+    height = 1;
+  }
+  if (width < SIMD_MIN_WIDTH) {
+    rfbTranslateWithRGBTables32to32(table, in, out, iptr, optr,
+                                    bytesBetweenInputLines, width, height);
+    return;
+  }
+
+  rfbSIMDGetTranslateParams(in, out, &params);
+  while (height > 0) {
+    rfbSIMD.swizzle32((CARD32 *)iptr, (CARD32 *)optr, width, &params);
+    iptr += bytesBetweenInputLines;
+    optr += width * 4;
+    height--;
+  }
+}
+
+
+static void rfbTranslatePack32to16(char *table, rfbPixelFormat *in,
+                                   rfbPixelFormat *out, char *iptr,
+                                   char *optr, int bytesBetweenInputLines,
+                                   int width, int height)
+{
+  rfbTranslateParams params;
+
+  if (bytesBetweenInputLines == width * 4) {
+    width *= height;
+    height = 1;
+  }
+  if (width < SIMD_MIN_WIDTH) {
+    rfbTranslateWithRGBTables32to16(table, in, out, iptr, optr,
+                                    bytesBetweenInputLines, width, height);
+    return;
+  }
+
+  rfbSIMDGetTranslateParams(in, out, &params);
+  while (height > 0) {
+    rfbSIMD.pack32to16((CARD32 *)iptr, (CARD16 *)optr, width, &params);
+    iptr += bytesBetweenInputLines;
+    optr += width * 2;
+    height--;
+  }
+}
+
+
 /*
  * rfbSetTranslateFunction sets the translation function.
  */
 
 Bool rfbSetTranslateFunction(rfbClientPtr cl)
 {
+  rfbTranslateParams params;
+
   rfbLog("Pixel format for client %s:\n", cl->host);
   PrintPixelFormat(&cl->format);
 
@@ -298,7 +365,25 @@ Bool rfbSetTranslateFunction(rfbClientPtr cl)
 
     (*rfbInitTrueColourRGBTablesFns[cl->format.bitsPerPixel / 16])
       (&cl->translateLookupTable, &rfbServerFormat, &cl->format);
+
+    /* The tables are still needed for narrow rectangles. */
+
+    switch (rfbSIMDGetTranslateParams(&rfbServerFormat, &cl->format,
+                                      &params)) {
+      case TRANSLATE_SWIZZLE32:
+        if (rfbSIMD.swizzle32) {
+          rfbLog("  using %s swizzle translation\n", rfbSIMD.name);
+          cl->translateFn = rfbTranslateSwizzle32;
+        }
+        break;
+      case TRANSLATE_PACK32TO16:
+        if (rfbSIMD.pack32to16) {
+          rfbLog("  using %s packed translation\n", rfbSIMD.name);
+          cl->translateFn = rfbTranslatePack32to16;
+        }
+        break;
     }
+  }
 
   return TRUE;
 }
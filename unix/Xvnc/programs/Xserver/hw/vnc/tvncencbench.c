@@ -0,0 +1,736 @@
+/*
+ * tvncencbench.c - benchmark the TurboVNC Server's encoders offline
+ */
+
+/*
+ *  This is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This software is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this software; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301,
+ *  USA.
+ */
+
+/* This program replays a corpus of framebuffer snapshots through the Tight,
+   ZRLE, Hextile, and Zlib encoders of the TurboVNC Server, using the same
+   encoder source files as Xvnc and a client record that isn't attached to a
+   socket.  Each snapshot is a binary PPM file.  The damage rectangles for a
+   snapshot are read from a file with the same name plus ".damage", which
+   contains one "x y w h" line per rectangle, or, if there is no such file,
+   the damage is computed by comparing the snapshot with the previous one.
+   (The first snapshot is always sent in full.)  The snapshots are assumed to
+   be FRAME_INTERVAL seconds apart, which matters only to Tight's content
+   classification.
+
+   For each combination of encoding, compression level, JPEG quality, chroma
+   subsampling, and thread count that applies to the encoding, the program
+   reports the encoding throughput, the number of bytes per pixel of damage
+   (including rectangle headers), the compression ratio relative to raw
+   pixels in the client's pixel format, and the CPU time used by all threads
+   as a percentage of the encoding time times the thread count.  For Tight,
+   it also reports the per-thread utilization of the tile scheduler and the
+   content classification statistics (see rfbTightPrintProfile().) */
+
+#include <ctype.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include "rfb.h"
+#include "simd.h"
+
+
+#define DIFF_TILE_SIZE  16
+#define FRAME_INTERVAL  (1. / 30.)
+#define MAX_LIST  16
+
+typedef struct {
+  char *pixels;
+  BoxPtr damage;
+  int nDamage;
+  double damagePixels;
+} FRAME;
+
+typedef struct {
+  const char *name;
+  int encoding;
+  Bool (*sendRect)(rfbClientPtr cl, int x, int y, int w, int h);
+  Bool hasCompressLevel, hasQuality, isMultithreaded;
+} ENCODING;
+
+static const ENCODING encodings[] = {
+  { "Tight", rfbEncodingTight, rfbSendRectEncodingTight, TRUE, TRUE, TRUE },
+  { "ZRLE", rfbEncodingZRLE, rfbSendRectEncodingZRLE, FALSE, FALSE, TRUE },
+  { "Hextile", rfbEncodingHextile, rfbSendRectEncodingHextile, FALSE, FALSE,
+    FALSE },
+  { "Zlib", rfbEncodingZlib, rfbSendRectEncodingZlib, TRUE, FALSE, FALSE }
+};
+#define NUM_ENCODINGS  (int)(sizeof(encodings) / sizeof(ENCODING))
+
+static const char *subsampName[TVNC_SAMPOPT] = { "1x", "4x", "2x", "gray" };
+
+static FRAME *frames = NULL;
+static int nFrames = 0, width = 0, height = 0, iterations = 1;
+static Bool verbose = FALSE;
+static unsigned long long bytesSent = 0;
+
+
+/*
+ * Stubs for the parts of Xvnc that the encoders use
+ */
+
+rfbFBInfo rfbFB;
+ColormapPtr rfbInstalledColormap = NULL;
+rfbClientPtr rfbClientHead = NULL;
+Bool rfbProfile = TRUE;
+int rfbNumThreads = 1;
+double rfbAutoLosslessRefresh = 0.0;
+Bool rfbTraceEnabled = FALSE;
+
+/* The encoders refer to the region code only if automatic lossless refresh is
+   enabled, which it never is here. */
+RegDataRec RegionEmptyData = { 0, 0 };
+RegDataRec RegionBrokenData = { 0, 0 };
+BoxRec RegionEmptyBox = { 0, 0, 0, 0 };
+
+
+double gettime(void)
+{
+  struct timeval tv;
+
+  gettimeofday(&tv, NULL);
+  return (double)tv.tv_sec + (double)tv.tv_usec * 0.000001;
+}
+
+
+void rfbLog(char *format, ...)
+{
+  va_list args;
+
+  if (!verbose) return;
+  va_start(args, format);
+  printf("    ");
+  vprintf(format, args);
+  va_end(args);
+}
+
+
+void rfbLogPerror(char *str)
+{
+  perror(str);
+}
+
+
+void *rfbAlloc(size_t size)
+{
+  void *mem = malloc(size);
+
+  if (!mem) {
+    fprintf(stderr, "Memory allocation failure\n");
+    exit(1);
+  }
+  return mem;
+}
+
+
+void *rfbAlloc0(size_t size)
+{
+  void *mem = rfbAlloc(size);
+
+  memset(mem, 0, size);
+  return mem;
+}
+
+
+void *rfbRealloc(void *ptr, size_t size)
+{
+  void *mem = realloc(ptr, size);
+
+  if (!mem) {
+    fprintf(stderr, "Memory allocation failure\n");
+    exit(1);
+  }
+  return mem;
+}
+
+
+void rfbCloseClient(rfbClientPtr cl)
+{
+}
+
+
+void rfbTraceSpan(const char *name, double start, const char *argName,
+                  long arg)
+{
+}
+
+
+void rfbTraceThreadName(int slot, const char *name)
+{
+}
+
+
+int WriteExact(rfbClientPtr cl, char *buf, int len)
+{
+  bytesSent += len;
+  return 1;
+}
+
+
+Bool rfbSendUpdateBuf(rfbClientPtr cl)
+{
+  bytesSent += cl->ublen;
+  cl->ublen = 0;
+  return TRUE;
+}
+
+
+rfbOutputBlock *rfbNewExternalBlock(char *buf, int len)
+{
+  rfbOutputBlock *block = (rfbOutputBlock *)rfbAlloc0(sizeof(rfbOutputBlock));
+
+  block->len = len;
+  block->ext = buf;
+  return block;
+}
+
+
+void rfbFreeOutputBlock(rfbOutputBlock *block)
+{
+  if (block->extSize)
+    rfbTightFreeBuf(block->ext, block->extSize);
+  else
+    free(block->ext);
+  free(block);
+}
+
+
+Bool rfbSendUpdateBlock(rfbClientPtr cl, rfbOutputBlock *block)
+{
+  rfbSendUpdateBuf(cl);
+  bytesSent += block->len;
+  rfbFreeOutputBlock(block);
+  return TRUE;
+}
+
+
+Bool rfbSendRectEncodingRaw(rfbClientPtr cl, int x, int y, int w, int h)
+{
+  bytesSent += sz_rfbFramebufferUpdateRectHeader +
+               w * h * (cl->format.bitsPerPixel / 8);
+  return TRUE;
+}
+
+
+Bool rfbSendSetColourMapEntries(rfbClientPtr cl, int firstColour, int nColours)
+{
+  return TRUE;
+}
+
+
+/*
+ * Corpus loading
+ */
+
+static int ReadPPMInt(FILE *file)
+{
+  int c, value = 0;
+
+  do {
+    if ((c = getc(file)) == '#')
+      while ((c = getc(file)) != '\n' && c != EOF);
+  } while (c == ' ' || c == '\t' || c == '\n' || c == '\r');
+  if (c < '0' || c > '9')
+    return -1;
+  while (c >= '0' && c <= '9') {
+    value = value * 10 + c - '0';
+    c = getc(file);
+  }
+  return value;
+}
+
+
+static char *ReadPPM(const char *filename, int *w, int *h)
+{
+  FILE *file;
+  unsigned char *row = NULL;
+  CARD32 *pixels = NULL;
+  int maxval, x, y;
+
+  if ((file = fopen(filename, "rb")) == NULL) {
+    perror(filename);
+    return NULL;
+  }
+  if (getc(file) != 'P' || getc(file) != '6' ||
+      (*w = ReadPPMInt(file)) < 1 || (*h = ReadPPMInt(file)) < 1 ||
+      (maxval = ReadPPMInt(file)) != 255) {
+    fprintf(stderr, "%s: not an 8-bit binary PPM file\n", filename);
+    goto bailout;
+  }
+
+  row = (unsigned char *)rfbAlloc(*w * 3);
+  pixels = (CARD32 *)rfbAlloc(*w * *h * 4);
+  for (y = 0; y < *h; y++) {
+    if (fread(row, *w * 3, 1, file) != 1) {
+      fprintf(stderr, "%s: unexpected end of file\n", filename);
+      free(pixels);
+      pixels = NULL;
+      goto bailout;
+    }
+    for (x = 0; x < *w; x++)
+      pixels[y * *w + x] = (row[x * 3] << 16) | (row[x * 3 + 1] << 8) |
+                           row[x * 3 + 2];
+  }
+
+  bailout:
+  free(row);
+  fclose(file);
+  return (char *)pixels;
+}
+
+
+static void AddDamage(FRAME *frame, int x1, int y1, int x2, int y2)
+{
+  BoxPtr box;
+
+  x1 = max(x1, 0);  y1 = max(y1, 0);
+  x2 = min(x2, width);  y2 = min(y2, height);
+  if (x2 <= x1 || y2 <= y1) return;
+
+  frame->damage = (BoxPtr)rfbRealloc(frame->damage,
+                                     (frame->nDamage + 1) * sizeof(BoxRec));
+  box = &frame->damage[frame->nDamage++];
+  box->x1 = x1;  box->y1 = y1;
+  box->x2 = x2;  box->y2 = y2;
+  frame->damagePixels += (double)(x2 - x1) * (double)(y2 - y1);
+}
+
+
+static Bool ReadDamage(FRAME *frame, const char *filename)
+{
+  char *damageFile = (char *)rfbAlloc(strlen(filename) + 8);
+  FILE *file;
+  int x, y, w, h;
+
+  sprintf(damageFile, "%s.damage", filename);
+  file = fopen(damageFile, "r");
+  free(damageFile);
+  if (!file) return FALSE;
+
+  while (fscanf(file, "%d %d %d %d", &x, &y, &w, &h) == 4)
+    AddDamage(frame, x, y, x + w, y + h);
+  fclose(file);
+  return TRUE;
+}
+
+
+/*
+ * Compute the damage between two snapshots as a list of rectangles made up
+ * of changed DIFF_TILE_SIZE x DIFF_TILE_SIZE tiles.  Each run of changed
+ * tiles in a row of tiles is merged with an identical run in the row above, if
+ * there is one.
+ */
+
+static void DiffFrames(FRAME *frame, const char *prev)
+{
+  int tx, ty, i;
+
+  for (ty = 0; ty < height; ty += DIFF_TILE_SIZE) {
+    int th = min(DIFF_TILE_SIZE, height - ty);
+
+    for (tx = 0; tx < width; ) {
+      int runStart, runEnd;
+
+      for (runStart = tx; runStart < width; runStart += DIFF_TILE_SIZE) {
+        int tw = min(DIFF_TILE_SIZE, width - runStart), y;
+
+        for (y = ty; y < ty + th; y++) {
+          int offset = (y * width + runStart) * 4;
+
+          if (memcmp(&frame->pixels[offset], &prev[offset], tw * 4))
+            break;
+        }
+        if (y < ty + th) break;
+      }
+      if (runStart >= width) break;
+
+      for (runEnd = runStart + DIFF_TILE_SIZE; runEnd < width;
+           runEnd += DIFF_TILE_SIZE) {
+        int tw = min(DIFF_TILE_SIZE, width - runEnd), y;
+
+        for (y = ty; y < ty + th; y++) {
+          int offset = (y * width + runEnd) * 4;
+
+          if (memcmp(&frame->pixels[offset], &prev[offset], tw * 4))
+            break;
+        }
+        if (y >= ty + th) break;
+      }
+      runEnd = min(runEnd, width);
+
+      /* Extend a rectangle from the previous row of tiles if possible. */
+      for (i = 0; i < frame->nDamage; i++) {
+        BoxPtr box = &frame->damage[i];
+
+        if (box->x1 == runStart && box->x2 == runEnd && box->y2 == ty) {
+          box->y2 += th;
+          frame->damagePixels += (double)(runEnd - runStart) * th;
+          break;
+        }
+      }
+      if (i >= frame->nDamage)
+        AddDamage(frame, runStart, ty, runEnd, ty + th);
+      tx = runEnd;
+    }
+  }
+}
+
+
+static Bool LoadCorpus(int argc, char **argv)
+{
+  int i;
+
+  frames = (FRAME *)rfbAlloc0(argc * sizeof(FRAME));
+  for (i = 0; i < argc; i++) {
+    FRAME *frame = &frames[nFrames];
+    int w, h;
+
+    if ((frame->pixels = ReadPPM(argv[i], &w, &h)) == NULL)
+      return FALSE;
+    if (nFrames == 0) {
+      width = w;  height = h;
+    } else if (w != width || h != height) {
+      fprintf(stderr, "%s: all snapshots must be %d x %d\n", argv[i], width,
+              height);
+      return FALSE;
+    }
+
+    if (!ReadDamage(frame, argv[i])) {
+      if (nFrames == 0)
+        AddDamage(frame, 0, 0, width, height);
+      else
+        DiffFrames(frame, frames[nFrames - 1].pixels);
+    }
+    nFrames++;
+  }
+  return TRUE;
+}
+
+
+/*
+ * Benchmarking
+ */
+
+static void SetPixelFormat(rfbPixelFormat *pf, int bpp)
+{
+  memset(pf, 0, sizeof(rfbPixelFormat));
+  pf->bitsPerPixel = bpp;
+  pf->trueColour = TRUE;
+  switch (bpp) {
+    case 8:
+      pf->depth = 8;
+      pf->redMax = 7;  pf->greenMax = 7;  pf->blueMax = 3;
+      pf->redShift = 0;  pf->greenShift = 3;  pf->blueShift = 6;
+      break;
+    case 16:
+      pf->depth = 16;
+      pf->redMax = 31;  pf->greenMax = 63;  pf->blueMax = 31;
+      pf->redShift = 11;  pf->greenShift = 5;  pf->blueShift = 0;
+      break;
+    default:
+      pf->depth = 24;
+      pf->redMax = 255;  pf->greenMax = 255;  pf->blueMax = 255;
+      pf->redShift = 16;  pf->greenShift = 8;  pf->blueShift = 0;
+  }
+}
+
+
+static double GetCPUTime(void)
+{
+  struct rusage usage;
+
+  getrusage(RUSAGE_SELF, &usage);
+  return (double)usage.ru_utime.tv_sec +
+         (double)usage.ru_utime.tv_usec * 0.000001 +
+         (double)usage.ru_stime.tv_sec +
+         (double)usage.ru_stime.tv_usec * 0.000001;
+}
+
+
+static Bool Benchmark(const ENCODING *enc, int compressLevel, int quality,
+                      int subsamp, int nThreads, int bpp)
+{
+  rfbClientRec client, *cl = &client;
+  double encodeTime = 0., cpuTime = 0., pixels = 0.;
+  char clStr[12] = "-", qualStr[12] = "-", sampStr[12] = "-";
+  int iter, i, j;
+
+  if (nThreads != rfbNumThreads) {
+    ShutdownTightThreads();
+    rfbNumThreads = nThreads;
+  }
+
+  memset(cl, 0, sizeof(rfbClientRec));
+  cl->host = "tvncencbench";
+  cl->fb = rfbFB.pfbMemory;
+  SetPixelFormat(&cl->format, bpp);
+  if (!rfbSetTranslateFunction(cl)) {
+    fprintf(stderr, "Could not set pixel format\n");
+    return FALSE;
+  }
+  cl->ubBlock = (rfbOutputBlock *)rfbAlloc(sizeof(rfbOutputBlock) +
+                                           UPDATE_BUF_SIZE);
+  cl->updateBuf = cl->ubBlock->data;
+  cl->preferredEncoding = enc->encoding;
+  cl->enableLastRectEncoding = TRUE;
+  cl->tightCompressLevel = compressLevel;
+  cl->tightQualityLevel = quality;
+  cl->tightSubsampLevel = subsamp;
+  cl->imageQualityLevel = -1;
+  cl->zlibCompressLevel = compressLevel;
+  bytesSent = 0;
+
+  for (iter = 0; iter < iterations; iter++) {
+    for (i = 0; i < nFrames; i++) {
+      FRAME *frame = &frames[i];
+      double tStart, cpuStart;
+
+      memcpy(rfbFB.pfbMemory, frame->pixels, width * height * 4);
+      cl->tUpdateStart = (double)(iter * nFrames + i + 1) * FRAME_INTERVAL;
+
+      cpuStart = GetCPUTime();
+      tStart = gettime();
+      for (j = 0; j < frame->nDamage; j++) {
+        BoxPtr box = &frame->damage[j];
+
+        if (!enc->sendRect(cl, box->x1, box->y1, box->x2 - box->x1,
+                           box->y2 - box->y1)) {
+          fprintf(stderr, "%s encoder failed\n", enc->name);
+          return FALSE;
+        }
+      }
+      rfbSendUpdateBuf(cl);
+      encodeTime += gettime() - tStart;
+      cpuTime += GetCPUTime() - cpuStart;
+      pixels += frame->damagePixels;
+    }
+  }
+
+  if (enc->hasCompressLevel) snprintf(clStr, 12, "%d", compressLevel);
+  if (enc->hasQuality && quality >= 0) {
+    snprintf(qualStr, 12, "%d", quality);
+    snprintf(sampStr, 12, "%s", subsampName[subsamp]);
+  }
+  printf("%-8s %3s %4s %4s %3d %10.2f %11.4f %8.2f:1 %8.1f%%\n", enc->name,
+         clStr, qualStr, sampStr, nThreads,
+         encodeTime > 0. ? pixels / 1000000. / encodeTime : 0.,
+         pixels > 0. ? (double)bytesSent / pixels : 0.,
+         bytesSent > 0 ? pixels * (bpp / 8) / (double)bytesSent : 0.,
+         encodeTime > 0. ? cpuTime / encodeTime / nThreads * 100. : 0.);
+  if (enc->encoding == rfbEncodingTight) {
+    Bool verboseSave = verbose;
+
+    verbose = TRUE;
+    rfbTightPrintProfile();
+    verbose = verboseSave;
+  }
+
+  rfbFreeTightData(cl);
+  rfbFreeZrleData(cl);
+  free(cl->zrleBeforeBuf);
+  free(cl->paletteHelper);
+  if (cl->compStreamInited)
+    deflateEnd(&cl->compStream);
+  for (i = 0; i < 4; i++) {
+    if (cl->zsActive[i])
+      deflateEnd(cl->zsStruct[i]);
+    free(cl->zsStruct[i]);
+  }
+  free(cl->translateLookupTable);
+  free(cl->ubBlock);
+  return TRUE;
+}
+
+
+static int ParseList(char *str, int *list, int minValue, int maxValue)
+{
+  char *token, *saveptr = NULL;
+  int n = 0;
+
+  for (token = strtok_r(str, ",", &saveptr); token && n < MAX_LIST;
+       token = strtok_r(NULL, ",", &saveptr)) {
+    char *end;
+    long value = strtol(token, &end, 10);
+
+    if (*end || value < minValue || value > maxValue)
+      return 0;
+    list[n++] = (int)value;
+  }
+  return n;
+}
+
+
+static int ParseSubsamp(char *str, int *list)
+{
+  char *token, *saveptr = NULL;
+  int n = 0;
+
+  for (token = strtok_r(str, ",", &saveptr); token && n < MAX_LIST;
+       token = strtok_r(NULL, ",", &saveptr)) {
+    switch (toupper(token[0])) {
+      case 'G':  list[n++] = TVNC_GRAY;  break;
+      case '1':  list[n++] = TVNC_1X;  break;
+      case '2':  list[n++] = TVNC_2X;  break;
+      case '4':  list[n++] = TVNC_4X;  break;
+      default:  return 0;
+    }
+  }
+  return n;
+}
+
+
+static void Usage(char *progName)
+{
+  fprintf(stderr, "\nUSAGE: %s [options] snapshot1.ppm [snapshot2.ppm ...]\n\n",
+          progName);
+  fprintf(stderr, "Options:\n");
+  fprintf(stderr, "-enc E1[,E2...]  benchmark the specified encodings (tight, zrle, hextile,\n");
+  fprintf(stderr, "                 zlib) [default: all]\n");
+  fprintf(stderr, "-cl L1[,L2...]   use the specified Tight/Zlib compression levels (0-9)\n");
+  fprintf(stderr, "                 [default: 1]\n");
+  fprintf(stderr, "-q Q1[,Q2...]    use the specified Tight JPEG qualities (1-100, or -1 to\n");
+  fprintf(stderr, "                 disable JPEG) [default: -1,95,80]\n");
+  fprintf(stderr, "-samp S1[,S2...] use the specified Tight chroma subsampling factors (1x, 2x,\n");
+  fprintf(stderr, "                 4x, gray) [default: 1x]\n");
+  fprintf(stderr, "-nt N1[,N2...]   use the specified numbers of threads for Tight and ZRLE\n");
+  fprintf(stderr, "                 (1-%d) [default: 1 and the number of CPUs, up to 4]\n",
+          MAX_ENCODING_THREADS);
+  fprintf(stderr, "-bpp B           use a client pixel format with B bits per pixel (8, 16,\n");
+  fprintf(stderr, "                 32) [default: 32]\n");
+  fprintf(stderr, "-iter N          replay the corpus N times [default: 1]\n");
+  fprintf(stderr, "-v               show the log messages from the encoders\n\n");
+  exit(1);
+}
+
+
+int main(int argc, char **argv)
+{
+  Bool encEnabled[NUM_ENCODINGS];
+  int compressLevels[MAX_LIST] = { 1 }, nCompressLevels = 1;
+  int qualities[MAX_LIST] = { -1, 95, 80 }, nQualities = 3;
+  int subsamps[MAX_LIST] = { TVNC_1X }, nSubsamps = 1;
+  int threads[MAX_LIST] = { 1 }, nThreadCounts = 1;
+  int bpp = 32, e, c, q, s, t, i, np;
+  double damagePixels = 0.;
+  long nRects = 0;
+
+  for (e = 0; e < NUM_ENCODINGS; e++)
+    encEnabled[e] = TRUE;
+  if ((np = sysconf(_SC_NPROCESSORS_CONF)) > 1)
+    threads[nThreadCounts++] = min(np, 4);
+
+  for (i = 1; i < argc && argv[i][0] == '-'; i++) {
+    if (!strcasecmp(argv[i], "-enc") && i < argc - 1) {
+      char *token, *saveptr = NULL;
+
+      for (e = 0; e < NUM_ENCODINGS; e++)
+        encEnabled[e] = FALSE;
+      for (token = strtok_r(argv[++i], ",", &saveptr); token;
+           token = strtok_r(NULL, ",", &saveptr)) {
+        for (e = 0; e < NUM_ENCODINGS; e++) {
+          if (!strcasecmp(token, encodings[e].name)) {
+            encEnabled[e] = TRUE;
+            break;
+          }
+        }
+        if (e >= NUM_ENCODINGS) Usage(argv[0]);
+      }
+    } else if (!strcasecmp(argv[i], "-cl") && i < argc - 1) {
+      if (!(nCompressLevels = ParseList(argv[++i], compressLevels, 0, 9)))
+        Usage(argv[0]);
+    } else if (!strcasecmp(argv[i], "-q") && i < argc - 1) {
+      if (!(nQualities = ParseList(argv[++i], qualities, -1, 100)))
+        Usage(argv[0]);
+      for (q = 0; q < nQualities; q++)
+        if (qualities[q] == 0) Usage(argv[0]);
+    } else if (!strcasecmp(argv[i], "-samp") && i < argc - 1) {
+      if (!(nSubsamps = ParseSubsamp(argv[++i], subsamps)))
+        Usage(argv[0]);
+    } else if (!strcasecmp(argv[i], "-nt") && i < argc - 1) {
+      if (!(nThreadCounts = ParseList(argv[++i], threads, 1,
+                                      MAX_ENCODING_THREADS)))
+        Usage(argv[0]);
+    } else if (!strcasecmp(argv[i], "-bpp") && i < argc - 1) {
+      bpp = atoi(argv[++i]);
+      if (bpp != 8 && bpp != 16 && bpp != 32) Usage(argv[0]);
+    } else if (!strcasecmp(argv[i], "-iter") && i < argc - 1) {
+      if ((iterations = atoi(argv[++i])) < 1) Usage(argv[0]);
+    } else if (!strcasecmp(argv[i], "-v"))
+      verbose = TRUE;
+    else
+      Usage(argv[0]);
+  }
+  if (i >= argc) Usage(argv[0]);
+
+  if (!LoadCorpus(argc - i, &argv[i]))
+    return 1;
+
+  rfbSIMDInit();
+  SetPixelFormat(&rfbServerFormat, 32);
+  rfbFB.width = width;
+  rfbFB.height = height;
+  rfbFB.depth = 24;
+  rfbFB.bitsPerPixel = 32;
+  rfbFB.paddedWidthInBytes = width * 4;
+  rfbFB.sizeInBytes = width * height * 4;
+  rfbFB.pfbMemory = (char *)rfbAlloc(rfbFB.sizeInBytes);
+
+  for (i = 0; i < nFrames; i++) {
+    damagePixels += frames[i].damagePixels;
+    nRects += frames[i].nDamage;
+  }
+  printf("Corpus: %d snapshots, %d x %d, %ld damage rectangles, %.2f Mpixels\n",
+         nFrames, width, height, nRects, damagePixels / 1000000.);
+  printf("SIMD kernels: %s\n\n", rfbSIMD.name);
+  printf("Encoding  CL Qual Samp Thr  Mpixels/s Bytes/pixel    Ratio CPU/thread\n");
+
+  for (e = 0; e < NUM_ENCODINGS; e++) {
+    const ENCODING *enc = &encodings[e];
+
+    if (!encEnabled[e]) continue;
+    for (c = 0; c < (enc->hasCompressLevel ? nCompressLevels : 1); c++) {
+      for (q = 0; q < (enc->hasQuality ? nQualities : 1); q++) {
+        int quality = enc->hasQuality ? qualities[q] : -1;
+
+        for (s = 0; s < (quality >= 0 ? nSubsamps : 1); s++) {
+          for (t = 0; t < (enc->isMultithreaded ? nThreadCounts : 1); t++) {
+            if (!Benchmark(enc, compressLevels[c], quality, subsamps[s],
+                           enc->isMultithreaded ? threads[t] : 1, bpp))
+              return 1;
+          }
+        }
+      }
+    }
+  }
+
+  ShutdownTightThreads();
+  for (i = 0; i < nFrames; i++) {
+    free(frames[i].pixels);
+    free(frames[i].damage);
+  }
+  free(frames);
+  free(rfbFB.pfbMemory);
+  return 0;
+}
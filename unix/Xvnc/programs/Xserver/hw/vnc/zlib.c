@@ -93,7 +93,7 @@ static Bool rfbSendOneRectEncodingZlib(rfbClientPtr cl, int x, int y, int w,
      * architectures like SPARC, PARISC...
      */
     if ((cl->format.bitsPerPixel > 8) &&
-        (ublen % (cl->format.bitsPerPixel / 8)) != 0) {
+        (cl->ublen % (cl->format.bitsPerPixel / 8)) != 0) {
       if (!rfbSendUpdateBuf(cl))
         return FALSE;
     }
@@ -172,7 +172,7 @@ static Bool rfbSendOneRectEncodingZlib(rfbClientPtr cl, int x, int y, int w,
   cl->rfbBytesSent[rfbEncodingZlib] +=
     (sz_rfbFramebufferUpdateRectHeader + sz_rfbZlibHeader + zlibAfterBufLen);
 
-  if (ublen + sz_rfbFramebufferUpdateRectHeader + sz_rfbZlibHeader >
+  if (cl->ublen + sz_rfbFramebufferUpdateRectHeader + sz_rfbZlibHeader >
       UPDATE_BUF_SIZE) {
     if (!rfbSendUpdateBuf(cl))
       return FALSE;
@@ -184,26 +184,28 @@ static Bool rfbSendOneRectEncodingZlib(rfbClientPtr cl, int x, int y, int w,
   rect.r.h = Swap16IfLE(h);
   rect.encoding = Swap32IfLE(rfbEncodingZlib);
 
-  memcpy(&updateBuf[ublen], (char *)&rect, sz_rfbFramebufferUpdateRectHeader);
-  ublen += sz_rfbFramebufferUpdateRectHeader;
+  memcpy(&cl->updateBuf[cl->ublen], (char *)&rect,
+
+         sz_rfbFramebufferUpdateRectHeader);
+  cl->ublen += sz_rfbFramebufferUpdateRectHeader;
 
   hdr.nBytes = Swap32IfLE(zlibAfterBufLen);
 
-  memcpy(&updateBuf[ublen], (char *)&hdr, sz_rfbZlibHeader);
-  ublen += sz_rfbZlibHeader;
+  memcpy(&cl->updateBuf[cl->ublen], (char *)&hdr, sz_rfbZlibHeader);
+  cl->ublen += sz_rfbZlibHeader;
 
   for (i = 0; i < zlibAfterBufLen;) {
-    int bytesToCopy = UPDATE_BUF_SIZE - ublen;
+    int bytesToCopy = UPDATE_BUF_SIZE - cl->ublen;
 
     if (i + bytesToCopy > zlibAfterBufLen)
       bytesToCopy = zlibAfterBufLen - i;
 
-    memcpy(&updateBuf[ublen], &zlibAfterBuf[i], bytesToCopy);
+    memcpy(&cl->updateBuf[cl->ublen], &zlibAfterBuf[i], bytesToCopy);
 
-    ublen += bytesToCopy;
+    cl->ublen += bytesToCopy;
     i += bytesToCopy;
 
-    if (ublen == UPDATE_BUF_SIZE) {
+    if (cl->ublen == UPDATE_BUF_SIZE) {
       if (!rfbSendUpdateBuf(cl))
         return FALSE;
     }
@@ -262,7 +264,7 @@ Bool rfbSendRectEncodingZlib(rfbClientPtr cl, int x, int y, int w, int h)
      * Since, zlib is most useful for slow networks, this flush
      * is appropriate for the desired behavior of the zlib encoding.
      */
-    if ((ublen > 0) && (linesToComp == maxLines)) {
+    if ((cl->ublen > 0) && (linesToComp == maxLines)) {
       if (!rfbSendUpdateBuf(cl))
         return FALSE;
     }
@@ -27,6 +27,7 @@
 
 #include "rfb.h"
 #include "zrleoutstream.h"
+#include "zrlepalettehelper.h"
 
 
 #define GET_IMAGE_INTO_BUF(tx, ty, tw, th, buf) {                  \
@@ -96,61 +97,46 @@
  * data.
  */
 
+#define ZRLE_BEFORE_BUF_SIZE  (rfbZRLETileWidth * rfbZRLETileHeight * 4 + 4)
 
-/*
- * rfbSendRectEncodingZRLE - send a given rectangle using ZRLE encoding.
- */
+/* Scratch buffers used by one encoding thread */
 
-Bool rfbSendRectEncodingZRLE(rfbClientPtr cl, int x, int y, int w, int h)
-{
-  zrleOutStream *zos;
-  rfbFramebufferUpdateRectHeader rect;
-  rfbZRLEHeader hdr;
-  int i;
-  char *zrleBeforeBuf;
+typedef struct {
+  char *beforeBuf;
+  int *zywrleBuf;
+  void *paletteHelper;
+} zrleScratch;
 
-  if (cl->zrleBeforeBuf == NULL) {
-    cl->zrleBeforeBuf = (char *)rfbAlloc(rfbZRLETileWidth *
-                                         rfbZRLETileHeight * 4 + 4);
-  }
-  zrleBeforeBuf = cl->zrleBeforeBuf;
 
-  if (cl->preferredEncoding == rfbEncodingZYWRLE) {
-    if (cl->imageQualityLevel < 0) {
-      cl->zywrleLevel = 1;
-    } else if (cl->imageQualityLevel < 3) {
-      cl->zywrleLevel = 3;
-    } else if (cl->imageQualityLevel < 6) {
-      cl->zywrleLevel = 2;
-    } else {
-      cl->zywrleLevel = 1;
-    }
-  } else
-    cl->zywrleLevel = 0;
+/*
+ * Encode the tiles of a rectangle, in the client's pixel format, into the
+ * given stream.
+ */
 
-  if (!cl->zrleData)
-    cl->zrleData = zrleOutStreamNew();
-  zos = cl->zrleData;
-  zos->in.ptr = zos->in.start;
-  zos->out.ptr = zos->out.start;
+static void EncodeRect(rfbClientPtr cl, int x, int y, int w, int h,
+                       zrleOutStream *zos, zrleScratch *s)
+{
+  char *zrleBeforeBuf = s->beforeBuf;
+  int *zywrleBuf = s->zywrleBuf;
+  void *ph = s->paletteHelper;
 
   switch (cl->format.bitsPerPixel) {
 
     case 8:
-      zrleEncode8NE(x, y, w, h, zos, zrleBeforeBuf, cl);
+      zrleEncode8NE(x, y, w, h, zos, zrleBeforeBuf, zywrleBuf, ph, cl);
       break;
 
     case 16:
       if (cl->format.greenMax > 0x1F) {
         if (cl->format.bigEndian)
-          zrleEncode16BE(x, y, w, h, zos, zrleBeforeBuf, cl);
+          zrleEncode16BE(x, y, w, h, zos, zrleBeforeBuf, zywrleBuf, ph, cl);
         else
-          zrleEncode16LE(x, y, w, h, zos, zrleBeforeBuf, cl);
+          zrleEncode16LE(x, y, w, h, zos, zrleBeforeBuf, zywrleBuf, ph, cl);
       } else {
         if (cl->format.bigEndian)
-          zrleEncode15BE(x, y, w, h, zos, zrleBeforeBuf, cl);
+          zrleEncode15BE(x, y, w, h, zos, zrleBeforeBuf, zywrleBuf, ph, cl);
         else
-          zrleEncode15LE(x, y, w, h, zos, zrleBeforeBuf, cl);
+          zrleEncode15LE(x, y, w, h, zos, zrleBeforeBuf, zywrleBuf, ph, cl);
       }
       break;
 
@@ -167,32 +153,235 @@ Bool rfbSendRectEncodingZRLE(rfbClientPtr cl, int x, int y, int w, int h)
       if ((fitsInLS3Bytes && !cl->format.bigEndian) ||
           (fitsInMS3Bytes && cl->format.bigEndian)) {
         if (cl->format.bigEndian)
-          zrleEncode24ABE(x, y, w, h, zos, zrleBeforeBuf, cl);
+          zrleEncode24ABE(x, y, w, h, zos, zrleBeforeBuf, zywrleBuf, ph, cl);
         else
-          zrleEncode24ALE(x, y, w, h, zos, zrleBeforeBuf, cl);
+          zrleEncode24ALE(x, y, w, h, zos, zrleBeforeBuf, zywrleBuf, ph, cl);
 
       } else if ((fitsInLS3Bytes && cl->format.bigEndian) ||
                  (fitsInMS3Bytes && !cl->format.bigEndian)) {
         if (cl->format.bigEndian)
-          zrleEncode24BBE(x, y, w, h, zos, zrleBeforeBuf, cl);
+          zrleEncode24BBE(x, y, w, h, zos, zrleBeforeBuf, zywrleBuf, ph, cl);
         else
-          zrleEncode24BLE(x, y, w, h, zos, zrleBeforeBuf, cl);
+          zrleEncode24BLE(x, y, w, h, zos, zrleBeforeBuf, zywrleBuf, ph, cl);
 
       } else {
         if (cl->format.bigEndian)
-          zrleEncode32BE(x, y, w, h, zos, zrleBeforeBuf, cl);
+          zrleEncode32BE(x, y, w, h, zos, zrleBeforeBuf, zywrleBuf, ph, cl);
         else
-          zrleEncode32LE(x, y, w, h, zos, zrleBeforeBuf, cl);
+          zrleEncode32LE(x, y, w, h, zos, zrleBeforeBuf, zywrleBuf, ph, cl);
       }
       break;
     }
   }
+}
+
+
+/*
+ * Multithreaded encoding
+ *
+ * A rectangle that spans several rows of tiles is split among the threads in
+ * the Tight encoder's worker pool.  The threads take rows of tiles in order,
+ * and each row is encoded into its own raw (uncompressed) stream.  The ZRLE
+ * data for the whole rectangle has to pass through the client's zlib stream
+ * in order, so the calling thread (thread 0) compresses each row as soon as
+ * it and all of the rows above it have been encoded.  Thread 0 encodes rows
+ * itself only when the next row to be compressed is not ready yet.  The
+ * compressed data is the same as if the rectangle had been encoded by a
+ * single thread.
+ */
+
+#define ZRLE_MT_MIN_PIXELS  (rfbZRLETileWidth * rfbZRLETileHeight * 4)
+
+static struct {
+  pthread_mutex_t mutex;
+  pthread_cond_t rowDone;
+  rfbClientPtr cl;
+  int x, y, w, h, nRows, nextRow;
+  zrleOutStream **rowStreams;
+  Bool *rowReady;
+  int rowsAlloc;
+} zrleSched = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER };
+
+/* scratch[0] points to the client's buffers. */
+static zrleScratch scratch[MAX_ENCODING_THREADS];
+
+
+static void EncodeRow(int id, int row)
+{
+  zrleOutStream *os = zrleSched.rowStreams[row];
+  int y = zrleSched.y + row * rfbZRLETileHeight;
+
+  os->in.ptr = os->in.start;
+  EncodeRect(zrleSched.cl, zrleSched.x, y, zrleSched.w,
+             min(rfbZRLETileHeight, zrleSched.y + zrleSched.h - y), os,
+             &scratch[id]);
+}
+
+
+static Bool EncodeRowsJob(int id, void *arg)
+{
+  zrleOutStream *zos = (zrleOutStream *)arg, *os;
+  int row, nextOut = 0;
+
+  if (id > 0) {
+    for (;;) {
+      pthread_mutex_lock(&zrleSched.mutex);
+      row = zrleSched.nextRow < zrleSched.nRows ? zrleSched.nextRow++ : -1;
+      pthread_mutex_unlock(&zrleSched.mutex);
+      if (row < 0) return TRUE;
+
+      EncodeRow(id, row);
+
+      pthread_mutex_lock(&zrleSched.mutex);
+      zrleSched.rowReady[row] = TRUE;
+      pthread_cond_signal(&zrleSched.rowDone);
+      pthread_mutex_unlock(&zrleSched.mutex);
+    }
+  }
+
+  while (nextOut < zrleSched.nRows) {
+    row = -1;
+    pthread_mutex_lock(&zrleSched.mutex);
+    if (!zrleSched.rowReady[nextOut]) {
+      if (zrleSched.nextRow < zrleSched.nRows)
+        row = zrleSched.nextRow++;
+      else {
+        while (!zrleSched.rowReady[nextOut])
+          pthread_cond_wait(&zrleSched.rowDone, &zrleSched.mutex);
+      }
+    }
+    pthread_mutex_unlock(&zrleSched.mutex);
+
+    if (row >= 0) {
+      EncodeRow(0, row);
+      pthread_mutex_lock(&zrleSched.mutex);
+      zrleSched.rowReady[row] = TRUE;
+      pthread_mutex_unlock(&zrleSched.mutex);
+    } else {
+      os = zrleSched.rowStreams[nextOut++];
+      zrleOutStreamWriteBytes(zos, os->in.start, ZRLE_BUFFER_LENGTH(&os->in));
+    }
+  }
+  return TRUE;
+}
+
+
+static Bool EncodeRectMT(rfbClientPtr cl, int x, int y, int w, int h,
+                         zrleOutStream *zos, int nt)
+{
+  int i;
+
+  zrleSched.cl = cl;
+  zrleSched.x = x;
+  zrleSched.y = y;
+  zrleSched.w = w;
+  zrleSched.h = h;
+  zrleSched.nRows = (h + rfbZRLETileHeight - 1) / rfbZRLETileHeight;
+  zrleSched.nextRow = 0;
+
+  if (zrleSched.nRows > zrleSched.rowsAlloc) {
+    zrleSched.rowStreams =
+      (zrleOutStream **)rfbRealloc(zrleSched.rowStreams,
+                                   zrleSched.nRows * sizeof(zrleOutStream *));
+    zrleSched.rowReady = (Bool *)rfbRealloc(zrleSched.rowReady,
+                                            zrleSched.nRows * sizeof(Bool));
+    for (i = zrleSched.rowsAlloc; i < zrleSched.nRows; i++)
+      zrleSched.rowStreams[i] = zrleOutStreamNewRaw();
+    zrleSched.rowsAlloc = zrleSched.nRows;
+  }
+  memset(zrleSched.rowReady, 0, zrleSched.nRows * sizeof(Bool));
+
+  scratch[0].beforeBuf = cl->zrleBeforeBuf;
+  scratch[0].zywrleBuf = cl->zywrleBuf;
+  scratch[0].paletteHelper = cl->paletteHelper;
+  for (i = 1; i < nt; i++) {
+    if (!scratch[i].beforeBuf) {
+      scratch[i].beforeBuf = (char *)rfbAlloc(ZRLE_BEFORE_BUF_SIZE);
+      scratch[i].zywrleBuf =
+        (int *)rfbAlloc(rfbZRLETileWidth * rfbZRLETileHeight * sizeof(int));
+      scratch[i].paletteHelper = rfbAlloc0(sizeof(zrlePaletteHelper));
+    }
+  }
+
+  return rfbRunParallelJobs(nt, EncodeRowsJob, zos);
+}
+
+
+static void FreeThreadData(void)
+{
+  int i;
+
+  for (i = 1; i < MAX_ENCODING_THREADS; i++) {
+    free(scratch[i].beforeBuf);
+    free(scratch[i].zywrleBuf);
+    free(scratch[i].paletteHelper);
+  }
+  memset(scratch, 0, sizeof(scratch));
+
+  for (i = 0; i < zrleSched.rowsAlloc; i++)
+    zrleOutStreamFree(zrleSched.rowStreams[i]);
+  free(zrleSched.rowStreams);
+  zrleSched.rowStreams = NULL;
+  free(zrleSched.rowReady);
+  zrleSched.rowReady = NULL;
+  zrleSched.rowsAlloc = 0;
+}
+
+
+/*
+ * rfbSendRectEncodingZRLE - send a given rectangle using ZRLE encoding.
+ */
+
+Bool rfbSendRectEncodingZRLE(rfbClientPtr cl, int x, int y, int w, int h)
+{
+  zrleOutStream *zos;
+  rfbFramebufferUpdateRectHeader rect;
+  rfbZRLEHeader hdr;
+  int nt;
+
+  if (cl->zrleBeforeBuf == NULL)
+    cl->zrleBeforeBuf = (char *)rfbAlloc(ZRLE_BEFORE_BUF_SIZE);
+  if (cl->paletteHelper == NULL)
+    cl->paletteHelper = (void *)rfbAlloc0(sizeof(zrlePaletteHelper));
+
+  if (cl->preferredEncoding == rfbEncodingZYWRLE) {
+    if (cl->imageQualityLevel < 0) {
+      cl->zywrleLevel = 1;
+    } else if (cl->imageQualityLevel < 3) {
+      cl->zywrleLevel = 3;
+    } else if (cl->imageQualityLevel < 6) {
+      cl->zywrleLevel = 2;
+    } else {
+      cl->zywrleLevel = 1;
+    }
+  } else
+    cl->zywrleLevel = 0;
+
+  if (!cl->zrleData)
+    cl->zrleData = zrleOutStreamNew();
+  zos = cl->zrleData;
+  zos->in.ptr = zos->in.start;
+  zos->out.ptr = zos->out.start;
+
+  nt = min(rfbNumThreads, (h + rfbZRLETileHeight - 1) / rfbZRLETileHeight);
+  if (nt > 1 && w * h >= ZRLE_MT_MIN_PIXELS) {
+    if (!EncodeRectMT(cl, x, y, w, h, zos, nt))
+      return FALSE;
+  } else {
+    zrleScratch s;
+
+    s.beforeBuf = cl->zrleBeforeBuf;
+    s.zywrleBuf = cl->zywrleBuf;
+    s.paletteHelper = cl->paletteHelper;
+    EncodeRect(cl, x, y, w, h, zos, &s);
+  }
+  zrleOutStreamFlush(zos);
 
   cl->rfbBytesSent[rfbEncodingZRLE] += sz_rfbFramebufferUpdateRectHeader +
       sz_rfbZRLEHeader + ZRLE_BUFFER_LENGTH(&zos->out);
   cl->rfbRectanglesSent[rfbEncodingZRLE]++;
 
-  if (ublen + sz_rfbFramebufferUpdateRectHeader + sz_rfbZRLEHeader >
+  if (cl->ublen + sz_rfbFramebufferUpdateRectHeader + sz_rfbZRLEHeader >
       UPDATE_BUF_SIZE) {
     if (!rfbSendUpdateBuf(cl))
       return FALSE;
@@ -204,35 +393,39 @@ Bool rfbSendRectEncodingZRLE(rfbClientPtr cl, int x, int y, int w, int h)
   rect.r.h = Swap16IfLE(h);
   rect.encoding = Swap32IfLE(cl->preferredEncoding);
 
-  memcpy(updateBuf + ublen, (char *)&rect,
+  memcpy(cl->updateBuf + cl->ublen, (char *)&rect,
          sz_rfbFramebufferUpdateRectHeader);
-  ublen += sz_rfbFramebufferUpdateRectHeader;
+  cl->ublen += sz_rfbFramebufferUpdateRectHeader;
 
   hdr.length = Swap32IfLE(ZRLE_BUFFER_LENGTH(&zos->out));
 
-  memcpy(updateBuf + ublen, (char *)&hdr, sz_rfbZRLEHeader);
-  ublen += sz_rfbZRLEHeader;
-
-  /* copy into updateBuf and send from there.  Maybe should send directly? */
+  memcpy(cl->updateBuf + cl->ublen, (char *)&hdr, sz_rfbZRLEHeader);
+  cl->ublen += sz_rfbZRLEHeader;
 
-  for (i = 0; i < ZRLE_BUFFER_LENGTH(&zos->out);) {
+  /* Large payloads are passed to the output queue by reference, and smaller
+     ones are copied into updateBuf. */
 
-    int bytesToCopy = UPDATE_BUF_SIZE - ublen;
+  if (ZRLE_BUFFER_LENGTH(&zos->out) >= MIN_ZERO_COPY_SIZE) {
+    int len = ZRLE_BUFFER_LENGTH(&zos->out);
+    char *buf = (char *)zrleOutStreamDetachOutput(zos);
+    rfbOutputBlock *block = rfbNewExternalBlock(buf, len);
 
-    if (i + bytesToCopy > ZRLE_BUFFER_LENGTH(&zos->out)) {
-      bytesToCopy = ZRLE_BUFFER_LENGTH(&zos->out) - i;
+    if (!block) {
+      rfbLogPerror("rfbSendRectEncodingZRLE: couldn't allocate output block");
+      free(buf);
+      rfbCloseClient(cl);
+      return FALSE;
     }
+    return rfbSendUpdateBlock(cl, block);
+  }
 
-    memcpy(updateBuf + ublen, (CARD8 *)zos->out.start + i, bytesToCopy);
-
-    ublen += bytesToCopy;
-    i += bytesToCopy;
-
-    if (ublen == UPDATE_BUF_SIZE) {
-      if (!rfbSendUpdateBuf(cl))
-        return FALSE;
-    }
+  if (cl->ublen + ZRLE_BUFFER_LENGTH(&zos->out) > UPDATE_BUF_SIZE) {
+    if (!rfbSendUpdateBuf(cl))
+      return FALSE;
   }
+  memcpy(cl->updateBuf + cl->ublen, zos->out.start,
+         ZRLE_BUFFER_LENGTH(&zos->out));
+  cl->ublen += ZRLE_BUFFER_LENGTH(&zos->out);
 
   return TRUE;
 }
@@ -250,4 +443,7 @@ void rfbFreeZrleData(rfbClientPtr cl)
 
   free(cl->paletteHelper);
   cl->paletteHelper = NULL;
+
+  if (!rfbClientHead)
+    FreeThreadData();
 }
@@ -27,6 +27,10 @@
  * into the given buffer.  EXTRA_ARGS can be defined to pass any other
  * arguments needed by GET_IMAGE_INTO_BUF.
  *
+ * ZRLE_ENCODE does not flush the output stream, and it uses only the scratch
+ * buffers that are passed to it, so several threads can encode different
+ * tiles at the same time.
+ *
  * Note that the buf argument to ZRLE_ENCODE needs to be at least one pixel
  * bigger than the largest tile of pixel data, since the ZRLE encoding
  * algorithm writes to the position one past the end of the pixel data.
@@ -96,7 +100,8 @@ void ZRLE_ENCODE_TILE (PIXEL_T* data, int w, int h, zrleOutStream* os,
 #endif
 
 static void ZRLE_ENCODE (int x, int y, int w, int h,
-                  zrleOutStream* os, void* buf
+                  zrleOutStream* os, void* buf, int *zywrleBuf,
+                  void *paletteHelper
                   EXTRA_ARGS
                   )
 {
@@ -110,15 +115,10 @@ static void ZRLE_ENCODE (int x, int y, int w, int h,
 
       GET_IMAGE_INTO_BUF(tx,ty,tw,th,buf);
 
-      if (cl->paletteHelper == NULL) {
-          cl->paletteHelper = (void *) rfbAlloc0(sizeof(zrlePaletteHelper));
-      }
-
       ZRLE_ENCODE_TILE((PIXEL_T*)buf, tw, th, os,
-                      cl->zywrleLevel, cl->zywrleBuf, cl->paletteHelper);
+                      cl->zywrleLevel, zywrleBuf, paletteHelper);
     }
   }
-  zrleOutStreamFlush(os);
 }
 
 
@@ -74,9 +74,26 @@ zrleOutStream *zrleOutStreamNew(void)
   return os;
 }
 
+/* A raw stream has no zlib compressor.  It accumulates uncompressed data in
+   its input buffer, which grows as needed.  This allows tiles to be encoded
+   in parallel before they are passed through the (serial) zlib stream. */
+
+zrleOutStream *zrleOutStreamNewRaw(void)
+{
+  zrleOutStream *os;
+
+  os = rfbAlloc0(sizeof(zrleOutStream));
+
+  zrleBufferAlloc(&os->in, ZRLE_IN_BUFFER_SIZE);
+  os->raw = TRUE;
+
+  return os;
+}
+
 void zrleOutStreamFree (zrleOutStream *os)
 {
-  deflateEnd(&os->zs);
+  if (!os->raw)
+    deflateEnd(&os->zs);
   zrleBufferFree(&os->in);
   zrleBufferFree(&os->out);
   free(os);
@@ -125,6 +142,19 @@ Bool zrleOutStreamFlush(zrleOutStream *os)
   return TRUE;
 }
 
+/* Return the output buffer, which the caller must free, and replace it with
+   an empty buffer of the same size.  This allows the compressed data to be
+   sent without copying it. */
+
+zrle_U8 *zrleOutStreamDetachOutput(zrleOutStream *os)
+{
+  zrle_U8 *buf = os->out.start;
+
+  zrleBufferAlloc(&os->out, os->out.end - os->out.start);
+
+  return buf;
+}
+
 static int zrleOutStreamOverrun(zrleOutStream *os,
                                 int            size)
 {
@@ -132,6 +162,11 @@ static int zrleOutStreamOverrun(zrleOutStream *os,
   rfbLog("zrleOutStreamOverrun\n");
 #endif
 
+  if (os->raw) {
+    zrleBufferGrow(&os->in, max(size, os->in.end - os->in.start));
+    return size;
+  }
+
   while (os->in.end - os->in.ptr < size && os->in.ptr > os->in.start) {
     os->zs.next_in = os->in.start;
     os->zs.avail_in = ZRLE_BUFFER_LENGTH (&os->in);
@@ -36,13 +36,16 @@ typedef struct {
   zrleBuffer out;
 
   z_stream   zs;
+  Bool       raw;
 } zrleOutStream;
 
 #define ZRLE_BUFFER_LENGTH(b) ((b)->ptr - (b)->start)
 
 zrleOutStream *zrleOutStreamNew           (void);
+zrleOutStream *zrleOutStreamNewRaw        (void);
 void           zrleOutStreamFree          (zrleOutStream *os);
 Bool           zrleOutStreamFlush         (zrleOutStream *os);
+zrle_U8       *zrleOutStreamDetachOutput  (zrleOutStream *os);
 void           zrleOutStreamWriteBytes    (zrleOutStream *os,
                                            const zrle_U8 *data,
                                            int            length);